@@ -1,5 +1,13 @@
-HEADERS += $$PWD/zookeepermanager.h
-SOURCES += $$PWD/zookeepermanager.cpp
+HEADERS += $$PWD/zookeepermanager.h \
+    $$PWD/zookeepercodec.h \
+    $$PWD/zookeeperlock.h \
+    $$PWD/zookeeperleaderelection.h \
+    $$PWD/zookeepercontender.h
+SOURCES += $$PWD/zookeepermanager.cpp \
+    $$PWD/zookeepercodec.cpp \
+    $$PWD/zookeeperlock.cpp \
+    $$PWD/zookeeperleaderelection.cpp \
+    $$PWD/zookeepercontender.cpp
 
 INCLUDEPATH += \
     $$PWD \
@@ -0,0 +1,216 @@
+﻿#include "zookeepercodec.h"
+
+#include <QtEndian>
+
+#include <cstring>
+
+namespace
+{
+    const char Magic[4] = { '\xff', 'Z', 'K', 'C' };
+
+    //解压时允许的最大原始长度，防止损坏的头部申请过大的内存
+    const quint32 MaxDecodedSize = 256 * 1024 * 1024;
+
+    const int HashLog = 12;
+    const int MinMatch = 4;
+    //LZ4 块格式要求最后 5 个字节是字面量，最后一个匹配至少在结尾 12 字节之前开始
+    const int LastLiterals = 5;
+    const int MatchFindLimit = 12;
+    const int MaxOffset = 65535;
+
+    inline quint32 read32(const uchar *p)
+    {
+        quint32 v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline quint32 hash32(quint32 sequence)
+    {
+        return (sequence * 2654435761U) >> (32 - HashLog);
+    }
+
+    inline uchar *writeLength(uchar *op, int length)
+    {
+        while (length >= 255) {
+            *op++ = 255;
+            length -= 255;
+        }
+        *op++ = uchar(length);
+        return op;
+    }
+
+    uchar *writeLiterals(uchar *op, const uchar *literals, int length, int matchCode)
+    {
+        uchar *token = op++;
+        if (length >= 15) {
+            *token = uchar((15 << 4) | matchCode);
+            op = writeLength(op, length - 15);
+        } else {
+            *token = uchar((length << 4) | matchCode);
+        }
+        memcpy(op, literals, size_t(length));
+        return op + length;
+    }
+
+    int compressBound(int size)
+    {
+        return size + size / 255 + 16;
+    }
+
+    //贪心匹配的 LZ4 块压缩，返回压缩后的长度
+    int compressBlock(const uchar *src, int size, uchar *dst)
+    {
+        const uchar *ip = src;
+        const uchar *anchor = src;
+        const uchar *end = src + size;
+        uchar *op = dst;
+
+        //太短的值放不下一个匹配，全部作为字面量
+        if (size <= MatchFindLimit) {
+            op = writeLiterals(op, anchor, size, 0);
+            return int(op - dst);
+        }
+
+        const uchar *matchLimit = end - LastLiterals;
+        const uchar *findLimit = end - MatchFindLimit;
+        int table[1 << HashLog];
+        int misses = 0;
+
+        for (int i = 0; i < (1 << HashLog); i++)
+            table[i] = -1;
+
+        while (ip < findLimit) {
+            quint32 sequence = read32(ip);
+            quint32 h = hash32(sequence);
+            int ref = table[h];
+            int pos = int(ip - src);
+            table[h] = pos;
+
+            if (ref < 0 || pos - ref > MaxOffset || read32(src + ref) != sequence) {
+                //不可压缩的数据越往后跳得越快
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            const uchar *match = src + ref;
+            int length = MinMatch;
+            while (ip + length < matchLimit && ip[length] == match[length])
+                length++;
+
+            int matchCode = length - MinMatch;
+            op = writeLiterals(op, anchor, int(ip - anchor), matchCode >= 15 ? 15 : matchCode);
+            int offset = pos - ref;
+            *op++ = uchar(offset & 0xff);
+            *op++ = uchar(offset >> 8);
+            if (matchCode >= 15)
+                op = writeLength(op, matchCode - 15);
+
+            ip += length;
+            anchor = ip;
+        }
+
+        op = writeLiterals(op, anchor, int(end - anchor), 0);
+        return int(op - dst);
+    }
+
+    bool decompressBlock(const uchar *ip, int size, uchar *dst, int dstSize)
+    {
+        const uchar *iend = ip + size;
+        uchar *op = dst;
+        uchar *oend = dst + dstSize;
+
+        while (ip < iend) {
+            int token = *ip++;
+
+            int length = token >> 4;
+            if (length == 15) {
+                int b;
+                do {
+                    if (ip >= iend)
+                        return false;
+                    b = *ip++;
+                    length += b;
+                } while (b == 255);
+            }
+            if (length > iend - ip || length > oend - op)
+                return false;
+            memcpy(op, ip, size_t(length));
+            op += length;
+            ip += length;
+
+            //最后一个序列只有字面量
+            if (ip >= iend)
+                break;
+
+            if (iend - ip < 2)
+                return false;
+            int offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > op - dst)
+                return false;
+
+            length = token & 15;
+            if (length == 15) {
+                int b;
+                do {
+                    if (ip >= iend)
+                        return false;
+                    b = *ip++;
+                    length += b;
+                } while (b == 255);
+            }
+            length += MinMatch;
+            if (length > oend - op)
+                return false;
+            //匹配可以和输出重叠，逐字节复制
+            const uchar *match = op - offset;
+            for (int i = 0; i < length; i++)
+                op[i] = match[i];
+            op += length;
+        }
+
+        return op == oend;
+    }
+}
+
+bool ZooKeeperCodec::isEncoded(const QByteArray &data)
+{
+    return data.size() >= HeaderSize && memcmp(data.constData(), Magic, sizeof(Magic)) == 0;
+}
+
+QByteArray ZooKeeperCodec::encode(const QByteArray &value)
+{
+    QByteArray data(HeaderSize + compressBound(value.size()), Qt::Uninitialized);
+    uchar *header = reinterpret_cast<uchar *>(data.data());
+
+    memcpy(header, Magic, sizeof(Magic));
+    qToBigEndian(quint32(value.size()), header + sizeof(Magic));
+    int size = compressBlock(reinterpret_cast<const uchar *>(value.constData()), value.size(), header + HeaderSize);
+    data.resize(HeaderSize + size);
+
+    if (data.size() >= value.size() && !isEncoded(value))
+        return value;
+    return data;
+}
+
+QByteArray ZooKeeperCodec::decode(const QByteArray &data, bool *ok)
+{
+    if (ok)
+        *ok = true;
+    if (!isEncoded(data))
+        return data;
+
+    const uchar *header = reinterpret_cast<const uchar *>(data.constData());
+    quint32 size = qFromBigEndian<quint32>(header + sizeof(Magic));
+    if (size <= MaxDecodedSize) {
+        QByteArray value(int(size), Qt::Uninitialized);
+        if (decompressBlock(header + HeaderSize, data.size() - HeaderSize, reinterpret_cast<uchar *>(value.data()), int(size)))
+            return value;
+    }
+
+    if (ok)
+        *ok = false;
+    return data;
+}
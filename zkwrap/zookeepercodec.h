@@ -0,0 +1,32 @@
+﻿#ifndef ZOOKEEPERCODEC_H
+#define ZOOKEEPERCODEC_H
+
+#include <QByteArray>
+
+/**
+ * @brief 节点值的压缩编码。
+ * 编码后的值以 magic 头开始，后面是原始长度和 LZ4 块格式的压缩数据，
+ * 没有 magic 头的值按原样读出，所以未开启压缩的客户端写入的值也能正常读取。
+ */
+namespace ZooKeeperCodec
+{
+    /** 编码后的值的头部长度 */
+    const int HeaderSize = 8;
+
+    /** 值是否带有压缩头 */
+    bool isEncoded(const QByteArray &data);
+
+    /**
+     * @brief 压缩 value，压缩后没有变小时返回原值
+     * 原值恰好以 magic 头开始时总是编码，避免读取时误判
+     */
+    QByteArray encode(const QByteArray &value);
+
+    /**
+     * @brief 还原 encode 的结果，不带压缩头的值原样返回
+     * @param ok 数据损坏时置为 false，此时返回原始数据
+     */
+    QByteArray decode(const QByteArray &data, bool *ok = nullptr);
+};
+
+#endif // ZOOKEEPERCODEC_H
@@ -0,0 +1,456 @@
+﻿#define int_fast16_t int_fast16_t_
+#define uint_fast16_t uint_fast16_t_
+#include "zookeeper.h"
+#undef int_fast16_t
+#undef uint_fast16_t
+
+#include "zookeepercontender.h"
+
+#include <QDebug>
+#include <QPointer>
+#include <QUuid>
+
+#include <algorithm>
+
+using namespace ZooKeeper;
+
+namespace
+{
+    //C 客户端的回调参数，generation 不一致说明这次加入已经结束
+    struct ContenderContext
+    {
+        QPointer<ZooKeeperContender> contender;
+        quint64 generation;
+        QString path;
+        QString prefix;
+    };
+
+    //创建结果丢失时删除可能已经创建的节点，prefix 只属于那一次加入
+    struct OrphanContext
+    {
+        QByteArray path;
+        QString prefix;
+    };
+
+    qint64 sequenceOf(const QString &name)
+    {
+        return name.right(10).toLongLong();
+    }
+
+    bool isLost(int rc)
+    {
+        return rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT;
+    }
+}
+
+class ZooKeeperContenderPrivate
+{
+public:
+    ZooKeeperContenderPrivate(ZooKeeperContender *contender) : q(contender) { }
+
+    ContenderContext *context() const { return new ContenderContext { q, m_generation, m_path, m_prefix }; }
+    static zhandle_t *handle() { return ZooKeeperManager::instance()->zooHandle(); }
+
+    int create();
+    void listChildren();
+    void resync();
+    void onCreated(int rc, const QString &node);
+    void onChildren(int rc, const QStringList &children);
+    void watchPredecessor();
+    void onPredecessor(int rc);
+    void onPredecessorEvent(int type);
+    void fail(ZooKeeperError error);
+    void clear();
+
+    //在完成线程中调用，转到本对象所在的线程处理，release 为 false 时参数留给监听回调释放
+    static void post(const void *data, const std::function<void(ZooKeeperContenderPrivate *)> &handler, bool release = true);
+    static void createCompletion(int rc, const char *name, const void *data);
+    static void removeOrphan(const QString &path, const QString &prefix);
+    static void orphanCompletion(int rc, const struct String_vector *strings, const void *data);
+    static void childrenCompletion(int rc, const struct String_vector *strings, const void *data);
+    static void predecessorCompletion(int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
+    static void deleteCompletion(int rc, const void *data);
+    static void predecessorWatcher(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx);
+
+    ZooKeeperContender *q = nullptr;
+    QString m_path;
+    //节点名的固定前缀，用来从子节点中区分参与排队的节点
+    QString m_namePrefix;
+    //m_namePrefix 加上每次加入生成的 uuid
+    QString m_prefix;
+    QByteArray m_value;
+    QString m_node;
+    //排在自己前面的节点，按序号升序，最后一个是正在监听的节点
+    QStringList m_predecessors;
+    bool m_active = false;
+    //创建请求发出后连接断开，节点可能已经创建，重新连接后在子节点中找
+    bool m_recover = false;
+    //等待重新连接后重新读取子节点
+    bool m_resync = false;
+    quint64 m_generation = 0;
+};
+
+void ZooKeeperContenderPrivate::post(const void *data, const std::function<void (ZooKeeperContenderPrivate *)> &handler, bool release)
+{
+    auto context = reinterpret_cast<const ContenderContext *>(data);
+    QPointer<ZooKeeperContender> contender = context->contender;
+    quint64 generation = context->generation;
+    if (release)
+        delete context;
+
+    if (!contender)
+        return;
+
+    QMetaObject::invokeMethod(contender.data(), [contender, generation, handler] {
+        if (contender && contender->d_func()->m_generation == generation)
+            handler(contender->d_func());
+    }, Qt::QueuedConnection);
+}
+
+void ZooKeeperContenderPrivate::createCompletion(int rc, const char *name, const void *data)
+{
+    auto context = reinterpret_cast<const ContenderContext *>(data);
+    QString node = QString::fromLatin1(name);
+
+    //这次加入已经结束时删除刚创建的节点，否则它会一直挡住后面的节点
+    QPointer<ZooKeeperContender> contender = context->contender;
+    quint64 generation = context->generation;
+    QString parent = context->path;
+    QString prefix = context->prefix;
+    delete context;
+
+    //结果丢失时不知道节点名，按前缀在子节点中找
+    auto abandon = [rc, node, parent, prefix] {
+        if (rc == ZOK)
+            zoo_adelete(handle(), node.toLatin1().constData(), -1, &ZooKeeperContenderPrivate::deleteCompletion, nullptr);
+        else if (isLost(rc))
+            removeOrphan(parent, prefix);
+    };
+
+    if (!contender) {
+        abandon();
+        return;
+    }
+
+    QMetaObject::invokeMethod(contender.data(), [contender, generation, rc, node, abandon] {
+        if (contender && contender->d_func()->m_generation == generation)
+            contender->d_func()->onCreated(rc, node);
+        else
+            abandon();
+    }, Qt::QueuedConnection);
+}
+
+void ZooKeeperContenderPrivate::removeOrphan(const QString &path, const QString &prefix)
+{
+    zhandle_t *zh = handle();
+    if (!zh)
+        return;
+
+    OrphanContext *orphanContext = new OrphanContext { path.toLatin1(), prefix };
+    int ret = zoo_aget_children(zh, orphanContext->path.constData(), 0, &ZooKeeperContenderPrivate::orphanCompletion, orphanContext);
+    if (ret != ZOK) {
+        qWarning() << __func__ << ZooKeeperError(ret) << "prefix =" << prefix;
+        delete orphanContext;
+    }
+}
+
+void ZooKeeperContenderPrivate::orphanCompletion(int rc, const String_vector *strings, const void *data)
+{
+    auto orphanContext = reinterpret_cast<const OrphanContext *>(data);
+    QString path = QString::fromLatin1(orphanContext->path);
+    QString prefix = orphanContext->prefix;
+    delete orphanContext;
+
+    if (rc == ZOK) {
+        for (int i = 0; i < strings->count; i++) {
+            QString child = QString::fromLatin1(strings->data[i]);
+            if (child.startsWith(prefix)) {
+                qDebug() << __func__ << "remove" << child;
+                zoo_adelete(handle(), (path + "/" + child).toLatin1().constData(), -1
+                            , &ZooKeeperContenderPrivate::deleteCompletion, nullptr);
+            }
+        }
+    } else if (isLost(rc)) {
+        //连接还没有恢复，重新连接后再找；会话过期时节点已经被删除，请求会直接失败
+        removeOrphan(path, prefix);
+    } else if (rc != ZNONODE) {
+        qWarning() << __func__ << ZooKeeperError(rc) << "prefix =" << prefix;
+    }
+}
+
+void ZooKeeperContenderPrivate::childrenCompletion(int rc, const String_vector *strings, const void *data)
+{
+    QStringList children;
+    if (rc == ZOK) {
+        for (int i = 0; i < strings->count; i++)
+            children.append(QString::fromLatin1(strings->data[i]));
+    }
+
+    post(data, [rc, children](ZooKeeperContenderPrivate *d) { d->onChildren(rc, children); });
+}
+
+void ZooKeeperContenderPrivate::predecessorCompletion(int rc, const char *, int, const Stat *, const void *data)
+{
+    //get 只有成功时才注册监听，参数交给监听回调释放；节点不存在时没有监听，在这里释放
+    post(data, [rc](ZooKeeperContenderPrivate *d) { d->onPredecessor(rc); }, rc != ZOK);
+}
+
+void ZooKeeperContenderPrivate::deleteCompletion(int rc, const void *)
+{
+    if (rc != ZOK && rc != ZNONODE)
+        qWarning() << __func__ << ZooKeeperError(rc);
+}
+
+void ZooKeeperContenderPrivate::predecessorWatcher(zhandle_t *, int type, int state, const char *path, void *watcherCtx)
+{
+    //会话事件会发给所有监听，只有过期时监听才会被清除
+    if (type == ZOO_SESSION_EVENT) {
+        if (state == ZOO_EXPIRED_SESSION_STATE)
+            delete reinterpret_cast<ContenderContext *>(watcherCtx);
+        return;
+    }
+
+    qDebug() << __func__ << ZooKeeperType(type) << "path =" << path;
+
+    post(watcherCtx, [type](ZooKeeperContenderPrivate *d) { d->onPredecessorEvent(type); });
+}
+
+int ZooKeeperContenderPrivate::create()
+{
+    ContenderContext *createContext = context();
+    int ret = zoo_acreate(handle(), (m_path + "/" + m_prefix).toLatin1().constData(), m_value.constData(), m_value.size()
+                          , &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE
+                          , &ZooKeeperContenderPrivate::createCompletion, createContext);
+    if (ret != ZOK)
+        delete createContext;
+    return ret;
+}
+
+void ZooKeeperContenderPrivate::listChildren()
+{
+    ContenderContext *childrenContext = context();
+    int ret = zoo_aget_children(handle(), m_path.toLatin1().constData(), 0
+                                , &ZooKeeperContenderPrivate::childrenCompletion, childrenContext);
+    if (ret != ZOK) {
+        delete childrenContext;
+        fail(ZooKeeperError(ret));
+    }
+}
+
+void ZooKeeperContenderPrivate::resync()
+{
+    //连接恢复和请求失败可能同时触发，只保留最后一次读取
+    m_generation++;
+    m_predecessors.clear();
+    m_resync = !ZooKeeperManager::instance()->isConnected();
+    if (!m_resync)
+        listChildren();
+}
+
+void ZooKeeperContenderPrivate::onCreated(int rc, const QString &node)
+{
+    if (isLost(rc)) {
+        //请求可能已经在服务器上执行，重新连接后按前缀找回节点，找不到再创建
+        m_recover = true;
+        resync();
+        return;
+    }
+    if (rc != ZOK) {
+        fail(ZooKeeperError(rc));
+        return;
+    }
+
+    m_node = node;
+    //排队的节点列表只在加入时读取一次
+    listChildren();
+}
+
+void ZooKeeperContenderPrivate::onChildren(int rc, const QStringList &children)
+{
+    if (isLost(rc)) {
+        resync();
+        return;
+    }
+    if (rc != ZOK) {
+        fail(ZooKeeperError(rc));
+        return;
+    }
+
+    QStringList contenders;
+    for (const QString &child : children) {
+        if (child.startsWith(m_namePrefix))
+            contenders.append(child);
+    }
+    std::sort(contenders.begin(), contenders.end(), [](const QString &a, const QString &b) {
+        return sequenceOf(a) < sequenceOf(b);
+    });
+
+    if (m_recover) {
+        m_recover = false;
+        auto it = std::find_if(contenders.cbegin(), contenders.cend(), [this](const QString &child) {
+            return child.startsWith(m_prefix);
+        });
+        if (it != contenders.cend()) {
+            m_node = m_path + "/" + *it;
+            qDebug() << __func__ << "recovered" << m_node;
+        }
+    }
+
+    int index = contenders.indexOf(m_node.section('/', -1));
+    if (index < 0) {
+        //节点已经被删除，或者创建结果丢失且没有创建成功，重新创建
+        m_node.clear();
+        int ret = create();
+        if (ret != ZOK)
+            fail(ZooKeeperError(ret));
+        return;
+    }
+
+    m_predecessors = contenders.mid(0, index);
+    watchPredecessor();
+}
+
+void ZooKeeperContenderPrivate::watchPredecessor()
+{
+    if (m_predecessors.isEmpty()) {
+        qDebug() << __func__ << "first" << m_node;
+        emit q->first();
+        return;
+    }
+
+    /**
+     * 只监听紧挨着的前一个节点，它删除时只有自己被唤醒。
+     * 用 get 而不是 exists 监听：exists 在节点不存在时也会注册监听，参数要等到会话过期才能释放，
+     * get 在节点不存在时不注册，监听和完成回调共用一个参数
+     */
+    QByteArray predecessor = (m_path + "/" + m_predecessors.last()).toLatin1();
+    ContenderContext *watcherContext = context();
+    int ret = zoo_awget(handle(), predecessor.constData(), &ZooKeeperContenderPrivate::predecessorWatcher, watcherContext
+                        , &ZooKeeperContenderPrivate::predecessorCompletion, watcherContext);
+    if (ret != ZOK) {
+        delete watcherContext;
+        fail(ZooKeeperError(ret));
+    }
+}
+
+void ZooKeeperContenderPrivate::onPredecessor(int rc)
+{
+    if (rc == ZNONODE) {
+        //在监听之前已经删除，继续看缓存中的再前一个
+        m_predecessors.removeLast();
+        watchPredecessor();
+    } else if (isLost(rc)) {
+        resync();
+    } else if (rc != ZOK) {
+        fail(ZooKeeperError(rc));
+    }
+}
+
+void ZooKeeperContenderPrivate::onPredecessorEvent(int type)
+{
+    if (m_predecessors.isEmpty())
+        return;
+
+    if (type == ZOO_DELETED_EVENT)
+        m_predecessors.removeLast();
+    //其他事件重新监听同一个节点
+    watchPredecessor();
+}
+
+void ZooKeeperContenderPrivate::fail(ZooKeeperError error)
+{
+    qDebug() << __func__ << error << "path =" << m_path;
+
+    //之后到达的回调都被忽略
+    m_generation++;
+    m_predecessors.clear();
+    m_resync = false;
+    emit q->failed(error);
+}
+
+void ZooKeeperContenderPrivate::clear()
+{
+    m_generation++;
+    m_predecessors.clear();
+    m_node.clear();
+    m_active = false;
+    m_recover = false;
+    m_resync = false;
+}
+
+ZooKeeperContender::ZooKeeperContender(const QString &path, const QString &prefix, QObject *parent)
+    : QObject(parent)
+    , d_ptr(new ZooKeeperContenderPrivate(this))
+{
+    Q_D(ZooKeeperContender);
+
+    d->m_path = path;
+    d->m_namePrefix = prefix;
+
+    connect(ZooKeeperManager::instance(), &ZooKeeperManager::connected, this, [d] {
+        if (d->m_active && d->m_resync)
+            d->resync();
+    });
+}
+
+ZooKeeperContender::~ZooKeeperContender()
+{
+    leave();
+}
+
+QString ZooKeeperContender::path() const
+{
+    Q_D(const ZooKeeperContender);
+
+    return d->m_path;
+}
+
+QString ZooKeeperContender::nodePath() const
+{
+    Q_D(const ZooKeeperContender);
+
+    return d->m_node;
+}
+
+bool ZooKeeperContender::isActive() const
+{
+    Q_D(const ZooKeeperContender);
+
+    return d->m_active;
+}
+
+ZooKeeperError ZooKeeperContender::join(const QByteArray &value)
+{
+    Q_D(ZooKeeperContender);
+
+    if (d->m_active || !d->handle())
+        return ZooKeeperError::InvliadState;
+
+    d->clear();
+    d->m_value = value;
+    d->m_prefix = d->m_namePrefix + QString::fromLatin1(QUuid::createUuid().toRfc4122().toHex()) + "-";
+    int ret = d->create();
+    if (ret != ZOK)
+        return ZooKeeperError(ret);
+
+    d->m_active = true;
+    return ZooKeeperError::NoError;
+}
+
+void ZooKeeperContender::leave()
+{
+    Q_D(ZooKeeperContender);
+
+    if (d->m_recover)
+        d->removeOrphan(d->m_path, d->m_prefix);
+    if (!d->m_node.isEmpty())
+        zoo_adelete(d->handle(), d->m_node.toLatin1().constData(), -1, &ZooKeeperContenderPrivate::deleteCompletion, nullptr);
+    d->clear();
+}
+
+void ZooKeeperContender::forget()
+{
+    Q_D(ZooKeeperContender);
+
+    d->clear();
+}
@@ -0,0 +1,50 @@
+﻿#ifndef ZOOKEEPERCONTENDER_H
+#define ZOOKEEPERCONTENDER_H
+
+#include "zookeepermanager.h"
+
+QT_FORWARD_DECLARE_CLASS(ZooKeeperContenderPrivate);
+
+/**
+ * @brief 锁和选举共用的排队节点，只在 zkwrap 内部使用。
+ * 在 path 下创建名为 <prefix><uuid>-<序号> 的顺序临时节点，序号最小的排在最前面；
+ * 排在前面的节点列表在加入时读取一次并缓存，只监听紧挨着的前一个节点，前面的节点删除时只唤醒下一个。
+ * 请求结果因连接断开丢失时，重新连接后按 uuid 在子节点中找回自己的节点，找不到再创建。
+ * 回调都转到本对象所在的线程处理
+ */
+class ZooKeeperContender : public QObject
+{
+    Q_OBJECT
+
+public:
+    ZooKeeperContender(const QString &path, const QString &prefix, QObject *parent = nullptr);
+    /** 析构时离开队列 */
+    ~ZooKeeperContender();
+
+    QString path() const;
+    /** 自己的节点，还没有创建或者创建结果丢失时为空 */
+    QString nodePath() const;
+    bool isActive() const;
+
+    /**
+     * @brief 生成新的 uuid 并创建节点加入队列，排到最前面时发出 first。
+     * 请求没有发出时返回错误，之后的错误通过 failed 通知。已经在队列中时返回 InvliadState
+     */
+    ZooKeeper::ZooKeeperError join(const QByteArray &value = "");
+    /** 离开队列并删除自己的节点，创建结果丢失时按 uuid 找到节点删除 */
+    void leave();
+    /** 会话过期，节点已经随会话删除，只清除状态 */
+    void forget();
+
+signals:
+    /** 前面没有其他节点 */
+    void first();
+    /** 连接断开以外的错误，之后不再处理回调，节点保留，需要调用 leave 或 forget */
+    void failed(ZooKeeper::ZooKeeperError error);
+
+private:
+    QScopedPointer<ZooKeeperContenderPrivate> d_ptr;
+    Q_DECLARE_PRIVATE(ZooKeeperContender);
+};
+
+#endif // ZOOKEEPERCONTENDER_H
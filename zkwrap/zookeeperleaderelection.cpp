@@ -0,0 +1,161 @@
+﻿#include "zookeeperleaderelection.h"
+#include "zookeepercontender.h"
+
+#include <QDebug>
+
+using namespace ZooKeeper;
+
+class ZooKeeperLeaderElectionPrivate
+{
+public:
+    ZooKeeperLeaderElectionPrivate(ZooKeeperLeaderElection *election) : q(election) { }
+
+    void enter();
+    void fail(ZooKeeperError error);
+    void setLeader(bool leader);
+
+    ZooKeeperLeaderElection *q = nullptr;
+    ZooKeeperContender *m_contender = nullptr;
+    QByteArray m_value;
+    bool m_running = false;
+    bool m_leader = false;
+    //等待重新连接后再参选
+    bool m_rejoin = false;
+};
+
+void ZooKeeperLeaderElectionPrivate::enter()
+{
+    ZooKeeperError error = m_contender->join(m_value);
+    if (error != ZooKeeperError::NoError)
+        fail(error);
+}
+
+void ZooKeeperLeaderElectionPrivate::fail(ZooKeeperError error)
+{
+    qDebug() << __func__ << error << "path =" << m_contender->path();
+
+    setLeader(false);
+
+    switch (error) {
+    case ZooKeeperError::ConnectionLoss:
+    case ZooKeeperError::OperationTimeout:
+    case ZooKeeperError::SessionExpired:
+    case ZooKeeperError::InvliadState:
+        //节点随会话删除，重新连接后重新参选
+        m_contender->forget();
+        m_rejoin = true;
+        break;
+    default:
+        m_contender->leave();
+        m_running = false;
+        break;
+    }
+
+    emit q->error(error);
+}
+
+void ZooKeeperLeaderElectionPrivate::setLeader(bool leader)
+{
+    if (m_leader != leader) {
+        m_leader = leader;
+        qDebug() << __func__ << leader << m_contender->nodePath();
+        emit q->leadershipChanged(leader);
+    }
+}
+
+ZooKeeperLeaderElection::ZooKeeperLeaderElection(const QString &path, QObject *parent)
+    : QObject(parent)
+    , d_ptr(new ZooKeeperLeaderElectionPrivate(this))
+{
+    Q_D(ZooKeeperLeaderElection);
+
+    d->m_contender = new ZooKeeperContender(path, QStringLiteral("n_"), this);
+    connect(d->m_contender, &ZooKeeperContender::first, this, [d] {
+        if (d->m_running)
+            d->setLeader(true);
+    });
+    connect(d->m_contender, &ZooKeeperContender::failed, this, [d](ZooKeeperError error) {
+        if (d->m_running)
+            d->fail(error);
+    });
+
+    //会话过期后节点已经被服务器删除，重新连接后重新参选
+    connect(ZooKeeperManager::instance(), &ZooKeeperManager::disconnected, this, [d] {
+        if (!d->m_running)
+            return;
+        d->m_contender->forget();
+        d->m_rejoin = true;
+        d->setLeader(false);
+    });
+    connect(ZooKeeperManager::instance(), &ZooKeeperManager::connected, this, [d] {
+        if (d->m_running && d->m_rejoin) {
+            d->m_rejoin = false;
+            d->enter();
+        }
+    });
+}
+
+ZooKeeperLeaderElection::~ZooKeeperLeaderElection()
+{
+    Q_D(ZooKeeperLeaderElection);
+
+    d->m_contender->leave();
+}
+
+QString ZooKeeperLeaderElection::path() const
+{
+    Q_D(const ZooKeeperLeaderElection);
+
+    return d->m_contender->path();
+}
+
+QString ZooKeeperLeaderElection::nodePath() const
+{
+    Q_D(const ZooKeeperLeaderElection);
+
+    return d->m_contender->nodePath();
+}
+
+bool ZooKeeperLeaderElection::isRunning() const
+{
+    Q_D(const ZooKeeperLeaderElection);
+
+    return d->m_running;
+}
+
+bool ZooKeeperLeaderElection::isLeader() const
+{
+    Q_D(const ZooKeeperLeaderElection);
+
+    return d->m_leader;
+}
+
+ZooKeeperError ZooKeeperLeaderElection::start(const QByteArray &value)
+{
+    Q_D(ZooKeeperLeaderElection);
+
+    if (d->m_running)
+        return ZooKeeperError::InvliadState;
+
+    d->m_running = true;
+    d->m_value = value;
+    d->m_rejoin = false;
+    if (ZooKeeperManager::instance()->isConnected())
+        d->enter();
+    else
+        d->m_rejoin = true;
+    return ZooKeeperError::NoError;
+}
+
+void ZooKeeperLeaderElection::stop()
+{
+    Q_D(ZooKeeperLeaderElection);
+
+    if (!d->m_running)
+        return;
+
+    d->m_running = false;
+    d->m_rejoin = false;
+    d->m_contender->leave();
+    d->setLeader(false);
+}
@@ -0,0 +1,53 @@
+﻿#ifndef ZOOKEEPERLEADERELECTION_H
+#define ZOOKEEPERLEADERELECTION_H
+
+#include "zookeepermanager.h"
+
+QT_FORWARD_DECLARE_CLASS(ZooKeeperLeaderElectionPrivate);
+
+/**
+ * @brief 领导者选举。
+ * 每个候选者在 path 下创建一个顺序临时节点，序号最小的是领导者；其余的只监听排在自己前面的那个节点，
+ * 领导者变化时只通知下一个候选者，不读取子节点。是否是领导者缓存在本地，isLeader 不访问服务器。
+ * 会话过期后在新会话中自动重新参选。path 需要已经存在，且是持久节点
+ */
+class ZooKeeperLeaderElection : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(bool leader READ isLeader NOTIFY leadershipChanged)
+
+public:
+    explicit ZooKeeperLeaderElection(const QString &path, QObject *parent = nullptr);
+    /** 析构时退出选举 */
+    ~ZooKeeperLeaderElection();
+
+    QString path() const;
+    /** 自己的候选节点，还没有创建时为空 */
+    QString nodePath() const;
+
+    bool isRunning() const;
+    /**
+     * @brief 是否是领导者。连接暂时断开(suspended)时保持不变，
+     * 需要严格互斥的领导者应在 suspended 时暂停工作
+     */
+    bool isLeader() const;
+
+    /**
+     * @brief 开始参选，value 写入候选节点，例如自己的地址。已经在参选时返回 InvliadState
+     */
+    ZooKeeper::ZooKeeperError start(const QByteArray &value = "");
+    /** 退出选举并删除候选节点 */
+    void stop();
+
+signals:
+    void leadershipChanged(bool leader);
+    /** 参选出错。连接断开时在重新连接后自动重试，不发出；会话失效引起的错误在重新连接后重新参选，其他错误会退出选举 */
+    void error(ZooKeeper::ZooKeeperError error);
+
+private:
+    QScopedPointer<ZooKeeperLeaderElectionPrivate> d_ptr;
+    Q_DECLARE_PRIVATE(ZooKeeperLeaderElection);
+};
+
+#endif // ZOOKEEPERLEADERELECTION_H
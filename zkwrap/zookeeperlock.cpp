@@ -0,0 +1,147 @@
+﻿#include "zookeeperlock.h"
+#include "zookeepercontender.h"
+
+#include <QDebug>
+#include <QTimer>
+
+using namespace ZooKeeper;
+
+class ZooKeeperLockPrivate
+{
+public:
+    enum class State
+    {
+        Idle,
+        Waiting,
+        Locked
+    };
+
+    ZooKeeperLockPrivate(ZooKeeperLock *lock) : q(lock) { }
+
+    void onFirst();
+    void fail(ZooKeeperError error);
+    void reset();
+
+    ZooKeeperLock *q = nullptr;
+    ZooKeeperContender *m_contender = nullptr;
+    State m_state = State::Idle;
+    QTimer m_timer;
+};
+
+void ZooKeeperLockPrivate::onFirst()
+{
+    if (m_state != State::Waiting)
+        return;
+
+    m_state = State::Locked;
+    m_timer.stop();
+    qDebug() << __func__ << "locked" << m_contender->nodePath();
+    emit q->lockedChanged();
+    emit q->acquired();
+}
+
+void ZooKeeperLockPrivate::fail(ZooKeeperError error)
+{
+    qDebug() << __func__ << error << "path =" << m_contender->path();
+
+    reset();
+    emit q->acquireFailed(error);
+}
+
+void ZooKeeperLockPrivate::reset()
+{
+    m_timer.stop();
+    m_state = State::Idle;
+    m_contender->leave();
+}
+
+ZooKeeperLock::ZooKeeperLock(const QString &path, QObject *parent)
+    : QObject(parent)
+    , d_ptr(new ZooKeeperLockPrivate(this))
+{
+    Q_D(ZooKeeperLock);
+
+    d->m_contender = new ZooKeeperContender(path, QStringLiteral("lock-"), this);
+    connect(d->m_contender, &ZooKeeperContender::first, this, [d] { d->onFirst(); });
+    connect(d->m_contender, &ZooKeeperContender::failed, this, [d](ZooKeeperError error) {
+        if (d->m_state != ZooKeeperLockPrivate::State::Idle)
+            d->fail(error);
+    });
+
+    d->m_timer.setSingleShot(true);
+    connect(&d->m_timer, &QTimer::timeout, this, [d] {
+        if (d->m_state != ZooKeeperLockPrivate::State::Locked)
+            d->fail(ZooKeeperError::OperationTimeout);
+    });
+
+    //会话过期后节点已经被服务器删除
+    connect(ZooKeeperManager::instance(), &ZooKeeperManager::disconnected, this, [this, d] {
+        ZooKeeperLockPrivate::State state = d->m_state;
+        d->m_timer.stop();
+        d->m_state = ZooKeeperLockPrivate::State::Idle;
+        d->m_contender->forget();
+        if (state == ZooKeeperLockPrivate::State::Locked) {
+            emit lockedChanged();
+            emit released();
+        } else if (state != ZooKeeperLockPrivate::State::Idle) {
+            emit acquireFailed(ZooKeeperError::SessionExpired);
+        }
+    });
+}
+
+ZooKeeperLock::~ZooKeeperLock()
+{
+    Q_D(ZooKeeperLock);
+
+    d->reset();
+}
+
+QString ZooKeeperLock::path() const
+{
+    Q_D(const ZooKeeperLock);
+
+    return d->m_contender->path();
+}
+
+QString ZooKeeperLock::nodePath() const
+{
+    Q_D(const ZooKeeperLock);
+
+    return d->m_contender->nodePath();
+}
+
+bool ZooKeeperLock::isLocked() const
+{
+    Q_D(const ZooKeeperLock);
+
+    return d->m_state == ZooKeeperLockPrivate::State::Locked;
+}
+
+ZooKeeperError ZooKeeperLock::acquire(int msec)
+{
+    Q_D(ZooKeeperLock);
+
+    if (d->m_state != ZooKeeperLockPrivate::State::Idle)
+        return ZooKeeperError::InvliadState;
+
+    ZooKeeperError error = d->m_contender->join();
+    if (error != ZooKeeperError::NoError)
+        return error;
+
+    d->m_state = ZooKeeperLockPrivate::State::Waiting;
+    if (msec >= 0)
+        d->m_timer.start(msec);
+    return ZooKeeperError::NoError;
+}
+
+void ZooKeeperLock::release()
+{
+    Q_D(ZooKeeperLock);
+
+    bool locked = d->m_state == ZooKeeperLockPrivate::State::Locked;
+    d->reset();
+    if (locked) {
+        emit lockedChanged();
+        emit released();
+    }
+}
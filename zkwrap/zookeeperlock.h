@@ -0,0 +1,54 @@
+﻿#ifndef ZOOKEEPERLOCK_H
+#define ZOOKEEPERLOCK_H
+
+#include "zookeepermanager.h"
+
+QT_FORWARD_DECLARE_CLASS(ZooKeeperLockPrivate);
+
+/**
+ * @brief 分布式互斥锁。
+ * 每个竞争者在 path 下创建一个顺序临时节点，序号最小的持有锁；其余的只监听排在自己前面的那个节点，
+ * 释放锁时只唤醒下一个等待者。排在前面的节点列表在创建时读取一次并缓存，
+ * 因为序号只增不减，之后只需要沿着缓存往前找，不再读取子节点。
+ * 节点名带有每次获取生成的 uuid，创建的结果因连接断开丢失时，重新连接后据此找回节点，放弃获取时据此删除节点；
+ * 连接暂时断开时重新连接后继续等待。排队的实现和 ZooKeeperLeaderElection 共用 ZooKeeperContender。
+ * path 需要已经存在，且是持久节点。会话过期时节点随会话删除，持有的锁随之失去
+ */
+class ZooKeeperLock : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(bool locked READ isLocked NOTIFY lockedChanged)
+
+public:
+    explicit ZooKeeperLock(const QString &path, QObject *parent = nullptr);
+    /** 析构时释放锁或放弃等待 */
+    ~ZooKeeperLock();
+
+    QString path() const;
+    /** 自己的竞争节点，还没有创建时为空 */
+    QString nodePath() const;
+
+    bool isLocked() const;
+
+    /**
+     * @brief 异步获取锁，获得时发出 acquired，失败时发出 acquireFailed。
+     * msec 毫秒内没有获得时放弃等待，错误为 OperationTimeout，小于 0 一直等待。
+     * 已经在获取或持有锁时返回 InvliadState
+     */
+    ZooKeeper::ZooKeeperError acquire(int msec = -1);
+    /** 释放锁，正在等待时放弃等待，不发出 acquireFailed */
+    void release();
+
+signals:
+    void acquired();
+    void released();
+    void acquireFailed(ZooKeeper::ZooKeeperError error);
+    void lockedChanged();
+
+private:
+    QScopedPointer<ZooKeeperLockPrivate> d_ptr;
+    Q_DECLARE_PRIVATE(ZooKeeperLock);
+};
+
+#endif // ZOOKEEPERLOCK_H
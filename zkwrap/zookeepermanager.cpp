@@ -5,25 +5,296 @@
 #undef uint_fast16_t
 
 #include "zookeepermanager.h"
+#include "zookeepercodec.h"
 
+#include <QAtomicInteger>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDeadlineTimer>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
 #include <QHash>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QMetaEnum>
+#include <QMutex>
+#include <QQueue>
+#include <QRegularExpression>
+#include <QSaveFile>
 #include <QTimer>
-#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#ifndef Q_OS_WIN
+#include <netinet/in.h>
+#endif
+
+#include <algorithm>
 
 using namespace ZooKeeper;
 
+//读取节点值的缓冲区大小，与服务器默认的 jute.maxbuffer 一致
+static const int MaxValueSize = 1024 * 1024;
+
+//读取大值时清单被并发替换后重试的次数
+static const int LargeValueRetries = 3;
+
+//统计的 API 个数
+static const int ApiCount = int(ZooKeeperApi::Wget) + 1;
+
+//对数线性分桶的延迟直方图(微秒)，小于 32 的值精确计数，其上每个 2 的幂分成 16 个桶
+struct LatencyHistogram
+{
+    static const int SubBits = 5;
+    static const int SubCount = 1 << SubBits;
+    static const int HalfCount = SubCount / 2;
+    static const int MaxBits = 40;
+    static const int Buckets = SubCount + (MaxBits - SubBits) * HalfCount;
+
+    LatencyHistogram() : counts(Buckets, 0) { }
+
+    static int bucketOf(qint64 value)
+    {
+        if (value < SubCount)
+            return int(value);
+        int shift = 63 - qCountLeadingZeroBits(quint64(value)) - SubBits + 1;
+        return SubCount + (shift - 1) * HalfCount + int(value >> shift) - HalfCount;
+    }
+
+    //落在桶里的最大值
+    static qint64 bucketTop(int bucket)
+    {
+        if (bucket < SubCount)
+            return bucket;
+        int shift = (bucket - SubCount) / HalfCount + 1;
+        qint64 sub = (bucket - SubCount) % HalfCount + HalfCount;
+        return (sub << shift) + ((Q_INT64_C(1) << shift) - 1);
+    }
+
+    void record(qint64 value)
+    {
+        value = qBound<qint64>(0, value, (Q_INT64_C(1) << MaxBits) - 1);
+        counts[bucketOf(value)]++;
+        if (total == 0 || value < min)
+            min = value;
+        if (value > max)
+            max = value;
+        total++;
+        sum += double(value);
+    }
+
+    qint64 percentile(double percentile) const
+    {
+        if (total == 0)
+            return 0;
+        qint64 rank = qMax<qint64>(1, qint64(percentile / 100.0 * double(total) + 0.999999));
+        qint64 seen = 0;
+        for (int i = 0; i < Buckets; i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return qMin(bucketTop(i), max);
+        }
+        return max;
+    }
+
+    LatencySummary summary() const
+    {
+        LatencySummary summary;
+        summary.count = total;
+        summary.min = min;
+        summary.max = max;
+        summary.mean = total ? sum / double(total) : 0;
+        summary.p50 = percentile(50);
+        summary.p90 = percentile(90);
+        summary.p99 = percentile(99);
+        summary.p999 = percentile(99.9);
+        return summary;
+    }
+
+    void clear()
+    {
+        counts.fill(0);
+        total = min = max = 0;
+        sum = 0;
+    }
+
+    QVector<qint64> counts;
+    qint64 total = 0;
+    qint64 min = 0;
+    qint64 max = 0;
+    double sum = 0;
+};
+
+struct ApiRecorder
+{
+    qint64 calls = 0;
+    qint64 errors = 0;
+    LatencyHistogram latency;
+    LatencyHistogram delivery;
+};
+
+//大值的清单，保存在大值节点上，分片是它的子节点 <generation>-<index>
+struct LargeValueManifest
+{
+    QString generation;
+    int chunks = 0;
+    qint64 size = 0;
+    QByteArray sha1;
+
+    QByteArray chunkPath(const QString &path, int index) const
+    {
+        return QString("%1/%2-%3").arg(path, generation).arg(index).toLatin1();
+    }
+
+    QByteArray toJson() const
+    {
+        QJsonObject object;
+        object["zklv"] = 1;
+        object["generation"] = generation;
+        object["chunks"] = chunks;
+        object["size"] = size;
+        object["sha1"] = QString(sha1);
+        return QJsonDocument(object).toJson(QJsonDocument::Compact);
+    }
+
+    static bool fromJson(const QByteArray &data, LargeValueManifest *manifest)
+    {
+        if (!data.startsWith('{'))
+            return false;
+
+        QJsonObject object = QJsonDocument::fromJson(data).object();
+        if (object.value("zklv").toInt() != 1)
+            return false;
+
+        manifest->generation = object.value("generation").toString();
+        manifest->chunks = object.value("chunks").toInt();
+        manifest->size = qint64(object.value("size").toDouble());
+        manifest->sha1 = object.value("sha1").toString().toLatin1();
+        return !manifest->generation.isEmpty() && manifest->chunks >= 0;
+    }
+};
+
+//等待 zoo_abatch 提交的一组请求全部完成，没有完成的请求记为 SystemError
+struct BatchWaiter
+{
+    explicit BatchWaiter(int count) : pending(count), errors(count, ZSYSTEMERROR), values(count) { }
+
+    void done(int index, int rc, const QByteArray &value = QByteArray())
+    {
+        QMutexLocker locker(&mutex);
+        errors[index] = rc;
+        values[index] = value;
+        if (--pending == 0)
+            finished.wakeAll();
+    }
+
+    void wait()
+    {
+        QMutexLocker locker(&mutex);
+        while (pending > 0)
+            finished.wait(&mutex);
+    }
+
+    ZooKeeperError firstError() const
+    {
+        for (int rc : errors) {
+            if (rc != ZOK)
+                return ZooKeeperError(rc);
+        }
+        return ZooKeeperError::NoError;
+    }
+
+    QMutex mutex;
+    QWaitCondition finished;
+    int pending;
+    QVector<int> errors;
+    QVector<QByteArray> values;
+};
+
+struct BatchItem
+{
+    BatchWaiter *waiter;
+    int index;
+};
+
+//异步调用的参数，start 是调用时刻(微秒)，不统计时为 -1
+struct NodeParam
+{
+    QString path;
+    qint64 start;
+    int valueSize;
+};
+
+//排队等待窗口空位的异步调用，fail 以错误码调用原来的回调
+struct PendingCall
+{
+    ZooKeeperApi api;
+    qint64 start;
+    qint64 bytes;
+    std::function<int()> submit;
+    std::function<void(int)> fail;
+};
+
+//窗口按请求的路径加值的字节数计算
+static qint64 callBytes(const QString &path, int valueSize)
+{
+    return path.size() + qMax(valueSize, 0);
+}
+
 struct GetNodeValueParam
 {
     QString path;
     std::function<void(ZooKeeperError, const QByteArray &)> callback;
+    qint64 start;
 };
 
 struct GetChildrenNodeParam
 {
     QString path;
     std::function<void(ZooKeeperError, const QStringList &)> callback;
+    qint64 start;
+};
+
+//登记的临时节点，data 是编码后的值
+struct EphemeralEntry
+{
+    QString path;
+    QByteArray data;
+    int flags;
+};
+
+//一次 zoo_amulti 重建的节点，op 里的指针指向这里的数据，回调返回前不能释放
+struct RestoreBatch
+{
+    QVector<EphemeralEntry> entries;
+    QVector<QByteArray> paths;
+    QVector<QByteArray> created;
+    QVector<zoo_op_t> ops;
+    QVector<zoo_op_result_t> results;
+};
+
+//multi 失败后用 zoo_abatch 一次检查其余节点是否存在，items 指向这里，全部回调返回前不能释放
+struct RestoreCheck;
+struct RestoreCheckItem
+{
+    RestoreCheck *check;
+    int index;
+};
+
+struct RestoreCheck
+{
+    QVector<EphemeralEntry> entries;
+    QVector<QByteArray> paths;
+    QVector<RestoreCheckItem> items;
+    QVector<zoo_batch_op_t> ops;
+    QVector<int> errors;
+    int pending = 0;
+};
+
+struct RevalidateParam
+{
+    QString path;
 };
 
 struct WgetNodeValueParam
@@ -58,6 +329,56 @@ static QString error2string(ZooKeeperState state)
     }
 }
 
+//会话当前连接的服务器 address:port，未连接时为空
+static QString connectedServer(zhandle_t *zh)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (!zh || !zookeeper_get_connected_host(zh, reinterpret_cast<struct sockaddr *>(&addr), &len))
+        return QString();
+
+    //地址和端口都是网络字节序
+    QString host;
+    const quint8 *port = nullptr;
+    if (addr.ss_family == AF_INET) {
+        auto in = reinterpret_cast<const struct sockaddr_in *>(&addr);
+        auto ip = reinterpret_cast<const quint8 *>(&in->sin_addr);
+        host = QString("%1.%2.%3.%4").arg(ip[0]).arg(ip[1]).arg(ip[2]).arg(ip[3]);
+        port = reinterpret_cast<const quint8 *>(&in->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        auto in6 = reinterpret_cast<const struct sockaddr_in6 *>(&addr);
+        auto ip = reinterpret_cast<const quint8 *>(&in6->sin6_addr);
+        QStringList groups;
+        for (int i = 0; i < 16; i += 2)
+            groups.append(QString::number((ip[i] << 8) | ip[i + 1], 16));
+        host = "[" + groups.join(':') + "]";
+        port = reinterpret_cast<const quint8 *>(&in6->sin6_port);
+    } else {
+        return QString();
+    }
+    return QString("%1:%2").arg(host).arg((port[0] << 8) | port[1]);
+}
+
+//C 客户端请求的操作名，与 ZooKeeperApi 的名字一致
+static QString operationName(int type)
+{
+    switch (type) {
+    case ZOO_CREATE_OP: return QStringLiteral("Create");
+    case ZOO_DELETE_OP: return QStringLiteral("Delete");
+    case ZOO_EXISTS_OP: return QStringLiteral("Exists");
+    case ZOO_GETDATA_OP: return QStringLiteral("Get");
+    case ZOO_SETDATA_OP: return QStringLiteral("Set");
+    case ZOO_GETACL_OP: return QStringLiteral("GetAcl");
+    case ZOO_SETACL_OP: return QStringLiteral("SetAcl");
+    case ZOO_GETCHILDREN_OP:
+    case ZOO_GETCHILDREN2_OP: return QStringLiteral("Children");
+    case ZOO_SYNC_OP: return QStringLiteral("Sync");
+    case ZOO_CHECK_OP: return QStringLiteral("Check");
+    case ZOO_MULTI_OP: return QStringLiteral("Multi");
+    default: return QString::number(type);
+    }
+}
+
 class ZooKeeperNodePrivate
 {
 public:
@@ -67,6 +388,9 @@ public:
     QString m_path;
     QByteArray m_value;
     ZooKeeperNode::ZooKeeperNodeType m_type;
+    //缓存的值对应的版本，-1 表示未知
+    int m_version = -1;
+    bool m_stale = false;
 };
 
 
@@ -123,11 +447,37 @@ bool ZooKeeperNode::exists() const
     return d->m_exists;
 }
 
+bool ZooKeeperNode::isStale() const
+{
+    return d->m_stale;
+}
+
+void ZooKeeperNode::setStale(bool stale)
+{
+    if (d->m_stale != stale) {
+        d->m_stale = stale;
+        emit staleChanged();
+    }
+}
+
 class ZooKeeperManagerPrivate
 {
 public:
+    ZooKeeperManagerPrivate() { m_clock.start(); }
+
     static void processDisconnected();
+    static void processExpired(zhandle_t *zzh);
+    static bool isUnrecoverable(zhandle_t *zh);
+    void markStale();
+    void restoreEphemerals();
+    bool submitRestore(RestoreBatch *batch);
+    void finishRestore();
+    void checkRestore(RestoreCheck *check);
+    bool loadSession();
+    void saveSession() const;
+    void revalidate();
     static void watcher(zhandle_t *zzh, int type, int state, const char *path, void* context);
+    static void readOnlyWatcher(zhandle_t *zzh, int type, int state, const char *path, void* context);
     static void addAuthCompletion(int rc, const void *data);
     static void acreateCompletion(int rc, const char *name, const void *data);
     static void adeleteCompletion(int rc, const void *data);
@@ -135,15 +485,99 @@ public:
     static void asetCompletion(int rc, const struct Stat *stat, const void *data);
     static void agetCompletion(int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
     static void agetChildrenCompletion(int rc, const struct String_vector *strings, const void *data);
+    static void restoreCompletion(int rc, const void *data);
+    static void restoreCheckCompletion(int rc, const struct Stat *stat, const void *data);
+    static void revalidateCompletion(int rc, const struct Stat *stat, const void *data);
     static void wgetNodeValue(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx);
     static void wgetChildrenNode(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx);
+    static void batchDataCompletion(int rc, const char *value, int value_len, const struct Stat *stat, const void *data);
+    static void batchStringCompletion(int rc, const char *name, const void *data);
+    static void batchVoidCompletion(int rc, const void *data);
+
+    zhandle_t *readHandle(bool watch = false) const;
+    QByteArray encodeValue(const QByteArray &value);
+    QByteArray decodeValue(const QByteArray &data);
+
+    static ZooKeeperError submitBatch(zhandle_t *zh, const QVector<zoo_batch_op_t> &ops, BatchWaiter *waiter);
+    static ZooKeeperError readManifest(zhandle_t *zh, const QString &path, LargeValueManifest *manifest
+                                       , int *version, QByteArray *raw);
+    void removeChunks(const QString &path, const LargeValueManifest &manifest, const QVector<int> &errors);
+    static ZooKeeperError staleChunks(zhandle_t *zh, const QString &path, const QString &generation, QVector<QByteArray> *chunkPaths);
+    QString nextGeneration();
+
+    qint64 now() const { return m_clock.nsecsElapsed() / 1000; }
+    qint64 startCall() const { return m_metricsEnabled ? now() : -1; }
+    void recordSubmit(ZooKeeperApi api, qint64 start, int ret);
+    void recordResult(ZooKeeperApi api, qint64 start, ZooKeeperError error, const QString &path, int valueSize = -1);
+    void recordSync(ZooKeeperApi api, qint64 start, ZooKeeperError error, const QString &path, int valueSize = -1);
+    void recordDelivery(ZooKeeperApi api, qint64 start);
+    void recordSlow(ZooKeeperApi api, qint64 latency, ZooKeeperError error, const QString &path, int valueSize);
+    void applySlowLog(zhandle_t *zh) const;
+
+    bool windowLimited() const { return m_windowCalls > 0 || m_windowBytes > 0; }
+    bool hasRoom(qint64 bytes) const;
+    ZooKeeperError submitCall(ZooKeeperApi api, qint64 start, qint64 bytes
+                              , const std::function<int()> &submit, const std::function<void(int)> &fail);
+    void releaseWindow(qint64 bytes);
+    void drainPending(QMutexLocker &locker);
 
     zhandle_t *m_zooHandle = nullptr;
+    zhandle_t *m_readOnlyHandle = nullptr;
+    QString m_readOnlyHost = "";
+    int m_readOnlyTimeout = 30000;
     clientid_t m_clientId;
+    QString m_sessionFile;
     int m_timeout = 30000;
     QString m_host = "";
     bool m_connected = false;
     QHash<QString, ZooKeeperNode *> m_nodePool;
+    bool m_cacheStale = false;
+
+    QMutex m_ephemeralMutex;
+    QHash<QString, EphemeralEntry> m_ephemerals;
+    int m_ephemeralBatchOps = 500;
+    int m_ephemeralBatchBytes = 512 * 1024;
+    //以下只在完成线程中访问
+    bool m_restorePending = false;
+    int m_restoreBatches = 0;
+    int m_restoreCreated = 0;
+    int m_restoreExisting = 0;
+    int m_restoreFailed = 0;
+
+    bool m_compression = false;
+    int m_compressionThreshold = 64 * 1024;
+    QAtomicInteger<qint64> m_encodedValues;
+    QAtomicInteger<qint64> m_rawBytes;
+    QAtomicInteger<qint64> m_encodedBytes;
+    QAtomicInteger<qint64> m_decodedValues;
+    QAtomicInteger<qint64> m_decodeErrors;
+
+    QAtomicInteger<quint32> m_generation;
+
+    QTimer *m_statsTimer = nullptr;
+
+    bool m_metricsEnabled = true;
+    QElapsedTimer m_clock;
+    mutable QMutex m_metricsMutex;
+    ApiRecorder m_apis[ApiCount];
+    qint64 m_metricsSince = 0;
+    QTimer *m_metricsTimer = nullptr;
+
+    int m_slowThreshold = 0;
+    int m_slowCapacity = 64;
+    QVector<SlowOperation> m_slowOperations;
+    int m_slowNext = 0;
+    int m_hotPaths = 0;
+
+    mutable QMutex m_windowMutex;
+    QWaitCondition m_windowChanged;
+    int m_windowCalls = 0;
+    qint64 m_windowBytes = 0;
+    int m_inFlight = 0;
+    qint64 m_inFlightBytes = 0;
+    QQueue<PendingCall> m_pendingCalls;
+    bool m_windowFull = false;
+    bool m_draining = false;
 };
 
 void ZooKeeperManagerPrivate::processDisconnected()
@@ -162,6 +596,224 @@ void ZooKeeperManagerPrivate::processDisconnected()
     emit _this->disconnected();
 }
 
+bool ZooKeeperManagerPrivate::isUnrecoverable(zhandle_t *zh)
+{
+    int state = zoo_state(zh);
+    return state == ZOO_EXPIRED_SESSION_STATE || state == ZOO_AUTH_FAILED_STATE;
+}
+
+void ZooKeeperManagerPrivate::processExpired(zhandle_t *zzh)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+
+    /**
+     * 在旧会话的完成线程中调用，m_zooHandle 在调用者的线程中读取，
+     * 转到管理器所在的线程替换，先换上新会话再关闭旧会话，调用者不会拿到已经关闭的句柄
+     */
+    QMetaObject::invokeMethod(_this, [_this, zzh] {
+        ZooKeeperManagerPrivate *d = _this->d_func();
+        //quit 已经关闭了这个会话，地址可能被新打开的会话复用，再比较状态
+        if (d->m_zooHandle != zzh || !isUnrecoverable(zzh))
+            return;
+
+        d->m_connected = false;
+        d->markStale();
+        d->m_restorePending = true;
+
+        //用新会话重新连接，节点缓存保留到连接后校验，临时节点随旧会话删除
+        d->m_clientId.client_id = 0;
+        d->m_zooHandle = zookeeper_init(d->m_host.toLatin1().constData(), &ZooKeeperManagerPrivate::watcher,
+                                        d->m_timeout, &d->m_clientId, _this, 0);
+        d->applySlowLog(d->m_zooHandle);
+        zookeeper_close(zzh);
+
+        emit _this->disconnected();
+    }, Qt::QueuedConnection);
+}
+
+void ZooKeeperManagerPrivate::markStale()
+{
+    m_cacheStale = true;
+    for (auto it = m_nodePool.begin(); it != m_nodePool.end(); it++) {
+        it.value()->setStale(true);
+    }
+}
+
+void ZooKeeperManagerPrivate::restoreEphemerals()
+{
+    QVector<EphemeralEntry> entries;
+    int maxOps = 0;
+    int maxBytes = 0;
+    {
+        QMutexLocker locker(&m_ephemeralMutex);
+        entries.reserve(m_ephemerals.size());
+        for (auto it = m_ephemerals.cbegin(); it != m_ephemerals.cend(); it++)
+            entries.append(it.value());
+        maxOps = m_ephemeralBatchOps;
+        maxBytes = m_ephemeralBatchBytes;
+    }
+    if (entries.isEmpty())
+        return;
+
+    //按个数和字节数分批，所有批次一起提交，不等前一批返回；提交期间多占一个计数，全部提交后才可能结束
+    m_restoreBatches++;
+    RestoreBatch *batch = nullptr;
+    int bytes = 0;
+    for (const EphemeralEntry &entry : entries) {
+        int size = entry.path.size() + entry.data.size();
+        if (batch && (batch->entries.size() >= maxOps || bytes + size > maxBytes)) {
+            submitRestore(batch);
+            batch = nullptr;
+        }
+        if (!batch) {
+            batch = new RestoreBatch;
+            bytes = 0;
+        }
+        batch->entries.append(entry);
+        bytes += size;
+    }
+    submitRestore(batch);
+
+    qDebug() << __func__ << "ephemerals =" << entries.size() << "batches =" << m_restoreBatches - 1;
+    finishRestore();
+}
+
+bool ZooKeeperManagerPrivate::submitRestore(RestoreBatch *batch)
+{
+    int count = batch->entries.size();
+    batch->paths.resize(count);
+    batch->created.resize(count);
+    batch->ops.resize(count);
+    batch->results.resize(count);
+    for (int i = 0; i < count; i++) {
+        const EphemeralEntry &entry = batch->entries[i];
+        batch->paths[i] = entry.path.toLatin1();
+        batch->created[i] = QByteArray(batch->paths[i].size() + 1, '\0');
+        zoo_create_op_init(&batch->ops[i], batch->paths[i].constData(), entry.data.constData(), entry.data.size()
+                           , &ZOO_OPEN_ACL_UNSAFE, entry.flags, batch->created[i].data(), batch->created[i].size());
+    }
+
+    m_restoreBatches++;
+    int ret = zoo_amulti(m_zooHandle, count, batch->ops.constData(), batch->results.data()
+                         , &ZooKeeperManagerPrivate::restoreCompletion, batch);
+    if (ret != ZOK) {
+        qWarning() << __func__ << ZooKeeperError(ret) << "ephemerals =" << count;
+        m_restoreFailed += count;
+        m_restorePending = true;
+        delete batch;
+        finishRestore();
+        return false;
+    }
+    return true;
+}
+
+void ZooKeeperManagerPrivate::checkRestore(RestoreCheck *check)
+{
+    int count = check->entries.size();
+    check->paths.resize(count);
+    check->items.resize(count);
+    check->ops.resize(count);
+    check->errors.fill(ZSYSTEMERROR, count);
+    check->pending = count;
+    for (int i = 0; i < count; i++) {
+        check->paths[i] = check->entries[i].path.toLatin1();
+        check->items[i] = RestoreCheckItem { check, i };
+        zoo_batch_exists_init(&check->ops[i], check->paths[i].constData(), 0
+                              , &ZooKeeperManagerPrivate::restoreCheckCompletion, &check->items[i]);
+    }
+
+    m_restoreBatches++;
+    int ret = zoo_abatch(m_zooHandle, count, check->ops.constData());
+    if (ret != ZOK) {
+        qWarning() << __func__ << ZooKeeperError(ret) << "ephemerals =" << count;
+        m_restoreFailed += count;
+        m_restorePending = true;
+        delete check;
+        finishRestore();
+    }
+}
+
+void ZooKeeperManagerPrivate::finishRestore()
+{
+    if (--m_restoreBatches > 0)
+        return;
+
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    int created = m_restoreCreated;
+    int existing = m_restoreExisting;
+    int failed = m_restoreFailed;
+    m_restoreCreated = m_restoreExisting = m_restoreFailed = 0;
+
+    qDebug() << __func__ << "created =" << created << "existing =" << existing << "failed =" << failed;
+
+    emit _this->ephemeralsRestored(created, existing, failed);
+}
+
+bool ZooKeeperManagerPrivate::loadSession()
+{
+    QFile file(m_sessionFile);
+    if (m_sessionFile.isEmpty() || !file.open(QIODevice::ReadOnly))
+        return false;
+
+    QJsonObject object = QJsonDocument::fromJson(file.readAll()).object();
+    //连接的是另一个集群时会话不能恢复
+    if (object.value("host").toString() != m_host)
+        return false;
+
+    bool ok = false;
+    qint64 id = object.value("id").toString().toLongLong(&ok, 16);
+    QByteArray passwd = QByteArray::fromBase64(object.value("passwd").toString().toLatin1());
+    if (!ok || id == 0 || passwd.size() != int(sizeof(m_clientId.passwd)))
+        return false;
+
+    m_clientId.client_id = id;
+    memcpy(m_clientId.passwd, passwd.constData(), sizeof(m_clientId.passwd));
+    return true;
+}
+
+void ZooKeeperManagerPrivate::saveSession() const
+{
+    if (m_sessionFile.isEmpty())
+        return;
+
+    QJsonObject object;
+    object["host"] = m_host;
+    //JSON 的数字是 double，id 用十六进制字符串保存
+    object["id"] = QString::number(m_clientId.client_id, 16);
+    object["passwd"] = QString(QByteArray(m_clientId.passwd, sizeof(m_clientId.passwd)).toBase64());
+
+    //先写临时文件再替换，进程在写入时退出也不会留下损坏的文件
+    QSaveFile file(m_sessionFile);
+    if (!file.open(QIODevice::WriteOnly)
+            || file.write(QJsonDocument(object).toJson(QJsonDocument::Compact)) < 0
+            || !file.commit()) {
+        qWarning() << __func__ << "failed to save session to" << m_sessionFile << file.errorString();
+    }
+}
+
+void ZooKeeperManagerPrivate::revalidate()
+{
+    //只比较版本，版本变化的节点才重新读取值
+    int count = 0;
+    for (auto it = m_nodePool.begin(); it != m_nodePool.end(); it++) {
+        if (!it.value()->isStale())
+            continue;
+
+        RevalidateParam *param = new RevalidateParam { it.key() };
+        int ret = zoo_aexists(m_zooHandle, it.key().toLatin1().constData(), 0
+                              , &ZooKeeperManagerPrivate::revalidateCompletion, param);
+        if (ret != ZOK) {
+            delete param;
+            //下次连接时再校验
+            m_cacheStale = true;
+        } else {
+            count++;
+        }
+    }
+
+    qDebug() << __func__ << "nodes =" << count;
+}
+
 void ZooKeeperManagerPrivate::watcher(zhandle_t *zzh, int type, int state, const char *path, void *context)
 {
     ZooKeeperManager *_this = ZooKeeperManager::instance();
@@ -173,15 +825,35 @@ void ZooKeeperManagerPrivate::watcher(zhandle_t *zzh, int type, int state, const
             const clientid_t *id = zoo_client_id(zzh);
             if (_this->d_func()->m_clientId.client_id == 0 || _this->d_func()->m_clientId.client_id != id->client_id) {
                 _this->d_func()->m_clientId = *id;
+                _this->d_func()->saveSession();
             }
             _this->d_func()->m_connected = true;
+            //先重建临时节点，之后提交的校验请求在服务器上排在它后面
+            if (_this->d_func()->m_restorePending) {
+                _this->d_func()->m_restorePending = false;
+                _this->d_func()->restoreEphemerals();
+            }
+            if (_this->d_func()->m_cacheStale) {
+                _this->d_func()->m_cacheStale = false;
+                _this->d_func()->revalidate();
+            }
             emit _this->connected();
             qDebug() << u8"ZooKeeper Connect Success: id =" << id->client_id;
             break;
         }
-        case ZooKeeperState::Connecting: break;
-        case ZooKeeperState::AuthFailed:
+        case ZooKeeperState::Connecting:
+            //连接暂时断开，C 客户端会自动重连并恢复会话
+            if (_this->d_func()->m_connected) {
+                _this->d_func()->m_connected = false;
+                _this->d_func()->markStale();
+                emit _this->suspended();
+            }
+            break;
         case ZooKeeperState::ExpiredSession:
+            emit _this->error(error2string(zkState));
+            processExpired(zzh);
+            break;
+        case ZooKeeperState::AuthFailed:
         case ZooKeeperState::Closed:
         case ZooKeeperState::NotConnected:
         default:
@@ -197,6 +869,77 @@ void ZooKeeperManagerPrivate::watcher(zhandle_t *zzh, int type, int state, const
     qDebug() << __func__ << ZooKeeperType(type) << ZooKeeperState(state) << "path =" << path;
 }
 
+void ZooKeeperManagerPrivate::readOnlyWatcher(zhandle_t *zzh, int type, int state, const char *path, void *)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+
+    if (ZooKeeperType(type) == ZooKeeperType::SessionEvent) {
+        ZooKeeperState zkState = ZooKeeperState(state);
+        /**
+         * 只读会话失效后重新打开，在此期间读请求走主会话。
+         * 这里是只读会话的完成线程，句柄在管理器的线程中读取和关闭，转过去先替换再关闭旧的
+         */
+        if (zkState == ZooKeeperState::ExpiredSession || zkState == ZooKeeperState::AuthFailed) {
+            QMetaObject::invokeMethod(_this, [_this, zzh] {
+                ZooKeeperManagerPrivate *d = _this->d_func();
+                //closeReadOnlySession 已经关闭了这个会话，地址可能被新打开的会话复用，再比较状态
+                if (d->m_readOnlyHandle != zzh || !isUnrecoverable(zzh))
+                    return;
+
+                d->m_readOnlyHandle = zookeeper_init(d->m_readOnlyHost.toLatin1().constData(), &ZooKeeperManagerPrivate::readOnlyWatcher,
+                                                     d->m_readOnlyTimeout, nullptr, _this, ZOO_READONLY);
+                d->applySlowLog(d->m_readOnlyHandle);
+                zookeeper_close(zzh);
+            }, Qt::QueuedConnection);
+        }
+    }
+
+    qDebug() << __func__ << ZooKeeperType(type) << ZooKeeperState(state) << "path =" << path;
+}
+
+zhandle_t *ZooKeeperManagerPrivate::readHandle(bool watch) const
+{
+    //监听只注册在主会话上，只读会话断开时也退回主会话
+    if (!watch && m_readOnlyHandle) {
+        int state = zoo_state(m_readOnlyHandle);
+        if (state == ZOO_CONNECTED_STATE || state == ZOO_READONLY_STATE)
+            return m_readOnlyHandle;
+    }
+    return m_zooHandle;
+}
+
+QByteArray ZooKeeperManagerPrivate::encodeValue(const QByteArray &value)
+{
+    //值恰好以 magic 头开始时不管是否开启压缩都编码，否则读取时会被当成损坏的压缩值
+    if (!ZooKeeperCodec::isEncoded(value) && (!m_compression || value.size() < m_compressionThreshold))
+        return value;
+
+    QByteArray data = ZooKeeperCodec::encode(value);
+    if (ZooKeeperCodec::isEncoded(data)) {
+        m_encodedValues.fetchAndAddRelaxed(1);
+        m_rawBytes.fetchAndAddRelaxed(value.size());
+        m_encodedBytes.fetchAndAddRelaxed(data.size());
+    }
+    return data;
+}
+
+QByteArray ZooKeeperManagerPrivate::decodeValue(const QByteArray &data)
+{
+    //不管是否开启压缩都解码，其他客户端可能写入了压缩的值
+    if (!ZooKeeperCodec::isEncoded(data))
+        return data;
+
+    bool ok = false;
+    QByteArray value = ZooKeeperCodec::decode(data, &ok);
+    if (ok) {
+        m_decodedValues.fetchAndAddRelaxed(1);
+    } else {
+        m_decodeErrors.fetchAndAddRelaxed(1);
+        qWarning() << __func__ << "corrupted compressed value, size =" << data.size();
+    }
+    return value;
+}
+
 void ZooKeeperManagerPrivate::addAuthCompletion(int rc, const void *)
 {
     ZooKeeperManager *_this = ZooKeeperManager::instance();
@@ -213,8 +956,13 @@ void ZooKeeperManagerPrivate::acreateCompletion(int rc, const char *name, const
 
     ZooKeeperError error = ZooKeeperError(rc);
 
+    auto param = reinterpret_cast<const NodeParam *>(data);
+    qint64 start = param->start;
+    _this->d_func()->releaseWindow(callBytes(param->path, param->valueSize));
+    _this->d_func()->recordResult(ZooKeeperApi::Create, start, error, param->path, param->valueSize);
+
     QString path = QString(name);
-    QString pathOld = *(QString *)data;
+    QString pathOld = param->path;
     if (!pathOld.isEmpty()) {
         ZooKeeperNode *node = nullptr;
 
@@ -234,6 +982,7 @@ void ZooKeeperManagerPrivate::acreateCompletion(int rc, const char *name, const
         }
 
         if (error == ZooKeeperError::NoError) {
+            node->d->m_version = 0;
             node->setExists(true);
             emit node->created();
         } else if (error == ZooKeeperError::NodeExists) {
@@ -244,188 +993,973 @@ void ZooKeeperManagerPrivate::acreateCompletion(int rc, const char *name, const
         }
     }
 
-    delete (QString *)data;
+    delete param;
 
     emit _this->createNodeFinished(error, path);
+    _this->d_func()->recordDelivery(ZooKeeperApi::Create, start);
+
+    qDebug().noquote() << __func__ << "[" + path + "]" << "rc =" << error << "data =" << pathOld;
+}
+
+void ZooKeeperManagerPrivate::adeleteCompletion(int rc, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+    auto param = reinterpret_cast<const NodeParam *>(data);
+    QString path = param->path;
+    qint64 start = param->start;
+    _this->d_func()->releaseWindow(callBytes(path, param->valueSize));
+    _this->d_func()->recordResult(ZooKeeperApi::Delete, start, error, path);
+
+    delete param;
+
+    emit _this->deleteNodeFinished(error, path);
+    _this->d_func()->recordDelivery(ZooKeeperApi::Delete, start);
+
+    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+}
+
+void ZooKeeperManagerPrivate::aexistsCompletion(int rc, const Stat *stat, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+    auto param = reinterpret_cast<const NodeParam *>(data);
+    QString path = param->path;
+    qint64 start = param->start;
+    _this->d_func()->releaseWindow(callBytes(path, param->valueSize));
+    _this->d_func()->recordResult(ZooKeeperApi::Exists, start, error, path);
+
+    delete param;
+
+    emit _this->existsNodeFinished(error, path);
+    _this->d_func()->recordDelivery(ZooKeeperApi::Exists, start);
+
+    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+}
+
+void ZooKeeperManagerPrivate::asetCompletion(int rc, const Stat *stat, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+    auto param = reinterpret_cast<const NodeParam *>(data);
+    QString path = param->path;
+    qint64 start = param->start;
+    _this->d_func()->releaseWindow(callBytes(path, param->valueSize));
+    _this->d_func()->recordResult(ZooKeeperApi::Set, start, error, path, param->valueSize);
+
+    delete param;
+
+    emit _this->setNodeValueFinished(error, path);
+    _this->d_func()->recordDelivery(ZooKeeperApi::Set, start);
+
+    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+}
+
+void ZooKeeperManagerPrivate::agetCompletion(int rc, const char *value, int value_len, const Stat *stat, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+
+    auto param = reinterpret_cast<const GetNodeValueParam *>(data);
+    _this->d_func()->releaseWindow(callBytes(param->path, -1));
+    _this->d_func()->recordResult(ZooKeeperApi::Get, param->start, error, param->path, value_len);
+
+    QString path = param->path;
+    QByteArray nodeValue = _this->d_func()->decodeValue(QByteArray(value, value_len));
+    ZooKeeperNode *node = _this->d_func()->m_nodePool[path];
+
+    if (param->callback) {
+        param->callback(error, nodeValue);
+    }
+
+    if (error == ZooKeeper::ZooKeeperError::NoError) {
+        if (node->d->m_value != nodeValue) {
+            node->d->m_value = nodeValue;
+            emit node->valueChanged();
+        }
+        node->d->m_version = stat->version;
+        node->setExists(true);
+        node->setStale(false);
+    } else if (error == ZooKeeper::ZooKeeperError::NoNode) {
+        node->d->m_version = -1;
+        node->setExists(false);
+        node->setStale(false);
+    }
+
+    _this->d_func()->recordDelivery(ZooKeeperApi::Get, param->start);
+    delete param;
+
+    qDebug() << __func__ << "rc =" << error << "path =" << path << "value =" << nodeValue;
+}
+
+void ZooKeeperManagerPrivate::agetChildrenCompletion(int rc, const String_vector *strings, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+
+    auto param = reinterpret_cast<const GetChildrenNodeParam *>(data);
+    auto path = param->path;
+    _this->d_func()->releaseWindow(callBytes(path, -1));
+    _this->d_func()->recordResult(ZooKeeperApi::Children, param->start, error, path);
+
+    QStringList children;
+    if (error == ZooKeeperError::NoError) {
+        for (int i = 0; i < strings->count; i++) {
+            children.append(strings->data[i]);
+        }
+    }
+
+    if (param->callback) {
+        param->callback(error, children);
+    } else {
+        emit _this->getChildrenNodeFinished(error, path, children);
+    }
+
+    _this->d_func()->recordDelivery(ZooKeeperApi::Children, param->start);
+    delete param;
+
+    qDebug() << __func__ << "rc =" << error << "path =" << path << "children =" << children;
+}
+
+void ZooKeeperManagerPrivate::restoreCompletion(int rc, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperManagerPrivate *d = _this->d_func();
+    auto batch = reinterpret_cast<RestoreBatch *>(const_cast<void *>(data));
+
+    if (rc == ZOK) {
+        for (const EphemeralEntry &entry : batch->entries) {
+            d->m_restoreCreated++;
+            if (ZooKeeperNode *node = d->m_nodePool.value(entry.path)) {
+                node->d->m_version = 0;
+                node->setExists(true);
+            }
+        }
+    } else if (rc < ZAPIERROR) {
+        /**
+         * multi 是原子的，一个节点失败时整批都没有创建，失败节点之后的结果都只是 ZRUNTIMEINCONSISTENCY。
+         * 逐个去掉失败节点重试要 K+1 次往返，这里把其余节点的 exists 一次流水线发出，
+         * 只把确实不存在的节点放进一个 multi 重新提交
+         */
+        RestoreCheck *check = new RestoreCheck;
+        for (int i = 0; i < batch->entries.size(); i++) {
+            int err = batch->results[i].err;
+            if (err == ZOK || err == ZRUNTIMEINCONSISTENCY) {
+                check->entries.append(batch->entries[i]);
+            } else if (err == ZNODEEXISTS) {
+                d->m_restoreExisting++;
+            } else {
+                qWarning() << __func__ << ZooKeeperError(err) << "path =" << batch->entries[i].path;
+                d->m_restoreFailed++;
+            }
+        }
+        //没有找到失败的节点时放弃这一批，保证不会一直重试
+        if (check->entries.size() == batch->entries.size()) {
+            d->m_restoreFailed += check->entries.size();
+            check->entries.clear();
+        }
+        if (check->entries.isEmpty())
+            delete check;
+        else
+            d->checkRestore(check);
+    } else {
+        //连接断开，下次连接时重建，已经存在的节点会被跳过
+        qWarning() << __func__ << ZooKeeperError(rc) << "ephemerals =" << batch->entries.size();
+        d->m_restoreFailed += batch->entries.size();
+        d->m_restorePending = true;
+    }
+
+    delete batch;
+    d->finishRestore();
+}
+
+void ZooKeeperManagerPrivate::restoreCheckCompletion(int rc, const struct Stat *stat, const void *data)
+{
+    Q_UNUSED(stat);
+
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperManagerPrivate *d = _this->d_func();
+    auto item = reinterpret_cast<const RestoreCheckItem *>(data);
+    RestoreCheck *check = item->check;
+
+    //回调都在完成线程上依次执行，不需要加锁
+    check->errors[item->index] = rc;
+    if (--check->pending > 0)
+        return;
+
+    RestoreBatch *retry = new RestoreBatch;
+    for (int i = 0; i < check->entries.size(); i++) {
+        int err = check->errors[i];
+        if (err == ZNONODE) {
+            retry->entries.append(check->entries[i]);
+        } else if (err == ZOK) {
+            d->m_restoreExisting++;
+        } else {
+            //连接断开时下次连接再重建
+            qWarning() << __func__ << ZooKeeperError(err) << "path =" << check->entries[i].path;
+            d->m_restoreFailed++;
+            if (err > ZAPIERROR)
+                d->m_restorePending = true;
+        }
+    }
+    if (retry->entries.isEmpty())
+        delete retry;
+    else
+        d->submitRestore(retry);
+
+    delete check;
+    d->finishRestore();
+}
+
+void ZooKeeperManagerPrivate::revalidateCompletion(int rc, const Stat *stat, const void *data)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    ZooKeeperError error = ZooKeeperError(rc);
+    auto param = reinterpret_cast<const RevalidateParam *>(data);
+    QString path = param->path;
+    delete param;
+
+    //校验期间节点可能已经被删除
+    ZooKeeperNode *node = _this->d_func()->m_nodePool.value(path);
+    if (!node)
+        return;
+
+    if (error == ZooKeeperError::NoError) {
+        if (stat->version != node->d->m_version || !node->d->m_exists) {
+            //重新读取值，读到后恢复
+            _this->getNodeValue(path);
+        } else {
+            node->setStale(false);
+        }
+    } else if (error == ZooKeeperError::NoNode) {
+        node->d->m_version = -1;
+        node->setExists(false);
+        node->setStale(false);
+    } else {
+        //连接又断开了，下次连接时再校验
+        _this->d_func()->m_cacheStale = true;
+    }
+
+    qDebug() << __func__ << "[" + path + "]" << "rc =" << error << "stale =" << node->isStale();
+}
+
+void ZooKeeperManagerPrivate::wgetNodeValue(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    auto param = reinterpret_cast<const WgetNodeValueParam *>(watcherCtx);
+
+    QByteArray buffer(MaxValueSize, Qt::Uninitialized);
+    int len = buffer.size();
+    Stat stat;
+
+    //监听触发后重新注册时的读取也计入 Wget
+    qint64 start = _this->d_func()->startCall();
+    auto error = ZooKeeperError(zoo_wget(_this->d_func()->m_zooHandle, path
+                                         , &ZooKeeperManagerPrivate::wgetNodeValue
+                                         , watcherCtx, buffer.data(), &len, &stat));
+    _this->d_func()->recordSync(ZooKeeperApi::Wget, start, error, param->path, error == ZooKeeperError::NoError ? len : -1);
+
+    QByteArray value;
+    if (error == ZooKeeperError::NoError && len > 0)
+        value = _this->d_func()->decodeValue(buffer.left(len));
+
+    if (param->callback) {
+        param->callback(error, param->path, value, ZooKeeperType(type), ZooKeeperState(state));
+    } else {
+        emit _this->wgetNodeValueFinished(error, param->path, value, ZooKeeperType(type), ZooKeeperState(state));
+    }
+    _this->d_func()->recordDelivery(ZooKeeperApi::Wget, start);
+
+    qDebug() << __func__ << zh << ZooKeeperType(type) << ZooKeeperState(state) << path << value.size();
+}
+
+void ZooKeeperManagerPrivate::wgetChildrenNode(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+    auto param = reinterpret_cast<const WgetChildrenNodeParam *>(watcherCtx);
+
+    String_vector strings;
+    qint64 start = _this->d_func()->startCall();
+    auto error = ZooKeeperError(zoo_wget_children(_this->d_func()->m_zooHandle
+                                                  , path, &ZooKeeperManagerPrivate::wgetChildrenNode
+                                                  , watcherCtx, &strings));
+    _this->d_func()->recordSync(ZooKeeperApi::Wget, start, error, param->path);
+
+    QStringList children;
+    if (error == ZooKeeperError::NoError) {
+        for (int i = 0; i < strings.count; i++) {
+            children.append(strings.data[i]);
+        }
+    }
+
+    if (param->callback) {
+        param->callback(ZooKeeperError(error), param->path, children, ZooKeeperType(type), ZooKeeperState(state));
+    } else {
+        emit _this->wgetChildrenNodeFinished(error, param->path, children, ZooKeeperType(type), ZooKeeperState(state));
+    }
+    _this->d_func()->recordDelivery(ZooKeeperApi::Wget, start);
+
+    qDebug() << __func__ << zh << ZooKeeperType(type) << ZooKeeperState(state) << path << children;
+}
+
+void ZooKeeperManagerPrivate::batchDataCompletion(int rc, const char *value, int value_len, const Stat *, const void *data)
+{
+    auto item = reinterpret_cast<const BatchItem *>(data);
+    item->waiter->done(item->index, rc, (rc == ZOK && value) ? QByteArray(value, value_len) : QByteArray());
+}
+
+void ZooKeeperManagerPrivate::batchStringCompletion(int rc, const char *, const void *data)
+{
+    auto item = reinterpret_cast<const BatchItem *>(data);
+    item->waiter->done(item->index, rc);
+}
+
+void ZooKeeperManagerPrivate::batchVoidCompletion(int rc, const void *data)
+{
+    auto item = reinterpret_cast<const BatchItem *>(data);
+    item->waiter->done(item->index, rc);
+}
+
+ZooKeeperError ZooKeeperManagerPrivate::submitBatch(zhandle_t *zh, const QVector<zoo_batch_op_t> &ops, BatchWaiter *waiter)
+{
+    if (ops.isEmpty())
+        return ZooKeeperError::NoError;
+
+    //zoo_abatch 失败时一个回调都不会调用，成功时等全部回调返回
+    int ret = zoo_abatch(zh, ops.size(), ops.constData());
+    if (ret != ZOK)
+        return ZooKeeperError(ret);
+
+    waiter->wait();
+    return ZooKeeperError::NoError;
+}
+
+ZooKeeperError ZooKeeperManagerPrivate::readManifest(zhandle_t *zh, const QString &path, LargeValueManifest *manifest
+                                                     , int *version, QByteArray *raw)
+{
+    QByteArray buffer(MaxValueSize, Qt::Uninitialized);
+    int len = buffer.size();
+    Stat stat;
+
+    int ret = zoo_get(zh, path.toLatin1().constData(), 0, buffer.data(), &len, &stat);
+    if (ret != ZOK)
+        return ZooKeeperError(ret);
+
+    buffer.truncate(qMax(len, 0));
+    if (!LargeValueManifest::fromJson(buffer, manifest))
+        *manifest = LargeValueManifest();
+    if (version)
+        *version = stat.version;
+    if (raw)
+        *raw = buffer;
+    return ZooKeeperError::NoError;
+}
+
+void ZooKeeperManagerPrivate::removeChunks(const QString &path, const LargeValueManifest &manifest, const QVector<int> &errors)
+{
+    //只删除本次成功创建的分片，删除失败时只记录日志
+    QVector<QByteArray> chunkPaths;
+    for (int i = 0; i < manifest.chunks; i++) {
+        if (errors.value(i) == ZOK)
+            chunkPaths.append(manifest.chunkPath(path, i));
+    }
+
+    BatchWaiter waiter(chunkPaths.size());
+    QVector<BatchItem> items(chunkPaths.size());
+    QVector<zoo_batch_op_t> ops(chunkPaths.size());
+    for (int i = 0; i < chunkPaths.size(); i++) {
+        items[i] = BatchItem { &waiter, i };
+        zoo_batch_delete_init(&ops[i], chunkPaths[i].constData(), -1, &ZooKeeperManagerPrivate::batchVoidCompletion, &items[i]);
+    }
+
+    ZooKeeperError error = submitBatch(m_zooHandle, ops, &waiter);
+    if (error == ZooKeeperError::NoError)
+        error = waiter.firstError();
+    if (error != ZooKeeperError::NoError)
+        qWarning() << __func__ << "path =" << path << "generation =" << manifest.generation << error;
+}
+
+ZooKeeperError ZooKeeperManagerPrivate::staleChunks(zhandle_t *zh, const QString &path, const QString &generation
+                                                    , QVector<QByteArray> *chunkPaths)
+{
+    /**
+     * 按子节点列表而不是按清单收集要删除的分片，
+     * 创建分片后、切换清单前崩溃留下的孤儿分片也会被删除，
+     * 名字不是 <generation>-<index> 的子节点不是分片，保持不动
+     */
+    static const QRegularExpression chunkName("^([0-9a-f]+\\.[0-9a-z]+\\.[0-9]+)-[0-9]+$");
+
+    String_vector strings;
+    int ret = zoo_get_children(zh, path.toLatin1().constData(), 0, &strings);
+    if (ret != ZOK)
+        return ZooKeeperError(ret);
+
+    chunkPaths->clear();
+    for (int i = 0; i < strings.count; i++) {
+        QString child = strings.data[i];
+        QRegularExpressionMatch match = chunkName.match(child);
+        if (match.hasMatch() && match.captured(1) != generation)
+            chunkPaths->append(QString("%1/%2").arg(path, child).toLatin1());
+    }
+    deallocate_String_vector(&strings);
+    return ZooKeeperError::NoError;
+}
+
+QString ZooKeeperManagerPrivate::nextGeneration()
+{
+    //会话号区分客户端，时间和计数区分同一会话内以及复用会话号的进程间的写入
+    const clientid_t *id = zoo_client_id(m_zooHandle);
+    return QString("%1.%2.%3").arg(quint64(id ? id->client_id : 0), 0, 16)
+            .arg(QDateTime::currentMSecsSinceEpoch(), 0, 36)
+            .arg(m_generation.fetchAndAddRelaxed(1));
+}
+
+void ZooKeeperManagerPrivate::recordSubmit(ZooKeeperApi api, qint64 start, int ret)
+{
+    if (start < 0)
+        return;
+
+    //提交失败时回调不会被调用，这里计为错误
+    QMutexLocker locker(&m_metricsMutex);
+    m_apis[int(api)].calls++;
+    if (ret != ZOK)
+        m_apis[int(api)].errors++;
+}
+
+void ZooKeeperManagerPrivate::recordResult(ZooKeeperApi api, qint64 start, ZooKeeperError error, const QString &path, int valueSize)
+{
+    if (start < 0)
+        return;
+
+    qint64 latency = now() - start;
+    {
+        QMutexLocker locker(&m_metricsMutex);
+        m_apis[int(api)].latency.record(latency);
+        if (error != ZooKeeperError::NoError)
+            m_apis[int(api)].errors++;
+    }
+    if (m_slowThreshold > 0 && latency >= qint64(m_slowThreshold) * 1000)
+        recordSlow(api, latency, error, path, valueSize);
+}
+
+void ZooKeeperManagerPrivate::recordSync(ZooKeeperApi api, qint64 start, ZooKeeperError error, const QString &path, int valueSize)
+{
+    if (start < 0)
+        return;
+
+    qint64 latency = now() - start;
+    {
+        QMutexLocker locker(&m_metricsMutex);
+        m_apis[int(api)].calls++;
+        m_apis[int(api)].latency.record(latency);
+        if (error != ZooKeeperError::NoError)
+            m_apis[int(api)].errors++;
+    }
+    if (m_slowThreshold > 0 && latency >= qint64(m_slowThreshold) * 1000)
+        recordSlow(api, latency, error, path, valueSize);
+}
+
+void ZooKeeperManagerPrivate::recordDelivery(ZooKeeperApi api, qint64 start)
+{
+    if (start < 0)
+        return;
+
+    //排队的信号和这个事件一起经过管理器所在线程的事件循环，到达时刻即跨线程一跳之后的时刻
+    QMetaObject::invokeMethod(ZooKeeperManager::instance(), [this, api, start]{
+        qint64 latency = now() - start;
+        QMutexLocker locker(&m_metricsMutex);
+        m_apis[int(api)].delivery.record(latency);
+    }, Qt::QueuedConnection);
+}
+
+void ZooKeeperManagerPrivate::recordSlow(ZooKeeperApi api, qint64 latency, ZooKeeperError error, const QString &path, int valueSize)
+{
+    SlowOperation operation;
+    operation.operation = QMetaEnum::fromType<ZooKeeperApi>().valueToKey(int(api));
+    operation.path = path;
+    operation.valueSize = valueSize;
+    operation.error = error;
+    //读请求可能由只读会话处理
+    bool read = api == ZooKeeperApi::Get || api == ZooKeeperApi::Children;
+    operation.server = connectedServer(read ? readHandle() : m_zooHandle);
+    operation.finishedAt = QDateTime::currentMSecsSinceEpoch();
+    operation.totalUs = latency;
+
+    {
+        QMutexLocker locker(&m_metricsMutex);
+        if (m_slowOperations.size() < m_slowCapacity) {
+            m_slowOperations.append(operation);
+        } else if (m_slowCapacity > 0) {
+            m_slowOperations[m_slowNext] = operation;
+            m_slowNext = (m_slowNext + 1) % m_slowCapacity;
+        }
+    }
+
+    qWarning().noquote() << "ZooKeeper slow" << operation.operation << "[" + path + "]" << error
+                         << "took" << latency << "us, server =" << operation.server;
+    emit ZooKeeperManager::instance()->slowOperationDetected(operation);
+}
+
+bool ZooKeeperManagerPrivate::hasRoom(qint64 bytes) const
+{
+    //窗口为空时总能提交一个调用，超过字节上限的单个调用不会一直排队
+    if (m_inFlight == 0)
+        return true;
+    if (m_windowCalls > 0 && m_inFlight >= m_windowCalls)
+        return false;
+    if (m_windowBytes > 0 && m_inFlightBytes + bytes > m_windowBytes)
+        return false;
+    return true;
+}
+
+ZooKeeperError ZooKeeperManagerPrivate::submitCall(ZooKeeperApi api, qint64 start, qint64 bytes
+                                                   , const std::function<int()> &submit, const std::function<void(int)> &fail)
+{
+    QMutexLocker locker(&m_windowMutex);
+    //排在已经排队的调用后面，保持提交顺序
+    if (!m_pendingCalls.isEmpty() || !hasRoom(bytes)) {
+        m_pendingCalls.enqueue(PendingCall { api, start, bytes, submit, fail });
+        m_windowFull = true;
+        return ZooKeeperError::NoError;
+    }
+    m_inFlight++;
+    m_inFlightBytes += bytes;
+    locker.unlock();
+
+    int ret = submit();
+    recordSubmit(api, start, ret);
+    //提交失败时回调不会被调用
+    if (ret != ZOK)
+        releaseWindow(bytes);
+    return ZooKeeperError(ret);
+}
+
+void ZooKeeperManagerPrivate::drainPending(QMutexLocker &locker)
+{
+    //提交失败时回调在这里重入 releaseWindow，由外层循环继续提交，避免递归
+    if (m_draining)
+        return;
+
+    m_draining = true;
+    while (!m_pendingCalls.isEmpty() && hasRoom(m_pendingCalls.head().bytes)) {
+        PendingCall call = m_pendingCalls.dequeue();
+        m_inFlight++;
+        m_inFlightBytes += call.bytes;
+        locker.unlock();
+
+        int ret = call.submit();
+        //错误由回调统计
+        recordSubmit(call.api, call.start, ZOK);
+        if (ret != ZOK)
+            call.fail(ret);
+
+        locker.relock();
+    }
+    m_draining = false;
+}
+
+void ZooKeeperManagerPrivate::releaseWindow(qint64 bytes)
+{
+    ZooKeeperManager *_this = ZooKeeperManager::instance();
+
+    QMutexLocker locker(&m_windowMutex);
+    m_inFlight--;
+    m_inFlightBytes -= bytes;
+    drainPending(locker);
+
+    bool available = m_windowFull && m_pendingCalls.isEmpty() && hasRoom(1);
+    if (available)
+        m_windowFull = false;
+    bool drained = windowLimited() && m_inFlight == 0 && m_pendingCalls.isEmpty();
+    m_windowChanged.wakeAll();
+    locker.unlock();
+
+    if (available)
+        emit _this->windowAvailable();
+    if (drained)
+        emit _this->drained();
+}
+
+void ZooKeeperManagerPrivate::applySlowLog(zhandle_t *zh) const
+{
+    if (!zh)
+        return;
+
+    if (m_slowThreshold > 0)
+        zoo_set_slow_log(zh, m_slowThreshold, m_slowCapacity);
+    if (m_hotPaths > 0)
+        zoo_set_hot_paths(zh, m_hotPaths);
+}
+
+ZooKeeperManager::~ZooKeeperManager()
+{
+    quit();
+}
+
+ZooKeeperManager *ZooKeeperManager::instance()
+{
+    static ZooKeeperManager manager;
+    return &manager;
+}
+
+zhandle_t *ZooKeeperManager::zooHandle() const
+{
+    Q_D(const ZooKeeperManager);
+
+    return d->m_zooHandle;
+}
+
+qint64 ZooKeeperManager::zooKeeperId() const
+{
+    Q_D(const ZooKeeperManager);
+
+    return d->m_clientId.client_id;
+}
+
+void ZooKeeperManager::initialize(const QString &host, int timeout)
+{
+    Q_D(ZooKeeperManager);
+
+    d->m_host = host;
+    d->m_timeout = timeout;
+    d->m_clientId.client_id = 0;
+    if (d->loadSession())
+        qDebug() << __func__ << "resume session: id =" << d->m_clientId.client_id;
+    d->m_zooHandle = zookeeper_init(host.toLatin1().constData(), &ZooKeeperManagerPrivate::watcher,
+                                    timeout, &d->m_clientId, this, 0);
+    d->applySlowLog(d->m_zooHandle);
+    QTimer::singleShot(timeout, [this, d]{
+        ZooKeeperState state = ZooKeeperState(zoo_state(d->m_zooHandle));
+        if (state != ZooKeeperState::Connected && state != ZooKeeperState::Connecting)
+            emit error(QStringLiteral("ZooKeeper Error: 连接超时."));
+    });
+}
+
+void ZooKeeperManager::setSessionFile(const QString &fileName)
+{
+    Q_D(ZooKeeperManager);
 
-    qDebug().noquote() << __func__ << "[" + path + "]" << "rc =" << error << "data =" << pathOld;
+    d->m_sessionFile = fileName;
 }
 
-void ZooKeeperManagerPrivate::adeleteCompletion(int rc, const void *data)
+void ZooKeeperManager::openReadOnlySession(const QString &host, int timeout)
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    ZooKeeperError error = ZooKeeperError(rc);
-    QString path = *(QString *)data;
-
-    delete (QString *)data;
+    Q_D(ZooKeeperManager);
 
-    emit _this->deleteNodeFinished(error, path);
+    closeReadOnlySession();
 
-    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+    d->m_readOnlyHost = host.isEmpty() ? d->m_host : host;
+    d->m_readOnlyTimeout = timeout;
+    d->m_readOnlyHandle = zookeeper_init(d->m_readOnlyHost.toLatin1().constData(), &ZooKeeperManagerPrivate::readOnlyWatcher,
+                                         timeout, nullptr, this, ZOO_READONLY);
+    d->applySlowLog(d->m_readOnlyHandle);
 }
 
-void ZooKeeperManagerPrivate::aexistsCompletion(int rc, const Stat *stat, const void *data)
+void ZooKeeperManager::closeReadOnlySession()
 {
-    ZooKeeperManager *_this = (ZooKeeperManager *)(data);
-    ZooKeeperError error = ZooKeeperError(rc);
-    QString path = *(QString *)data;
-
-    delete (QString *)data;
-
-    emit _this->existsNodeFinished(error, path);
+    Q_D(ZooKeeperManager);
 
-    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+    if (d->m_readOnlyHandle) {
+        zookeeper_close(d->m_readOnlyHandle);
+        d->m_readOnlyHandle = nullptr;
+    }
 }
 
-void ZooKeeperManagerPrivate::asetCompletion(int rc, const Stat *stat, const void *data)
+void ZooKeeperManager::setCompression(bool enabled, int threshold)
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    ZooKeeperError error = ZooKeeperError(rc);
-    QString path = *(QString *)data;
+    Q_D(ZooKeeperManager);
 
-    delete (QString *)data;
+    d->m_compression = enabled;
+    d->m_compressionThreshold = threshold;
+}
 
-    emit _this->setNodeValueFinished(error, path);
+CompressionStats ZooKeeperManager::compressionStats() const
+{
+    Q_D(const ZooKeeperManager);
 
-    qDebug() << __func__ << "[" + path + "]" << "rc =" << error;
+    CompressionStats stats;
+    stats.encodedValues = d->m_encodedValues.loadAcquire();
+    stats.rawBytes = d->m_rawBytes.loadAcquire();
+    stats.encodedBytes = d->m_encodedBytes.loadAcquire();
+    stats.decodedValues = d->m_decodedValues.loadAcquire();
+    stats.decodeErrors = d->m_decodeErrors.loadAcquire();
+    return stats;
 }
 
-void ZooKeeperManagerPrivate::agetCompletion(int rc, const char *value, int value_len, const Stat *stat, const void *data)
+ClientStats ZooKeeperManager::clientStats() const
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    ZooKeeperError error = ZooKeeperError(rc);
+    Q_D(const ZooKeeperManager);
 
-    auto param = reinterpret_cast<const GetNodeValueParam *>(data);
+    ClientStats stats;
+    zoo_stats_t zkStats;
+    if (!d->m_zooHandle || zoo_get_stats(d->m_zooHandle, &zkStats) != ZOK)
+        return stats;
+
+    stats.sendQueue = zkStats.send_queue;
+    stats.sendQueueBytes = zkStats.send_queue_bytes;
+    stats.sentRequests = zkStats.sent_requests;
+    stats.completionBacklog = zkStats.completion_backlog;
+    stats.outstandingSync = zkStats.outstanding_sync;
+    stats.reconnects = zkStats.reconnects;
+    stats.bytesIn = zkStats.bytes_in;
+    stats.bytesOut = zkStats.bytes_out;
+    stats.framesIn = zkStats.frames_in;
+    stats.framesOut = zkStats.frames_out;
+    stats.maxRecvDwellMs = zkStats.max_recv_dwell_ms;
+    return stats;
+}
 
-    QString path = param->path;
-    QByteArray nodeValue(value, value_len);
-    ZooKeeperNode *node = _this->d_func()->m_nodePool[path];
+void ZooKeeperManager::setStatsInterval(int msec)
+{
+    Q_D(ZooKeeperManager);
 
-    if (param->callback) {
-        param->callback(error, nodeValue);
+    if (msec <= 0) {
+        if (d->m_statsTimer)
+            d->m_statsTimer->stop();
+        return;
     }
 
-    if (error == ZooKeeper::ZooKeeperError::NoError) {
-        if (node->d->m_value != nodeValue) {
-            node->d->m_value = nodeValue;
-            emit node->valueChanged();
-        }
-        node->setExists(true);
-    } else if (error == ZooKeeper::ZooKeeperError::NoNode) {
-        node->setExists(false);
+    if (!d->m_statsTimer) {
+        d->m_statsTimer = new QTimer(this);
+        connect(d->m_statsTimer, &QTimer::timeout, this, [this]{
+            emit clientStatsChanged(clientStats());
+        });
     }
+    d->m_statsTimer->start(msec);
+}
 
-    delete param;
+void ZooKeeperManager::setMetricsEnabled(bool enabled)
+{
+    Q_D(ZooKeeperManager);
 
-    qDebug() << __func__ << "rc =" << error << "path =" << path << "value =" << nodeValue;
+    d->m_metricsEnabled = enabled;
 }
 
-void ZooKeeperManagerPrivate::agetChildrenCompletion(int rc, const String_vector *strings, const void *data)
+Metrics ZooKeeperManager::metrics() const
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    ZooKeeperError error = ZooKeeperError(rc);
+    Q_D(const ZooKeeperManager);
 
-    auto param = reinterpret_cast<const GetChildrenNodeParam *>(data);
-    auto path = param->path;
+    Metrics metrics;
+    metrics.apis.resize(ApiCount);
 
-    QStringList children;
-    if (error == ZooKeeperError::NoError) {
-        for (int i = 0; i < strings->count; i++) {
-            children.append(strings->data[i]);
-        }
+    QMutexLocker locker(&d->m_metricsMutex);
+    metrics.elapsedMs = (d->now() - d->m_metricsSince) / 1000;
+    for (int i = 0; i < ApiCount; i++) {
+        metrics.apis[i].calls = d->m_apis[i].calls;
+        metrics.apis[i].errors = d->m_apis[i].errors;
+        metrics.apis[i].latency = d->m_apis[i].latency.summary();
+        metrics.apis[i].delivery = d->m_apis[i].delivery.summary();
     }
+    return metrics;
+}
 
-    if (param->callback) {
-        param->callback(error, children);
-    } else {
-        emit _this->getChildrenNodeFinished(error, path, children);
+void ZooKeeperManager::resetMetrics()
+{
+    Q_D(ZooKeeperManager);
+
+    QMutexLocker locker(&d->m_metricsMutex);
+    d->m_metricsSince = d->now();
+    for (ApiRecorder &recorder : d->m_apis) {
+        recorder.calls = 0;
+        recorder.errors = 0;
+        recorder.latency.clear();
+        recorder.delivery.clear();
     }
+}
 
-    delete param;
+void ZooKeeperManager::setMetricsInterval(int msec)
+{
+    Q_D(ZooKeeperManager);
 
-    qDebug() << __func__ << "rc =" << error << "path =" << path << "children =" << children;
+    if (msec <= 0) {
+        if (d->m_metricsTimer)
+            d->m_metricsTimer->stop();
+        return;
+    }
+
+    if (!d->m_metricsTimer) {
+        d->m_metricsTimer = new QTimer(this);
+        connect(d->m_metricsTimer, &QTimer::timeout, this, [this]{
+            emit metricsUpdated(metrics());
+        });
+    }
+    d->m_metricsTimer->start(msec);
 }
 
-void ZooKeeperManagerPrivate::wgetNodeValue(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx)
+void ZooKeeperManager::setSlowThreshold(int msec, int capacity)
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    auto param = reinterpret_cast<const WgetNodeValueParam *>(watcherCtx);
-
-    int len = 65535;
-    char buffer[65535];
-    Stat stat;
+    Q_D(ZooKeeperManager);
 
-    auto error = ZooKeeperError(zoo_wget(_this->d_func()->m_zooHandle, path
-                                         , &ZooKeeperManagerPrivate::wgetNodeValue
-                                         , watcherCtx, buffer, &len, &stat));
+    if (msec < 0 || (msec > 0 && capacity <= 0))
+        return;
 
-    if (param->callback) {
-        param->callback(error, param->path, QByteArray(buffer), ZooKeeperType(type), ZooKeeperState(state));
-    } else {
-        emit _this->wgetNodeValueFinished(error, param->path, QByteArray(buffer), ZooKeeperType(type), ZooKeeperState(state));
+    {
+        QMutexLocker locker(&d->m_metricsMutex);
+        d->m_slowOperations.clear();
+        d->m_slowNext = 0;
+        d->m_slowCapacity = capacity;
+        d->m_slowThreshold = msec;
     }
 
-    qDebug() << __func__ << zh << ZooKeeperType(type) << ZooKeeperState(state) << path << buffer;
+    if (d->m_zooHandle)
+        zoo_set_slow_log(d->m_zooHandle, msec, capacity);
+    if (d->m_readOnlyHandle)
+        zoo_set_slow_log(d->m_readOnlyHandle, msec, capacity);
 }
 
-void ZooKeeperManagerPrivate::wgetChildrenNode(zhandle_t *zh, int type, int state, const char *path, void *watcherCtx)
+QVector<SlowOperation> ZooKeeperManager::slowOperations() const
 {
-    ZooKeeperManager *_this = ZooKeeperManager::instance();
-    auto param = reinterpret_cast<const WgetChildrenNodeParam *>(watcherCtx);
+    Q_D(const ZooKeeperManager);
 
-    String_vector strings;
-    auto error = ZooKeeperError(zoo_wget_children(_this->d_func()->m_zooHandle
-                                                  , path, &ZooKeeperManagerPrivate::wgetChildrenNode
-                                                  , watcherCtx, &strings));
+    QMutexLocker locker(&d->m_metricsMutex);
+    const QVector<SlowOperation> &ring = d->m_slowOperations;
+    //环满之前按追加顺序保存，满了之后 m_slowNext 是最旧的一条
+    int newest = ring.size() < d->m_slowCapacity ? ring.size() - 1 : d->m_slowNext - 1;
+    QVector<SlowOperation> operations;
+    operations.reserve(ring.size());
+    for (int i = 0; i < ring.size(); i++)
+        operations.append(ring[(newest - i + 2 * ring.size()) % ring.size()]);
+    return operations;
+}
 
-    QStringList children;
-    if (error == ZooKeeperError::NoError) {
-        for (int i = 0; i < strings.count; i++) {
-            children.append(strings.data[i]);
+QVector<SlowOperation> ZooKeeperManager::requestSlowLog() const
+{
+    Q_D(const ZooKeeperManager);
+
+    QVector<SlowOperation> operations;
+    if (d->m_slowThreshold <= 0)
+        return operations;
+
+    for (zhandle_t *zh : { d->m_zooHandle, d->m_readOnlyHandle }) {
+        if (!zh)
+            continue;
+
+        QVector<zoo_slow_op_t> ops(d->m_slowCapacity);
+        int count = zoo_get_slow_ops(zh, ops.data(), ops.size());
+        for (int i = 0; i < count; i++) {
+            const zoo_slow_op_t &op = ops[i];
+            SlowOperation operation;
+            operation.operation = operationName(op.trace.type);
+            operation.path = QString::fromUtf8(op.path);
+            operation.valueSize = op.value_len;
+            operation.error = ZooKeeperError(op.trace.rc);
+            operation.server = QString::fromLatin1(op.server);
+            operation.totalUs = op.trace.completed - op.trace.queued;
+            if (op.trace.sent)
+                operation.sendQueueUs = op.trace.sent - op.trace.queued;
+            if (op.trace.sent && op.trace.received)
+                operation.serverUs = op.trace.received - op.trace.sent;
+            if (op.trace.received)
+                operation.dispatchUs = op.trace.completed - op.trace.received;
+            operations.append(operation);
         }
     }
+    return operations;
+}
 
-    if (param->callback) {
-        param->callback(ZooKeeperError(error), param->path, children, ZooKeeperType(type), ZooKeeperState(state));
-    } else {
-        emit _this->wgetChildrenNodeFinished(error, param->path, children, ZooKeeperType(type), ZooKeeperState(state));
+void ZooKeeperManager::setHotPaths(int k)
+{
+    Q_D(ZooKeeperManager);
+
+    if (k < 0)
+        return;
+
+    d->m_hotPaths = k;
+    if (d->m_zooHandle)
+        zoo_set_hot_paths(d->m_zooHandle, k);
+    if (d->m_readOnlyHandle)
+        zoo_set_hot_paths(d->m_readOnlyHandle, k);
+}
+
+QVector<HotPath> ZooKeeperManager::hotPaths(int count) const
+{
+    Q_D(const ZooKeeperManager);
+
+    QVector<HotPath> paths;
+    if (d->m_hotPaths <= 0 || count <= 0)
+        return paths;
+
+    //两个会话各自计数，同一节点的计数和误差相加
+    QHash<QString, int> index;
+    for (zhandle_t *zh : { d->m_zooHandle, d->m_readOnlyHandle }) {
+        if (!zh)
+            continue;
+
+        QVector<zoo_hot_path_t> hot(d->m_hotPaths);
+        int n = zoo_get_hot_paths(zh, hot.data(), hot.size());
+        for (int i = 0; i < n; i++) {
+            QString path = QString::fromUtf8(hot[i].path);
+            if (!index.contains(path)) {
+                index[path] = paths.size();
+                HotPath hotPath;
+                hotPath.path = path;
+                paths.append(hotPath);
+            }
+            paths[index[path]].count += hot[i].count;
+            paths[index[path]].error += hot[i].error;
+        }
     }
 
-    qDebug() << __func__ << zh << ZooKeeperType(type) << ZooKeeperState(state) << path << children;
+    std::sort(paths.begin(), paths.end(), [](const HotPath &a, const HotPath &b) {
+        return a.count > b.count;
+    });
+    if (paths.size() > count)
+        paths.resize(count);
+    return paths;
 }
 
-ZooKeeperManager::~ZooKeeperManager()
+void ZooKeeperManager::setInFlightWindow(int maxCalls, qint64 maxBytes)
 {
-    quit();
+    Q_D(ZooKeeperManager);
+
+    QMutexLocker locker(&d->m_windowMutex);
+    d->m_windowCalls = qMax(maxCalls, 0);
+    d->m_windowBytes = qMax<qint64>(maxBytes, 0);
+    //窗口放大时立即提交排队的调用
+    d->drainPending(locker);
+    d->m_windowChanged.wakeAll();
 }
 
-ZooKeeperManager *ZooKeeperManager::instance()
+int ZooKeeperManager::inFlightCalls() const
 {
-    static ZooKeeperManager manager;
-    return &manager;
+    Q_D(const ZooKeeperManager);
+
+    QMutexLocker locker(&d->m_windowMutex);
+    return d->m_inFlight;
 }
 
-qint64 ZooKeeperManager::zooKeeperId() const
+int ZooKeeperManager::queuedCalls() const
 {
     Q_D(const ZooKeeperManager);
 
-    return d->m_clientId.client_id;
+    QMutexLocker locker(&d->m_windowMutex);
+    return d->m_pendingCalls.size();
 }
 
-void ZooKeeperManager::initialize(const QString &host, int timeout)
+bool ZooKeeperManager::waitForWindow(int msec)
 {
     Q_D(ZooKeeperManager);
 
-    d->m_host = host;
-    d->m_timeout = timeout;
-    d->m_clientId.client_id = 0;
-    d->m_zooHandle = zookeeper_init(host.toLatin1().constData(), &ZooKeeperManagerPrivate::watcher,
-                                    timeout, &d->m_clientId, this, 0);
-    QTimer::singleShot(timeout, [this, d]{
-        ZooKeeperState state = ZooKeeperState(zoo_state(d->m_zooHandle));
-        if (state != ZooKeeperState::Connected && state != ZooKeeperState::Connecting)
-            emit error(QStringLiteral("ZooKeeper Error: 连接超时."));
-    });
+    QDeadlineTimer deadline(msec < 0 ? QDeadlineTimer::Forever : QDeadlineTimer(msec));
+    QMutexLocker locker(&d->m_windowMutex);
+    while (!d->m_pendingCalls.isEmpty() || !d->hasRoom(1)) {
+        if (!d->m_windowChanged.wait(&d->m_windowMutex, deadline))
+            return false;
+    }
+    return true;
+}
+
+bool ZooKeeperManager::waitForDrained(int msec)
+{
+    Q_D(ZooKeeperManager);
+
+    QDeadlineTimer deadline(msec < 0 ? QDeadlineTimer::Forever : QDeadlineTimer(msec));
+    QMutexLocker locker(&d->m_windowMutex);
+    while (d->m_inFlight > 0 || !d->m_pendingCalls.isEmpty()) {
+        if (!d->m_windowChanged.wait(&d->m_windowMutex, deadline))
+            return false;
+    }
+    return true;
 }
 
 void ZooKeeperManager::addAuth(const QString &scheme, const QString &cert)
@@ -466,13 +2000,20 @@ ZooKeeperNode *ZooKeeperManager::createNode(ZooKeeperNode::ZooKeeperNodeType typ
     }
 
     if (!d->m_nodePool.contains(path)) {
-        int ret = zoo_acreate(d->m_zooHandle, path.toLatin1().constData()
-                              , value.toStdString().c_str(), int(value.toStdString().length())
-                              , &ZOO_OPEN_ACL_UNSAFE, flag, &ZooKeeperManagerPrivate::acreateCompletion, new QString(path));
+        QByteArray data = d->encodeValue(value);
+        QByteArray nodePath = path.toLatin1();
+        qint64 start = d->startCall();
+        NodeParam *param = new NodeParam { path, start, data.size() };
+        ZooKeeperError ret = d->submitCall(ZooKeeperApi::Create, start, callBytes(path, data.size()), [d, nodePath, data, flag, param] {
+            return zoo_acreate(d->m_zooHandle, nodePath.constData(), data.constData(), data.size()
+                               , &ZOO_OPEN_ACL_UNSAFE, flag, &ZooKeeperManagerPrivate::acreateCompletion, param);
+        }, [param](int rc) {
+            ZooKeeperManagerPrivate::acreateCompletion(rc, nullptr, param);
+        });
         if (error)
-            *error = ZooKeeperError(ret);
+            *error = ret;
 
-        if (ZooKeeperError(ret) == ZooKeeperError::NoError) {
+        if (ret == ZooKeeperError::NoError) {
             ZooKeeperNode *node = new ZooKeeperNode(this);
             node->d->m_path = path;
             node->d->m_value = value;
@@ -513,9 +2054,12 @@ ZooKeeperNode *ZooKeeperManager::createNodeSync(ZooKeeperNode::ZooKeeperNodeType
     char newPath[1024] = { '\0' };
 
     if (!d->m_nodePool.contains(path)) {
+        QByteArray data = d->encodeValue(value);
+        qint64 start = d->startCall();
         int ret = zoo_create(d->m_zooHandle, path.toLatin1().constData()
-                              , value.toStdString().c_str(), int(value.toStdString().length())
+                              , data.constData(), data.size()
                               , &ZOO_OPEN_ACL_UNSAFE, flag, newPath, len);
+        d->recordSync(ZooKeeperApi::Create, start, ZooKeeperError(ret), path, data.size());
         if (error)
             *error = ZooKeeperError(ret);
 
@@ -527,6 +2071,7 @@ ZooKeeperNode *ZooKeeperManager::createNodeSync(ZooKeeperNode::ZooKeeperNodeType
             node->d->m_path = QString(newPath);
             node->d->m_value = value;
             node->d->m_type = type;
+            node->d->m_version = 0;
             d->m_nodePool[newPath] = node;
             d->m_nodePool.remove(path);
             emit node->created();
@@ -539,6 +2084,52 @@ ZooKeeperNode *ZooKeeperManager::createNodeSync(ZooKeeperNode::ZooKeeperNodeType
     }
 }
 
+ZooKeeperNode *ZooKeeperManager::registerEphemeral(const QString &path, const QByteArray &value
+                                                   , ZooKeeperNode::ZooKeeperNodeType type, ZooKeeperError *error)
+{
+    Q_D(ZooKeeperManager);
+
+    /**
+     * 顺序节点每次重建都会得到新的路径，按登记的路径既判断不了是否已经存在，
+     * 也找不到上一次创建的节点，所以只接受普通临时节点
+     */
+    if (type != ZooKeeperNode::ZooKeeperNodeType::EphemeralNode) {
+        if (error)
+            *error = ZooKeeperError::BadArguments;
+        return nullptr;
+    }
+
+    {
+        QMutexLocker locker(&d->m_ephemeralMutex);
+        d->m_ephemerals[path] = EphemeralEntry { path, d->encodeValue(value), ZOO_EPHEMERAL };
+    }
+
+    return createNode(type, path, value, error);
+}
+
+void ZooKeeperManager::unregisterEphemeral(const QString &path, bool remove)
+{
+    Q_D(ZooKeeperManager);
+
+    {
+        QMutexLocker locker(&d->m_ephemeralMutex);
+        if (!d->m_ephemerals.remove(path))
+            return;
+    }
+
+    if (remove)
+        deleteNode(path);
+}
+
+void ZooKeeperManager::setEphemeralBatch(int maxOps, int maxBytes)
+{
+    Q_D(ZooKeeperManager);
+
+    QMutexLocker locker(&d->m_ephemeralMutex);
+    d->m_ephemeralBatchOps = qMax(maxOps, 1);
+    d->m_ephemeralBatchBytes = qMax(maxBytes, 1);
+}
+
 ZooKeeperError ZooKeeperManager::deleteNode(ZooKeeperNode *node)
 {
     return deleteNode(node->path());
@@ -553,10 +2144,14 @@ ZooKeeperError ZooKeeperManager::deleteNode(const QString &path)
         d->m_nodePool.remove(path);
     }
 
-    int ret = zoo_adelete(d->m_zooHandle, path.toLatin1().constData()
-                          , -1, &ZooKeeperManagerPrivate::adeleteCompletion, new QString(path));
-
-    return ZooKeeperError(ret);
+    QByteArray nodePath = path.toLatin1();
+    qint64 start = d->startCall();
+    NodeParam *param = new NodeParam { path, start, -1 };
+    return d->submitCall(ZooKeeperApi::Delete, start, callBytes(path, -1), [d, nodePath, param] {
+        return zoo_adelete(d->m_zooHandle, nodePath.constData(), -1, &ZooKeeperManagerPrivate::adeleteCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::adeleteCompletion(rc, param);
+    });
 }
 
 ZooKeeper::ZooKeeperError ZooKeeperManager::deleteNodeSync(ZooKeeperNode *node)
@@ -573,7 +2168,9 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::deleteNodeSync(const QString &path)
         d->m_nodePool.remove(path);
     }
 
+    qint64 start = d->startCall();
     int ret = zoo_delete(d->m_zooHandle, path.toUtf8().constData(), -1);
+    d->recordSync(ZooKeeperApi::Delete, start, ZooKeeperError(ret), path);
 
     return ZooKeeperError(ret);
 }
@@ -582,10 +2179,14 @@ ZooKeeperError ZooKeeperManager::existsNode(const QString &path)
 {
     Q_D(ZooKeeperManager);
 
-    int ret = zoo_aexists(d->m_zooHandle, path.toLatin1().constData(), 0
-                          , &ZooKeeperManagerPrivate::aexistsCompletion, new QString(path));
-
-    return ZooKeeperError(ret);
+    QByteArray nodePath = path.toLatin1();
+    qint64 start = d->startCall();
+    NodeParam *param = new NodeParam { path, start, -1 };
+    return d->submitCall(ZooKeeperApi::Exists, start, callBytes(path, -1), [d, nodePath, param] {
+        return zoo_aexists(d->m_zooHandle, nodePath.constData(), 0, &ZooKeeperManagerPrivate::aexistsCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::aexistsCompletion(rc, nullptr, param);
+    });
 }
 
 ZooKeeper::ZooKeeperError ZooKeeperManager::existsNodeSync(const QString &path)
@@ -594,7 +2195,9 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::existsNodeSync(const QString &path)
 
     Stat stat;
 
+    qint64 start = d->startCall();
     int ret = zoo_exists(d->m_zooHandle, path.toLatin1().constData(), 0, &stat);
+    d->recordSync(ZooKeeperApi::Exists, start, ZooKeeperError(ret), path);
 
     qDebug() << __func__ << ZooKeeperError(ret);
 
@@ -610,15 +2213,17 @@ ZooKeeperError ZooKeeperManager::setNodeValue(const QString &path, const QByteAr
 {
     Q_D(ZooKeeperManager);
 
-    /**
-     * @warnning QThread::msleep 避免设置过快
-     */
-    QThread::msleep(10);
-    int ret = zoo_aset(d->m_zooHandle, path.toLatin1().constData()
-                       , value.toStdString().c_str(), int(value.toStdString().length())
-                       , -1, &ZooKeeperManagerPrivate::asetCompletion, new QString(path));
-
-    return ZooKeeperError(ret);
+    //设置过快时由 setInFlightWindow 的窗口限速
+    QByteArray data = d->encodeValue(value);
+    QByteArray nodePath = path.toLatin1();
+    qint64 start = d->startCall();
+    NodeParam *param = new NodeParam { path, start, data.size() };
+    return d->submitCall(ZooKeeperApi::Set, start, callBytes(path, data.size()), [d, nodePath, data, param] {
+        return zoo_aset(d->m_zooHandle, nodePath.constData(), data.constData(), data.size()
+                        , -1, &ZooKeeperManagerPrivate::asetCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::asetCompletion(rc, nullptr, param);
+    });
 }
 
 ZooKeeper::ZooKeeperError ZooKeeperManager::setNodeValueSync(ZooKeeperNode *node, const QByteArray &value)
@@ -630,8 +2235,11 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::setNodeValueSync(const QString &path
 {
     Q_D(ZooKeeperManager);
 
+    QByteArray data = d->encodeValue(value);
+    qint64 start = d->startCall();
     int ret = zoo_set(d->m_zooHandle, path.toLatin1().constData()
-                      , value.toStdString().c_str(), int(value.toStdString().length()), -1);
+                      , data.constData(), data.size(), -1);
+    d->recordSync(ZooKeeperApi::Set, start, ZooKeeperError(ret), path, data.size());
 
     qDebug() << __func__ << ZooKeeperError(ret);
 
@@ -643,7 +2251,8 @@ ZooKeeperNode * ZooKeeperManager::getNodeValue(const QString &path, const std::f
 {
     Q_D(ZooKeeperManager);
 
-    GetNodeValueParam *param = new GetNodeValueParam { path, callback };
+    qint64 start = d->startCall();
+    GetNodeValueParam *param = new GetNodeValueParam { path, callback, start };
 
     ZooKeeperNode *node = nullptr;
     if (d->m_nodePool.contains(path)) {
@@ -654,10 +2263,15 @@ ZooKeeperNode * ZooKeeperManager::getNodeValue(const QString &path, const std::f
         d->m_nodePool[path] = node;
     }
 
-    int ret = zoo_aget(d->m_zooHandle, path.toLatin1().constData(), 0, &ZooKeeperManagerPrivate::agetCompletion, param);
+    QByteArray nodePath = path.toLatin1();
+    ZooKeeperError ret = d->submitCall(ZooKeeperApi::Get, start, callBytes(path, -1), [d, nodePath, param] {
+        return zoo_aget(d->readHandle(), nodePath.constData(), 0, &ZooKeeperManagerPrivate::agetCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::agetCompletion(rc, nullptr, -1, nullptr, param);
+    });
 
     if (error)
-        *error = ZooKeeperError(ret);
+        *error = ret;
 
     return node;
 }
@@ -666,8 +2280,10 @@ ZooKeeperNode *ZooKeeperManager::getNodeValue(const QString &path, ZooKeeperErro
 {
     Q_D(ZooKeeperManager);
 
+    qint64 start = d->startCall();
     GetNodeValueParam *param = new GetNodeValueParam;
     param->path = path;
+    param->start = start;
 
     ZooKeeperNode *node = nullptr;
     if (d->m_nodePool.contains(path)) {
@@ -678,11 +2294,15 @@ ZooKeeperNode *ZooKeeperManager::getNodeValue(const QString &path, ZooKeeperErro
         d->m_nodePool[path] = node;
     }
 
-    int ret = zoo_aget(d->m_zooHandle, path.toLatin1().constData(), 0
-                       , &ZooKeeperManagerPrivate::agetCompletion, param);
+    QByteArray nodePath = path.toLatin1();
+    ZooKeeperError ret = d->submitCall(ZooKeeperApi::Get, start, callBytes(path, -1), [d, nodePath, param] {
+        return zoo_aget(d->readHandle(), nodePath.constData(), 0, &ZooKeeperManagerPrivate::agetCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::agetCompletion(rc, nullptr, -1, nullptr, param);
+    });
 
     if (error)
-        *error = ZooKeeperError(ret);
+        *error = ret;
 
     return node;
 }
@@ -700,24 +2320,30 @@ ZooKeeperNode *ZooKeeperManager::getNodeValueSync(const QString &path, ZooKeeper
         d->m_nodePool[path] = node;
     }
 
-    int len = 65535;
-    char buffer[65535];
+    QByteArray buffer(MaxValueSize, Qt::Uninitialized);
+    int len = buffer.size();
     Stat stat;
 
-    int ret = zoo_get(d->m_zooHandle, path.toLatin1().constData(), 0, buffer, &len, &stat);
+    qint64 start = d->startCall();
+    int ret = zoo_get(d->readHandle(), path.toLatin1().constData(), 0, buffer.data(), &len, &stat);
+    d->recordSync(ZooKeeperApi::Get, start, ZooKeeperError(ret), path, ret == ZOK ? len : -1);
 
     if (error)
         *error = ZooKeeperError(ret);
 
     if (ZooKeeperError(ret) == ZooKeeperError::NoError) {
-        auto value = QByteArray(buffer, len);
+        auto value = d->decodeValue(buffer.left(qMax(len, 0)));
         if (node->d->m_value != value) {
             node->d->m_value = value;
             emit node->valueChanged();
         }
+        node->d->m_version = stat.version;
         node->setExists(true);
+        node->setStale(false);
     } else if (ZooKeeperError(ret) == ZooKeeperError::NoNode) {
+        node->d->m_version = -1;
         node->setExists(false);
+        node->setStale(false);
     }
 
     qDebug() << __func__ << ZooKeeperError(ret) << "value =" << QString(node->value());
@@ -729,24 +2355,32 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::getChildrenNode(const QString &path,
 {
     Q_D(ZooKeeperManager);
 
-    GetChildrenNodeParam *param = new GetChildrenNodeParam { path, callback };
+    qint64 start = d->startCall();
+    GetChildrenNodeParam *param = new GetChildrenNodeParam { path, callback, start };
 
-    int ret = zoo_aget_children(d->m_zooHandle, path.toLatin1().constData(), watch
-                       , &ZooKeeperManagerPrivate::agetChildrenCompletion, param);
-
-    return ZooKeeperError(ret);
+    QByteArray nodePath = path.toLatin1();
+    return d->submitCall(ZooKeeperApi::Children, start, callBytes(path, -1), [d, nodePath, watch, param] {
+        return zoo_aget_children(d->readHandle(watch), nodePath.constData(), watch
+                                 , &ZooKeeperManagerPrivate::agetChildrenCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::agetChildrenCompletion(rc, nullptr, param);
+    });
 }
 
 ZooKeeper::ZooKeeperError ZooKeeperManager::getChildrenNode(const QString &path, bool watch)
 {
     Q_D(ZooKeeperManager);
 
-    GetChildrenNodeParam *param = new GetChildrenNodeParam { path };
-
-    int ret = zoo_aget_children(d->m_zooHandle, path.toLatin1().constData(), watch
-                       , &ZooKeeperManagerPrivate::agetChildrenCompletion, param);
+    qint64 start = d->startCall();
+    GetChildrenNodeParam *param = new GetChildrenNodeParam { path, nullptr, start };
 
-    return ZooKeeperError(ret);
+    QByteArray nodePath = path.toLatin1();
+    return d->submitCall(ZooKeeperApi::Children, start, callBytes(path, -1), [d, nodePath, watch, param] {
+        return zoo_aget_children(d->readHandle(watch), nodePath.constData(), watch
+                                 , &ZooKeeperManagerPrivate::agetChildrenCompletion, param);
+    }, [param](int rc) {
+        ZooKeeperManagerPrivate::agetChildrenCompletion(rc, nullptr, param);
+    });
 }
 
 ZooKeeper::ZooKeeperError ZooKeeperManager::getChildrenNodeSync(const QString &path, bool watch, QStringList *children)
@@ -754,7 +2388,9 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::getChildrenNodeSync(const QString &p
     Q_D(ZooKeeperManager);
 
     String_vector strings;
-    ZooKeeperError error = ZooKeeperError(zoo_get_children(d->m_zooHandle, path.toLatin1().constData(), watch, &strings));
+    qint64 start = d->startCall();
+    ZooKeeperError error = ZooKeeperError(zoo_get_children(d->readHandle(watch), path.toLatin1().constData(), watch, &strings));
+    d->recordSync(ZooKeeperApi::Children, start, error, path);
 
     children->clear();
     if (error == ZooKeeperError::NoError) {
@@ -783,21 +2419,27 @@ ZooKeeperNode *ZooKeeperManager::wgetNodeValue(const QString &path, const std::f
         d->m_nodePool[path] = node;
     }
 
-    int len = 65535;
-    char buffer[65535];
+    QByteArray buffer(MaxValueSize, Qt::Uninitialized);
+    int len = buffer.size();
     Stat stat;
 
-    int ret = zoo_wget(d->m_zooHandle, path.toLatin1().constData(), &ZooKeeperManagerPrivate::wgetNodeValue, param, buffer, &len, &stat);
+    qint64 start = d->startCall();
+    int ret = zoo_wget(d->m_zooHandle, path.toLatin1().constData(), &ZooKeeperManagerPrivate::wgetNodeValue, param, buffer.data(), &len, &stat);
+    d->recordSync(ZooKeeperApi::Wget, start, ZooKeeperError(ret), path, ret == ZOK ? len : -1);
 
     if (ZooKeeperError(ret) == ZooKeeperError::NoError) {
-        auto value = QByteArray(buffer, len);
+        auto value = d->decodeValue(buffer.left(qMax(len, 0)));
         if (node->d->m_value != value) {
             node->d->m_value = value;
             emit node->valueChanged();
         }
+        node->d->m_version = stat.version;
         node->setExists(true);
+        node->setStale(false);
     } else if (ZooKeeperError(ret) == ZooKeeperError::NoNode) {
+        node->d->m_version = -1;
         node->setExists(false);
+        node->setStale(false);
     }
 
     qDebug() << __func__ << ZooKeeperError(ret) << "value =" << QString(node->value());
@@ -812,7 +2454,9 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::wgetChildrenNode(const QString &path
     WgetChildrenNodeParam *param = new WgetChildrenNodeParam { path, callback };
 
     String_vector strings;
+    qint64 start = d->startCall();
     ZooKeeperError error = ZooKeeperError(zoo_wget_children(d->m_zooHandle, path.toLatin1().constData(), &ZooKeeperManagerPrivate::wgetChildrenNode, param, &strings));
+    d->recordSync(ZooKeeperApi::Wget, start, error, path);
 
     children->clear();
     if (error == ZooKeeperError::NoError) {
@@ -826,13 +2470,188 @@ ZooKeeper::ZooKeeperError ZooKeeperManager::wgetChildrenNode(const QString &path
     return error;
 }
 
-void ZooKeeperManager::quit()
+ZooKeeper::ZooKeeperError ZooKeeperManager::setLargeValueSync(const QString &path, const QByteArray &value, int chunkSize)
+{
+    Q_D(ZooKeeperManager);
+
+    if (chunkSize <= 0 || chunkSize > MaxValueSize)
+        return ZooKeeperError::BadArguments;
+
+    //分片挂在清单节点下面，清单节点不存在时先创建
+    QByteArray nodePath = path.toLatin1();
+    int ret = zoo_create(d->m_zooHandle, nodePath.constData(), nullptr, -1, &ZOO_OPEN_ACL_UNSAFE, 0, nullptr, 0);
+    if (ret != ZOK && ret != ZNODEEXISTS)
+        return ZooKeeperError(ret);
+
+    LargeValueManifest old;
+    int version = -1;
+    ZooKeeperError error = d->readManifest(d->m_zooHandle, path, &old, &version, nullptr);
+    if (error != ZooKeeperError::NoError)
+        return error;
+
+    QByteArray data = d->encodeValue(value);
+    LargeValueManifest manifest;
+    manifest.generation = d->nextGeneration();
+    manifest.chunks = (data.size() + chunkSize - 1) / chunkSize;
+    manifest.size = data.size();
+    manifest.sha1 = QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+
+    //每个分片单独一帧，一次提交后流水线发送，新分片在清单切换前对读者不可见
+    QVector<QByteArray> chunkPaths(manifest.chunks);
+    BatchWaiter waiter(manifest.chunks);
+    QVector<BatchItem> items(manifest.chunks);
+    QVector<zoo_batch_op_t> ops(manifest.chunks);
+    for (int i = 0; i < manifest.chunks; i++) {
+        chunkPaths[i] = manifest.chunkPath(path, i);
+        items[i] = BatchItem { &waiter, i };
+        int offset = i * chunkSize;
+        zoo_batch_create_init(&ops[i], chunkPaths[i].constData(), data.constData() + offset, qMin(chunkSize, data.size() - offset)
+                              , &ZOO_OPEN_ACL_UNSAFE, 0, &ZooKeeperManagerPrivate::batchStringCompletion, &items[i]);
+    }
+
+    error = d->submitBatch(d->m_zooHandle, ops, &waiter);
+    if (error == ZooKeeperError::NoError)
+        error = waiter.firstError();
+
+    if (error == ZooKeeperError::NoError) {
+        /**
+         * 一个 multi 请求本身也是一帧，分片数据不能放进去，
+         * 这里只把清单切换（带版本检查）和旧分片删除合成一个原子操作，
+         * 不属于新一代的子节点都当作旧分片删除
+         */
+        QVector<QByteArray> oldPaths;
+        error = d->staleChunks(d->m_zooHandle, path, manifest.generation, &oldPaths);
+        if (error == ZooKeeperError::NoError) {
+            QByteArray manifestData = manifest.toJson();
+            QVector<zoo_op_t> multi(oldPaths.size() + 1);
+            QVector<zoo_op_result_t> results(multi.size());
+
+            zoo_set_op_init(&multi[0], nodePath.constData(), manifestData.constData(), manifestData.size(), version, nullptr);
+            for (int i = 0; i < oldPaths.size(); i++) {
+                zoo_delete_op_init(&multi[i + 1], oldPaths[i].constData(), -1);
+            }
+
+            error = ZooKeeperError(zoo_multi(d->m_zooHandle, multi.size(), multi.constData(), results.data()));
+        }
+    }
+
+    if (error != ZooKeeperError::NoError)
+        d->removeChunks(path, manifest, waiter.errors);
+
+    qDebug() << __func__ << error << "path =" << path << "size =" << data.size() << "chunks =" << manifest.chunks;
+
+    return error;
+}
+
+ZooKeeper::ZooKeeperError ZooKeeperManager::getLargeValueSync(const QString &path, QByteArray *value)
+{
+    Q_D(ZooKeeperManager);
+
+    ZooKeeperError error = ZooKeeperError::BadVersion;
+    for (int attempt = 0; attempt < LargeValueRetries; attempt++) {
+        //清单和分片从同一个会话读取
+        zhandle_t *zh = d->readHandle();
+
+        LargeValueManifest manifest;
+        QByteArray raw;
+        error = d->readManifest(zh, path, &manifest, nullptr, &raw);
+        if (error != ZooKeeperError::NoError)
+            break;
+
+        if (manifest.generation.isEmpty()) {
+            *value = d->decodeValue(raw);
+            break;
+        }
+
+        QVector<QByteArray> chunkPaths(manifest.chunks);
+        BatchWaiter waiter(manifest.chunks);
+        QVector<BatchItem> items(manifest.chunks);
+        QVector<zoo_batch_op_t> ops(manifest.chunks);
+        for (int i = 0; i < manifest.chunks; i++) {
+            chunkPaths[i] = manifest.chunkPath(path, i);
+            items[i] = BatchItem { &waiter, i };
+            zoo_batch_get_init(&ops[i], chunkPaths[i].constData(), 0, &ZooKeeperManagerPrivate::batchDataCompletion, &items[i]);
+        }
+
+        error = d->submitBatch(zh, ops, &waiter);
+        if (error == ZooKeeperError::NoError)
+            error = waiter.firstError();
+
+        //分片已被删除说明清单在读取期间被替换，重新读取清单
+        if (error == ZooKeeperError::NoNode) {
+            error = ZooKeeperError::BadVersion;
+            continue;
+        }
+        if (error != ZooKeeperError::NoError)
+            break;
+
+        QByteArray data;
+        data.reserve(int(manifest.size));
+        for (const QByteArray &chunk : waiter.values)
+            data.append(chunk);
+
+        if (data.size() != manifest.size
+                || QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex() != manifest.sha1) {
+            error = ZooKeeperError::DataInconsistency;
+            break;
+        }
+
+        *value = d->decodeValue(data);
+        break;
+    }
+
+    qDebug() << __func__ << error << "path =" << path << "size =" << value->size();
+
+    return error;
+}
+
+ZooKeeper::ZooKeeperError ZooKeeperManager::deleteLargeValueSync(const QString &path)
+{
+    Q_D(ZooKeeperManager);
+
+    LargeValueManifest manifest;
+    int version = -1;
+    ZooKeeperError error = d->readManifest(d->m_zooHandle, path, &manifest, &version, nullptr);
+    if (error != ZooKeeperError::NoError)
+        return error;
+
+    //全部分片（包括孤儿分片）和清单节点一起删除，清单在此期间被替换时返回 BadVersion
+    QVector<QByteArray> chunkPaths;
+    error = d->staleChunks(d->m_zooHandle, path, QString(), &chunkPaths);
+    if (error != ZooKeeperError::NoError)
+        return error;
+
+    QByteArray nodePath = path.toLatin1();
+    QVector<zoo_op_t> multi(chunkPaths.size() + 1);
+    QVector<zoo_op_result_t> results(multi.size());
+    for (int i = 0; i < chunkPaths.size(); i++) {
+        zoo_delete_op_init(&multi[i], chunkPaths[i].constData(), -1);
+    }
+    zoo_delete_op_init(&multi[chunkPaths.size()], nodePath.constData(), version);
+
+    error = ZooKeeperError(zoo_multi(d->m_zooHandle, multi.size(), multi.constData(), results.data()));
+
+    qDebug() << __func__ << error << "path =" << path;
+
+    return error;
+}
+
+void ZooKeeperManager::quit(bool keepSession)
 {
     Q_D(ZooKeeperManager);
 
+    closeReadOnlySession();
+
     if (d->m_zooHandle) {
         d->m_connected = false;
-        zookeeper_close(d->m_zooHandle);
+        if (keepSession) {
+            zookeeper_detach(d->m_zooHandle);
+        } else {
+            zookeeper_close(d->m_zooHandle);
+            //会话已经关闭，不再恢复
+            if (!d->m_sessionFile.isEmpty())
+                QFile::remove(d->m_sessionFile);
+        }
         d->m_zooHandle = nullptr;
     }
 }
@@ -863,6 +2682,9 @@ ZooKeeperManager::ZooKeeperManager(QObject *parent)
     qRegisterMetaType<ZooKeeperError>("ZooKeeperError");
     qRegisterMetaType<ZooKeeperType>("ZooKeeperType");
     qRegisterMetaType<ZooKeeperState>("ZooKeeperState");
+    qRegisterMetaType<ClientStats>("ClientStats");
+    qRegisterMetaType<Metrics>("Metrics");
+    qRegisterMetaType<SlowOperation>("SlowOperation");
 
     setDebugLevel(ZooKeeperDebugLevel::Warn);
     zoo_deterministic_conn_order(1);
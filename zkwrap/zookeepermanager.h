@@ -2,6 +2,7 @@
 #define ZOOKEEPERMANAGER_H
 
 #include <QObject>
+#include <QVector>
 
 namespace ZooKeeper
 {
@@ -43,7 +44,8 @@ namespace ZooKeeper
         AuthFailed = -115, /*!< 客户端认证失败 */
         Closure = -116, /*!< ZooKeeper 正在关闭 */
         Nothing = -117, /*!< (不是错误)没有服务器响应处理 */
-        SessionMoved = -118 /*!< 会话移动到另一台服务器，因此操作被忽略 */
+        SessionMoved = -118, /*!< 会话移动到另一台服务器，因此操作被忽略 */
+        NotReadOnly = -119 /*!< 只读服务器不能处理修改状态的请求 */
     };
 
     enum class ZooKeeperType
@@ -62,16 +64,119 @@ namespace ZooKeeper
         Connecting = 1,
         Assoctating = 2,
         Connected = 3,
+        ReadOnly = 5,
         ExpiredSession = -112,
         AuthFailed = -113,
         NotConnected = 999
     };
 
+    /** 统计调用延迟的 API，Wget 包括监听触发后重新注册时的读取 */
+    enum class ZooKeeperApi
+    {
+        Create = 0,
+        Delete,
+        Exists,
+        Set,
+        Get,
+        Children,
+        Wget
+    };
+
+    /** 延迟分布，单位为微秒，分位值的误差约为 3% */
+    struct LatencySummary
+    {
+        qint64 count = 0; /*!< 样本个数 */
+        qint64 min = 0;
+        qint64 max = 0;
+        double mean = 0;
+        qint64 p50 = 0;
+        qint64 p90 = 0;
+        qint64 p99 = 0;
+        qint64 p999 = 0;
+    };
+
+    /** 单个 API 的调用统计 */
+    struct ApiMetrics
+    {
+        qint64 calls = 0; /*!< 调用次数，同步和异步调用都计入 */
+        qint64 errors = 0; /*!< 提交失败或结果不是 NoError 的次数 */
+        LatencySummary latency; /*!< 从调用到结果到达回调，同步调用为调用耗时 */
+        LatencySummary delivery; /*!< 从调用到结果投递到 ZooKeeperManager 所在线程，包括跨线程的一跳，只统计异步调用和监听回调 */
+    };
+
+    /** ZooKeeperManager 按 API 的调用统计 */
+    struct Metrics
+    {
+        qint64 elapsedMs = 0; /*!< 开始统计(或上次 resetMetrics)以来的毫秒数 */
+        QVector<ApiMetrics> apis; /*!< 以 ZooKeeperApi 为下标 */
+
+        ApiMetrics api(ZooKeeperApi which) const { return apis.value(int(which)); }
+        /** 每秒的调用次数 */
+        double throughput(ZooKeeperApi which) const { return elapsedMs > 0 ? api(which).calls * 1000.0 / elapsedMs : 0; }
+    };
+
+    /** 慢调用记录，时间单位为微秒，没有测量的阶段为 -1 */
+    struct SlowOperation
+    {
+        QString operation; /*!< 操作名，如 Create、Get、Children */
+        QString path; /*!< 节点路径，C 客户端的记录包括 chroot */
+        int valueSize = -1; /*!< 写入或读到的值的字节数，其他操作为 -1 */
+        ZooKeeperError error = ZooKeeperError::NoError;
+        QString server; /*!< 处理请求的服务器 address:port */
+        qint64 finishedAt = 0; /*!< 完成时刻，自 1970 年起的毫秒数，C 客户端的记录为 0 */
+        qint64 totalUs = 0; /*!< 从调用到结果到达回调 */
+        qint64 sendQueueUs = -1; /*!< C 客户端：从提交到写入套接字 */
+        qint64 serverUs = -1; /*!< C 客户端：从写入到读到应答，即网络和服务器 */
+        qint64 dispatchUs = -1; /*!< C 客户端：从读到应答到完成回调 */
+    };
+
+    /** 访问最多的节点，count 可能多算，最多多算 error 次 */
+    struct HotPath
+    {
+        QString path;
+        qint64 count = 0;
+        qint64 error = 0;
+    };
+
+    /** 节点值压缩的统计 */
+    struct CompressionStats
+    {
+        qint64 encodedValues = 0; /*!< 压缩后写入的值的个数 */
+        qint64 rawBytes = 0; /*!< 这些值压缩前的字节数 */
+        qint64 encodedBytes = 0; /*!< 这些值压缩后的字节数 */
+        qint64 decodedValues = 0; /*!< 读取时解压的值的个数 */
+        qint64 decodeErrors = 0; /*!< 无法解压的值的个数 */
+
+        /** 压缩率，压缩后与压缩前字节数之比 */
+        double ratio() const { return rawBytes > 0 ? double(encodedBytes) / double(rawBytes) : 1.0; }
+    };
+
+    /** 客户端排队和流量的统计，对应 zoo_get_stats，取值不加锁，是近似值 */
+    struct ClientStats
+    {
+        int sendQueue = 0; /*!< 等待写入套接字的缓冲区个数 */
+        qint64 sendQueueBytes = 0; /*!< 这些缓冲区的字节数 */
+        int sentRequests = 0; /*!< 已发送、等待应答的请求个数 */
+        int completionBacklog = 0; /*!< 等待完成线程处理的应答和事件个数 */
+        int outstandingSync = 0; /*!< 等待应答的同步调用个数 */
+        qint64 reconnects = 0; /*!< 会话建立(含重连)的次数 */
+        qint64 bytesIn = 0; /*!< 从服务器读取的字节数 */
+        qint64 bytesOut = 0; /*!< 写往服务器的字节数 */
+        qint64 framesIn = 0; /*!< 读取的应答、事件和握手个数 */
+        qint64 framesOut = 0; /*!< 写出的请求和心跳个数 */
+        int maxRecvDwellMs = 0; /*!< 应答在套接字接收缓冲区中停留的最长时间 */
+    };
+
     Q_ENUM_NS(ZooKeeperError);
     Q_ENUM_NS(ZooKeeperType);
     Q_ENUM_NS(ZooKeeperState);
+    Q_ENUM_NS(ZooKeeperApi);
 };
 
+Q_DECLARE_METATYPE(ZooKeeper::ClientStats)
+Q_DECLARE_METATYPE(ZooKeeper::Metrics)
+Q_DECLARE_METATYPE(ZooKeeper::SlowOperation)
+
 QT_FORWARD_DECLARE_CLASS(ZooKeeperManagerPrivate);
 
 QT_FORWARD_DECLARE_CLASS(ZooKeeperNodePrivate);
@@ -82,6 +187,7 @@ class ZooKeeperNode : public QObject
 
     Q_PROPERTY(bool exists READ exists WRITE setExists NOTIFY existsChanged)
     Q_PROPERTY(QByteArray value READ value WRITE setValue NOTIFY valueChanged)
+    Q_PROPERTY(bool stale READ isStale NOTIFY staleChanged)
 
 public:
     enum class ZooKeeperNodeType
@@ -109,16 +215,25 @@ public:
     void setExists(bool exists);
     bool exists() const;
 
+    /**
+     * @brief 连接断开或会话过期后缓存的值可能已经过时，重新连接后按版本校验，
+     * 只有版本变化的节点重新读取值，校验完成后恢复
+     */
+    bool isStale() const;
+
     ZooKeeperNode *addChildNode(ZooKeeperNodeType type, const QString &name, const QByteArray &value);
 
 signals:
     void created();
     void valueChanged();
     void existsChanged();
+    void staleChanged();
 
 private:
     explicit ZooKeeperNode(QObject *parent = nullptr);
 
+    void setStale(bool stale);
+
     ZooKeeperNodePrivate *d = nullptr;
 
     friend class ZooKeeperManager;
@@ -129,6 +244,9 @@ class ZooKeeperManager : public QObject
 {
     Q_OBJECT
 
+    Q_PROPERTY(ZooKeeper::ClientStats clientStats READ clientStats NOTIFY clientStatsChanged)
+    Q_PROPERTY(ZooKeeper::Metrics metrics READ metrics NOTIFY metricsUpdated)
+
 public:
     enum class ZooKeeperDebugLevel
     {
@@ -146,11 +264,93 @@ public:
 
     void initialize(const QString &host, int timeout = 30000);
 
+    /**
+     * @brief 把会话 id 和密码保存到文件，initialize 时读取并恢复这个会话，在 initialize 之前调用。
+     * 进程在会话超时内重启时临时节点不会丢失，会话已经过期时服务器拒绝恢复，改用新会话。
+     * 监听保存在客户端进程里，重启后不会恢复，恢复会话之后需要重新注册
+     */
+    void setSessionFile(const QString &fileName);
+
+    /**
+     * @brief 打开只读辅助会话，getNodeValue/getChildrenNode 的读请求改由它处理。
+     * 集群失去多数派时只读会话仍然可用，不可用时读请求回到主会话。
+     * @param host 只读会话连接的服务器，例如 observer 节点，为空时使用 initialize 的 host
+     */
+    void openReadOnlySession(const QString &host = QString(), int timeout = 30000);
+    void closeReadOnlySession();
+
+    /**
+     * @brief 开启节点值压缩，不小于 threshold 字节的值压缩后写入。
+     * 读取时总是自动解压，不受此开关影响；恰好以压缩头开始的值也不受此开关影响，总是编码后写入
+     */
+    void setCompression(bool enabled, int threshold = 64 * 1024);
+    ZooKeeper::CompressionStats compressionStats() const;
+
+    ZooKeeper::ClientStats clientStats() const;
+    /**
+     * @brief 每隔 msec 毫秒读取一次 clientStats 并发出 clientStatsChanged，0 停止
+     */
+    void setStatsInterval(int msec);
+
+    /**
+     * @brief 开启或关闭按 API 的调用统计，默认开启。
+     * 开启时每个异步结果额外向本对象所在线程投递一个事件，用来测量跨线程的一跳
+     */
+    void setMetricsEnabled(bool enabled);
+    ZooKeeper::Metrics metrics() const;
+    void resetMetrics();
+    /**
+     * @brief 每隔 msec 毫秒发出一次 metricsUpdated，0 停止
+     */
+    void setMetricsInterval(int msec);
+
+    /**
+     * @brief 记录从调用到结果超过 msec 毫秒的调用，0 关闭。
+     * 包装层保留最近 capacity 条(需要开启调用统计)，并发出 slowOperationDetected；
+     * 同时开启 C 客户端的慢请求日志，记录排队、网络和服务器、分发各阶段的耗时。随时可以调用
+     */
+    void setSlowThreshold(int msec, int capacity = 64);
+    /** 包装层记录的慢调用，最新的在前 */
+    QVector<ZooKeeper::SlowOperation> slowOperations() const;
+    /** C 客户端记录的慢请求，先主会话后只读会话，各自最新的在前 */
+    QVector<ZooKeeper::SlowOperation> requestSlowLog() const;
+
+    /**
+     * @brief 用 k 个计数器统计访问最多的节点，0 关闭，重新调用时重新计数。
+     * 出现频率超过 1/k 的节点一定在统计中
+     */
+    void setHotPaths(int k);
+    /** 访问最多的 count 个节点，合并主会话和只读会话，最多的在前 */
+    QVector<ZooKeeper::HotPath> hotPaths(int count = 20) const;
+
+    /**
+     * @brief 限制在途的异步调用，0 表示不限制(默认)。
+     * 在途调用达到 maxCalls 个或请求字节数(路径加值)达到 maxBytes 时，之后的异步调用进入内部队列，
+     * 返回 NoError，等有调用完成后按顺序提交；排队的调用提交失败时通过原来的信号或回调报告错误。
+     * 只限制 createNode、deleteNode、existsNode、setNodeValue、getNodeValue、getChildrenNode
+     */
+    void setInFlightWindow(int maxCalls, qint64 maxBytes = 0);
+    int inFlightCalls() const;
+    int queuedCalls() const;
+    /**
+     * @brief 阻塞直到队列为空且窗口有空位，超时返回 false，msec 小于 0 一直等待。
+     * 供批量任务的工作线程控制速度，不要在回调或 ZooKeeperManager 所在线程中调用
+     */
+    bool waitForWindow(int msec = -1);
+    /**
+     * @brief 阻塞直到所有在途和排队的异步调用完成，超时返回 false，限制同 waitForWindow
+     */
+    bool waitForDrained(int msec = -1);
+
     void addAuth(const QString &scheme, const QString &cert);
 
     void setDebugLevel(ZooKeeperDebugLevel level);
 
-    void quit();
+    /**
+     * @brief 关闭会话，keepSession 为 true 时只释放连接，会话留给 setSessionFile 恢复，
+     * 超时之前临时节点不会被删除
+     */
+    void quit(bool keepSession = false);
 
     bool isConnected();
 
@@ -161,6 +361,23 @@ public:
     ZooKeeperNode *createNodeSync(ZooKeeperNode::ZooKeeperNodeType type, const QString &path, const QByteArray &value = ""
                                   , ZooKeeper::ZooKeeperError *error = nullptr);
 
+    /**
+     * @brief 创建临时节点并登记，会话过期后在新会话中自动重建。
+     * 重建时用 multi 分批提交，已经存在的节点跳过，完成后发出 ephemeralsRestored。
+     * type 只能是 EphemeralNode，顺序临时节点每次重建路径都不同，不能登记，返回 nullptr，error 为 BadArguments
+     */
+    ZooKeeperNode *registerEphemeral(const QString &path, const QByteArray &value = ""
+                                     , ZooKeeperNode::ZooKeeperNodeType type = ZooKeeperNode::ZooKeeperNodeType::EphemeralNode
+                                     , ZooKeeper::ZooKeeperError *error = nullptr);
+    /**
+     * @brief 取消登记，remove 为 true 时同时删除节点
+     */
+    void unregisterEphemeral(const QString &path, bool remove = true);
+    /**
+     * @brief 重建临时节点时每个 multi 最多 maxOps 个节点、maxBytes 字节(路径加值)，不能超过服务器的 jute.maxbuffer
+     */
+    void setEphemeralBatch(int maxOps, int maxBytes = 512 * 1024);
+
     ZooKeeper::ZooKeeperError deleteNode(ZooKeeperNode *node);
     ZooKeeper::ZooKeeperError deleteNode(const QString &path);
     ZooKeeper::ZooKeeperError deleteNodeSync(ZooKeeperNode *node);
@@ -190,10 +407,34 @@ public:
                                                , const std::function<void(ZooKeeper::ZooKeeperError, const QString &path, const QStringList &children
                                                , ZooKeeper::ZooKeeperType, ZooKeeper::ZooKeeperState)> &callback);
 
+    /**
+     * @brief 写入超过 jute.maxbuffer 的大值。值被切成不超过 chunkSize 字节的分片，作为 path 的子节点
+     * 流水线写入，再用一次 multi 原子地把 path 上的清单切换到新分片并删除旧分片。
+     * 其他客户端同时写入时清单版本冲突，返回 BadVersion
+     */
+    ZooKeeper::ZooKeeperError setLargeValueSync(const QString &path, const QByteArray &value, int chunkSize = 512 * 1024);
+    /**
+     * @brief 读取 setLargeValueSync 写入的大值，所有分片的读请求一次提交、并行返回，
+     * 并按清单校验长度和摘要。path 上不是清单时返回它本身的值
+     */
+    ZooKeeper::ZooKeeperError getLargeValueSync(const QString &path, QByteArray *value);
+    ZooKeeper::ZooKeeperError deleteLargeValueSync(const QString &path);
+
 signals:
     void error(const QString &errorString);
     void connected();
     void disconnected();
+    /** 连接暂时断开，会话仍然有效，节点缓存保留并标记为过时，重新连接后发出 connected */
+    void suspended();
+    /** 会话过期后登记的临时节点重建完成，existing 是已经存在而跳过的个数 */
+    void ephemeralsRestored(int created, int existing, int failed);
+    void clientStatsChanged(const ZooKeeper::ClientStats &stats);
+    void metricsUpdated(const ZooKeeper::Metrics &metrics);
+    void slowOperationDetected(const ZooKeeper::SlowOperation &operation);
+    /** 有调用排队之后，队列清空且窗口有空位 */
+    void windowAvailable();
+    /** 设置了窗口时，所有在途和排队的异步调用都已完成 */
+    void drained();
 
     void watcher(ZooKeeper::ZooKeeperType type, ZooKeeper::ZooKeeperState state, const QString &path);
     void addAuthFinished(ZooKeeper::ZooKeeperError code);
@@ -210,8 +451,13 @@ signals:
 private:
     ZooKeeperManager(QObject *parent = nullptr);
 
+    /** 当前的主会话，会话过期后会换成新的，每次使用时重新取得 */
+    struct _zhandle *zooHandle() const;
+
     QScopedPointer<ZooKeeperManagerPrivate> d_ptr;
     Q_DECLARE_PRIVATE(ZooKeeperManager);
+
+    friend class ZooKeeperContenderPrivate;
 };
 
 #endif // ZOOKEEPERMANAGER_H
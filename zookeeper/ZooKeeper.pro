@@ -31,7 +31,10 @@ HEADERS += \
     src/hashtable/hashtable_private.h \
     src/winport.h \
     src/zk_adaptor.h \
-    src/zk_hashtable.h
+    src/zk_hashtable.h \
+    src/zk_histogram.h \
+    src/zk_timerwheel.h \
+    src/zk_topk.h
 
 SOURCES += \
     generated/zookeeper.jute.c \
@@ -41,5 +44,8 @@ SOURCES += \
     src/recordio.c \
     src/winport.c \
     src/zk_hashtable.c \
+    src/zk_histogram.c \
     src/zk_log.c \
+    src/zk_timerwheel.c \
+    src/zk_topk.c \
     src/zookeeper.c
@@ -0,0 +1,31 @@
+CONFIG -= QT
+
+TEMPLATE = lib
+
+CONFIG += staticlib
+
+TARGET = zkserver
+
+DESTDIR = $$PWD/lib
+
+win32 {
+    error(The stand-in server needs POSIX sockets and threads)
+}
+
+INCLUDEPATH += include generated src server
+
+HEADERS += \
+    generated/zookeeper.jute.h \
+    include/proto.h \
+    include/recordio.h \
+    src/hashtable/hashtable.h \
+    src/hashtable/hashtable_itr.h \
+    src/hashtable/hashtable_private.h \
+    server/zk_server.h
+
+SOURCES += \
+    generated/zookeeper.jute.c \
+    src/hashtable/hashtable.c \
+    src/hashtable/hashtable_itr.c \
+    src/recordio.c \
+    server/zk_server.c
@@ -0,0 +1,528 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the data paths of the client: the jute codecs, the
+ * watcher tables and the request and completion queues.
+ *
+ * The queues are private to zookeeper.c, so this file is built together
+ * with the library sources and includes zookeeper.c instead of linking
+ * against the library (see zk_bench.pro). On glibc malloc is interposed to
+ * report the allocations and bytes allocated per op.
+ *
+ * USAGE: zk_bench [-x scale] [filter...]
+ * runs the benchmarks whose names contain one of the filters, or all of
+ * them; -x multiplies the iteration counts.
+ */
+
+#include "zookeeper.c"
+
+#include <pthread.h>
+
+// *****************************************************************************
+// allocation counting
+
+static volatile long allocCount;
+static volatile long allocBytes;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static void countAlloc(size_t size)
+{
+    __sync_fetch_and_add(&allocCount, 1);
+    __sync_fetch_and_add(&allocBytes, (long)size);
+}
+
+void *malloc(size_t size)
+{
+    countAlloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    countAlloc(n * size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    countAlloc(size);
+    return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+    __libc_free(p);
+}
+#define ALLOCS_COUNTED 1
+#else
+#define ALLOCS_COUNTED 0
+#endif
+
+// *****************************************************************************
+// the harness
+
+typedef struct bench {
+    const char *name;
+    int64_t ops;
+    int64_t startNs;
+    int64_t elapsedNs;
+    long startAllocs;
+    long startBytes;
+    long allocs;
+    long bytes;
+} bench_t;
+
+static int scale = 1;
+
+static int64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void benchStart(bench_t *b)
+{
+    b->startAllocs = allocCount;
+    b->startBytes = allocBytes;
+    b->startNs = nowNs();
+}
+
+/* ends the measured part, ops is the number of operations it did */
+static void benchStop(bench_t *b, int64_t ops)
+{
+    b->elapsedNs += nowNs() - b->startNs;
+    b->allocs += allocCount - b->startAllocs;
+    b->bytes += allocBytes - b->startBytes;
+    b->ops += ops;
+}
+
+static void benchReport(const bench_t *b)
+{
+    double ops = b->ops ? (double)b->ops : 1;
+    if (ALLOCS_COUNTED) {
+        printf("%-34s %10lld %12.1f %10.2f %12.1f\n", b->name, (long long)b->ops,
+                b->elapsedNs / ops, b->allocs / ops, b->bytes / ops);
+    } else {
+        printf("%-34s %10lld %12.1f %10s %12s\n", b->name, (long long)b->ops,
+                b->elapsedNs / ops, "-", "-");
+    }
+    fflush(stdout);
+}
+
+// *****************************************************************************
+// jute codecs
+
+static struct Stat sampleStat(int i)
+{
+    struct Stat stat;
+    memset(&stat, 0, sizeof(stat));
+    stat.czxid = 0x100000000LL + i;
+    stat.mzxid = 0x100000000LL + i * 2;
+    stat.ctime = 1500000000000LL + i;
+    stat.mtime = 1500000000000LL + i * 3;
+    stat.version = i;
+    stat.dataLength = 1024;
+    stat.pzxid = stat.czxid;
+    return stat;
+}
+
+/* serializes and then deserializes one GetDataResponse per op */
+static void benchGetData(bench_t *b, int valueSize, int iterations)
+{
+    struct GetDataResponse resp;
+    int i;
+
+    resp.data.len = valueSize;
+    resp.data.buff = calloc(1, valueSize);
+    resp.stat = sampleStat(1);
+
+    benchStart(b);
+    for (i = 0; i < iterations; i++) {
+        struct oarchive *oa = create_buffer_oarchive();
+        struct iarchive *ia;
+        struct GetDataResponse out;
+        serialize_GetDataResponse(oa, "reply", &resp);
+        ia = create_buffer_iarchive(get_buffer(oa), get_buffer_len(oa));
+        deserialize_GetDataResponse(ia, "reply", &out);
+        deallocate_GetDataResponse(&out);
+        close_buffer_iarchive(&ia);
+        close_buffer_oarchive(&oa, 1);
+    }
+    benchStop(b, iterations);
+    free(resp.data.buff);
+}
+
+/* serializes and deserializes a GetChildrenResponse, one op per response */
+static void benchGetChildren(bench_t *b, int children, int iterations)
+{
+    struct GetChildrenResponse resp;
+    char name[32];
+    int i;
+
+    resp.children.count = children;
+    resp.children.data = calloc(children, sizeof(char *));
+    for (i = 0; i < children; i++) {
+        snprintf(name, sizeof(name), "node-%010d", i);
+        resp.children.data[i] = strdup(name);
+    }
+
+    benchStart(b);
+    for (i = 0; i < iterations; i++) {
+        struct oarchive *oa = create_buffer_oarchive();
+        struct iarchive *ia;
+        struct GetChildrenResponse out;
+        serialize_GetChildrenResponse(oa, "reply", &resp);
+        ia = create_buffer_iarchive(get_buffer(oa), get_buffer_len(oa));
+        deserialize_GetChildrenResponse(ia, "reply", &out);
+        deallocate_GetChildrenResponse(&out);
+        close_buffer_iarchive(&ia);
+        close_buffer_oarchive(&oa, 1);
+    }
+    benchStop(b, iterations);
+    deallocate_GetChildrenResponse(&resp);
+}
+
+/* a stream of Stat records, one op per record */
+static void benchStatStream(bench_t *b, int count, int iterations)
+{
+    struct Stat stat = sampleStat(7);
+    struct Stat out;
+    int i;
+    int j;
+
+    benchStart(b);
+    for (i = 0; i < iterations; i++) {
+        struct oarchive *oa = create_buffer_oarchive();
+        struct iarchive *ia;
+        for (j = 0; j < count; j++)
+            serialize_Stat(oa, "stat", &stat);
+        ia = create_buffer_iarchive(get_buffer(oa), get_buffer_len(oa));
+        for (j = 0; j < count; j++)
+            deserialize_Stat(ia, "stat", &out);
+        close_buffer_iarchive(&ia);
+        close_buffer_oarchive(&oa, 1);
+    }
+    benchStop(b, (int64_t)iterations * count);
+}
+
+/*
+ * A multi response as the server writes it: a MultiHeader and a
+ * SetDataResponse per op, then the closing header. One op per result.
+ */
+static void benchMultiStream(bench_t *b, int count, int iterations)
+{
+    struct MultiHeader mh;
+    struct SetDataResponse resp;
+    int i;
+    int j;
+
+    resp.stat = sampleStat(3);
+
+    benchStart(b);
+    for (i = 0; i < iterations; i++) {
+        struct oarchive *oa = create_buffer_oarchive();
+        struct iarchive *ia;
+        for (j = 0; j < count; j++) {
+            mh.type = ZOO_SETDATA_OP;
+            mh.done = 0;
+            mh.err = 0;
+            serialize_MultiHeader(oa, "multiheader", &mh);
+            serialize_SetDataResponse(oa, "reply", &resp);
+        }
+        mh.type = -1;
+        mh.done = 1;
+        mh.err = -1;
+        serialize_MultiHeader(oa, "multiheader", &mh);
+
+        ia = create_buffer_iarchive(get_buffer(oa), get_buffer_len(oa));
+        for (;;) {
+            struct SetDataResponse out;
+            deserialize_MultiHeader(ia, "multiheader", &mh);
+            if (mh.done)
+                break;
+            deserialize_SetDataResponse(ia, "reply", &out);
+        }
+        close_buffer_iarchive(&ia);
+        close_buffer_oarchive(&oa, 1);
+    }
+    benchStop(b, (int64_t)iterations * count);
+}
+
+// *****************************************************************************
+// watcher tables
+
+static zk_hashtable *benchTable;
+
+static zk_hashtable *benchChecker(zhandle_t *zh, int rc)
+{
+    return benchTable;
+}
+
+static void benchWatcher(zhandle_t *zh, int type, int state, const char *path,
+        void *ctx)
+{
+}
+
+/*
+ * Registers a watch on each of paths nodes, collects the keys the way a
+ * reconnect does, then fires and delivers every watch. Reported as three
+ * benchmarks, one op per path.
+ */
+static void benchWatchers(bench_t *insert, bench_t *collect, bench_t *fire,
+        int paths)
+{
+    zhandle_t *zh = calloc(1, sizeof(*zh));
+    watcher_registration_t reg;
+    char path[64];
+    char **keys;
+    int count;
+    int i;
+
+    zh->active_node_watchers = create_zk_hashtable();
+    zh->active_exist_watchers = create_zk_hashtable();
+    zh->active_child_watchers = create_zk_hashtable();
+    benchTable = zh->active_node_watchers;
+    reg.watcher = benchWatcher;
+    reg.context = 0;
+    reg.checker = benchChecker;
+    reg.path = path;
+
+    benchStart(insert);
+    for (i = 0; i < paths; i++) {
+        snprintf(path, sizeof(path), "/bench/watched/node-%010d", i);
+        activateWatcher(zh, &reg, ZOK);
+    }
+    benchStop(insert, paths);
+
+    benchStart(collect);
+    keys = collect_keys(zh->active_node_watchers, &count);
+    for (i = 0; i < count; i++)
+        free(keys[i]);
+    free(keys);
+    benchStop(collect, count);
+
+    benchStart(fire);
+    for (i = 0; i < paths; i++) {
+        watcher_object_list_t *list;
+        snprintf(path, sizeof(path), "/bench/watched/node-%010d", i);
+        list = collectWatchers(zh, ZOO_CHANGED_EVENT, path);
+        deliverWatchers(zh, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, path, &list);
+    }
+    benchStop(fire, paths);
+
+    destroy_zk_hashtable(zh->active_node_watchers);
+    destroy_zk_hashtable(zh->active_exist_watchers);
+    destroy_zk_hashtable(zh->active_child_watchers);
+    free(zh);
+}
+
+// *****************************************************************************
+// queues
+
+/* queue_buffer and dequeue_buffer with batch buffers in flight, one op per
+ * buffer queued, dequeued and freed */
+static void benchBufferQueue(bench_t *b, int batch, int iterations)
+{
+    buffer_head_t list;
+    int i;
+    int j;
+
+    memset(&list, 0, sizeof(list));
+    pthread_mutex_init(&list.lock, 0);
+
+    benchStart(b);
+    for (i = 0; i < iterations; i++) {
+        buffer_list_t *buffer;
+        for (j = 0; j < batch; j++)
+            queue_buffer(&list, allocate_buffer(malloc(64), 64), 0);
+        while ((buffer = dequeue_buffer(&list)) != 0)
+            free_buffer(buffer);
+    }
+    benchStop(b, (int64_t)iterations * batch);
+    pthread_mutex_destroy(&list.lock);
+}
+
+typedef struct churn {
+    zhandle_t *zh;
+    int requests;
+} churn_t;
+
+static void churnCompletion(int rc, const void *data)
+{
+}
+
+static void *churnProducer(void *arg)
+{
+    churn_t *churn = (churn_t *)arg;
+    int i;
+    for (i = 0; i < churn->requests; i++) {
+        completion_list_t *c = create_completion_entry(i, COMPLETION_VOID,
+                churnCompletion, 0, 0, 0);
+        c->request = allocate_buffer(malloc(32), 32);
+        submit_requests(churn->zh, c, c);
+    }
+    return 0;
+}
+
+/*
+ * A request's trip through the queues: producers submit completion
+ * entries, the consumer moves them to sent_requests and to_send, "sends"
+ * the buffers, matches the replies, and queues and runs the completions.
+ * One op per request.
+ */
+static void benchCompletionChurn(bench_t *b, int producers, int requests)
+{
+    zhandle_t *zh = calloc(1, sizeof(*zh));
+    pthread_t threads[16];
+    churn_t churn;
+    int64_t done = 0;
+    int64_t total = (int64_t)producers * requests;
+    int i;
+
+    pthread_mutex_init(&zh->to_send.lock, 0);
+    pthread_mutex_init(&zh->sent_requests.lock, 0);
+    pthread_cond_init(&zh->sent_requests.cond, 0);
+    pthread_mutex_init(&zh->completions_to_process.lock, 0);
+    pthread_cond_init(&zh->completions_to_process.cond, 0);
+    zk_timerwheel_init(&zh->request_timers, 0);
+    churn.zh = zh;
+    churn.requests = requests;
+
+    benchStart(b);
+    for (i = 0; i < producers; i++)
+        pthread_create(&threads[i], 0, churnProducer, &churn);
+    while (done < total) {
+        buffer_list_t *buffer;
+        completion_list_t *c;
+        drain_submissions_nolock(zh);
+        while ((buffer = dequeue_buffer(&zh->to_send)) != 0)
+            free_buffer(buffer);
+        while ((c = dequeue_sent_request(zh)) != 0)
+            queue_completion(&zh->completions_to_process, c, 0);
+        while ((c = dequeue_completion(&zh->completions_to_process)) != 0) {
+            c->c.void_result(ZOK, c->data);
+            destroy_completion_entry(c);
+            done++;
+        }
+    }
+    for (i = 0; i < producers; i++)
+        pthread_join(threads[i], 0);
+    benchStop(b, total);
+
+    pthread_mutex_destroy(&zh->to_send.lock);
+    pthread_mutex_destroy(&zh->sent_requests.lock);
+    pthread_cond_destroy(&zh->sent_requests.cond);
+    pthread_mutex_destroy(&zh->completions_to_process.lock);
+    pthread_cond_destroy(&zh->completions_to_process.cond);
+    free(zh);
+}
+
+// *****************************************************************************
+
+static int selectedCount;
+static char **selected;
+
+static int isSelected(const char *name)
+{
+    int i;
+    if (selectedCount == 0)
+        return 1;
+    for (i = 0; i < selectedCount; i++) {
+        if (strstr(name, selected[i]))
+            return 1;
+    }
+    return 0;
+}
+
+#define RUN(title, call) \
+    do { \
+        bench_t b; \
+        memset(&b, 0, sizeof(b)); \
+        b.name = title; \
+        if (isSelected(b.name)) { \
+            call; \
+            benchReport(&b); \
+        } \
+    } while (0)
+
+static void runWatchers(int paths, const char *insertName,
+        const char *collectName, const char *fireName)
+{
+    bench_t insert;
+    bench_t collect;
+    bench_t fire;
+
+    if (!isSelected(insertName) && !isSelected(collectName) && !isSelected(fireName))
+        return;
+    memset(&insert, 0, sizeof(insert));
+    memset(&collect, 0, sizeof(collect));
+    memset(&fire, 0, sizeof(fire));
+    insert.name = insertName;
+    collect.name = collectName;
+    fire.name = fireName;
+    benchWatchers(&insert, &collect, &fire, paths);
+    benchReport(&insert);
+    benchReport(&collect);
+    benchReport(&fire);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    selected = calloc(argc, sizeof(char *));
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            scale = atoi(argv[++i]);
+            if (scale < 1)
+                scale = 1;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "USAGE: %s [-x scale] [filter...]\n", argv[0]);
+            return 2;
+        } else {
+            selected[selectedCount++] = argv[i];
+        }
+    }
+    zoo_set_debug_level(ZOO_LOG_LEVEL_ERROR);
+
+    printf("%-34s %10s %12s %10s %12s\n", "benchmark", "ops", "ns/op",
+            "allocs/op", "bytes/op");
+    RUN("jute/GetDataResponse/64B", benchGetData(&b, 64, 200000 * scale));
+    RUN("jute/GetDataResponse/64KB", benchGetData(&b, 64 * 1024, 5000 * scale));
+    RUN("jute/GetChildrenResponse/1k", benchGetChildren(&b, 1000, 500 * scale));
+    RUN("jute/GetChildrenResponse/100k", benchGetChildren(&b, 100000, 5 * scale));
+    RUN("jute/Stat/stream", benchStatStream(&b, 10000, 50 * scale));
+    RUN("jute/MultiHeader/stream", benchMultiStream(&b, 1000, 200 * scale));
+    runWatchers(100000 * scale, "hashtable/insert/100k",
+            "hashtable/collect_keys/100k", "hashtable/fire/100k");
+    runWatchers(1000000 * scale, "hashtable/insert/1M",
+            "hashtable/collect_keys/1M", "hashtable/fire/1M");
+    RUN("queue/buffer/1", benchBufferQueue(&b, 1, 1000000 * scale));
+    RUN("queue/buffer/64", benchBufferQueue(&b, 64, 20000 * scale));
+    RUN("queue/completion/1-producer", benchCompletionChurn(&b, 1, 1000000 * scale));
+    RUN("queue/completion/4-producers", benchCompletionChurn(&b, 4, 250000 * scale));
+    free(selected);
+    return 0;
+}
@@ -113,7 +113,8 @@ enum ZOO_ERRORS {
   ZAUTHFAILED = -115, /*!< Client authentication failed */
   ZCLOSING = -116, /*!< ZooKeeper is closing */
   ZNOTHING = -117, /*!< (not error) no server responses to process */
-  ZSESSIONMOVED = -118 /*!<session moved to another server, so operation is ignored */ 
+  ZSESSIONMOVED = -118, /*!<session moved to another server, so operation is ignored */ 
+  ZNOTREADONLY = -119 /*!< state-changing request is passed to read-only server */
 };
 
 #ifdef __cplusplus
@@ -173,6 +174,18 @@ extern ZOOAPI const int ZOO_EPHEMERAL;
 extern ZOOAPI const int ZOO_SEQUENCE;
 // @}
 
+/**
+ * @name Init Flags
+ *
+ * These flags are used by zookeeper_init to affect the session.
+ */
+// @{
+/** The session may be established with, or stay on, a server that has
+ * lost contact with the quorum. Such a session only serves reads and is
+ * reported with the ZOO_READONLY_STATE state. */
+extern ZOOAPI const int ZOO_READONLY;
+// @}
+
 /**
  * @name State Consts
  * These constants represent the states of a zookeeper connection. They are
@@ -184,6 +197,7 @@ extern ZOOAPI const int ZOO_AUTH_FAILED_STATE;
 extern ZOOAPI const int ZOO_CONNECTING_STATE;
 extern ZOOAPI const int ZOO_ASSOCIATING_STATE;
 extern ZOOAPI const int ZOO_CONNECTED_STATE;
+extern ZOOAPI const int ZOO_READONLY_STATE;
 // @}
 
 /**
@@ -257,6 +271,117 @@ typedef struct {
     char passwd[16];
 } clientid_t;
 
+/**
+ * \brief connection establishment counters.
+ *
+ * Filled in by \ref zoo_get_connect_stats. The counters are updated by the
+ * thread doing the I/O and read without locking, so they are approximate.
+ */
+typedef struct {
+    int64_t attempts; /* connects started to any server */
+    int64_t failed_attempts; /* connects that were refused or timed out */
+    int64_t failed_rounds; /* times every server failed and the client backed off */
+    int64_t reconnects; /* times the session was (re-)established */
+    int64_t total_reconnect_ms; /* time spent without a session, summed over all reconnects */
+    int last_reconnect_ms; /* time it took to establish the session the last time */
+    int max_reconnect_ms; /* the longest time it took to establish the session */
+} zoo_connect_stats_t;
+
+/**
+ * \brief queueing and traffic counters.
+ *
+ * Filled in by \ref zoo_get_stats. The counters are kept up to date as the
+ * requests move through the client and are read without locking, so a
+ * snapshot is approximate but costs nothing to take.
+ */
+typedef struct {
+    int send_queue; /* buffers waiting to be written to the socket */
+    int64_t send_queue_bytes; /* the bytes in those buffers */
+    int sent_requests; /* requests written and waiting for their reply */
+    int completion_backlog; /* replies and events waiting for the completion thread */
+    int outstanding_sync; /* synchronous calls waiting for their reply */
+    int64_t reconnects; /* times the session was (re-)established */
+    int64_t bytes_in; /* bytes read from the servers */
+    int64_t bytes_out; /* bytes written to the servers */
+    int64_t frames_in; /* replies, events and handshakes read */
+    int64_t frames_out; /* requests and pings written */
+    int max_recv_dwell_ms; /* the longest a reply waited in the socket receive buffer */
+} zoo_stats_t;
+
+/**
+ * \brief the life of one request, as passed to a \ref zoo_trace_fn.
+ *
+ * The times are in microseconds of a monotonic clock with an arbitrary
+ * origin, only the differences between them are meaningful. A time is 0
+ * if it was not taken, e.g. when tracing was turned on while the request
+ * was in flight.
+ */
+typedef struct {
+    int xid;
+    int type; /* the op code of the request, ZOO_GETDATA_OP etc. */
+    int rc; /* the result the request completed with */
+    int64_t queued; /* the request was submitted */
+    int64_t sent; /* its last byte was written to the socket */
+    int64_t received; /* the whole reply was read from the socket */
+    int64_t completed; /* the completion was dispatched or the caller woken */
+} zoo_request_trace_t;
+
+/**
+ * \brief the stages of a request that \ref zoo_get_latency reports on.
+ */
+#define ZOO_TRACE_SEND_QUEUE 0 /* queued to sent: waiting for the IO thread */
+#define ZOO_TRACE_SERVER 1 /* sent to received: the network and the server */
+#define ZOO_TRACE_DISPATCH 2 /* received to completed: the completion backlog */
+#define ZOO_TRACE_TOTAL 3 /* queued to completed */
+#define ZOO_TRACE_STAGES 4
+
+/**
+ * \brief a latency distribution in microseconds.
+ *
+ * Filled in by \ref zoo_get_latency. The percentiles are accurate to about
+ * 1.6% of their value.
+ */
+typedef struct {
+    int64_t count;
+    int64_t min;
+    int64_t max;
+    double mean;
+    int64_t p50;
+    int64_t p90;
+    int64_t p99;
+    int64_t p999;
+} zoo_latency_t;
+
+/**
+ * \brief the longest path kept by the slow log and the hot paths, longer
+ * ones are truncated.
+ */
+#define ZOO_SLOW_OP_PATH_LEN 256
+
+/**
+ * \brief a request that took longer than the slow log threshold.
+ *
+ * Filled in by \ref zoo_get_slow_ops.
+ */
+typedef struct {
+    zoo_request_trace_t trace; /* the op, its result and the time of each phase */
+    char path[ZOO_SLOW_OP_PATH_LEN]; /* as sent, with the chroot; empty for ops without one */
+    int value_len; /* the value written by a create or set or read by a get, -1 for other ops */
+    char server[128]; /* the server that replied, address:port */
+} zoo_slow_op_t;
+
+/**
+ * \brief one of the most accessed paths.
+ *
+ * Filled in by \ref zoo_get_hot_paths. The count may overestimate the
+ * true number of requests by up to error.
+ */
+typedef struct {
+    char path[ZOO_SLOW_OP_PATH_LEN];
+    int64_t count;
+    int64_t error;
+} zoo_hot_path_t;
+
 /**
  * \brief zoo_op structure.
  *
@@ -441,7 +566,11 @@ typedef void (*watcher_fn)(zhandle_t *zh, int type,
  *   of zhandle_t. Application can access it (for example, in the watcher 
  *   callback) using \ref zoo_get_context. The object is not used by zookeeper 
  *   internally and can be null.
- * \param flags reserved for future use. Should be set to zero.
+ * \param flags 0 or ZOO_READONLY to allow a read-only session. A read-only
+ *   session is reported with ZOO_READONLY_STATE instead of ZOO_CONNECTED_STATE,
+ *   write requests fail with ZNOTREADONLY on it. Such a session is local to
+ *   the server, so once the client moves to a server of the quorum it gets
+ *   a new session instead of resuming it.
  * \return a pointer to the opaque zhandle structure. If it fails to create 
  * a new zhandle the function returns NULL and the errno variable 
  * indicates the reason.
@@ -473,6 +602,20 @@ ZOOAPI zhandle_t *zookeeper_init(const char *host, watcher_fn fn,
  */
 ZOOAPI int zookeeper_close(zhandle_t *zh);
 
+/**
+ * \brief free the zookeeper handle but leave the session open on the server.
+ *
+ * Works like \ref zookeeper_close except that the server is not told to
+ * close the session, so its ephemeral nodes and watches survive until the
+ * session times out. Another process can resume the session in the meantime
+ * by passing the client id (see \ref zoo_client_id) to \ref zookeeper_init,
+ * which lets a process restart without its ephemeral nodes disappearing.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \return the same result codes as \ref zookeeper_close
+ */
+ZOOAPI int zookeeper_detach(zhandle_t *zh);
+
 /**
  * \brief return the client session id, only valid if the connections
  * is currently connected (ie. last watcher state is ZOO_CONNECTED_STATE)
@@ -1114,6 +1257,142 @@ ZOOAPI int zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t comple
 ZOOAPI int zoo_aset_acl(zhandle_t *zh, const char *path, int version, 
         struct ACL_vector *acl, void_completion_t, const void *data);
 
+/**
+ * \brief zoo_batch_op structure.
+ *
+ * This structure holds all the arguments of one independent request
+ * submitted as part of a batch via \ref zoo_abatch. Unlike the ops of
+ * \ref zoo_amulti every request in a batch is applied on its own and has
+ * its own completion. This structure should be treated as opaque and
+ * initialized via \ref zoo_batch_get_init, \ref zoo_batch_exists_init,
+ * \ref zoo_batch_get_children_init, \ref zoo_batch_create_init,
+ * \ref zoo_batch_delete_init and \ref zoo_batch_set_init.
+ */
+typedef struct zoo_batch_op {
+    int type;
+    const void *data;
+    union {
+        // GET
+        struct {
+            const char *path;
+            int watch;
+            data_completion_t completion;
+        } get_op;
+
+        // EXISTS
+        struct {
+            const char *path;
+            int watch;
+            stat_completion_t completion;
+        } exists_op;
+
+        // GET CHILDREN
+        struct {
+            const char *path;
+            int watch;
+            strings_completion_t completion;
+        } children_op;
+
+        // CREATE
+        struct {
+            const char *path;
+            const char *data;
+            int datalen;
+            const struct ACL_vector *acl;
+            int flags;
+            string_completion_t completion;
+        } create_op;
+
+        // DELETE
+        struct {
+            const char *path;
+            int version;
+            void_completion_t completion;
+        } delete_op;
+
+        // SET
+        struct {
+            const char *path;
+            const char *data;
+            int datalen;
+            int version;
+            stat_completion_t completion;
+        } set_op;
+    };
+} zoo_batch_op_t;
+
+/**
+ * \brief initializes a zoo_batch_op_t for a get request.
+ *
+ * The arguments are the same as those of \ref zoo_aget.
+ */
+ZOOAPI void zoo_batch_get_init(zoo_batch_op_t *op, const char *path, int watch,
+        data_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_batch_op_t for an exists request.
+ *
+ * The arguments are the same as those of \ref zoo_aexists.
+ */
+ZOOAPI void zoo_batch_exists_init(zoo_batch_op_t *op, const char *path,
+        int watch, stat_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_batch_op_t for a get children request.
+ *
+ * The arguments are the same as those of \ref zoo_aget_children.
+ */
+ZOOAPI void zoo_batch_get_children_init(zoo_batch_op_t *op, const char *path,
+        int watch, strings_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_batch_op_t for a create request.
+ *
+ * The arguments are the same as those of \ref zoo_acreate.
+ */
+ZOOAPI void zoo_batch_create_init(zoo_batch_op_t *op, const char *path,
+        const char *value, int valuelen, const struct ACL_vector *acl,
+        int flags, string_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_batch_op_t for a delete request.
+ *
+ * The arguments are the same as those of \ref zoo_adelete.
+ */
+ZOOAPI void zoo_batch_delete_init(zoo_batch_op_t *op, const char *path,
+        int version, void_completion_t completion, const void *data);
+
+/**
+ * \brief initializes a zoo_batch_op_t for a set request.
+ *
+ * The arguments are the same as those of \ref zoo_aset.
+ */
+ZOOAPI void zoo_batch_set_init(zoo_batch_op_t *op, const char *path,
+        const char *buffer, int buflen, int version,
+        stat_completion_t completion, const void *data);
+
+/**
+ * \brief submits several independent asynchronous requests at once.
+ *
+ * All the requests are serialized up front and then queued for sending
+ * in a single pass, so the cost of taking the handle locks and waking up
+ * the IO thread is paid once per batch instead of once per request. The
+ * requests are sent in array order and each one calls its own completion,
+ * exactly as if it had been issued through the matching async call.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param count the number of requests
+ * \param ops an array of requests initialized with the zoo_batch_*_init calls
+ * \return ZOK on success, in which case every completion will be called,
+ * or one of the following errcodes, in which case none of the requests
+ * was submitted and no completion will be called:
+ * ZBADARGUMENTS - invalid input parameters
+ * ZINVALIDSTATE - zhandle state is either ZOO_SESSION_EXPIRED_STATE or ZOO_AUTH_FAILED_STATE
+ * ZUNIMPLEMENTED - one of the requests has an unsupported type
+ * ZMARSHALLINGERROR - failed to marshall a request; possibly, out of memory
+ */
+ZOOAPI int zoo_abatch(zhandle_t *zh, int count, const zoo_batch_op_t *ops);
+
 /**
  * \brief atomically commits multiple zookeeper operations.
  *
@@ -1195,6 +1474,24 @@ ZOOAPI void zoo_set_debug_level(ZooLogLevel logLevel);
  */
 ZOOAPI void zoo_set_log_stream(FILE* logStream);
 
+/**
+ * \brief enable/disable asynchronous logging
+ *
+ * In the multithreaded library log messages are by default copied into
+ * a per-thread ring buffer and written to the log stream by a background
+ * thread, so the calling thread never waits on the stream. If a ring is
+ * full the message is dropped and counted. Passing zero writes every
+ * message synchronously, after flushing what has been queued so far.
+ * This call has no effect in the single threaded library.
+ */
+ZOOAPI void zoo_set_log_async(int yesOrNo);
+
+/**
+ * \brief return the number of log messages dropped because a log ring
+ * buffer was full.
+ */
+ZOOAPI int zoo_get_log_dropped();
+
 /**
  * \brief enable/disable quorum endpoint order randomization
  * 
@@ -1208,6 +1505,199 @@ ZOOAPI void zoo_set_log_stream(FILE* logStream);
  */
 ZOOAPI void zoo_deterministic_conn_order(int yesOrNo);
 
+/**
+ * \brief configure how the client races connects when (re)connecting.
+ *
+ * When a connect to a server does not complete within stagger_ms the client
+ * starts a connect to the next server while keeping the first one, up to
+ * max_attempts connects at a time. The first connect to complete is used for
+ * the session handshake and the others are closed, so a dead server no longer
+ * costs a whole connect timeout. The defaults are 3 attempts and 250ms.
+ * Passing 1 for max_attempts connects to one server at a time.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param max_attempts the maximum number of connects in progress, from 1 to 3.
+ * \param stagger_ms the time given to a connect before the next one starts.
+ */
+ZOOAPI void zoo_set_parallel_connect(zhandle_t *zh, int max_attempts,
+        int stagger_ms);
+
+/**
+ * \brief configure the backoff between connect rounds.
+ *
+ * When every server has failed the client waits a random time between 0
+ * and min(cap_ms, base_ms * 2^n) before trying again, where n is the number
+ * of rounds that failed in a row ("full jitter"). After losing an
+ * established connection the client waits between 0 and base_ms, so that
+ * clients dropped at the same time don't reconnect in lock step. The
+ * defaults are a 100ms base and a 10s cap.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param base_ms the backoff after the first failed round.
+ * \param cap_ms the maximum backoff.
+ */
+ZOOAPI void zoo_set_reconnect_backoff(zhandle_t *zh, int base_ms, int cap_ms);
+
+/**
+ * \brief limit the rate of connects of all the handles of the process.
+ *
+ * Connects are paced by a token bucket shared by every zhandle, holding up
+ * to burst tokens and refilled at per_second tokens a second. The default
+ * is 100 connects a second with a burst of 100. Passing 0 for per_second
+ * removes the limit.
+ */
+ZOOAPI void zoo_set_connect_rate_limit(int per_second, int burst);
+
+/**
+ * \brief return the connection establishment counters of the handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in.
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_connect_stats(zhandle_t *zh, zoo_connect_stats_t *stats);
+
+/**
+ * \brief return the queueing and traffic counters of the handle.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param stats the structure to fill in.
+ * \return ZOK on success or ZBADARGUMENTS if an argument is NULL
+ */
+ZOOAPI int zoo_get_stats(zhandle_t *zh, zoo_stats_t *stats);
+
+/**
+ * \brief set a deadline for the requests of the handle.
+ *
+ * A request that gets no reply within timeout_ms of being submitted is
+ * completed with ZOPERATIONTIMEOUT, and a synchronous call returns
+ * ZOPERATIONTIMEOUT. The request is not cancelled on the server and may
+ * still take effect; its reply is discarded when it arrives. The deadline
+ * applies to requests submitted after the call. Passing 0, the default,
+ * lets requests wait until they complete or the connection is lost.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param timeout_ms the deadline of each request in ms, 0 for none.
+ */
+ZOOAPI void zoo_set_operation_timeout(zhandle_t *zh, int timeout_ms);
+
+/**
+ * \brief signature of a request trace hook.
+ *
+ * Called once for every request that got a reply, right after its
+ * completion ran, on the thread that ran it: the completion thread for
+ * asynchronous calls and the IO thread for synchronous ones. The hook must
+ * be quick and must not block.
+ *
+ * \param zh the zookeeper handle the request was made on.
+ * \param trace the times of the request, only valid during the call.
+ * \param context the context passed to \ref zoo_set_trace_hook.
+ */
+typedef void (*zoo_trace_fn)(zhandle_t *zh, const zoo_request_trace_t *trace,
+        void *context);
+
+/**
+ * \brief install a hook that is called with the trace of every request.
+ *
+ * The requests are stamped while a hook is installed or the latency
+ * histograms are on; otherwise tracing costs nothing. The hook applies to
+ * requests submitted after the call.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param hook the hook, NULL to remove it.
+ * \param context passed to the hook as is.
+ */
+ZOOAPI void zoo_set_trace_hook(zhandle_t *zh, zoo_trace_fn hook, void *context);
+
+/**
+ * \brief aggregate the request traces into latency histograms.
+ *
+ * While on, the time every request spends in each \ref ZOO_TRACE_STAGES
+ * stage is recorded per op type, to be read with \ref zoo_get_latency.
+ * Turning them off keeps what has been recorded.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param enable non-zero to record, 0 to stop.
+ */
+ZOOAPI void zoo_set_latency_histograms(zhandle_t *zh, int enable);
+
+/**
+ * \brief return the latency of a stage of the requests of a type.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param type the op code, ZOO_GETDATA_OP etc., or -1 for all the ops.
+ * \param stage one of ZOO_TRACE_SEND_QUEUE, ZOO_TRACE_SERVER,
+ *    ZOO_TRACE_DISPATCH or ZOO_TRACE_TOTAL.
+ * \param latency the structure to fill in, all 0 if nothing was recorded.
+ * \return ZOK on success, ZBADARGUMENTS if an argument is out of range
+ *    or NULL, ZSYSTEMERROR if out of memory
+ */
+ZOOAPI int zoo_get_latency(zhandle_t *zh, int type, int stage,
+        zoo_latency_t *latency);
+
+/**
+ * \brief forget the latencies recorded so far.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ */
+ZOOAPI void zoo_reset_latency(zhandle_t *zh);
+
+/**
+ * \brief keep the requests slower than a threshold.
+ *
+ * A request that takes threshold_ms or longer from being submitted to its
+ * completion is logged as a warning and kept in a ring of the last capacity
+ * slow requests, with its path, value size, the server that replied and the
+ * time of each phase. While on, every request with a path gets a small
+ * record of its own. The call empties the ring and applies to requests
+ * submitted after it; it may be made at any time.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param threshold_ms the threshold in ms, 0 turns the slow log off.
+ * \param capacity the number of slow requests kept, at least 1 when on.
+ * \return ZOK on success, ZBADARGUMENTS if an argument is out of range,
+ *    ZSYSTEMERROR if out of memory
+ */
+ZOOAPI int zoo_set_slow_log(zhandle_t *zh, int threshold_ms, int capacity);
+
+/**
+ * \brief return the slow requests kept by the slow log, newest first.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param ops the array to fill in.
+ * \param count the size of the array.
+ * \return the number of requests filled in, ZBADARGUMENTS if an argument
+ *    is NULL or negative
+ */
+ZOOAPI int zoo_get_slow_ops(zhandle_t *zh, zoo_slow_op_t *ops, int count);
+
+/**
+ * \brief count the most accessed paths.
+ *
+ * The paths of the submitted requests are counted in a fixed number of
+ * counters with the Space-Saving algorithm: a path seen more than 1/k of
+ * the time is always counted, and the cost per request is O(log k) under a
+ * lock, paid only while on. The call restarts the counting; it may be
+ * made at any time.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param k the number of counters, 0 turns the counting off.
+ * \return ZOK on success, ZBADARGUMENTS if k is negative, ZSYSTEMERROR if
+ *    out of memory
+ */
+ZOOAPI int zoo_set_hot_paths(zhandle_t *zh, int k);
+
+/**
+ * \brief return the most accessed paths, most frequent first.
+ *
+ * \param zh the zookeeper handle obtained by a call to \ref zookeeper_init
+ * \param paths the array to fill in.
+ * \param count the size of the array.
+ * \return the number of paths filled in, ZBADARGUMENTS if an argument is
+ *    NULL or negative
+ */
+ZOOAPI int zoo_get_hot_paths(zhandle_t *zh, zoo_hot_path_t *paths, int count);
+
 /**
  * \brief create a node synchronously.
  * 
@@ -0,0 +1,24 @@
+CONFIG -= QT
+CONFIG += console
+
+TEMPLATE = app
+
+TARGET = load_gen
+
+DESTDIR = $$PWD/bin
+
+win32 {
+    error(The load generator needs POSIX clocks and threads)
+}
+
+DEFINES += THREADED
+
+INCLUDEPATH += include generated src
+
+HEADERS += \
+    src/zk_histogram.h
+
+SOURCES += \
+    src/load_gen.c
+
+LIBS += -L$$PWD/lib -lzookeeper -lpthread
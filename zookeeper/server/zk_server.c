@@ -0,0 +1,1795 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLL_EXPORT
+#  define USE_STATIC_LIB
+#endif
+
+#include "zk_server.h"
+#include <zookeeper.h>
+#include <proto.h>
+#include "zookeeper.jute.h"
+#include "hashtable/hashtable.h"
+#include "hashtable/hashtable_itr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define EPHEMERAL_FLAG 1
+#define SEQUENCE_FLAG 2
+
+#define CREATED_EVENT 1
+#define DELETED_EVENT 2
+#define CHANGED_EVENT 3
+#define CHILD_EVENT 4
+#define CONNECTED_STATE 3
+
+#define WATCHER_EVENT_XID -1
+#define ERROR_OP -1
+
+/* the same limits as a server with the default configuration */
+#define TICK_TIME 2000
+#define MIN_SESSION_TIMEOUT (2 * TICK_TIME)
+#define MAX_SESSION_TIMEOUT (20 * TICK_TIME)
+#define MAX_BUFFER 0xfffff
+
+#define PASSWD_LEN 16
+#define READ_CHUNK 65536
+/* the longest the loop sleeps, so stop requests are never missed for long */
+#define MAX_POLL_INTERVAL 1000
+
+struct zks_node {
+    char *path;
+    const char *name; /* the last component of path */
+    char *data;
+    int32_t datalen; /* -1 for a null value */
+    struct Stat stat;
+    struct zks_node *parent;
+    struct zks_node **children;
+    int32_t nchildren;
+    int32_t cchildren;
+};
+
+/* the sessions watching a path; a watch fires once and is then removed */
+struct zks_watchers {
+    int64_t *ids;
+    int count;
+    int capacity;
+};
+
+struct zks_conn;
+
+struct zks_session {
+    int64_t id;
+    char passwd[PASSWD_LEN];
+    int32_t timeout;
+    int64_t last_seen;
+    struct zks_conn *conn;
+};
+
+struct zks_conn {
+    int fd;
+    struct zks_session *session; /* 0 until the handshake is done */
+    char *in;
+    int inlen;
+    int incap;
+    char *out;
+    int outpos;
+    int outlen;
+    int outcap;
+    int close_after_flush;
+    int dead;
+    struct zks_conn *next;
+};
+
+/* how to revert one change of a transaction */
+struct zks_undo {
+    int type; /* ZOO_CREATE_OP, ZOO_DELETE_OP or ZOO_SETDATA_OP */
+    struct zks_node *node;
+    struct Stat stat;
+    struct Stat parent_stat;
+    char *data;
+    int32_t datalen;
+    struct zks_undo *next;
+};
+
+struct zks_event {
+    int type;
+    char *path;
+    struct zks_event *next;
+};
+
+/**
+ * A transaction collects the undo records and the watch events of a
+ * request. Single requests and multi go through the same path, so a multi
+ * that fails half way is rolled back and fires no watches.
+ */
+struct zks_txn {
+    int64_t zxid;
+    int64_t time;
+    struct zks_undo *undo; /* most recent first */
+    struct zks_event *events;
+    struct zks_event **events_tail;
+};
+
+struct _zk_server {
+    int listen_fd;
+    int port;
+    int wake_fds[2];
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int has_thread;
+    int running;
+    int stopping;
+    int read_only;
+    int64_t zxid;
+    int64_t next_session;
+    struct zks_node *root;
+    struct hashtable *nodes;         /* path -> zks_node */
+    struct hashtable *data_watches;  /* path -> zks_watchers, exists and get */
+    struct hashtable *child_watches; /* path -> zks_watchers, get children */
+    struct hashtable *sessions;      /* int64_t id -> zks_session */
+    struct zks_conn *conns;
+};
+
+static int64_t now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static unsigned int string_hash(void *key)
+{
+    unsigned int hash = 5381;
+    const unsigned char *s = (const unsigned char *)key;
+    int c;
+    while ((c = *s++))
+        hash = ((hash << 5) + hash) + c;
+    return hash;
+}
+
+static int string_equal(void *key1, void *key2)
+{
+    return strcmp((const char *)key1, (const char *)key2) == 0;
+}
+
+static unsigned int id_hash(void *key)
+{
+    int64_t id = *(int64_t *)key;
+    return (unsigned int)(id ^ (id >> 32));
+}
+
+static int id_equal(void *key1, void *key2)
+{
+    return *(int64_t *)key1 == *(int64_t *)key2;
+}
+
+static void wake_loop(zk_server_t *srv)
+{
+    char c = 0;
+    ssize_t rc = write(srv->wake_fds[1], &c, 1);
+    (void)rc;
+}
+
+/* ---------------------------------------------------------------------- */
+/* the data tree                                                           */
+/* ---------------------------------------------------------------------- */
+
+static struct zks_node *find_node(zk_server_t *srv, const char *path)
+{
+    return (struct zks_node *)hashtable_search(srv->nodes, (void *)path);
+}
+
+static struct zks_node *new_node(const char *path, const char *data,
+        int32_t datalen)
+{
+    struct zks_node *node = calloc(1, sizeof(*node));
+    node->path = strdup(path);
+    node->name = strrchr(node->path, '/') + 1;
+    node->datalen = datalen;
+    if (datalen > 0) {
+        node->data = malloc(datalen);
+        memcpy(node->data, data, datalen);
+    }
+    node->stat.dataLength = datalen > 0 ? datalen : 0;
+    return node;
+}
+
+static void free_node(struct zks_node *node)
+{
+    free(node->path);
+    free(node->data);
+    free(node->children);
+    free(node);
+}
+
+static void link_node(zk_server_t *srv, struct zks_node *parent,
+        struct zks_node *node)
+{
+    if (parent->nchildren == parent->cchildren) {
+        parent->cchildren = parent->cchildren ? parent->cchildren * 2 : 4;
+        parent->children = realloc(parent->children,
+                parent->cchildren * sizeof(*parent->children));
+    }
+    parent->children[parent->nchildren++] = node;
+    node->parent = parent;
+    hashtable_insert(srv->nodes, strdup(node->path), node);
+}
+
+static void unlink_node(zk_server_t *srv, struct zks_node *node)
+{
+    struct zks_node *parent = node->parent;
+    int32_t i;
+    for (i = 0; i < parent->nchildren; i++) {
+        if (parent->children[i] == node) {
+            parent->children[i] = parent->children[--parent->nchildren];
+            break;
+        }
+    }
+    hashtable_remove(srv->nodes, node->path);
+}
+
+/* a path is absolute, has no empty, "." or ".." components and no trailing slash */
+static int is_valid_path(const char *path)
+{
+    const char *p;
+    if (!path || path[0] != '/')
+        return 0;
+    if (path[1] == '\0')
+        return 1;
+    for (p = path; *p; p++) {
+        if (*p == '/') {
+            if (p[1] == '/' || p[1] == '\0')
+                return 0;
+            if (p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+                return 0;
+            if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || p[3] == '\0'))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static char *parent_path(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    char *parent = malloc(len + 1);
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    return parent;
+}
+
+static void sync_child_stat(struct zks_node *node)
+{
+    node->stat.numChildren = node->nchildren;
+}
+
+/* ---------------------------------------------------------------------- */
+/* transactions                                                            */
+/* ---------------------------------------------------------------------- */
+
+static void txn_begin(zk_server_t *srv, struct zks_txn *txn)
+{
+    txn->zxid = srv->zxid + 1;
+    txn->time = now_ms();
+    txn->undo = 0;
+    txn->events = 0;
+    txn->events_tail = &txn->events;
+}
+
+static void txn_event(struct zks_txn *txn, int type, const char *path)
+{
+    struct zks_event *event = calloc(1, sizeof(*event));
+    event->type = type;
+    event->path = strdup(path);
+    *txn->events_tail = event;
+    txn->events_tail = &event->next;
+}
+
+static struct zks_undo *txn_undo(struct zks_txn *txn, int type,
+        struct zks_node *node)
+{
+    struct zks_undo *undo = calloc(1, sizeof(*undo));
+    undo->type = type;
+    undo->node = node;
+    undo->stat = node->stat;
+    if (node->parent)
+        undo->parent_stat = node->parent->stat;
+    undo->next = txn->undo;
+    txn->undo = undo;
+    return undo;
+}
+
+static void free_events(struct zks_event *event)
+{
+    while (event) {
+        struct zks_event *next = event->next;
+        free(event->path);
+        free(event);
+        event = next;
+    }
+}
+
+static int txn_create(zk_server_t *srv, struct zks_txn *txn,
+        struct zks_session *session, const char *path, const char *data,
+        int32_t datalen, int flags, char **created)
+{
+    struct zks_node *parent;
+    struct zks_node *node;
+    char *parent_name;
+    char *full;
+    size_t len;
+
+    if (!path || path[0] != '/')
+        return ZBADARGUMENTS;
+
+    parent_name = parent_path(path);
+    parent = find_node(srv, parent_name);
+    free(parent_name);
+
+    len = strlen(path);
+    full = malloc(len + 11);
+    memcpy(full, path, len + 1);
+    if ((flags & SEQUENCE_FLAG) && parent)
+        sprintf(full + len, "%010d", parent->stat.cversion);
+
+    if (!is_valid_path(full) || strcmp(full, "/") == 0) {
+        free(full);
+        return ZBADARGUMENTS;
+    }
+    if (!parent) {
+        free(full);
+        return ZNONODE;
+    }
+    if (parent->stat.ephemeralOwner != 0) {
+        free(full);
+        return ZNOCHILDRENFOREPHEMERALS;
+    }
+    if (find_node(srv, full)) {
+        free(full);
+        return ZNODEEXISTS;
+    }
+
+    node = new_node(full, data, datalen);
+    node->stat.czxid = node->stat.mzxid = node->stat.pzxid = txn->zxid;
+    node->stat.ctime = node->stat.mtime = txn->time;
+    node->stat.ephemeralOwner = (flags & EPHEMERAL_FLAG) ? session->id : 0;
+
+    link_node(srv, parent, node);
+    txn_undo(txn, ZOO_CREATE_OP, node);
+    parent->stat.cversion++;
+    parent->stat.pzxid = txn->zxid;
+    sync_child_stat(parent);
+
+    txn_event(txn, CREATED_EVENT, full);
+    txn_event(txn, CHILD_EVENT, parent->path);
+
+    if (created)
+        *created = full;
+    else
+        free(full);
+    return ZOK;
+}
+
+static int txn_delete(zk_server_t *srv, struct zks_txn *txn,
+        const char *path, int32_t version)
+{
+    struct zks_node *node;
+    struct zks_node *parent;
+
+    if (!is_valid_path(path) || strcmp(path, "/") == 0)
+        return ZBADARGUMENTS;
+    node = find_node(srv, path);
+    if (!node)
+        return ZNONODE;
+    if (version != -1 && version != node->stat.version)
+        return ZBADVERSION;
+    if (node->nchildren > 0)
+        return ZNOTEMPTY;
+
+    parent = node->parent;
+    txn_undo(txn, ZOO_DELETE_OP, node);
+    unlink_node(srv, node);
+    parent->stat.cversion++;
+    parent->stat.pzxid = txn->zxid;
+    sync_child_stat(parent);
+
+    txn_event(txn, DELETED_EVENT, node->path);
+    txn_event(txn, CHILD_EVENT, parent->path);
+    return ZOK;
+}
+
+static int txn_set_data(zk_server_t *srv, struct zks_txn *txn,
+        const char *path, const char *data, int32_t datalen,
+        int32_t version, struct Stat *stat)
+{
+    struct zks_node *node;
+    struct zks_undo *undo;
+
+    if (!is_valid_path(path))
+        return ZBADARGUMENTS;
+    node = find_node(srv, path);
+    if (!node)
+        return ZNONODE;
+    if (version != -1 && version != node->stat.version)
+        return ZBADVERSION;
+
+    undo = txn_undo(txn, ZOO_SETDATA_OP, node);
+    undo->data = node->data;
+    undo->datalen = node->datalen;
+
+    node->data = 0;
+    node->datalen = datalen;
+    if (datalen > 0) {
+        node->data = malloc(datalen);
+        memcpy(node->data, data, datalen);
+    }
+    node->stat.dataLength = datalen > 0 ? datalen : 0;
+    node->stat.version++;
+    node->stat.mzxid = txn->zxid;
+    node->stat.mtime = txn->time;
+
+    txn_event(txn, CHANGED_EVENT, path);
+    if (stat)
+        *stat = node->stat;
+    return ZOK;
+}
+
+static int txn_check(zk_server_t *srv, const char *path, int32_t version)
+{
+    struct zks_node *node;
+
+    if (!is_valid_path(path))
+        return ZBADARGUMENTS;
+    node = find_node(srv, path);
+    if (!node)
+        return ZNONODE;
+    if (version != -1 && version != node->stat.version)
+        return ZBADVERSION;
+    return ZOK;
+}
+
+static void txn_rollback(zk_server_t *srv, struct zks_txn *txn)
+{
+    while (txn->undo) {
+        struct zks_undo *undo = txn->undo;
+        struct zks_node *node = undo->node;
+        txn->undo = undo->next;
+
+        switch (undo->type) {
+        case ZOO_CREATE_OP:
+            unlink_node(srv, node);
+            node->parent->stat = undo->parent_stat;
+            free_node(node);
+            break;
+        case ZOO_DELETE_OP:
+            link_node(srv, node->parent, node);
+            node->parent->stat = undo->parent_stat;
+            break;
+        case ZOO_SETDATA_OP:
+            free(node->data);
+            node->data = undo->data;
+            node->datalen = undo->datalen;
+            node->stat = undo->stat;
+            break;
+        }
+        free(undo);
+    }
+    free_events(txn->events);
+    txn->events = 0;
+}
+
+static void fire_events(zk_server_t *srv, struct zks_event *events);
+
+static void txn_commit(zk_server_t *srv, struct zks_txn *txn)
+{
+    if (txn->undo)
+        srv->zxid = txn->zxid;
+
+    while (txn->undo) {
+        struct zks_undo *undo = txn->undo;
+        txn->undo = undo->next;
+
+        if (undo->type == ZOO_DELETE_OP)
+            free_node(undo->node);
+        else if (undo->type == ZOO_SETDATA_OP)
+            free(undo->data);
+        free(undo);
+    }
+    fire_events(srv, txn->events);
+    free_events(txn->events);
+    txn->events = 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* connections and watches                                                 */
+/* ---------------------------------------------------------------------- */
+
+static void reserve_out(struct zks_conn *conn, int len)
+{
+    if (conn->outpos == conn->outlen) {
+        conn->outpos = conn->outlen = 0;
+    }
+    if (conn->outlen + len > conn->outcap) {
+        if (conn->outpos > 0) {
+            memmove(conn->out, conn->out + conn->outpos,
+                    conn->outlen - conn->outpos);
+            conn->outlen -= conn->outpos;
+            conn->outpos = 0;
+        }
+        while (conn->outlen + len > conn->outcap)
+            conn->outcap = conn->outcap ? conn->outcap * 2 : READ_CHUNK;
+        conn->out = realloc(conn->out, conn->outcap);
+    }
+}
+
+/* queues a length prefixed frame holding the two archives back to back */
+static void queue_frame(struct zks_conn *conn, struct oarchive *first,
+        struct oarchive *second, const char *tail, int taillen)
+{
+    int len1 = get_buffer_len(first);
+    int len2 = second ? get_buffer_len(second) : 0;
+    int32_t len = len1 + len2 + taillen;
+    int32_t nlen = htonl(len);
+
+    reserve_out(conn, len + 4);
+    memcpy(conn->out + conn->outlen, &nlen, 4);
+    memcpy(conn->out + conn->outlen + 4, get_buffer(first), len1);
+    if (len2)
+        memcpy(conn->out + conn->outlen + 4 + len1, get_buffer(second), len2);
+    if (taillen)
+        memcpy(conn->out + conn->outlen + 4 + len1 + len2, tail, taillen);
+    conn->outlen += len + 4;
+}
+
+static void send_event(struct zks_conn *conn, int type, const char *path)
+{
+    struct ReplyHeader h = { WATCHER_EVENT_XID, -1, ZOK };
+    struct WatcherEvent event;
+    struct oarchive *hdr = create_buffer_oarchive();
+    struct oarchive *body = create_buffer_oarchive();
+
+    event.type = type;
+    event.state = CONNECTED_STATE;
+    event.path = (char *)path;
+    serialize_ReplyHeader(hdr, "hdr", &h);
+    serialize_WatcherEvent(body, "event", &event);
+    queue_frame(conn, hdr, body, 0, 0);
+    close_buffer_oarchive(&hdr, 1);
+    close_buffer_oarchive(&body, 1);
+}
+
+static void add_watch(struct hashtable *table, const char *path, int64_t id)
+{
+    struct zks_watchers *w = hashtable_search(table, (void *)path);
+    int i;
+
+    if (!w) {
+        w = calloc(1, sizeof(*w));
+        hashtable_insert(table, strdup(path), w);
+    }
+    for (i = 0; i < w->count; i++) {
+        if (w->ids[i] == id)
+            return;
+    }
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 4;
+        w->ids = realloc(w->ids, w->capacity * sizeof(*w->ids));
+    }
+    w->ids[w->count++] = id;
+}
+
+static int contains_id(struct zks_watchers *w, int64_t id)
+{
+    int i;
+    for (i = 0; w && i < w->count; i++) {
+        if (w->ids[i] == id)
+            return 1;
+    }
+    return 0;
+}
+
+static void notify(zk_server_t *srv, struct zks_watchers *w, int type,
+        const char *path, struct zks_watchers *skip)
+{
+    int i;
+    for (i = 0; w && i < w->count; i++) {
+        struct zks_session *session;
+        if (contains_id(skip, w->ids[i]))
+            continue;
+        session = hashtable_search(srv->sessions, &w->ids[i]);
+        if (session && session->conn && !session->conn->dead)
+            send_event(session->conn, type, path);
+    }
+}
+
+static void free_watchers(struct zks_watchers *w)
+{
+    if (w) {
+        free(w->ids);
+        free(w);
+    }
+}
+
+static void fire_events(zk_server_t *srv, struct zks_event *event)
+{
+    for (; event; event = event->next) {
+        struct zks_watchers *data = 0;
+        struct zks_watchers *child = 0;
+
+        switch (event->type) {
+        case CREATED_EVENT:
+        case CHANGED_EVENT:
+            data = hashtable_remove(srv->data_watches, event->path);
+            break;
+        case DELETED_EVENT:
+            data = hashtable_remove(srv->data_watches, event->path);
+            child = hashtable_remove(srv->child_watches, event->path);
+            break;
+        case CHILD_EVENT:
+            child = hashtable_remove(srv->child_watches, event->path);
+            break;
+        }
+        /* a session watching both data and children gets one deleted event */
+        notify(srv, data, event->type, event->path, 0);
+        notify(srv, child, event->type, event->path, data);
+        free_watchers(data);
+        free_watchers(child);
+    }
+}
+
+static void remove_id(struct hashtable *table, int64_t id)
+{
+    struct hashtable_itr *it;
+    if (hashtable_count(table) == 0)
+        return;
+    it = hashtable_iterator(table);
+    do {
+        struct zks_watchers *w = hashtable_iterator_value(it);
+        int i;
+        for (i = 0; i < w->count; i++) {
+            if (w->ids[i] == id) {
+                w->ids[i] = w->ids[--w->count];
+                break;
+            }
+        }
+    } while (hashtable_iterator_advance(it));
+    free(it);
+}
+
+/* the watches of a connection go away with it, the client sets them again */
+static void drop_watches(zk_server_t *srv, int64_t id)
+{
+    remove_id(srv->data_watches, id);
+    remove_id(srv->child_watches, id);
+}
+
+static void delete_ephemerals(zk_server_t *srv, int64_t id)
+{
+    struct hashtable_itr *it;
+    char **paths = 0;
+    int count = 0;
+    int capacity = 0;
+    int i;
+
+    if (hashtable_count(srv->nodes) > 0) {
+        it = hashtable_iterator(srv->nodes);
+        do {
+            struct zks_node *node = hashtable_iterator_value(it);
+            if (node->stat.ephemeralOwner == id) {
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    paths = realloc(paths, capacity * sizeof(*paths));
+                }
+                paths[count++] = strdup(node->path);
+            }
+        } while (hashtable_iterator_advance(it));
+        free(it);
+    }
+
+    for (i = 0; i < count; i++) {
+        struct zks_txn txn;
+        txn_begin(srv, &txn);
+        txn_delete(srv, &txn, paths[i], -1);
+        txn_commit(srv, &txn);
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+/* ends a session; its connection, if any, is left to the caller */
+static void close_session(zk_server_t *srv, struct zks_session *session)
+{
+    int64_t id = session->id;
+    if (session->conn) {
+        session->conn->session = 0;
+        session->conn = 0;
+    }
+    hashtable_remove(srv->sessions, &id);
+    drop_watches(srv, id);
+    delete_ephemerals(srv, id);
+    free(session);
+}
+
+static void expire_sessions(zk_server_t *srv)
+{
+    struct hashtable_itr *it;
+    int64_t now = now_ms();
+    int64_t *expired = 0;
+    int count = 0;
+    int capacity = 0;
+    int i;
+
+    if (hashtable_count(srv->sessions) == 0)
+        return;
+    it = hashtable_iterator(srv->sessions);
+    do {
+        struct zks_session *session = hashtable_iterator_value(it);
+        if (now - session->last_seen > session->timeout) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                expired = realloc(expired, capacity * sizeof(*expired));
+            }
+            expired[count++] = session->id;
+        }
+    } while (hashtable_iterator_advance(it));
+    free(it);
+
+    for (i = 0; i < count; i++) {
+        struct zks_session *session = hashtable_search(srv->sessions, &expired[i]);
+        if (session->conn)
+            session->conn->dead = 1;
+        close_session(srv, session);
+    }
+    free(expired);
+}
+
+static int next_expiry(zk_server_t *srv)
+{
+    struct hashtable_itr *it;
+    int64_t now = now_ms();
+    int64_t wait = MAX_POLL_INTERVAL;
+
+    if (hashtable_count(srv->sessions) == 0)
+        return (int)wait;
+    it = hashtable_iterator(srv->sessions);
+    do {
+        struct zks_session *session = hashtable_iterator_value(it);
+        int64_t left = session->last_seen + session->timeout - now + 1;
+        if (left < wait)
+            wait = left;
+    } while (hashtable_iterator_advance(it));
+    free(it);
+    return wait < 0 ? 0 : (int)wait;
+}
+
+/* ---------------------------------------------------------------------- */
+/* requests                                                                */
+/* ---------------------------------------------------------------------- */
+
+static struct ACL world_all_acl = { 0x1f, { "world", "anyone" } };
+
+static int is_write(int type)
+{
+    return type == ZOO_CREATE_OP || type == ZOO_DELETE_OP
+        || type == ZOO_SETDATA_OP || type == ZOO_SETACL_OP
+        || type == ZOO_MULTI_OP;
+}
+
+static int do_create(zk_server_t *srv, struct zks_session *session,
+        struct iarchive *ia, struct oarchive *oa)
+{
+    struct CreateRequest req;
+    struct CreateResponse res;
+    struct zks_txn txn;
+    char *created = 0;
+    int rc;
+
+    if (deserialize_CreateRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    txn_begin(srv, &txn);
+    rc = txn_create(srv, &txn, session, req.path, req.data.buff,
+            req.data.len, req.flags, &created);
+    txn_commit(srv, &txn);
+    if (rc == ZOK) {
+        res.path = created;
+        serialize_CreateResponse(oa, "reply", &res);
+        free(created);
+    }
+    deallocate_CreateRequest(&req);
+    return rc;
+}
+
+static int do_delete(zk_server_t *srv, struct iarchive *ia)
+{
+    struct DeleteRequest req;
+    struct zks_txn txn;
+    int rc;
+
+    if (deserialize_DeleteRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    txn_begin(srv, &txn);
+    rc = txn_delete(srv, &txn, req.path, req.version);
+    txn_commit(srv, &txn);
+    deallocate_DeleteRequest(&req);
+    return rc;
+}
+
+static int do_exists(zk_server_t *srv, struct zks_session *session,
+        struct iarchive *ia, struct oarchive *oa)
+{
+    struct ExistsRequest req;
+    struct ExistsResponse res;
+    struct zks_node *node;
+    int rc = ZOK;
+
+    if (deserialize_ExistsRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    if (!is_valid_path(req.path)) {
+        rc = ZBADARGUMENTS;
+    } else {
+        node = find_node(srv, req.path);
+        if (req.watch)
+            add_watch(srv->data_watches, req.path, session->id);
+        if (node) {
+            res.stat = node->stat;
+            serialize_ExistsResponse(oa, "reply", &res);
+        } else {
+            rc = ZNONODE;
+        }
+    }
+    deallocate_ExistsRequest(&req);
+    return rc;
+}
+
+static int do_get_data(zk_server_t *srv, struct zks_session *session,
+        struct iarchive *ia, struct oarchive *oa)
+{
+    struct GetDataRequest req;
+    struct GetDataResponse res;
+    struct zks_node *node;
+    int rc = ZOK;
+
+    if (deserialize_GetDataRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    node = is_valid_path(req.path) ? find_node(srv, req.path) : 0;
+    if (!is_valid_path(req.path)) {
+        rc = ZBADARGUMENTS;
+    } else if (!node) {
+        rc = ZNONODE;
+    } else {
+        if (req.watch)
+            add_watch(srv->data_watches, req.path, session->id);
+        res.data.buff = node->data;
+        res.data.len = node->datalen;
+        res.stat = node->stat;
+        serialize_GetDataResponse(oa, "reply", &res);
+    }
+    deallocate_GetDataRequest(&req);
+    return rc;
+}
+
+static int do_set_data(zk_server_t *srv, struct iarchive *ia,
+        struct oarchive *oa)
+{
+    struct SetDataRequest req;
+    struct SetDataResponse res;
+    struct zks_txn txn;
+    int rc;
+
+    if (deserialize_SetDataRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    txn_begin(srv, &txn);
+    rc = txn_set_data(srv, &txn, req.path, req.data.buff, req.data.len,
+            req.version, &res.stat);
+    txn_commit(srv, &txn);
+    if (rc == ZOK)
+        serialize_SetDataResponse(oa, "reply", &res);
+    deallocate_SetDataRequest(&req);
+    return rc;
+}
+
+static int do_get_acl(zk_server_t *srv, struct iarchive *ia,
+        struct oarchive *oa)
+{
+    struct GetACLRequest req;
+    struct GetACLResponse res;
+    struct zks_node *node;
+    int rc = ZOK;
+
+    if (deserialize_GetACLRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    node = find_node(srv, req.path);
+    if (!node) {
+        rc = ZNONODE;
+    } else {
+        res.acl.count = 1;
+        res.acl.data = &world_all_acl;
+        res.stat = node->stat;
+        serialize_GetACLResponse(oa, "reply", &res);
+    }
+    deallocate_GetACLRequest(&req);
+    return rc;
+}
+
+/* ACLs are accepted but not enforced, only the version is kept */
+static int do_set_acl(zk_server_t *srv, struct iarchive *ia,
+        struct oarchive *oa)
+{
+    struct SetACLRequest req;
+    struct SetACLResponse res;
+    struct zks_node *node;
+    int rc = ZOK;
+
+    if (deserialize_SetACLRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    node = find_node(srv, req.path);
+    if (!node) {
+        rc = ZNONODE;
+    } else if (req.version != -1 && req.version != node->stat.aversion) {
+        rc = ZBADVERSION;
+    } else {
+        node->stat.aversion++;
+        res.stat = node->stat;
+        serialize_SetACLResponse(oa, "reply", &res);
+    }
+    deallocate_SetACLRequest(&req);
+    return rc;
+}
+
+static int do_get_children(zk_server_t *srv, struct zks_session *session,
+        struct iarchive *ia, struct oarchive *oa, int with_stat)
+{
+    struct GetChildrenRequest req;
+    struct zks_node *node;
+    int rc = ZOK;
+
+    /* GetChildren2Request has the same layout */
+    if (deserialize_GetChildrenRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    node = find_node(srv, req.path);
+    if (!node) {
+        rc = ZNONODE;
+    } else {
+        struct String_vector children;
+        int32_t i;
+
+        if (req.watch)
+            add_watch(srv->child_watches, req.path, session->id);
+        children.count = node->nchildren;
+        children.data = malloc((node->nchildren + 1) * sizeof(char *));
+        for (i = 0; i < node->nchildren; i++)
+            children.data[i] = (char *)node->children[i]->name;
+        if (with_stat) {
+            struct GetChildren2Response res;
+            res.children = children;
+            res.stat = node->stat;
+            serialize_GetChildren2Response(oa, "reply", &res);
+        } else {
+            struct GetChildrenResponse res;
+            res.children = children;
+            serialize_GetChildrenResponse(oa, "reply", &res);
+        }
+        free(children.data);
+    }
+    deallocate_GetChildrenRequest(&req);
+    return rc;
+}
+
+static int do_sync(struct iarchive *ia, struct oarchive *oa)
+{
+    struct SyncRequest req;
+    struct SyncResponse res;
+
+    if (deserialize_SyncRequest(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+    res.path = req.path;
+    serialize_SyncResponse(oa, "reply", &res);
+    deallocate_SyncRequest(&req);
+    return ZOK;
+}
+
+struct zks_op {
+    int type;
+    union {
+        struct CreateRequest create;
+        struct DeleteRequest del;
+        struct SetDataRequest set;
+        struct CheckVersionRequest check;
+    } u;
+};
+
+static void deallocate_op(struct zks_op *op)
+{
+    switch (op->type) {
+    case ZOO_CREATE_OP: deallocate_CreateRequest(&op->u.create); break;
+    case ZOO_DELETE_OP: deallocate_DeleteRequest(&op->u.del); break;
+    case ZOO_SETDATA_OP: deallocate_SetDataRequest(&op->u.set); break;
+    case ZOO_CHECK_OP: deallocate_CheckVersionRequest(&op->u.check); break;
+    }
+}
+
+/**
+ * Runs the operations in one transaction. On success every operation gets
+ * its own result; on failure the changes are rolled back, the failed
+ * operation gets its error, the ones before it ZOK and the ones after it
+ * ZRUNTIMEINCONSISTENCY, as the real server does.
+ */
+static int do_multi(zk_server_t *srv, struct zks_session *session,
+        struct iarchive *ia, struct oarchive *oa)
+{
+    struct MultiHeader mh;
+    struct zks_op *ops = 0;
+    struct zks_txn txn;
+    char **created;
+    struct Stat *stats;
+    int count = 0;
+    int capacity = 0;
+    int failed = -1;
+    int err = ZOK;
+    int rc = ZOK;
+    int i;
+
+    for (;;) {
+        struct zks_op *op;
+        if (deserialize_MultiHeader(ia, "multiheader", &mh) < 0) {
+            rc = ZMARSHALLINGERROR;
+            break;
+        }
+        if (mh.done)
+            break;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            ops = realloc(ops, capacity * sizeof(*ops));
+        }
+        op = &ops[count];
+        op->type = mh.type;
+        switch (mh.type) {
+        case ZOO_CREATE_OP:
+            rc = deserialize_CreateRequest(ia, "req", &op->u.create);
+            break;
+        case ZOO_DELETE_OP:
+            rc = deserialize_DeleteRequest(ia, "req", &op->u.del);
+            break;
+        case ZOO_SETDATA_OP:
+            rc = deserialize_SetDataRequest(ia, "req", &op->u.set);
+            break;
+        case ZOO_CHECK_OP:
+            rc = deserialize_CheckVersionRequest(ia, "req", &op->u.check);
+            break;
+        default:
+            rc = -1;
+            break;
+        }
+        if (rc < 0) {
+            rc = mh.type == ZOO_CREATE_OP || mh.type == ZOO_DELETE_OP
+                || mh.type == ZOO_SETDATA_OP || mh.type == ZOO_CHECK_OP
+                ? ZMARSHALLINGERROR : ZUNIMPLEMENTED;
+            break;
+        }
+        count++;
+    }
+
+    if (rc != ZOK) {
+        for (i = 0; i < count; i++)
+            deallocate_op(&ops[i]);
+        free(ops);
+        return rc;
+    }
+
+    created = calloc(count + 1, sizeof(*created));
+    stats = calloc(count + 1, sizeof(*stats));
+    txn_begin(srv, &txn);
+    for (i = 0; i < count && failed < 0; i++) {
+        struct zks_op *op = &ops[i];
+        switch (op->type) {
+        case ZOO_CREATE_OP:
+            err = txn_create(srv, &txn, session, op->u.create.path,
+                    op->u.create.data.buff, op->u.create.data.len,
+                    op->u.create.flags, &created[i]);
+            break;
+        case ZOO_DELETE_OP:
+            err = txn_delete(srv, &txn, op->u.del.path, op->u.del.version);
+            break;
+        case ZOO_SETDATA_OP:
+            err = txn_set_data(srv, &txn, op->u.set.path, op->u.set.data.buff,
+                    op->u.set.data.len, op->u.set.version, &stats[i]);
+            break;
+        case ZOO_CHECK_OP:
+            err = txn_check(srv, op->u.check.path, op->u.check.version);
+            break;
+        }
+        if (err != ZOK)
+            failed = i;
+    }
+    if (failed < 0)
+        txn_commit(srv, &txn);
+    else
+        txn_rollback(srv, &txn);
+
+    for (i = 0; i < count; i++) {
+        if (failed >= 0) {
+            struct ErrorResponse er;
+            er.err = i < failed ? ZOK : i == failed ? err : ZRUNTIMEINCONSISTENCY;
+            mh.type = ERROR_OP;
+            mh.done = 0;
+            mh.err = er.err;
+            serialize_MultiHeader(oa, "multiheader", &mh);
+            serialize_ErrorResponse(oa, "error", &er);
+        } else {
+            mh.type = ops[i].type;
+            mh.done = 0;
+            mh.err = 0;
+            serialize_MultiHeader(oa, "multiheader", &mh);
+            if (ops[i].type == ZOO_CREATE_OP) {
+                struct CreateResponse res;
+                res.path = created[i];
+                serialize_CreateResponse(oa, "reply", &res);
+            } else if (ops[i].type == ZOO_SETDATA_OP) {
+                struct SetDataResponse res;
+                res.stat = stats[i];
+                serialize_SetDataResponse(oa, "reply", &res);
+            }
+        }
+        free(created[i]);
+        deallocate_op(&ops[i]);
+    }
+    mh.type = ERROR_OP;
+    mh.done = 1;
+    mh.err = -1;
+    serialize_MultiHeader(oa, "multiheader", &mh);
+
+    free(created);
+    free(stats);
+    free(ops);
+    /* the reply header of a multi is ZOK, the results carry the errors */
+    return ZOK;
+}
+
+static int do_set_watches(zk_server_t *srv, struct zks_conn *conn,
+        struct iarchive *ia)
+{
+    struct SetWatches req;
+    int64_t id = conn->session->id;
+    int32_t i;
+
+    if (deserialize_SetWatches(ia, "req", &req) < 0)
+        return ZMARSHALLINGERROR;
+
+    /* changes made while the client was away fire right away */
+    for (i = 0; i < req.dataWatches.count; i++) {
+        const char *path = req.dataWatches.data[i];
+        struct zks_node *node = find_node(srv, path);
+        if (!node)
+            send_event(conn, DELETED_EVENT, path);
+        else if (node->stat.mzxid > req.relativeZxid)
+            send_event(conn, CHANGED_EVENT, path);
+        else
+            add_watch(srv->data_watches, path, id);
+    }
+    for (i = 0; i < req.existWatches.count; i++) {
+        const char *path = req.existWatches.data[i];
+        if (find_node(srv, path))
+            send_event(conn, CREATED_EVENT, path);
+        else
+            add_watch(srv->data_watches, path, id);
+    }
+    for (i = 0; i < req.childWatches.count; i++) {
+        const char *path = req.childWatches.data[i];
+        struct zks_node *node = find_node(srv, path);
+        if (!node)
+            send_event(conn, DELETED_EVENT, path);
+        else if (node->stat.pzxid > req.relativeZxid)
+            send_event(conn, CHILD_EVENT, path);
+        else
+            add_watch(srv->child_watches, path, id);
+    }
+    deallocate_SetWatches(&req);
+    return ZOK;
+}
+
+static void handle_request(zk_server_t *srv, struct zks_conn *conn,
+        char *buf, int len)
+{
+    struct iarchive *ia = create_buffer_iarchive(buf, len);
+    struct oarchive *body = create_buffer_oarchive();
+    struct oarchive *hdr;
+    struct zks_session *session = conn->session;
+    struct RequestHeader h;
+    struct ReplyHeader rh;
+    int closing = 0;
+
+    if (deserialize_RequestHeader(ia, "hdr", &h) < 0) {
+        conn->dead = 1;
+        close_buffer_iarchive(&ia);
+        close_buffer_oarchive(&body, 1);
+        return;
+    }
+
+    rh.xid = h.xid;
+    rh.err = ZOK;
+    if (srv->read_only && is_write(h.type)) {
+        rh.err = ZNOTREADONLY;
+    } else {
+        switch (h.type) {
+        case ZOO_PING_OP:
+            break;
+        case ZOO_SETAUTH_OP: {
+            struct AuthPacket auth;
+            if (deserialize_AuthPacket(ia, "auth", &auth) == 0)
+                deallocate_AuthPacket(&auth);
+            break;
+        }
+        case ZOO_SETWATCHES_OP:
+            rh.err = do_set_watches(srv, conn, ia);
+            break;
+        case ZOO_CLOSE_OP:
+            closing = 1;
+            break;
+        case ZOO_CREATE_OP:
+            rh.err = do_create(srv, session, ia, body);
+            break;
+        case ZOO_DELETE_OP:
+            rh.err = do_delete(srv, ia);
+            break;
+        case ZOO_EXISTS_OP:
+            rh.err = do_exists(srv, session, ia, body);
+            break;
+        case ZOO_GETDATA_OP:
+            rh.err = do_get_data(srv, session, ia, body);
+            break;
+        case ZOO_SETDATA_OP:
+            rh.err = do_set_data(srv, ia, body);
+            break;
+        case ZOO_GETACL_OP:
+            rh.err = do_get_acl(srv, ia, body);
+            break;
+        case ZOO_SETACL_OP:
+            rh.err = do_set_acl(srv, ia, body);
+            break;
+        case ZOO_GETCHILDREN_OP:
+            rh.err = do_get_children(srv, session, ia, body, 0);
+            break;
+        case ZOO_GETCHILDREN2_OP:
+            rh.err = do_get_children(srv, session, ia, body, 1);
+            break;
+        case ZOO_SYNC_OP:
+            rh.err = do_sync(ia, body);
+            break;
+        case ZOO_MULTI_OP:
+            rh.err = do_multi(srv, session, ia, body);
+            break;
+        default:
+            rh.err = ZUNIMPLEMENTED;
+            break;
+        }
+    }
+    rh.zxid = srv->zxid;
+
+    hdr = create_buffer_oarchive();
+    serialize_ReplyHeader(hdr, "hdr", &rh);
+    queue_frame(conn, hdr, rh.err == ZOK ? body : 0, 0, 0);
+    close_buffer_oarchive(&hdr, 1);
+    close_buffer_oarchive(&body, 1);
+    close_buffer_iarchive(&ia);
+
+    if (closing) {
+        close_session(srv, session);
+        conn->close_after_flush = 1;
+    }
+}
+
+static void handle_connect(zk_server_t *srv, struct zks_conn *conn,
+        char *buf, int len)
+{
+    struct iarchive *ia = create_buffer_iarchive(buf, len);
+    struct oarchive *oa;
+    struct ConnectRequest req;
+    struct ConnectResponse res;
+    struct zks_session *session = 0;
+    char read_only = 0;
+    int has_read_only;
+    int rc;
+
+    rc = deserialize_ConnectRequest(ia, "connect", &req);
+    close_buffer_iarchive(&ia);
+    if (rc < 0) {
+        conn->dead = 1;
+        return;
+    }
+
+    /* newer clients append a byte saying whether they accept a read-only server */
+    has_read_only = len > 28 + (req.passwd.len > 0 ? req.passwd.len : 0);
+    if (has_read_only)
+        read_only = buf[len - 1];
+    if (srv->read_only && !read_only) {
+        deallocate_ConnectRequest(&req);
+        conn->dead = 1;
+        return;
+    }
+
+    if (req.sessionId != 0) {
+        session = hashtable_search(srv->sessions, &req.sessionId);
+        if (session && (req.passwd.len != PASSWD_LEN
+                    || memcmp(req.passwd.buff, session->passwd, PASSWD_LEN) != 0))
+            session = 0;
+    } else {
+        int64_t *key = malloc(sizeof(*key));
+        int i;
+        session = calloc(1, sizeof(*session));
+        session->id = srv->next_session++;
+        for (i = 0; i < PASSWD_LEN; i++)
+            session->passwd[i] = (char)rand();
+        session->timeout = req.timeOut;
+        if (session->timeout < MIN_SESSION_TIMEOUT)
+            session->timeout = MIN_SESSION_TIMEOUT;
+        if (session->timeout > MAX_SESSION_TIMEOUT)
+            session->timeout = MAX_SESSION_TIMEOUT;
+        *key = session->id;
+        hashtable_insert(srv->sessions, key, session);
+    }
+    deallocate_ConnectRequest(&req);
+
+    res.protocolVersion = 0;
+    if (session) {
+        if (session->conn && session->conn != conn) {
+            session->conn->session = 0;
+            session->conn->dead = 1;
+            drop_watches(srv, session->id);
+        }
+        session->conn = conn;
+        session->last_seen = now_ms();
+        conn->session = session;
+        res.timeOut = session->timeout;
+        res.sessionId = session->id;
+        res.passwd.len = PASSWD_LEN;
+        res.passwd.buff = session->passwd;
+    } else {
+        /* an unknown or expired session gets a zero timeout and is dropped */
+        static char zeros[PASSWD_LEN];
+        res.timeOut = 0;
+        res.sessionId = 0;
+        res.passwd.len = PASSWD_LEN;
+        res.passwd.buff = zeros;
+        conn->close_after_flush = 1;
+    }
+
+    oa = create_buffer_oarchive();
+    serialize_ConnectResponse(oa, "connect", &res);
+    read_only = srv->read_only;
+    queue_frame(conn, oa, 0, &read_only, has_read_only ? 1 : 0);
+    close_buffer_oarchive(&oa, 1);
+}
+
+/* ---------------------------------------------------------------------- */
+/* the event loop                                                          */
+/* ---------------------------------------------------------------------- */
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void accept_connections(zk_server_t *srv)
+{
+    for (;;) {
+        struct zks_conn *conn;
+        int on = 1;
+        int fd = accept(srv->listen_fd, 0, 0);
+        if (fd < 0)
+            return;
+        set_nonblocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        conn = calloc(1, sizeof(*conn));
+        conn->fd = fd;
+        conn->next = srv->conns;
+        srv->conns = conn;
+    }
+}
+
+static void flush_connection(struct zks_conn *conn)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (conn->outpos < conn->outlen) {
+        ssize_t rc = send(conn->fd, conn->out + conn->outpos,
+                conn->outlen - conn->outpos, flags);
+        if (rc > 0) {
+            conn->outpos += (int)rc;
+        } else if (rc < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                conn->dead = 1;
+            return;
+        }
+    }
+}
+
+static void read_connection(zk_server_t *srv, struct zks_conn *conn)
+{
+    int closed = 0;
+    int off = 0;
+
+    for (;;) {
+        ssize_t rc;
+        if (conn->incap - conn->inlen < READ_CHUNK) {
+            conn->incap = conn->inlen + READ_CHUNK;
+            conn->in = realloc(conn->in, conn->incap);
+        }
+        rc = recv(conn->fd, conn->in + conn->inlen, conn->incap - conn->inlen, 0);
+        if (rc > 0) {
+            conn->inlen += (int)rc;
+        } else if (rc < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                closed = 1;
+            break;
+        }
+    }
+
+    while (!conn->dead && !conn->close_after_flush && conn->inlen - off >= 4) {
+        int32_t len;
+        memcpy(&len, conn->in + off, 4);
+        len = ntohl(len);
+        if (len < 0 || len > MAX_BUFFER) {
+            conn->dead = 1;
+            break;
+        }
+        if (conn->inlen - off - 4 < len)
+            break;
+        if (conn->session) {
+            conn->session->last_seen = now_ms();
+            handle_request(srv, conn, conn->in + off + 4, len);
+        } else {
+            handle_connect(srv, conn, conn->in + off + 4, len);
+        }
+        off += 4 + len;
+    }
+    if (off > 0) {
+        memmove(conn->in, conn->in + off, conn->inlen - off);
+        conn->inlen -= off;
+    }
+    /* the frames that came in before the peer closed, like a close request, still count */
+    if (closed)
+        conn->dead = 1;
+    else if (!conn->dead)
+        flush_connection(conn);
+}
+
+static void free_connection(zk_server_t *srv, struct zks_conn *conn)
+{
+    if (conn->session) {
+        conn->session->conn = 0;
+        drop_watches(srv, conn->session->id);
+    }
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void reap_connections(zk_server_t *srv)
+{
+    struct zks_conn **link = &srv->conns;
+    while (*link) {
+        struct zks_conn *conn = *link;
+        if (conn->dead || (conn->close_after_flush && conn->outpos == conn->outlen)) {
+            *link = conn->next;
+            free_connection(srv, conn);
+        } else {
+            link = &conn->next;
+        }
+    }
+}
+
+int zk_server_run(zk_server_t *srv)
+{
+    struct pollfd *fds = 0;
+    struct zks_conn **conns = 0;
+    int capacity = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->running = 1;
+    while (!srv->stopping) {
+        struct zks_conn *conn;
+        int count = 2;
+        int timeout;
+        int i;
+
+        reap_connections(srv);
+        for (conn = srv->conns; conn; conn = conn->next)
+            count++;
+        if (count > capacity) {
+            capacity = count * 2;
+            fds = realloc(fds, capacity * sizeof(*fds));
+            conns = realloc(conns, capacity * sizeof(*conns));
+        }
+
+        fds[0].fd = srv->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = srv->wake_fds[0];
+        fds[1].events = POLLIN;
+        for (i = 2, conn = srv->conns; conn; conn = conn->next, i++) {
+            conns[i] = conn;
+            fds[i].fd = conn->fd;
+            fds[i].events = POLLIN;
+            if (conn->outpos < conn->outlen)
+                fds[i].events |= POLLOUT;
+        }
+        for (i = 0; i < count; i++)
+            fds[i].revents = 0;
+        timeout = next_expiry(srv);
+
+        pthread_mutex_unlock(&srv->lock);
+        if (poll(fds, count, timeout) < 0 && errno != EINTR) {
+            rc = errno;
+            pthread_mutex_lock(&srv->lock);
+            break;
+        }
+        pthread_mutex_lock(&srv->lock);
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(srv->wake_fds[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (fds[0].revents & POLLIN)
+            accept_connections(srv);
+        for (i = 2; i < count; i++) {
+            conn = conns[i];
+            if (conn->dead)
+                continue;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                read_connection(srv, conn);
+            if (!conn->dead && (fds[i].revents & POLLOUT))
+                flush_connection(conn);
+            if (fds[i].revents & POLLNVAL)
+                conn->dead = 1;
+        }
+        expire_sessions(srv);
+    }
+    srv->running = 0;
+    pthread_mutex_unlock(&srv->lock);
+
+    free(fds);
+    free(conns);
+    return rc;
+}
+
+static void *server_thread(void *arg)
+{
+    zk_server_run((zk_server_t *)arg);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* the public api                                                          */
+/* ---------------------------------------------------------------------- */
+
+zk_server_t *zk_server_create(const char *host, int port)
+{
+    zk_server_t *srv;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int on = 1;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host ? host : "127.0.0.1", &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(fd, 128) < 0
+            || getsockname(fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return 0;
+    }
+    set_nonblocking(fd);
+
+    srv = calloc(1, sizeof(*srv));
+    srv->listen_fd = fd;
+    srv->port = ntohs(addr.sin_port);
+    if (pipe(srv->wake_fds) < 0) {
+        int err = errno;
+        close(fd);
+        free(srv);
+        errno = err;
+        return 0;
+    }
+    set_nonblocking(srv->wake_fds[0]);
+    set_nonblocking(srv->wake_fds[1]);
+    pthread_mutex_init(&srv->lock, 0);
+
+    /* like the real server, the session ids start from the startup time */
+    srv->next_session = (now_ms() & 0xffffffffffLL) << 16;
+    srv->nodes = create_hashtable(1024, string_hash, string_equal);
+    srv->data_watches = create_hashtable(256, string_hash, string_equal);
+    srv->child_watches = create_hashtable(256, string_hash, string_equal);
+    srv->sessions = create_hashtable(64, id_hash, id_equal);
+
+    srv->root = new_node("/", 0, -1);
+    hashtable_insert(srv->nodes, strdup("/"), srv->root);
+    link_node(srv, srv->root, new_node("/zookeeper", 0, -1));
+    srv->root->stat.cversion = 1;
+    sync_child_stat(srv->root);
+    return srv;
+}
+
+int zk_server_port(zk_server_t *srv)
+{
+    return srv->port;
+}
+
+int zk_server_start(zk_server_t *srv)
+{
+    int rc;
+    pthread_mutex_lock(&srv->lock);
+    if (srv->has_thread) {
+        pthread_mutex_unlock(&srv->lock);
+        return EBUSY;
+    }
+    srv->stopping = 0;
+    rc = pthread_create(&srv->thread, 0, server_thread, srv);
+    if (rc == 0)
+        srv->has_thread = 1;
+    pthread_mutex_unlock(&srv->lock);
+    return rc;
+}
+
+void zk_server_stop(zk_server_t *srv)
+{
+    int join;
+    pthread_mutex_lock(&srv->lock);
+    srv->stopping = 1;
+    join = srv->has_thread;
+    srv->has_thread = 0;
+    pthread_mutex_unlock(&srv->lock);
+    wake_loop(srv);
+    if (join)
+        pthread_join(srv->thread, 0);
+}
+
+static void free_tree(struct zks_node *node)
+{
+    int32_t i;
+    for (i = 0; i < node->nchildren; i++)
+        free_tree(node->children[i]);
+    free_node(node);
+}
+
+static void free_watch_table(struct hashtable *table)
+{
+    struct hashtable_itr *it;
+    if (hashtable_count(table) > 0) {
+        it = hashtable_iterator(table);
+        do {
+            struct zks_watchers *w = hashtable_iterator_value(it);
+            free(w->ids);
+        } while (hashtable_iterator_advance(it));
+        free(it);
+    }
+    hashtable_destroy(table, 1);
+}
+
+void zk_server_destroy(zk_server_t *srv)
+{
+    if (!srv)
+        return;
+    zk_server_stop(srv);
+
+    while (srv->conns) {
+        struct zks_conn *conn = srv->conns;
+        srv->conns = conn->next;
+        conn->session = 0;
+        free_connection(srv, conn);
+    }
+    hashtable_destroy(srv->sessions, 1);
+    free_watch_table(srv->data_watches);
+    free_watch_table(srv->child_watches);
+    hashtable_destroy(srv->nodes, 0);
+    free_tree(srv->root);
+
+    close(srv->listen_fd);
+    close(srv->wake_fds[0]);
+    close(srv->wake_fds[1]);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+}
+
+void zk_server_set_read_only(zk_server_t *srv, int read_only)
+{
+    pthread_mutex_lock(&srv->lock);
+    srv->read_only = read_only;
+    pthread_mutex_unlock(&srv->lock);
+}
+
+int zk_server_expire_session(zk_server_t *srv, int64_t session_id)
+{
+    struct zks_session *session;
+    pthread_mutex_lock(&srv->lock);
+    session = hashtable_search(srv->sessions, &session_id);
+    if (session) {
+        if (session->conn)
+            session->conn->dead = 1;
+        close_session(srv, session);
+    }
+    pthread_mutex_unlock(&srv->lock);
+    wake_loop(srv);
+    return session ? 0 : -1;
+}
+
+void zk_server_drop_connections(zk_server_t *srv)
+{
+    struct zks_conn *conn;
+    pthread_mutex_lock(&srv->lock);
+    for (conn = srv->conns; conn; conn = conn->next)
+        conn->dead = 1;
+    pthread_mutex_unlock(&srv->lock);
+    wake_loop(srv);
+}
+
+int zk_server_session_count(zk_server_t *srv)
+{
+    int count;
+    pthread_mutex_lock(&srv->lock);
+    count = (int)hashtable_count(srv->sessions);
+    pthread_mutex_unlock(&srv->lock);
+    return count;
+}
+
+int zk_server_node_count(zk_server_t *srv)
+{
+    int count;
+    pthread_mutex_lock(&srv->lock);
+    count = (int)hashtable_count(srv->nodes);
+    pthread_mutex_unlock(&srv->lock);
+    return count;
+}
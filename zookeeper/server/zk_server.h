@@ -0,0 +1,126 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_SERVER_H_
+#define ZK_SERVER_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \file zk_server.h
+ * \brief a single process stand-in for a ZooKeeper server.
+ *
+ * The stand-in speaks the client wire protocol and keeps the whole data
+ * tree in memory: node versions, sequential and ephemeral nodes, one-shot
+ * watches, sessions with expiry, and atomic multi. It is meant for tests
+ * and benchmarks that need a server without a JVM or an ensemble, so it
+ * does not enforce ACLs or authentication and does not persist anything.
+ *
+ * The server either runs its event loop on a thread of its own, see
+ * \ref zk_server_start, or on the calling thread, see \ref zk_server_run.
+ * All the other calls may be made from any thread.
+ */
+
+typedef struct _zk_server zk_server_t;
+
+/**
+ * \brief creates a server listening on the given address.
+ *
+ * \param host the address to listen on, 0 means 127.0.0.1
+ * \param port the TCP port to listen on, 0 picks a free one, see
+ * \ref zk_server_port
+ * \return the server, or 0 if the port could not be bound (errno is set)
+ */
+zk_server_t *zk_server_create(const char *host, int port);
+
+/**
+ * \brief returns the TCP port the server listens on.
+ */
+int zk_server_port(zk_server_t *srv);
+
+/**
+ * \brief runs the event loop on a new thread.
+ *
+ * \return 0 on success, or an errno value if the thread could not be started
+ */
+int zk_server_start(zk_server_t *srv);
+
+/**
+ * \brief runs the event loop on the calling thread until \ref zk_server_stop
+ * is called.
+ *
+ * \return 0 when stopped, or an errno value if the loop failed
+ */
+int zk_server_run(zk_server_t *srv);
+
+/**
+ * \brief stops the event loop and waits for the thread started by
+ * \ref zk_server_start to exit. Sessions and data are kept, the loop may be
+ * started again.
+ */
+void zk_server_stop(zk_server_t *srv);
+
+/**
+ * \brief stops the server if needed and frees it with all its data.
+ */
+void zk_server_destroy(zk_server_t *srv);
+
+/**
+ * \brief switches the server in and out of read-only mode.
+ *
+ * In read-only mode the server refuses clients that did not ask for a
+ * read-only session and fails every write with ZNOTREADONLY, like a
+ * server that lost contact with the quorum.
+ */
+void zk_server_set_read_only(zk_server_t *srv, int read_only);
+
+/**
+ * \brief expires a session as if its timeout had elapsed.
+ *
+ * The ephemeral nodes of the session are deleted, its watches are dropped
+ * and its connection, if any, is closed.
+ *
+ * \return 0 on success, or -1 if there is no such session
+ */
+int zk_server_expire_session(zk_server_t *srv, int64_t session_id);
+
+/**
+ * \brief closes every client connection but keeps the sessions, so the
+ * clients reconnect and resume them.
+ */
+void zk_server_drop_connections(zk_server_t *srv);
+
+/**
+ * \brief returns the number of live sessions.
+ */
+int zk_server_session_count(zk_server_t *srv);
+
+/**
+ * \brief returns the number of nodes in the tree, including the root.
+ */
+int zk_server_node_count(zk_server_t *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZK_SERVER_H_ */
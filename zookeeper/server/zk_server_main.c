@@ -0,0 +1,85 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zk_server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s [-h host] [-p port] [-r]\n"
+            "  -h host  the address to listen on, default 127.0.0.1\n"
+            "  -p port  the port to listen on, default 2181, 0 picks a free one\n"
+            "  -r       start in read-only mode\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = 0;
+    int port = 2181;
+    int read_only = 0;
+    zk_server_t *srv;
+    sigset_t signals;
+    int sig;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            read_only = 1;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    /* the loop thread inherits the mask, so only sigwait sees the signals */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+    srv = zk_server_create(host, port);
+    if (!srv) {
+        fprintf(stderr, "Cannot listen on %s:%d: %s\n", host ? host : "127.0.0.1",
+                port, strerror(errno));
+        return 1;
+    }
+    zk_server_set_read_only(srv, read_only);
+    if (zk_server_start(srv) != 0) {
+        fprintf(stderr, "Cannot start the server thread\n");
+        zk_server_destroy(srv);
+        return 1;
+    }
+
+    printf("Listening on %s:%d\n", host ? host : "127.0.0.1", zk_server_port(srv));
+    fflush(stdout);
+
+    sigwait(&signals, &sig);
+    zk_server_destroy(srv);
+    return 0;
+}
@@ -16,170 +16,188 @@
  * limitations under the License.
  */
 
+/*
+ * A load generator for comparing client changes.
+ *
+ * N sessions are shared by M threads, which issue asynchronous requests
+ * picked from a weighted op mix against a fixed set of keys. In the closed
+ * loop mode every thread keeps a fixed number of requests outstanding; in
+ * the open loop mode the threads issue requests at a fixed overall rate
+ * and the latency is measured from the time each request was due, so a
+ * stalled server shows up in the percentiles instead of hiding behind a
+ * lower request rate. Requests issued during the warm-up are not counted.
+ */
+
 #include <zookeeper.h>
 #include "zookeeper_log.h"
+#include "zk_histogram.h"
 #include <errno.h>
 #ifndef WIN32
-#ifdef THREADED 
+#ifdef THREADED
 #include <pthread.h>
 #endif
+#include <time.h>
+#include <unistd.h>
 #else
 #include "win32port.h"
 #endif
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
-static zhandle_t *zh;
+#define OP_GET 0
+#define OP_SET 1
+#define OP_EXISTS 2
+#define OP_CHILDREN 3
+#define OP_CREATE 4
+#define OP_DELETE 5
+#define OP_COUNT 6
 
-static int shutdownThisThing=0;
+static const char *opNames[OP_COUNT] = {
+    "get", "set", "exists", "children", "create", "delete"
+};
 
-// *****************************************************************************
-//
-static pthread_cond_t cond=PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+/* the open loop never lets a thread have more requests than this in flight */
+#define MAX_OPEN_LOOP_OUTSTANDING 10000
 
-static pthread_cond_t counterCond=PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t counterLock=PTHREAD_MUTEX_INITIALIZER;
-static int counter; 
+static struct {
+    const char *hosts;
+    const char *root;
+    int sessions;
+    int threads;
+    int keys;
+    int valueMin;
+    int valueMax;
+    int warmup;   /* seconds */
+    int duration; /* seconds */
+    int depth;    /* outstanding requests per thread in the closed loop */
+    double rate;  /* requests per second over all threads, 0 for a closed loop */
+    int mix[OP_COUNT];
+    int mixTotal;
+    const char *jsonPath;
+} cfg;
 
+typedef struct session {
+    zhandle_t *zh;
+    /* only the completion thread of the session touches these */
+    zk_histogram_t latency[OP_COUNT];
+    int64_t errors[OP_COUNT];
+} session_t;
 
+typedef struct worker {
+    int id;
+    session_t *session;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int outstanding;
+    unsigned int seed;
+    int64_t nextCreate; /* the index of the next node this worker creates */
+    int64_t created;    /* the nodes created so far, they complete in order */
+    int64_t deleted;
+} worker_t;
 
-void ensureConnected(){
-    pthread_mutex_lock(&lock);
-    while (zoo_state(zh)!=ZOO_CONNECTED_STATE) {
-        pthread_cond_wait(&cond,&lock);
-    }
-    pthread_mutex_unlock(&lock);
+typedef struct request {
+    worker_t *worker;
+    int op;
+    int64_t start; /* us */
+} request_t;
+
+static session_t *sessions;
+static worker_t *workers;
+static char *valueBuffer;
+static int64_t runId;
+static int64_t measureStart; /* us, the end of the warm-up */
+static int64_t measureEnd;   /* us */
+
+static int64_t nowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+static void sleepUs(int64_t us)
+{
+    struct timespec ts;
+    if (us <= 0)
+        return;
+    ts.tv_sec = (time_t)(us / 1000000);
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+    nanosleep(&ts, 0);
+}
+
+/* xorshift, so every thread has its own cheap random sequence */
+static unsigned int nextRandom(worker_t *w)
+{
+    unsigned int x = w->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return w->seed = x;
+}
+
+// *****************************************************************************
+// the original create/clean helpers, used to set up and tear down the keys
+
+static pthread_cond_t counterCond=PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t counterLock=PTHREAD_MUTEX_INITIALIZER;
+static int counter;
+
 void incCounter(int delta){
     pthread_mutex_lock(&counterLock);
     counter+=delta;
     pthread_cond_broadcast(&counterCond);
-    pthread_mutex_unlock(&counterLock);        
-    
-}
-void setCounter(int cnt){
-    pthread_mutex_lock(&counterLock);
-    counter=cnt;
-    pthread_cond_broadcast(&counterCond);
-    pthread_mutex_unlock(&counterLock);        
-    
+    pthread_mutex_unlock(&counterLock);
 }
+
 void waitCounter(){
     pthread_mutex_lock(&counterLock);
     while (counter>0) {
         pthread_cond_wait(&counterCond,&counterLock);
     }
-    pthread_mutex_unlock(&counterLock);    
+    pthread_mutex_unlock(&counterLock);
 }
 
 void listener(zhandle_t *zzh, int type, int state, const char *path,void* ctx) {
-    if(type == ZOO_SESSION_EVENT){
-        if(state == ZOO_CONNECTED_STATE){
-            pthread_mutex_lock(&lock);
-            pthread_cond_broadcast(&cond);
-            pthread_mutex_unlock(&lock);
-        }
-        setCounter(0);
+    if(type == ZOO_SESSION_EVENT && state == ZOO_EXPIRED_SESSION_STATE){
+        LOG_ERROR(("Session expired, the results are not valid"));
     }
 }
 
+int ensureConnected(zhandle_t *zh){
+    int i;
+    for (i = 0; i < 3000 && zoo_state(zh) != ZOO_CONNECTED_STATE; i++)
+        sleepUs(10000);
+    return zoo_state(zh) == ZOO_CONNECTED_STATE;
+}
+
 void create_completion(int rc, const char *name, const void *data) {
     incCounter(-1);
-    if(rc!=ZOK){
+    if(rc!=ZOK && rc!=ZNODEEXISTS){
         LOG_ERROR(("Failed to create a node rc=%d",rc));
     }
 }
 
-int doCreateNodes(const char* root, int count){
+int doCreateNodes(zhandle_t *zh, const char* root, int count){
     char nodeName[1024];
     int i;
     for(i=0; i<count;i++){
         int rc = 0;
-        snprintf(nodeName, sizeof(nodeName),"%s/%d",root,i);
+        snprintf(nodeName, sizeof(nodeName),"%s/k%d",root,i);
         incCounter(1);
-        rc=zoo_acreate(zh, nodeName, "first", 5, &ZOO_OPEN_ACL_UNSAFE, 0,
+        rc=zoo_acreate(zh, nodeName, valueBuffer, cfg.valueMin, &ZOO_OPEN_ACL_UNSAFE, 0,
                             create_completion, 0);
-        if(i%1000==0){
-            LOG_INFO(("Created %s",nodeName));
+        if(rc!=ZOK){
+            incCounter(-1);
+            return rc;
         }
-        if(rc!=ZOK) return rc;        
-    }
-    return ZOK;
-}
-
-int createRoot(const char* root){
-    char realpath[1024];
-    return zoo_create(zh,root,"root",4,&ZOO_OPEN_ACL_UNSAFE,0,realpath,sizeof(realpath)-1);
-}
-
-void write_completion(int rc, const struct Stat *stat, const void *data) {
-    incCounter(-1);
-    if(rc!=ZOK){
-        LOG_ERROR(("Failed to write a node rc=%d",rc));
-    }
-}
-
-int doWrites(const char* root, int count){
-    char nodeName[1024];
-    int i;
-    counter=0;
-    for(i=0; i<count;i++){
-        int rc = 0;
-        snprintf(nodeName, sizeof(nodeName),"%s/%d",root,i);
-        incCounter(1);
-        rc=zoo_aset(zh, nodeName, "second", 6,-1,write_completion, 0);
-        if(rc!=ZOK) return rc;        
-    }
-    return ZOK;
-}
-
-void read_completion(int rc, const char *value, int value_len,
-        const struct Stat *stat, const void *data) {
-    incCounter(-1);    
-    if(rc!=ZOK){
-        LOG_ERROR(("Failed to read a node rc=%d",rc));
-        return;
-    }
-    if(memcmp(value,"second",6)!=0){
-        char buf[value_len+1];
-        memcpy(buf,value,value_len);buf[value_len]=0;
-        LOG_ERROR(("Invalid read, expected [second], received [%s]\n",buf));
-        exit(1);
-    }
-}
-
-int doReads(const char* root, int count){
-    char nodeName[1024];
-    int i;
-    counter=0;
-    for(i=0; i<count;i++){
-        int rc = 0;
-        snprintf(nodeName, sizeof(nodeName),"%s/%d",root,i);
-        incCounter(1);
-        rc=zoo_aget(zh, nodeName,0,read_completion, 0);
-        if(rc!=ZOK) return rc;        
     }
     return ZOK;
 }
 
 void delete_completion(int rc, const void *data) {
-    incCounter(-1);    
-}
-
-int doDeletes(const char* root, int count){
-    char nodeName[1024];
-    int i;
-    counter=0;
-    for(i=0; i<count;i++){
-        int rc = 0;
-        snprintf(nodeName, sizeof(nodeName),"%s/%d",root,i);
-        incCounter(1);
-        rc=zoo_adelete(zh, nodeName,-1,delete_completion, 0);
-        if(rc!=ZOK) return rc;        
-    }
-    return ZOK;
+    incCounter(-1);
 }
 
 static int free_String_vector(struct String_vector *v) {
@@ -196,7 +214,7 @@ static int free_String_vector(struct String_vector *v) {
 
 static int deletedCounter;
 
-int recursiveDelete(const char* root){
+int recursiveDelete(zhandle_t *zh, const char* root){
     struct String_vector children;
     int i;
     int rc=zoo_get_children(zh,root,0,&children);
@@ -209,7 +227,7 @@ int recursiveDelete(const char* root){
             int rc = 0;
             char nodeName[2048];
             snprintf(nodeName, sizeof(nodeName),"%s/%s",root,children.data[i]);
-            rc=recursiveDelete(nodeName);
+            rc=recursiveDelete(zh,nodeName);
             if(rc!=ZOK){
                 free_String_vector(&children);
                 return rc;
@@ -227,60 +245,468 @@ int recursiveDelete(const char* root){
     return rc;
 }
 
+// *****************************************************************************
+// the measured requests
+
+static void finishRequest(request_t *req, int rc)
+{
+    worker_t *w = req->worker;
+    session_t *s = w->session;
+    int ok = rc == ZOK || (rc == ZNONODE && req->op == OP_EXISTS);
+
+    if (req->start >= measureStart && req->start < measureEnd) {
+        if (ok)
+            zk_histogram_record(&s->latency[req->op], nowUs() - req->start);
+        else
+            s->errors[req->op]++;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (req->op == OP_CREATE && rc == ZOK)
+        w->created++;
+    w->outstanding--;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    free(req);
+}
+
+static void dataCompletion(int rc, const char *value, int value_len,
+        const struct Stat *stat, const void *data)
+{
+    finishRequest((request_t *)data, rc);
+}
+
+static void statCompletion(int rc, const struct Stat *stat, const void *data)
+{
+    finishRequest((request_t *)data, rc);
+}
+
+static void stringsCompletion(int rc, const struct String_vector *strings,
+        const void *data)
+{
+    finishRequest((request_t *)data, rc);
+}
+
+static void stringCompletion(int rc, const char *name, const void *data)
+{
+    finishRequest((request_t *)data, rc);
+}
+
+static void voidCompletion(int rc, const void *data)
+{
+    finishRequest((request_t *)data, rc);
+}
+
+static int pickOp(worker_t *w)
+{
+    int r = (int)(nextRandom(w) % (unsigned int)cfg.mixTotal);
+    int op;
+    for (op = 0; op < OP_COUNT; op++) {
+        if (r < cfg.mix[op])
+            return op;
+        r -= cfg.mix[op];
+    }
+    return OP_GET;
+}
+
+static int pickValueSize(worker_t *w)
+{
+    if (cfg.valueMax == cfg.valueMin)
+        return cfg.valueMin;
+    return cfg.valueMin + (int)(nextRandom(w) % (unsigned int)(cfg.valueMax - cfg.valueMin + 1));
+}
+
+static void issueRequest(worker_t *w, int op, int64_t start)
+{
+    zhandle_t *zh = w->session->zh;
+    request_t *req = malloc(sizeof(*req));
+    char path[1024];
+    int rc = ZOK;
+
+    if (op == OP_DELETE) {
+        /* only delete what this worker has created, or create instead */
+        pthread_mutex_lock(&w->lock);
+        if (w->deleted < w->created)
+            snprintf(path, sizeof(path), "%s/r%lld-w%d-%lld", cfg.root,
+                    (long long)runId, w->id, (long long)w->deleted++);
+        else
+            op = OP_CREATE;
+        pthread_mutex_unlock(&w->lock);
+    }
+    if (op == OP_CREATE) {
+        snprintf(path, sizeof(path), "%s/r%lld-w%d-%lld", cfg.root,
+                (long long)runId, w->id, (long long)w->nextCreate++);
+    } else if (op != OP_DELETE && op != OP_CHILDREN) {
+        snprintf(path, sizeof(path), "%s/k%u", cfg.root,
+                nextRandom(w) % (unsigned int)cfg.keys);
+    }
+
+    req->worker = w;
+    req->op = op;
+    req->start = start;
+
+    pthread_mutex_lock(&w->lock);
+    w->outstanding++;
+    pthread_mutex_unlock(&w->lock);
+
+    switch (op) {
+    case OP_GET:
+        rc = zoo_aget(zh, path, 0, dataCompletion, req);
+        break;
+    case OP_SET:
+        rc = zoo_aset(zh, path, valueBuffer, pickValueSize(w), -1, statCompletion, req);
+        break;
+    case OP_EXISTS:
+        rc = zoo_aexists(zh, path, 0, statCompletion, req);
+        break;
+    case OP_CHILDREN:
+        rc = zoo_aget_children(zh, cfg.root, 0, stringsCompletion, req);
+        break;
+    case OP_CREATE:
+        rc = zoo_acreate(zh, path, valueBuffer, pickValueSize(w), &ZOO_OPEN_ACL_UNSAFE,
+                0, stringCompletion, req);
+        break;
+    case OP_DELETE:
+        rc = zoo_adelete(zh, path, -1, voidCompletion, req);
+        break;
+    }
+    if (rc != ZOK)
+        finishRequest(req, rc);
+}
+
+static void *workerThread(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    /* the open loop spreads the threads evenly over the request interval */
+    double interval = cfg.rate > 0 ? 1e6 * cfg.threads / cfg.rate : 0;
+    int64_t first = measureStart - (int64_t)cfg.warmup * 1000000
+        + (int64_t)(interval * w->id / cfg.threads);
+    int64_t issued = 0;
+    int limit = cfg.rate > 0 ? MAX_OPEN_LOOP_OUTSTANDING : cfg.depth;
+
+    for (;;) {
+        int64_t start;
+
+        pthread_mutex_lock(&w->lock);
+        while (w->outstanding >= limit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        pthread_mutex_unlock(&w->lock);
+
+        if (cfg.rate > 0) {
+            start = first + (int64_t)(interval * issued);
+            if (start >= measureEnd)
+                break;
+            sleepUs(start - nowUs());
+        } else {
+            start = nowUs();
+            if (start >= measureEnd)
+                break;
+        }
+        issueRequest(w, pickOp(w), start);
+        issued++;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->outstanding > 0)
+        pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/* removes the nodes the workers created and did not delete */
+static void deleteCreatedNodes(void)
+{
+    char path[1024];
+    int i;
+    for (i = 0; i < cfg.threads; i++) {
+        worker_t *w = &workers[i];
+        for (; w->deleted < w->created; w->deleted++) {
+            snprintf(path, sizeof(path), "%s/r%lld-w%d-%lld", cfg.root,
+                    (long long)runId, w->id, (long long)w->deleted);
+            incCounter(1);
+            if (zoo_adelete(w->session->zh, path, -1, delete_completion, 0) != ZOK)
+                incCounter(-1);
+        }
+    }
+    waitCounter();
+}
+
+// *****************************************************************************
+// reporting
+
+static void printLatency(FILE *out, const zk_histogram_t *h)
+{
+    fprintf(out, "{\"min\":%lld,\"mean\":%.1f,\"p50\":%lld,\"p90\":%lld,"
+            "\"p99\":%lld,\"p999\":%lld,\"max\":%lld}",
+            (long long)h->min, zk_histogram_mean(h),
+            (long long)zk_histogram_percentile(h, 50),
+            (long long)zk_histogram_percentile(h, 90),
+            (long long)zk_histogram_percentile(h, 99),
+            (long long)zk_histogram_percentile(h, 99.9),
+            (long long)h->max);
+}
+
+static void printJson(FILE *out, zk_histogram_t *latency, int64_t *errors,
+        zk_histogram_t *total, int64_t totalErrors)
+{
+    int op;
+    int first = 1;
+
+    fprintf(out, "{\"config\":{\"hosts\":\"%s\",\"path\":\"%s\",\"sessions\":%d,"
+            "\"threads\":%d,\"keys\":%d,\"value_min\":%d,\"value_max\":%d,"
+            "\"mode\":\"%s\",\"depth\":%d,\"rate\":%.1f,\"warmup_s\":%d,"
+            "\"duration_s\":%d,\"mix\":{",
+            cfg.hosts, cfg.root, cfg.sessions, cfg.threads, cfg.keys,
+            cfg.valueMin, cfg.valueMax, cfg.rate > 0 ? "open" : "closed",
+            cfg.depth, cfg.rate, cfg.warmup, cfg.duration);
+    for (op = 0; op < OP_COUNT; op++) {
+        if (cfg.mix[op] == 0)
+            continue;
+        fprintf(out, "%s\"%s\":%d", first ? "" : ",", opNames[op], cfg.mix[op]);
+        first = 0;
+    }
+    fprintf(out, "}},\"ops\":{");
+
+    first = 1;
+    for (op = 0; op < OP_COUNT; op++) {
+        if (cfg.mix[op] == 0)
+            continue;
+        fprintf(out, "%s\"%s\":{\"count\":%lld,\"errors\":%lld,\"throughput\":%.1f,"
+                "\"latency_us\":", first ? "" : ",", opNames[op],
+                (long long)latency[op].total, (long long)errors[op],
+                (double)latency[op].total / cfg.duration);
+        printLatency(out, &latency[op]);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "},\"total\":{\"count\":%lld,\"errors\":%lld,\"throughput\":%.1f,"
+            "\"latency_us\":", (long long)total->total, (long long)totalErrors,
+            (double)total->total / cfg.duration);
+    printLatency(out, total);
+    fprintf(out, "}}\n");
+}
+
+static void report(void)
+{
+    static zk_histogram_t latency[OP_COUNT];
+    static zk_histogram_t total;
+    int64_t errors[OP_COUNT];
+    int64_t totalErrors = 0;
+    int op;
+    int i;
+
+    zk_histogram_init(&total);
+    for (op = 0; op < OP_COUNT; op++) {
+        zk_histogram_init(&latency[op]);
+        errors[op] = 0;
+        for (i = 0; i < cfg.sessions; i++) {
+            zk_histogram_merge(&latency[op], &sessions[i].latency[op]);
+            errors[op] += sessions[i].errors[op];
+        }
+        zk_histogram_merge(&total, &latency[op]);
+        totalErrors += errors[op];
+    }
+
+    printf("%-9s %10s %10s %8s %9s %8s %8s %8s %8s %8s\n", "op", "count", "ops/s",
+            "errors", "mean(us)", "p50", "p90", "p99", "p99.9", "max");
+    for (op = 0; op <= OP_COUNT; op++) {
+        zk_histogram_t *h = op < OP_COUNT ? &latency[op] : &total;
+        if (op < OP_COUNT && cfg.mix[op] == 0)
+            continue;
+        printf("%-9s %10lld %10.1f %8lld %9.1f %8lld %8lld %8lld %8lld %8lld\n",
+                op < OP_COUNT ? opNames[op] : "total", (long long)h->total,
+                (double)h->total / cfg.duration,
+                (long long)(op < OP_COUNT ? errors[op] : totalErrors),
+                zk_histogram_mean(h),
+                (long long)zk_histogram_percentile(h, 50),
+                (long long)zk_histogram_percentile(h, 90),
+                (long long)zk_histogram_percentile(h, 99),
+                (long long)zk_histogram_percentile(h, 99.9),
+                (long long)h->max);
+    }
+
+    if (cfg.jsonPath) {
+        FILE *out = strcmp(cfg.jsonPath, "-") == 0 ? stdout : fopen(cfg.jsonPath, "w");
+        if (!out) {
+            LOG_ERROR(("Cannot write %s", cfg.jsonPath));
+            return;
+        }
+        printJson(out, latency, errors, &total, totalErrors);
+        if (out != stdout)
+            fclose(out);
+    }
+}
+
+// *****************************************************************************
+// command line
+
+/* parses a mix like get:80,set:15,create:5 */
+static int parseMix(const char *spec)
+{
+    char *copy = strdup(spec);
+    char *item;
+    int op;
+
+    memset(cfg.mix, 0, sizeof(cfg.mix));
+    cfg.mixTotal = 0;
+    for (item = strtok(copy, ","); item; item = strtok(0, ",")) {
+        char *colon = strchr(item, ':');
+        if (!colon)
+            break;
+        *colon = '\0';
+        for (op = 0; op < OP_COUNT && strcmp(item, opNames[op]) != 0; op++)
+            ;
+        if (op == OP_COUNT || atoi(colon + 1) < 0)
+            break;
+        cfg.mix[op] = atoi(colon + 1);
+        cfg.mixTotal += cfg.mix[op];
+    }
+    free(copy);
+    return item == 0 && cfg.mixTotal > 0;
+}
+
 void usage(char *argv[]){
-    fprintf(stderr, "USAGE:\t%s zookeeper_host_list path #children\nor", argv[0]);
-    fprintf(stderr, "\t%s zookeeper_host_list path clean\n", argv[0]);
+    fprintf(stderr, "USAGE:\t%s [options] zookeeper_host_list path\nor", argv[0]);
+    fprintf(stderr, "\t%s zookeeper_host_list path clean\n\n", argv[0]);
+    fprintf(stderr,
+            "  -s sessions   the number of sessions, default 1\n"
+            "  -t threads    the number of threads sharing them, default 1\n"
+            "  -k keys       the number of nodes read and written, default 1000\n"
+            "  -m mix        the op weights, default get:80,set:20; ops are\n"
+            "                get, set, exists, children, create and delete\n"
+            "  -v min[-max]  the value size in bytes, default 64\n"
+            "  -w seconds    the warm-up, default 5\n"
+            "  -d seconds    the measured duration, default 30\n"
+            "  -o depth      the requests each thread keeps outstanding in the\n"
+            "                closed loop, default 1\n"
+            "  -r rate       switch to an open loop issuing this many requests\n"
+            "                per second over all threads\n"
+            "  -j file       also write the results as JSON, - for stdout\n");
     exit(0);
 }
 
 int main(int argc, char **argv) {
-    int nodeCount;
-    int cleaning=0;
-    if (argc < 4) {
-        usage(argv);
+    const char *positional[3];
+    int npositional = 0;
+    int i;
+
+    cfg.sessions = 1;
+    cfg.threads = 1;
+    cfg.keys = 1000;
+    cfg.valueMin = cfg.valueMax = 64;
+    cfg.warmup = 5;
+    cfg.duration = 30;
+    cfg.depth = 1;
+    parseMix("get:80,set:20");
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] && arg[2] == '\0' && i + 1 < argc) {
+            const char *value = argv[++i];
+            switch (arg[1]) {
+            case 's': cfg.sessions = atoi(value); break;
+            case 't': cfg.threads = atoi(value); break;
+            case 'k': cfg.keys = atoi(value); break;
+            case 'm': if (!parseMix(value)) usage(argv); break;
+            case 'v':
+                cfg.valueMin = cfg.valueMax = atoi(value);
+                if (strchr(value, '-'))
+                    cfg.valueMax = atoi(strchr(value, '-') + 1);
+                break;
+            case 'w': cfg.warmup = atoi(value); break;
+            case 'd': cfg.duration = atoi(value); break;
+            case 'o': cfg.depth = atoi(value); break;
+            case 'r': cfg.rate = atof(value); break;
+            case 'j': cfg.jsonPath = value; break;
+            default: usage(argv);
+            }
+        } else if (npositional < 3) {
+            positional[npositional++] = arg;
+        } else {
+            usage(argv);
+        }
     }
-    if(strcmp("clean",argv[3])==0){
-        cleaning=1;
+    if (npositional < 2 || cfg.sessions < 1 || cfg.threads < 1 || cfg.keys < 1
+            || cfg.valueMin < 0 || cfg.valueMax < cfg.valueMin || cfg.warmup < 0
+            || cfg.duration < 1 || cfg.depth < 1 || cfg.rate < 0) {
+        usage(argv);
     }
-    zoo_set_debug_level(ZOO_LOG_LEVEL_INFO);
-    zoo_deterministic_conn_order(1); // enable deterministic order
+    cfg.hosts = positional[0];
+    cfg.root = positional[1];
+    if (npositional == 3 && strcmp("clean", positional[2]) != 0)
+        cfg.keys = atoi(positional[2]); /* the old "path #children" form */
 
-    zh = zookeeper_init(argv[1], listener, 10000, 0, 0, 0);
-    if (!zh)
-        return errno;
+    zoo_set_debug_level(ZOO_LOG_LEVEL_WARN);
+    zoo_deterministic_conn_order(1); // enable deterministic order
 
-    LOG_INFO(("Checking server connection..."));
-    ensureConnected();
-    if(cleaning==1){
-        int rc = 0;
+    if (npositional == 3 && strcmp("clean", positional[2]) == 0) {
+        zhandle_t *zh = zookeeper_init(cfg.hosts, listener, 10000, 0, 0, 0);
+        int rc;
+        if (!zh)
+            return errno;
+        if (!ensureConnected(zh)) {
+            LOG_ERROR(("Cannot connect to %s", cfg.hosts));
+            return 1;
+        }
         deletedCounter=0;
-        rc=recursiveDelete(argv[2]);
+        rc=recursiveDelete(zh,cfg.root);
+        zookeeper_close(zh);
         if(rc==ZOK){
             LOG_INFO(("Succesfully deleted a subtree starting at %s (%d nodes)",
-                    argv[2],deletedCounter));
+                    cfg.root,deletedCounter));
             exit(0);
         }
         exit(1);
     }
-    nodeCount=atoi(argv[3]);
-    createRoot(argv[2]);
-    while(1) {
-        ensureConnected();
-        LOG_INFO(("Creating children for path %s",argv[2]));
-        doCreateNodes(argv[2],nodeCount);
-        waitCounter();
-        
-        LOG_INFO(("Starting the write cycle for path %s",argv[2]));
-        doWrites(argv[2],nodeCount);
-        waitCounter();
-        LOG_INFO(("Starting the read cycle for path %s",argv[2]));
-        doReads(argv[2],nodeCount);
-        waitCounter();
-
-        LOG_INFO(("Starting the delete cycle for path %s",argv[2]));
-        doDeletes(argv[2],nodeCount);
-        waitCounter();
+
+    valueBuffer = malloc(cfg.valueMax + 1);
+    for (i = 0; i < cfg.valueMax; i++)
+        valueBuffer[i] = 'a' + i % 26;
+    runId = (int64_t)time(0);
+
+    sessions = calloc(cfg.sessions, sizeof(*sessions));
+    for (i = 0; i < cfg.sessions; i++) {
+        sessions[i].zh = zookeeper_init(cfg.hosts, listener, 10000, 0, 0, 0);
+        if (!sessions[i].zh)
+            return errno;
+    }
+    for (i = 0; i < cfg.sessions; i++) {
+        if (!ensureConnected(sessions[i].zh)) {
+            LOG_ERROR(("Cannot connect to %s", cfg.hosts));
+            return 1;
+        }
+    }
+
+    {
+        char realpath[1024];
+        zoo_create(sessions[0].zh, cfg.root, "root", 4, &ZOO_OPEN_ACL_UNSAFE, 0,
+                realpath, sizeof(realpath)-1);
+    }
+    doCreateNodes(sessions[0].zh, cfg.root, cfg.keys);
+    waitCounter();
+
+    fprintf(stderr, "Running %d threads on %d sessions: %d s warm-up, %d s measured\n",
+            cfg.threads, cfg.sessions, cfg.warmup, cfg.duration);
+    measureStart = nowUs() + (int64_t)cfg.warmup * 1000000;
+    measureEnd = measureStart + (int64_t)cfg.duration * 1000000;
+
+    workers = calloc(cfg.threads, sizeof(*workers));
+    for (i = 0; i < cfg.threads; i++) {
+        worker_t *w = &workers[i];
+        w->id = i;
+        w->session = &sessions[i % cfg.sessions];
+        w->seed = 2463534242u + 7919u * i;
+        pthread_mutex_init(&w->lock, 0);
+        pthread_cond_init(&w->cond, 0);
+        pthread_create(&w->thread, 0, workerThread, w);
     }
-    zookeeper_close(zh);
+    for (i = 0; i < cfg.threads; i++)
+        pthread_join(workers[i].thread, 0);
+
+    report();
+
+    deleteCreatedNodes();
+    for (i = 0; i < cfg.sessions; i++)
+        zookeeper_close(sessions[i].zh);
     return 0;
 }
@@ -31,6 +31,7 @@
 #include "zookeeper_log.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <time.h>
 #include <fcntl.h>
@@ -52,6 +53,14 @@ int zoo_unlock_auth(zhandle_t *zh)
 {
     return pthread_mutex_unlock(&zh->auth_h.lock);
 }
+int zoo_lock_trace(zhandle_t *zh)
+{
+    return pthread_mutex_lock(&zh->trace_lock);
+}
+int zoo_unlock_trace(zhandle_t *zh)
+{
+    return pthread_mutex_unlock(&zh->trace_lock);
+}
 int lock_buffer_list(buffer_head_t *l)
 {
     return pthread_mutex_lock(&l->lock);
@@ -251,6 +260,7 @@ int adaptor_init(zhandle_t *zh)
     set_nonblock(adaptor_threads->self_pipe[0]);
 
     pthread_mutex_init(&zh->auth_h.lock,0);
+    pthread_mutex_init(&zh->trace_lock,0);
 
     zh->adaptor_priv = adaptor_threads;
     pthread_mutex_init(&zh->to_process.lock,0);
@@ -313,6 +323,7 @@ void adaptor_destroy(zhandle_t *zh)
     pthread_mutex_destroy(&adaptor->zh_lock);
 
     pthread_mutex_destroy(&zh->auth_h.lock);
+    pthread_mutex_destroy(&zh->trace_lock);
 
     close(adaptor->self_pipe[0]);
     close(adaptor->self_pipe[1]);
@@ -499,6 +510,24 @@ int32_t fetch_and_add(volatile int32_t* operand, int incr)
 #endif
 }
 
+void *atomic_exchange_ptr(void *volatile *ptr, void *value)
+{
+#ifndef WIN32
+    return __sync_lock_test_and_set(ptr, value);
+#else
+    return InterlockedExchangePointer(ptr, value);
+#endif
+}
+
+int atomic_cas_ptr(void *volatile *ptr, void *expected, void *value)
+{
+#ifndef WIN32
+    return __sync_bool_compare_and_swap(ptr, expected, value);
+#else
+    return InterlockedCompareExchangePointer(ptr, value, expected) == expected;
+#endif
+}
+
 // make sure the static xid is initialized before any threads started
 __attribute__((constructor)) int32_t get_xid()
 {
@@ -528,3 +557,125 @@ int leave_critical(zhandle_t* zh)
         return 0;
     }
 }
+
+/* a mutex shared by all the zhandles of the process */
+struct global_lock {
+    pthread_mutex_t mutex;
+    volatile int32_t claimed;
+    volatile int32_t ready;
+};
+
+static struct global_lock dns_lock;
+static struct global_lock connect_limiter_lock;
+
+// there is no static mutex initializer on windows
+static int lock_global(struct global_lock *l)
+{
+    if (!l->ready) {
+        if (fetch_and_add(&l->claimed, 1) == 0) {
+            pthread_mutex_init(&l->mutex, 0);
+            fetch_and_add(&l->ready, 1);
+        } else {
+            while (!l->ready) {
+#ifdef WIN32
+                Sleep(1);
+#else
+                usleep(1000);
+#endif
+            }
+        }
+    }
+    return pthread_mutex_lock(&l->mutex);
+}
+
+int lock_dns_cache(void)
+{
+    return lock_global(&dns_lock);
+}
+
+int unlock_dns_cache(void)
+{
+    return pthread_mutex_unlock(&dns_lock.mutex);
+}
+
+int lock_connect_limiter(void)
+{
+    return lock_global(&connect_limiter_lock);
+}
+
+int unlock_connect_limiter(void)
+{
+    return pthread_mutex_unlock(&connect_limiter_lock.mutex);
+}
+
+#ifdef WIN32
+unsigned __stdcall do_resolve( void * v)
+#else
+void *do_resolve(void *v)
+#endif
+{
+    resolve_job_t *job = (resolve_job_t*)v;
+    struct sockaddr_storage *addrs;
+    int count;
+    int unresolved;
+    int rc;
+
+    rc = resolve_hosts(job->hosts, 0, &addrs, &count, &unresolved);
+    if (rc == ZOK)
+        dns_cache_store(job->hosts, addrs, count);
+    lock_dns_cache();
+    job->rc = rc;
+    job->addrs = addrs;
+    job->addrs_count = count;
+    job->done = 1;
+    unlock_dns_cache();
+    release_resolve_job(job);
+    return 0;
+}
+
+resolve_job_t *start_resolve_job(const char *hosts)
+{
+    pthread_t resolver;
+    resolve_job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+        return 0;
+    job->hosts = strdup(hosts);
+    if (!job->hosts) {
+        free(job);
+        return 0;
+    }
+    // one reference for the zhandle and one for the resolver, which may
+    // outlive the zhandle if a name server is slow
+    job->refs = 2;
+    if (pthread_create(&resolver, 0, do_resolve, job) == 0) {
+        pthread_detach(resolver);
+    } else {
+        LOG_WARN(("failed to start the resolver thread, resolving %s inline",
+                hosts));
+        do_resolve(job);
+    }
+    return job;
+}
+
+int resolve_job_done(resolve_job_t *job)
+{
+    int done;
+    lock_dns_cache();
+    done = job->done;
+    unlock_dns_cache();
+    return done;
+}
+
+void release_resolve_job(resolve_job_t *job)
+{
+    int refs;
+    lock_dns_cache();
+    refs = --job->refs;
+    unlock_dns_cache();
+    if (refs > 0)
+        return;
+    if (job->addrs)
+        free(job->addrs);
+    free(job->hosts);
+    free(job);
+}
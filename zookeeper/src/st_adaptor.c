@@ -22,6 +22,7 @@
 
 #include "zk_adaptor.h"
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 int zoo_lock_auth(zhandle_t *zh)
@@ -32,6 +33,14 @@ int zoo_unlock_auth(zhandle_t *zh)
 {
 	return 0;
 }
+int zoo_lock_trace(zhandle_t *zh)
+{
+	return 0;
+}
+int zoo_unlock_trace(zhandle_t *zh)
+{
+	return 0;
+}
 int lock_buffer_list(buffer_head_t *l)
 {
 	return 0;
@@ -93,6 +102,21 @@ int32_t inc_ref_counter(zhandle_t* zh,int i)
     return zh->ref_counter;
 }
 
+void *atomic_exchange_ptr(void *volatile *ptr, void *value)
+{
+    void *old = *ptr;
+    *ptr = value;
+    return old;
+}
+
+int atomic_cas_ptr(void *volatile *ptr, void *expected, void *value)
+{
+    if (*ptr != expected)
+        return 0;
+    *ptr = value;
+    return 1;
+}
+
 int32_t get_xid()
 {
     static int32_t xid = -1;
@@ -111,3 +135,59 @@ int leave_critical(zhandle_t* zh)
 {
 	return 0;
 }
+
+int lock_dns_cache(void)
+{
+	return 0;
+}
+
+int unlock_dns_cache(void)
+{
+	return 0;
+}
+
+int lock_connect_limiter(void)
+{
+	return 0;
+}
+
+int unlock_connect_limiter(void)
+{
+	return 0;
+}
+
+resolve_job_t *start_resolve_job(const char *hosts)
+{
+    int unresolved;
+    resolve_job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+        return 0;
+    job->hosts = strdup(hosts);
+    if (!job->hosts) {
+        free(job);
+        return 0;
+    }
+    job->refs = 1;
+    // there is no other thread to hand the lookup to
+    job->rc = resolve_hosts(hosts, 0, &job->addrs, &job->addrs_count,
+            &unresolved);
+    if (job->rc == ZOK)
+        dns_cache_store(hosts, job->addrs, job->addrs_count);
+    job->done = 1;
+    return job;
+}
+
+int resolve_job_done(resolve_job_t *job)
+{
+    return job->done;
+}
+
+void release_resolve_job(resolve_job_t *job)
+{
+    if (--job->refs > 0)
+        return;
+    if (job->addrs)
+        free(job->addrs);
+    free(job->hosts);
+    free(job);
+}
@@ -28,6 +28,7 @@
 #endif
 #include "zookeeper.h"
 #include "zk_hashtable.h"
+#include "zk_timerwheel.h"
 
 /* predefined xid's values recognized as special by the server */
 #define WATCHER_EVENT_XID -1 
@@ -41,6 +42,7 @@
 #define CONNECTING_STATE_DEF 1
 #define ASSOCIATING_STATE_DEF 2
 #define CONNECTED_STATE_DEF 3
+#define READONLY_STATE_DEF 5
 #define NOTCONNECTED_STATE_DEF 999
 
 /* zookeeper event type constants */
@@ -61,6 +63,8 @@ struct _completion_list;
 typedef struct _buffer_head {
     struct _buffer_list *volatile head;
     struct _buffer_list *last;
+    volatile int count; /* the buffers in the list */
+    volatile int64_t bytes; /* and their length */
 #ifdef THREADED
     pthread_mutex_t lock;
 #endif
@@ -69,6 +73,7 @@ typedef struct _buffer_head {
 typedef struct _completion_head {
     struct _completion_list *volatile head;
     struct _completion_list *last;
+    volatile int count; /* the completions in the list */
 #ifdef THREADED
     pthread_cond_t cond;
     pthread_mutex_t lock;
@@ -127,10 +132,12 @@ typedef struct _buffer_list {
     int len; /* This represents the length of sizeof(header) + length of buffer */
     int curr_offset; /* This is the offset into the header followed by offset into the buffer */
     struct _buffer_list *next;
+    struct _completion_list *completion; /* the traced request sent in this buffer */
+    int64_t received; /* when a reply was read, in us, while tracing */
 } buffer_list_t;
 
 /* the size of connect request */
-#define HANDSHAKE_REQ_SIZE 44
+#define HANDSHAKE_REQ_SIZE 45
 /* connect request */
 struct connect_req {
     int32_t protocolVersion;
@@ -139,6 +146,7 @@ struct connect_req {
     int64_t sessionId;
     int32_t passwd_len;
     char passwd[16];
+    char readOnly;
 };
 
 /* the connect response */
@@ -149,6 +157,7 @@ struct prime_struct {
     int64_t sessionId;
     int32_t passwd_len;
     char passwd[16];
+    char readOnly;
 }; 
 
 #ifdef THREADED
@@ -168,6 +177,48 @@ struct adaptor_threads {
 };
 #endif
 
+/** progress of restoring the watches after the session was re-established */
+typedef struct _set_watches_state {
+    int table; /* the watcher table being walked: 0=data, 1=exist, 2=child, 3=done */
+    zk_hashtable_cursor_t cursor; /* position in that table */
+    int64_t zxid; /* the last zxid seen when the connection was established */
+    int outstanding; /* SetWatches chunks sent but not acknowledged yet */
+} set_watches_state_t;
+
+/** the op codes that get latency histograms, ZOO_NOTIFY_OP to ZOO_MULTI_OP */
+#define TRACE_OPS 15
+
+/** the maximum number of connects racing each other while reconnecting */
+#define MAX_CONNECT_ATTEMPTS 3
+
+/** a non-blocking connect in progress to one of the servers */
+typedef struct _connect_attempt {
+#ifdef WIN32
+    SOCKET fd;
+#else
+    int fd;
+#endif
+    int index; /* the index of the address in addrs */
+    struct timeval started; /* the time the connect was started */
+} connect_attempt_t;
+
+/** what the client has measured about one of the server addresses */
+typedef struct _server_stats {
+    int rtt; /* smoothed round trip time in ms, -1 until measured */
+    int penalty; /* ms added to the rtt for recent failures, decays over time */
+    struct timeval last_failure; /* when the penalty was last updated */
+} server_stats_t;
+
+/** a lookup of the host names of a zhandle, done off the IO thread */
+typedef struct _resolve_job {
+    char *hosts; /* the host:port list being resolved */
+    int refs; /* the zhandle and the resolver each hold a reference */
+    volatile int done;
+    int rc; /* the result of resolve_hosts */
+    struct sockaddr_storage *addrs; /* the resolved addresses */
+    int addrs_count;
+} resolve_job_t;
+
 /** the auth list for adding auth */
 typedef struct _auth_list_head {
      auth_info *auth;
@@ -189,6 +240,11 @@ struct _zhandle {
     char *hostname; /* the hostname of zookeeper */
     struct sockaddr_storage *addrs; /* the addresses that correspond to the hostname */
     int addrs_count; /* The number of addresses in the addrs array */
+    server_stats_t *addr_stats; /* latency and failures of each address in addrs */
+    int needs_dns; /* non-zero if hostname has names to look up */
+    resolve_job_t *resolve_job; /* the lookup in progress, if any */
+    struct timeval addrs_resolved; /* when the names were last resolved */
+    struct timeval resolve_started; /* when the last lookup was started */
     watcher_fn watcher; /* the registered watcher */
     struct timeval last_recv; /* The time that the last message was received */
     struct timeval last_send; /* The time that the last message was sent */
@@ -200,14 +256,30 @@ struct _zhandle {
     buffer_head_t to_process; /* The buffers that have been read and are ready to be processed. */
     buffer_head_t to_send; /* The packets queued to send */
     completion_head_t sent_requests; /* The outstanding requests */
+    struct _completion_list *volatile submitted; /* requests not yet queued to send, newest first */
     completion_head_t completions_to_process; /* completions that are ready to run */
+    zk_timerwheel_t request_timers; /* deadlines of the sent_requests, under its lock */
+    int operation_timeout; /* the deadline of a request in ms, 0 for none */
     int connect_index; /* The index of the address to connect to */
+    connect_attempt_t attempts[MAX_CONNECT_ATTEMPTS]; /* connects in progress while fd is -1, oldest first */
+    int attempts_count; /* The number of entries in the attempts array */
+    int max_attempts; /* How many connects may race, 1 connects to one server at a time */
+    int connect_stagger; /* ms to give a connect before starting the next one */
+    struct timeval next_connect; /* no connect is started before this time */
+    int backoff_base; /* ms to back off after the first failed connect round */
+    int backoff_cap; /* the maximum ms to back off */
+    int failed_rounds; /* connect rounds that failed since the last session */
+    struct timeval disconnected_at; /* when the session was lost, 0 while connected */
+    zoo_connect_stats_t connect_stats;
+    zoo_stats_t stats; /* the traffic counters, the queue depths are kept by the lists */
     clientid_t client_id;
     long long last_zxid;
     int outstanding_sync; /* Number of outstanding synchronous requests */
+    int allow_read_only; /* a session on a read-only server is acceptable */
+    int seen_rw_server_before; /* the session was ever established with the quorum */
     struct _buffer_list primer_buffer; /* The buffer used for the handshake at the start of a connection */
     struct prime_struct primer_storage; /* the connect response */
-    char primer_storage_buffer[40]; /* the true size of primer_storage */
+    char primer_storage_buffer[41]; /* the true size of primer_storage */
     volatile int state;
     void *context;
     auth_list_head_t auth_h; /* authentication data list */
@@ -216,15 +288,34 @@ struct _zhandle {
      * right before top-level API call returns to the caller */
     int32_t ref_counter;
     volatile int close_requested;
+    /* set by zookeeper_detach: free the handle without closing the session */
+    volatile int detach_requested;
     void *adaptor_priv;
-    /* Used for debugging only: non-zero value indicates the time when the zookeeper_process
+    /* non-zero value indicates the time when the zookeeper_process
      * call returned while there was at least one unprocessed server response 
-     * available in the socket recv buffer */
+     * available in the socket recv buffer, for max_recv_dwell_ms */
     struct timeval socket_readable;
     
     zk_hashtable* active_node_watchers;   
     zk_hashtable* active_exist_watchers;
     zk_hashtable* active_child_watchers;
+    set_watches_state_t set_watches; /* SetWatches restore in progress */
+    zoo_trace_fn trace_hook; /* called with the trace of every request */
+    void *trace_context;
+    int trace_histograms; /* aggregate the traces into latency */
+    /* the latencies per op type and stage, allocated on first use; the
+     * hook and the histograms are under the trace lock */
+    struct _zk_histogram *latency[TRACE_OPS][ZOO_TRACE_STAGES];
+    /* the slow log and the hot paths, also under the trace lock */
+    int64_t slow_threshold; /* in us, 0 when the slow log is off */
+    zoo_slow_op_t *slow_ops; /* a ring of the last slow_capacity slow requests */
+    int slow_capacity;
+    int slow_count;
+    int slow_next; /* the slot the next slow request goes to */
+    struct _zk_topk *hot_paths; /* 0 when the paths aren't counted */
+#ifdef THREADED
+    pthread_mutex_t trace_lock;
+#endif
     /** used for chroot path at the client side **/
     char *chroot;
 };
@@ -245,6 +336,21 @@ char* sub_string(zhandle_t *zh, const char* server_path);
 void free_duplicate_path(const char* free_path, const char* path);
 int zoo_lock_auth(zhandle_t *zh);
 int zoo_unlock_auth(zhandle_t *zh);
+int zoo_lock_trace(zhandle_t *zh);
+int zoo_unlock_trace(zhandle_t *zh);
+
+// host name resolution
+int resolve_hosts(const char *hostname, int numeric_only,
+        struct sockaddr_storage **addrs, int *count, int *unresolved);
+void dns_cache_store(const char *hosts, const struct sockaddr_storage *addrs,
+        int count);
+int lock_dns_cache(void);
+int unlock_dns_cache(void);
+resolve_job_t *start_resolve_job(const char *hosts);
+int resolve_job_done(resolve_job_t *job);
+void release_resolve_job(resolve_job_t *job);
+int lock_connect_limiter(void);
+int unlock_connect_limiter(void);
 
 // critical section guards
 int enter_critical(zhandle_t* zh);
@@ -255,6 +361,9 @@ int api_epilog(zhandle_t *zh, int rc);
 int32_t get_xid();
 // returns the new value of the ref counter
 int32_t inc_ref_counter(zhandle_t* zh,int i);
+// atomic pointer swaps, used to hand requests over to the IO thread
+void *atomic_exchange_ptr(void *volatile *ptr, void *value);
+int atomic_cas_ptr(void *volatile *ptr, void *expected, void *value);
 
 #ifdef THREADED
 // atomic post-increment
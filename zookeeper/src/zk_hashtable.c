@@ -20,6 +20,7 @@
 #include "zk_adaptor.h"
 #include "hashtable/hashtable.h"
 #include "hashtable/hashtable_itr.h"
+#include "hashtable/hashtable_private.h"
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -217,6 +218,38 @@ char **collect_keys(zk_hashtable *ht, int *count)
     return list;
 }
 
+int collect_keys_chunk(zk_hashtable *ht, zk_hashtable_cursor_t *cursor,
+        struct String_vector *keys, int *budget)
+{
+    struct hashtable *h = ht->ht;
+    int capacity = keys->count;
+
+    if (cursor->tablelength != h->tablelength) {
+        // the table has been rehashed since the last chunk; start over, the
+        // server doesn't mind seeing the same path twice
+        cursor->bucket = 0;
+        cursor->tablelength = h->tablelength;
+    }
+    // only stop on a bucket boundary: an entry removed from a partially
+    // walked bucket would shift its successors into the part already seen
+    while (cursor->bucket < h->tablelength && *budget > 0) {
+        struct entry *e;
+        for (e = h->table[cursor->bucket]; e != 0; e = e->next) {
+            if (keys->count == capacity) {
+                char **data;
+                capacity = capacity ? capacity * 2 : 64;
+                data = realloc(keys->data, capacity * sizeof(char*));
+                assert(data);
+                keys->data = data;
+            }
+            keys->data[keys->count++] = (char*)e->k;
+            *budget -= 4 + (int)strlen((const char*)e->k);
+        }
+        cursor->bucket++;
+    }
+    return cursor->bucket >= h->tablelength;
+}
+
 static int insert_watcher_object(zk_hashtable *ht, const char *path,
                                  watcher_object_t* wo)
 {
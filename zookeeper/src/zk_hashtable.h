@@ -53,6 +53,26 @@ void destroy_zk_hashtable(zk_hashtable* ht);
 
 char **collect_keys(zk_hashtable *ht, int *count);
 
+/**
+ * The position of an incremental walk over the keys of a watcher table.
+ * A zeroed cursor starts at the beginning of the table.
+ */
+typedef struct _zk_hashtable_cursor {
+    unsigned int bucket;
+    unsigned int tablelength;
+} zk_hashtable_cursor_t;
+
+/**
+ * Appends the paths of the watchers in ht to keys starting at the cursor
+ * position, one hash bucket at a time, until the serialized size of the
+ * collected paths exceeds *budget. The paths are not copied, so keys must be
+ * used before the table is modified; only keys->data needs to be freed.
+ * *budget is decreased by the serialized size of every path added.
+ * Returns 1 if the end of the table has been reached, 0 otherwise.
+ */
+int collect_keys_chunk(zk_hashtable *ht, zk_hashtable_cursor_t *cursor,
+        struct String_vector *keys, int *budget);
+
 /**
  * check if the completion has a watcher object associated
  * with it. If it does, move the watcher object to the map of
@@ -0,0 +1,124 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLL_EXPORT
+#  define USE_STATIC_LIB
+#endif
+
+#include "zk_histogram.h"
+
+#include <string.h>
+
+#define HALF_COUNT (ZK_HISTOGRAM_SUB_COUNT / 2)
+
+/* the position of the highest bit set, v > 0 */
+static int highest_bit(int64_t v)
+{
+    int bit = 0;
+    while (v >>= 1)
+        bit++;
+    return bit;
+}
+
+static int bucket_of(int64_t value)
+{
+    int shift;
+    if (value < ZK_HISTOGRAM_SUB_COUNT)
+        return (int)value;
+    shift = highest_bit(value) - ZK_HISTOGRAM_SUB_BITS + 1;
+    return ZK_HISTOGRAM_SUB_COUNT + (shift - 1) * HALF_COUNT
+        + (int)(value >> shift) - HALF_COUNT;
+}
+
+/* the highest value that falls in the bucket */
+static int64_t bucket_top(int bucket)
+{
+    int shift;
+    int64_t sub;
+    if (bucket < ZK_HISTOGRAM_SUB_COUNT)
+        return bucket;
+    shift = (bucket - ZK_HISTOGRAM_SUB_COUNT) / HALF_COUNT + 1;
+    sub = (bucket - ZK_HISTOGRAM_SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    /* written so the last bucket ends at 2^63 - 1 without overflowing */
+    return (sub << shift) + (((int64_t)1 << shift) - 1);
+}
+
+void zk_histogram_init(zk_histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void zk_histogram_record(zk_histogram_t *h, int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    h->counts[bucket_of(value)]++;
+    if (h->total == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += (double)value;
+}
+
+void zk_histogram_merge(zk_histogram_t *to, const zk_histogram_t *from)
+{
+    int i;
+    if (from->total == 0)
+        return;
+    for (i = 0; i < ZK_HISTOGRAM_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    if (to->total == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->total += from->total;
+    to->sum += from->sum;
+}
+
+int64_t zk_histogram_percentile(const zk_histogram_t *h, double percentile)
+{
+    int64_t rank;
+    int64_t seen = 0;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
+    /* the rank of the value, counting from 1, rounded up */
+    rank = (int64_t)(percentile / 100.0 * (double)h->total + 0.999999);
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < ZK_HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            int64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+double zk_histogram_mean(const zk_histogram_t *h)
+{
+    return h->total ? h->sum / (double)h->total : 0;
+}
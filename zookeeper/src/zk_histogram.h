@@ -0,0 +1,82 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_HISTOGRAM_H_
+#define ZK_HISTOGRAM_H_
+
+#include <zookeeper.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A log-linear histogram in the style of HdrHistogram. Values below
+ * ZK_HISTOGRAM_SUB_COUNT are counted exactly; above that every power of
+ * two is split into ZK_HISTOGRAM_SUB_COUNT / 2 equal buckets, so a value
+ * is reported within 1/64 (about 1.6%) of its true value whatever its
+ * magnitude. Recording is O(1) and the memory use is fixed.
+ *
+ * The histogram does no locking; the caller serializes access to it, or
+ * keeps one per thread and merges them.
+ */
+#define ZK_HISTOGRAM_SUB_BITS 7
+#define ZK_HISTOGRAM_SUB_COUNT (1 << ZK_HISTOGRAM_SUB_BITS)
+#define ZK_HISTOGRAM_BUCKETS (ZK_HISTOGRAM_SUB_COUNT + \
+        (62 - ZK_HISTOGRAM_SUB_BITS + 1) * (ZK_HISTOGRAM_SUB_COUNT / 2))
+
+typedef struct _zk_histogram {
+    int64_t total; /* the number of values recorded */
+    int64_t min;
+    int64_t max;
+    double sum;
+    int64_t counts[ZK_HISTOGRAM_BUCKETS];
+} zk_histogram_t;
+
+/**
+ * Empties the histogram.
+ */
+void zk_histogram_init(zk_histogram_t *h);
+
+/**
+ * Records a value. Negative values are recorded as 0.
+ */
+void zk_histogram_record(zk_histogram_t *h, int64_t value);
+
+/**
+ * Adds all the values recorded in one histogram to another.
+ */
+void zk_histogram_merge(zk_histogram_t *to, const zk_histogram_t *from);
+
+/**
+ * Returns the value at the given percentile, between 0 and 100, or 0 if
+ * the histogram is empty. The value is the highest one that falls in the
+ * same bucket, capped by the largest value recorded.
+ */
+int64_t zk_histogram_percentile(const zk_histogram_t *h, double percentile);
+
+/**
+ * Returns the mean of the recorded values, or 0 if the histogram is empty.
+ */
+double zk_histogram_mean(const zk_histogram_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_HISTOGRAM_H_*/
@@ -21,16 +21,27 @@
 #endif
 
 #include "zookeeper_log.h"
+#include "zk_adaptor.h"
 #ifndef WIN32
 #include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
 #endif
 
 #include <stdarg.h>
+#include <string.h>
 #include <time.h>
 
 #define TIME_NOW_BUF_SIZE 1024
 #define FORMAT_LOG_BUF_SIZE 4096
 
+/* the "yyyy-MM-dd HH:mm:ss" part of a timestamp, recomputed once a second */
+typedef struct _time_cache {
+    time_t sec;
+    size_t len;
+    char str[TIME_NOW_BUF_SIZE];
+} time_cache_t;
+
 #ifdef THREADED
 #ifndef WIN32
 #include <pthread.h>
@@ -64,7 +75,7 @@ char* getTSData(pthread_key_t key,int size){
 }
 
 char* get_time_buffer(){
-    return getTSData(time_now_buffer,TIME_NOW_BUF_SIZE);
+    return getTSData(time_now_buffer,sizeof(time_cache_t));
 }
 
 char* get_format_log_buffer(){  
@@ -72,8 +83,8 @@ char* get_format_log_buffer(){
 }
 #else
 char* get_time_buffer(){
-    static char buf[TIME_NOW_BUF_SIZE];
-    return buf;    
+    static time_cache_t buf;
+    return (char*)&buf;
 }
 
 char* get_format_log_buffer(){
@@ -92,60 +103,391 @@ FILE* getLogStream(){
     return logStream;
 }
 
-void zoo_set_log_stream(FILE* stream){
-    logStream=stream;
+static const char* time_now(time_cache_t* cache, const struct timeval *tv){
+    // clone the format used by log4j ISO8601DateFormat
+    // specifically: "yyyy-MM-dd HH:mm:ss,SSS"
+    if (cache->len == 0 || cache->sec != tv->tv_sec) {
+        struct tm lt;
+        time_t now = tv->tv_sec;
+        localtime_r(&now, &lt);
+        cache->len = strftime(cache->str, TIME_NOW_BUF_SIZE,
+                              "%Y-%m-%d %H:%M:%S",
+                              &lt);
+        cache->sec = tv->tv_sec;
+    }
+
+    snprintf(cache->str + cache->len,
+             TIME_NOW_BUF_SIZE - cache->len,
+             ",%03d",
+             (int)(tv->tv_usec/1000));
+
+    return cache->str;
+}
+
+static const char* dbgLevelStr[]={"ZOO_INVALID","ZOO_ERROR","ZOO_WARN",
+        "ZOO_INFO","ZOO_DEBUG"};
+
+static void write_log_line(FILE* stream, time_cache_t* cache,
+    const struct timeval* tv, unsigned long tid, ZooLogLevel curLevel,
+    int line, const char* funcName, const char* message, int len)
+{
+    static pid_t pid=0;
+    if(pid==0)pid=getpid();
+#ifndef THREADED
+    // pid_t is long on Solaris
+    fprintf(stream, "%s:%ld:%s@%s@%d: %.*s\n", time_now(cache, tv),(long)pid,
+            dbgLevelStr[curLevel],funcName,line,len,message);
+#else
+    fprintf(stream, "%s:%ld(0x%lx):%s@%s@%d: %.*s\n", time_now(cache, tv),(long)pid,
+            tid,dbgLevelStr[curLevel],funcName,line,len,message);
+#endif
 }
 
-static const char* time_now(char* now_str){
+#ifdef THREADED
+/*
+ * Asynchronous logging. Every thread that logs owns a ring of records that
+ * only this thread writes and only the log writer thread reads, so neither
+ * side takes a lock. The writer formats the timestamps, writes the records
+ * to the log stream and flushes it once per pass. When a ring is full the
+ * record is dropped and counted rather than blocking the caller, which is
+ * typically the IO thread.
+ */
+#define LOG_RING_SIZE (64 * 1024) /* must be a power of 2 */
+#define LOG_MAX_MESSAGE FORMAT_LOG_BUF_SIZE /* as long as a synchronous message */
+#define LOG_RECORD_ALIGN 8
+
+#ifdef WIN32
+#define log_barrier() MemoryBarrier()
+#define log_cas(p,o,n) (InterlockedCompareExchange((volatile LONG*)(p),(n),(o))==(o))
+#define log_yield() Sleep(0)
+#else
+#define log_barrier() __sync_synchronize()
+#define log_cas(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+#define log_yield() sched_yield()
+#endif
+
+typedef struct _log_record {
+    int len; /* the size of the record including the message, 0 marks a wrap */
+    int line;
+    ZooLogLevel level;
+    const char* funcName;
     struct timeval tv;
-    struct tm lt;
-    time_t now = 0;
-    size_t len = 0;
-    
-    gettimeofday(&tv,0);
+} log_record_t;
 
-    now = tv.tv_sec;
-    localtime_r(&now, &lt);
+typedef struct _log_ring {
+    volatile unsigned int head; /* advanced by the owning thread */
+    volatile unsigned int tail; /* advanced by the writer thread */
+    volatile int orphaned; /* the owning thread has exited */
+    unsigned long tid;
+    struct _log_ring *next;
+    char buf[LOG_RING_SIZE];
+} log_ring_t;
 
-    // clone the format used by log4j ISO8601DateFormat
-    // specifically: "yyyy-MM-dd HH:mm:ss,SSS"
+static volatile int32_t logInitState=0; /* 0=none, 1=in progress, 2=done */
+static volatile int32_t logDropped=0;
+static int logAsync=1;
+static int logWriterStarted=0;
+static pthread_key_t log_ring_key;
+static pthread_mutex_t log_rings_lock; /* protects log_rings */
+static pthread_mutex_t log_drain_lock; /* serializes the consumers and guards logStream */
+static pthread_mutex_t log_wakeup_lock;
+static pthread_cond_t log_wakeup;
+static volatile int logWriterIdle=0; /* the writer waits on log_wakeup */
+static log_ring_t* log_rings=0;
+static pthread_t log_writer;
+
+static unsigned long current_tid(){
+#ifdef WIN32
+    return (unsigned long int)(pthread_self().thread_id);
+#else
+    return (unsigned long int)pthread_self();
+#endif
+}
+
+static void orphan_log_ring(void* p){
+    log_ring_t* ring=p;
+    if(ring){
+        log_barrier();
+        ring->orphaned=1;
+    }
+}
+
+static void flush_async_log();
+
+/* initialized on the first asynchronous message */
+static void log_init(){
+    if(logInitState==2)
+        return;
+    if(log_cas(&logInitState,0,1)){
+        pthread_mutex_init(&log_rings_lock,0);
+        pthread_mutex_init(&log_drain_lock,0);
+        pthread_mutex_init(&log_wakeup_lock,0);
+        pthread_cond_init(&log_wakeup,0);
+        pthread_key_create(&log_ring_key,orphan_log_ring);
+        atexit(flush_async_log);
+        log_barrier();
+        logInitState=2;
+    }else{
+        while(logInitState!=2)
+            log_yield();
+    }
+}
+
+/* returns 1 if anything was written */
+static int drain_log_ring(log_ring_t* ring, FILE* stream, time_cache_t* cache){
+    unsigned int head=ring->head;
+    unsigned int tail=ring->tail;
+    log_barrier();
+    if(head==tail)
+        return 0;
+    while(tail!=head){
+        log_record_t* r=(log_record_t*)(ring->buf+(tail&(LOG_RING_SIZE-1)));
+        if(r->len==0){
+            // the record didn't fit at the end of the ring
+            tail+=LOG_RING_SIZE-(tail&(LOG_RING_SIZE-1));
+            continue;
+        }
+        write_log_line(stream,cache,&r->tv,ring->tid,r->level,r->line,
+                r->funcName,(const char*)(r+1),
+                r->len-(int)sizeof(log_record_t));
+        tail+=(r->len+LOG_RECORD_ALIGN-1)&~(LOG_RECORD_ALIGN-1);
+    }
+    log_barrier();
+    ring->tail=tail;
+    return 1;
+}
+
+static int32_t reportedDrops=0;
+
+/* returns 1 if anything was written, the caller holds log_drain_lock */
+static int drain_log_rings_nolock(){
+    static time_cache_t cache;
+    FILE* stream=LOGSTREAM;
+    log_ring_t** pp;
+    int written=0;
+    int32_t dropped;
+
+    pthread_mutex_lock(&log_rings_lock);
+    pp=&log_rings;
+    while(*pp){
+        log_ring_t* ring=*pp;
+        int orphaned=ring->orphaned;
+        log_barrier();
+        written|=drain_log_ring(ring,stream,&cache);
+        if(orphaned){
+            // nothing can be added after the owner has gone
+            *pp=ring->next;
+            free(ring);
+        }else{
+            pp=&ring->next;
+        }
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+    dropped=logDropped;
+    if(dropped!=reportedDrops){
+        struct timeval tv;
+        char msg[128];
+        gettimeofday(&tv,0);
+        snprintf(msg,sizeof(msg),"%d log messages dropped, the log rings were full",
+                dropped-reportedDrops);
+        write_log_line(stream,&cache,&tv,current_tid(),ZOO_LOG_LEVEL_WARN,
+                __LINE__,"drain_log_rings",msg,(int)strlen(msg));
+        reportedDrops=dropped;
+        written=1;
+    }
+    if(written)
+        fflush(stream);
+    return written;
+}
+
+/* returns 1 if anything was written */
+static int drain_log_rings(){
+    int written;
+    pthread_mutex_lock(&log_drain_lock);
+    written=drain_log_rings_nolock();
+    pthread_mutex_unlock(&log_drain_lock);
+    return written;
+}
 
-    len = strftime(now_str, TIME_NOW_BUF_SIZE,
-                          "%Y-%m-%d %H:%M:%S",
-                          &lt);
+/* returns 1 if a ring holds records or drops are still to be reported */
+static int log_pending(){
+    log_ring_t* ring;
+    int pending=logDropped!=reportedDrops;
+    pthread_mutex_lock(&log_rings_lock);
+    for(ring=log_rings;ring && !pending;ring=ring->next)
+        pending=ring->head!=ring->tail || ring->orphaned;
+    pthread_mutex_unlock(&log_rings_lock);
+    return pending;
+}
+
+static void flush_async_log(){
+    drain_log_rings();
+}
+
+#ifdef WIN32
+static unsigned __stdcall log_writer_thread(void* v)
+#else
+static void* log_writer_thread(void* v)
+#endif
+{
+    (void)v;
+    while(1){
+        if(drain_log_rings())
+            continue;
+        /* announce the wait before looking at the rings again: a producer
+         * either sees the flag and signals, or its record is seen here */
+        pthread_mutex_lock(&log_wakeup_lock);
+        logWriterIdle=1;
+        log_barrier();
+        while(logWriterIdle && !log_pending())
+            pthread_cond_wait(&log_wakeup,&log_wakeup_lock);
+        logWriterIdle=0;
+        pthread_mutex_unlock(&log_wakeup_lock);
+    }
+    return 0;
+}
+
+static void wake_log_writer(){
+    log_barrier();
+    if(logWriterIdle){
+        pthread_mutex_lock(&log_wakeup_lock);
+        logWriterIdle=0;
+        pthread_cond_signal(&log_wakeup);
+        pthread_mutex_unlock(&log_wakeup_lock);
+    }
+}
+
+static log_ring_t* get_log_ring(){
+    log_ring_t* ring=pthread_getspecific(log_ring_key);
+    if(ring==0){
+        ring=calloc(1,sizeof(log_ring_t));
+        if(ring==0)
+            return 0;
+        ring->tid=current_tid();
+        if(pthread_setspecific(log_ring_key,ring)!=0){
+            free(ring);
+            return 0;
+        }
+        pthread_mutex_lock(&log_rings_lock);
+        ring->next=log_rings;
+        log_rings=ring;
+        if(!logWriterStarted){
+            if(pthread_create(&log_writer,0,log_writer_thread,0)==0){
+                pthread_detach(log_writer);
+                logWriterStarted=1;
+            }
+        }
+        pthread_mutex_unlock(&log_rings_lock);
+    }
+    return ring;
+}
+
+/* returns 0 if the message has to be written synchronously */
+static int enqueue_log_record(ZooLogLevel curLevel,int line,
+    const char* funcName, const char* message)
+{
+    log_ring_t* ring;
+    log_record_t* r;
+    unsigned int head,tail,offset,size,needed;
+    int len;
+
+    log_init();
+    ring=get_log_ring();
+    if(ring==0 || !logWriterStarted)
+        return 0;
+    len=(int)strlen(message);
+    if(len>LOG_MAX_MESSAGE)
+        len=LOG_MAX_MESSAGE;
+    size=(sizeof(log_record_t)+len+LOG_RECORD_ALIGN-1)&~(LOG_RECORD_ALIGN-1);
 
-    len += snprintf(now_str + len,
-                    TIME_NOW_BUF_SIZE - len,
-                    ",%03d",
-                    (int)(tv.tv_usec/1000));
+    head=ring->head;
+    tail=ring->tail;
+    log_barrier();
+    offset=head&(LOG_RING_SIZE-1);
+    needed=size;
+    if(offset+size>LOG_RING_SIZE)
+        needed+=LOG_RING_SIZE-offset; // skip the end of the ring
+    if(LOG_RING_SIZE-(head-tail)<needed){
+        fetch_and_add(&logDropped,1);
+        return 1;
+    }
+    if(needed!=size){
+        ((log_record_t*)(ring->buf+offset))->len=0;
+        head+=LOG_RING_SIZE-offset;
+        offset=0;
+    }
+    r=(log_record_t*)(ring->buf+offset);
+    r->len=(int)sizeof(log_record_t)+len;
+    r->line=line;
+    r->level=curLevel;
+    r->funcName=funcName;
+    gettimeofday(&r->tv,0);
+    memcpy(r+1,message,len);
+    log_barrier();
+    ring->head=head+size;
+    wake_log_writer();
+    return 1;
+}
 
-    return now_str;
+void zoo_set_log_async(int yesOrNo){
+    if(!yesOrNo && logInitState==2)
+        drain_log_rings();
+    logAsync=yesOrNo;
 }
 
+int zoo_get_log_dropped(){
+    return logDropped;
+}
+
+void zoo_set_log_stream(FILE* stream){
+    if(logInitState!=2){
+        logStream=stream;
+        return;
+    }
+    /* the queued records belong to the old stream; the caller may close
+     * it as soon as this returns, so the writer must be done with it */
+    pthread_mutex_lock(&log_drain_lock);
+    drain_log_rings_nolock();
+    logStream=stream;
+    pthread_mutex_unlock(&log_drain_lock);
+}
+#else
+void zoo_set_log_stream(FILE* stream){
+    logStream=stream;
+}
+
+void zoo_set_log_async(int yesOrNo){
+}
+
+int zoo_get_log_dropped(){
+    return 0;
+}
+#endif
+
 void log_message(ZooLogLevel curLevel,int line,const char* funcName,
     const char* message)
 {
-    static const char* dbgLevelStr[]={"ZOO_INVALID","ZOO_ERROR","ZOO_WARN",
-            "ZOO_INFO","ZOO_DEBUG"};
-    static pid_t pid=0;
-#ifdef WIN32
-    char timebuf [TIME_NOW_BUF_SIZE];
+    struct timeval tv;
+#ifdef THREADED
+    if(logAsync && enqueue_log_record(curLevel,line,funcName,message))
+        return;
 #endif
-    if(pid==0)pid=getpid();
-#ifndef THREADED
-    // pid_t is long on Solaris
-    fprintf(LOGSTREAM, "%s:%ld:%s@%s@%d: %s\n", time_now(get_time_buffer()),(long)pid,
-            dbgLevelStr[curLevel],funcName,line,message);
-#else
+    gettimeofday(&tv,0);
+#ifdef THREADED
 #ifdef WIN32
-    fprintf(LOGSTREAM, "%s:%d(0x%lx):%s@%s@%d: %s\n", time_now(timebuf),pid,
-            (unsigned long int)(pthread_self().thread_id),
-            dbgLevelStr[curLevel],funcName,line,message);      
+    {
+        time_cache_t cache;
+        cache.len=0;
+        write_log_line(LOGSTREAM,&cache,&tv,current_tid(),curLevel,line,
+                funcName,message,(int)strlen(message));
+    }
 #else
-    fprintf(LOGSTREAM, "%s:%ld(0x%lx):%s@%s@%d: %s\n", time_now(get_time_buffer()),(long)pid,
-            (unsigned long int)pthread_self(),
-            dbgLevelStr[curLevel],funcName,line,message);      
+    write_log_line(LOGSTREAM,(time_cache_t*)get_time_buffer(),&tv,
+            current_tid(),curLevel,line,funcName,message,(int)strlen(message));
 #endif
+#else
+    write_log_line(LOGSTREAM,(time_cache_t*)get_time_buffer(),&tv,0,
+            curLevel,line,funcName,message,(int)strlen(message));
 #endif
     fflush(LOGSTREAM);
 }
@@ -174,4 +516,3 @@ void zoo_set_debug_level(ZooLogLevel level)
     if(level>ZOO_LOG_LEVEL_DEBUG)level=ZOO_LOG_LEVEL_DEBUG;
     logLevel=level;
 }
-
@@ -0,0 +1,215 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLL_EXPORT
+#  define USE_STATIC_LIB
+#endif
+
+#include "zk_timerwheel.h"
+
+#define SLOT_MASK (ZK_TIMERWHEEL_SLOTS - 1)
+
+/* the slot of the given level that holds the given tick */
+static int slot_of(int64_t tick, int level)
+{
+    return (int)((tick >> (level * ZK_TIMERWHEEL_BITS)) & SLOT_MASK);
+}
+
+static int is_linked(zk_timer_t *timer)
+{
+    return timer->prev != 0;
+}
+
+static void unlink_timer(zk_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = 0;
+}
+
+static void link_timer(zk_timer_t *head, zk_timer_t *timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/* puts the timer in the slot matching its distance from the wheel's time */
+static void place_timer(zk_timerwheel_t *wheel, zk_timer_t *timer)
+{
+    int64_t expires = timer->expires;
+    int64_t delta;
+    int level;
+
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    delta = expires - wheel->now;
+    for (level = 0; level < ZK_TIMERWHEEL_LEVELS - 1; level++) {
+        if (delta < ((int64_t)1 << ((level + 1) * ZK_TIMERWHEEL_BITS)))
+            break;
+    }
+    if (level == ZK_TIMERWHEEL_LEVELS - 1) {
+        int64_t max = ((int64_t)1 << (ZK_TIMERWHEEL_LEVELS * ZK_TIMERWHEEL_BITS)) - 1;
+        if (delta > max) {
+            /* parked in the farthest slot, placed again when it's reached */
+            expires = wheel->now + max;
+        }
+    }
+    link_timer(&wheel->slots[level][slot_of(expires, level)], timer);
+}
+
+void zk_timerwheel_init(zk_timerwheel_t *wheel, int64_t now)
+{
+    int level, slot;
+    for (level = 0; level < ZK_TIMERWHEEL_LEVELS; level++) {
+        for (slot = 0; slot < ZK_TIMERWHEEL_SLOTS; slot++) {
+            zk_timer_t *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void zk_timerwheel_add(zk_timerwheel_t *wheel, zk_timer_t *timer,
+        int64_t expires)
+{
+    timer->expires = expires;
+    place_timer(wheel, timer);
+    wheel->count++;
+}
+
+void zk_timerwheel_remove(zk_timerwheel_t *wheel, zk_timer_t *timer)
+{
+    if (!is_linked(timer))
+        return;
+    unlink_timer(timer);
+    wheel->count--;
+}
+
+/* moves the timers of a slot of a higher level down the wheel */
+static void cascade(zk_timerwheel_t *wheel, int level, int slot)
+{
+    zk_timer_t *head = &wheel->slots[level][slot];
+    zk_timer_t list;
+
+    if (head->next == head)
+        return;
+    /* detach the whole slot first, a timer may land in it again */
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->next = head->prev = head;
+    while (list.next != &list) {
+        zk_timer_t *timer = list.next;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+}
+
+/* returns non-zero if no slot of level 0 from the given one on is in use */
+static int rest_of_level0_empty(zk_timerwheel_t *wheel, int slot)
+{
+    for (; slot < ZK_TIMERWHEEL_SLOTS; slot++) {
+        zk_timer_t *head = &wheel->slots[0][slot];
+        if (head->next != head)
+            return 0;
+    }
+    return 1;
+}
+
+zk_timer_t *zk_timerwheel_advance(zk_timerwheel_t *wheel, int64_t now)
+{
+    zk_timer_t *expired = 0;
+    zk_timer_t **tail = &expired;
+
+    if (wheel->count == 0) {
+        if (now > wheel->now)
+            wheel->now = now;
+        return 0;
+    }
+    while (wheel->now < now) {
+        int64_t tick = wheel->now + 1;
+        int slot = slot_of(tick, 0);
+        zk_timer_t *head;
+
+        if (slot != 0 && rest_of_level0_empty(wheel, slot)) {
+            /* nothing expires before level 0 wraps around */
+            int64_t wrap = (tick | SLOT_MASK) + 1;
+            if (wrap > now) {
+                wheel->now = now;
+                break;
+            }
+            tick = wrap;
+            slot = 0;
+        }
+        wheel->now = tick;
+        if (slot == 0) {
+            int level;
+            for (level = 1; level < ZK_TIMERWHEEL_LEVELS; level++) {
+                int s = slot_of(tick, level);
+                cascade(wheel, level, s);
+                if (s != 0)
+                    break;
+            }
+        }
+        head = &wheel->slots[0][slot];
+        while (head->next != head) {
+            zk_timer_t *timer = head->next;
+            unlink_timer(timer);
+            wheel->count--;
+            *tail = timer;
+            tail = &timer->next;
+        }
+        if (wheel->count == 0) {
+            if (now > wheel->now)
+                wheel->now = now;
+            break;
+        }
+    }
+    /* the expired timers are no longer linked in the wheel, only chained */
+    *tail = 0;
+    {
+        zk_timer_t *timer;
+        for (timer = expired; timer; timer = timer->next)
+            timer->prev = 0;
+    }
+    return expired;
+}
+
+int zk_timerwheel_next(zk_timerwheel_t *wheel, int64_t now)
+{
+    int64_t tick;
+    int64_t wait;
+
+    if (wheel->count == 0)
+        return -1;
+    /* the first used slot of level 0, or the next cascade */
+    for (tick = wheel->now + 1; ; tick++) {
+        int slot = slot_of(tick, 0);
+        zk_timer_t *head = &wheel->slots[0][slot];
+        if (head->next != head || slot == 0)
+            break;
+    }
+    wait = tick - now;
+    if (wait < 0)
+        wait = 0;
+    return wait > 0x7fffffff ? 0x7fffffff : (int)wait;
+}
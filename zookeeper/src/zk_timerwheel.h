@@ -0,0 +1,91 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_TIMERWHEEL_H_
+#define ZK_TIMERWHEEL_H_
+
+#include <zookeeper.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A hierarchical timer wheel with a resolution of one millisecond. Level 0
+ * has a slot for each of the next 64ms, and every level above has slots
+ * 64 times as wide. Timers are moved down a level when the wheel reaches
+ * their slot, so adding, removing and expiring a timer is O(1).
+ *
+ * The wheel does no locking; the caller serializes access to it.
+ */
+#define ZK_TIMERWHEEL_BITS 6
+#define ZK_TIMERWHEEL_SLOTS (1 << ZK_TIMERWHEEL_BITS)
+#define ZK_TIMERWHEEL_LEVELS 4
+
+/**
+ * A timer is embedded in the object it belongs to and must be zeroed
+ * before it is first added. It must not be freed or re-added while it is
+ * in a wheel.
+ */
+typedef struct _zk_timer {
+    struct _zk_timer *next;
+    struct _zk_timer *prev;
+    int64_t expires; /* absolute time in ms */
+} zk_timer_t;
+
+typedef struct _zk_timerwheel {
+    int64_t now; /* the last tick processed, in ms */
+    int count; /* the number of timers in the wheel */
+    zk_timer_t slots[ZK_TIMERWHEEL_LEVELS][ZK_TIMERWHEEL_SLOTS];
+} zk_timerwheel_t;
+
+/**
+ * Empties the wheel and sets its time. Any timer still in the wheel is
+ * forgotten without being touched.
+ */
+void zk_timerwheel_init(zk_timerwheel_t *wheel, int64_t now);
+
+/**
+ * Adds a timer expiring at the given absolute time. Times in the past
+ * expire on the next advance.
+ */
+void zk_timerwheel_add(zk_timerwheel_t *wheel, zk_timer_t *timer,
+        int64_t expires);
+
+/**
+ * Removes a timer from the wheel. Does nothing if it isn't in a wheel.
+ */
+void zk_timerwheel_remove(zk_timerwheel_t *wheel, zk_timer_t *timer);
+
+/**
+ * Advances the wheel to the given time and returns the timers that expired,
+ * chained through their next pointers, or NULL.
+ */
+zk_timer_t *zk_timerwheel_advance(zk_timerwheel_t *wheel, int64_t now);
+
+/**
+ * Returns the number of ms until the wheel has to be advanced next, which
+ * is never later than the next expiry, or -1 if the wheel is empty.
+ */
+int zk_timerwheel_next(zk_timerwheel_t *wheel, int64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_TIMERWHEEL_H_*/
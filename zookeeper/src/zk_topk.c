@@ -0,0 +1,179 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DLL_EXPORT
+#  define USE_STATIC_LIB
+#endif
+
+#include "zk_topk.h"
+#include "hashtable/hashtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int string_hash_djb2(void *str)
+{
+    unsigned int hash = 5381;
+    int c;
+    const char* cstr = (const char*)str;
+    while ((c = *cstr++))
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+    return hash;
+}
+
+static int string_equal(void *key1, void *key2)
+{
+    return strcmp((const char*)key1, (const char*)key2) == 0;
+}
+
+static void heap_swap(zk_topk_t *t, int i, int j)
+{
+    zk_topk_entry_t *e = t->heap[i];
+    t->heap[i] = t->heap[j];
+    t->heap[j] = e;
+    t->heap[i]->heap_index = i;
+    t->heap[j]->heap_index = j;
+}
+
+static void sift_up(zk_topk_t *t, int i)
+{
+    while (i > 0 && t->heap[(i - 1) / 2]->count > t->heap[i]->count) {
+        heap_swap(t, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(zk_topk_t *t, int i)
+{
+    for (;;) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < t->size && t->heap[left]->count < t->heap[least]->count)
+            least = left;
+        if (right < t->size && t->heap[right]->count < t->heap[least]->count)
+            least = right;
+        if (least == i)
+            return;
+        heap_swap(t, i, least);
+        i = least;
+    }
+}
+
+zk_topk_t *zk_topk_create(int capacity)
+{
+    zk_topk_t *t;
+    if (capacity <= 0)
+        return 0;
+    t = calloc(1, sizeof(*t));
+    if (t == 0)
+        return 0;
+    t->capacity = capacity;
+    t->entries = calloc(capacity, sizeof(*t->entries));
+    t->heap = calloc(capacity, sizeof(*t->heap));
+    t->index = create_hashtable(capacity, string_hash_djb2, string_equal);
+    if (t->entries == 0 || t->heap == 0 || t->index == 0) {
+        zk_topk_destroy(t);
+        return 0;
+    }
+    return t;
+}
+
+void zk_topk_destroy(zk_topk_t *t)
+{
+    if (t == 0)
+        return;
+    /* the keys are owned by the index, the values point into entries */
+    if (t->index)
+        hashtable_destroy(t->index, 0);
+    free(t->heap);
+    free(t->entries);
+    free(t);
+}
+
+int zk_topk_add(zk_topk_t *t, const char *key)
+{
+    zk_topk_entry_t *e = hashtable_search(t->index, (void*)key);
+    char *copy;
+
+    t->total++;
+    if (e) {
+        e->count++;
+        sift_down(t, e->heap_index);
+        return 0;
+    }
+
+    copy = strdup(key);
+    if (copy == 0)
+        return -1;
+    if (t->size < t->capacity) {
+        e = &t->entries[t->size];
+        e->count = 1;
+        e->error = 0;
+        e->heap_index = t->size;
+        t->heap[t->size++] = e;
+        sift_up(t, e->heap_index);
+    } else {
+        /* take over the counter of the least frequent key */
+        e = t->heap[0];
+        if (e->key)
+            hashtable_remove(t->index, e->key);
+        e->error = e->count;
+        e->count++;
+        sift_down(t, 0);
+    }
+    e->key = copy;
+    if (!hashtable_insert(t->index, copy, e)) {
+        /* keep the counter consistent, it is dropped from the index */
+        free(copy);
+        e->key = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const zk_topk_entry_t *ea = *(const zk_topk_entry_t * const *)a;
+    const zk_topk_entry_t *eb = *(const zk_topk_entry_t * const *)b;
+    if (ea->count != eb->count)
+        return ea->count > eb->count ? -1 : 1;
+    return 0;
+}
+
+int zk_topk_list(const zk_topk_t *t, const zk_topk_entry_t **entries, int count)
+{
+    zk_topk_entry_t **sorted;
+    int n = 0;
+    int i;
+
+    if (count <= 0 || t->size == 0)
+        return 0;
+    sorted = malloc(t->size * sizeof(*sorted));
+    if (sorted == 0)
+        return 0;
+    memcpy(sorted, t->heap, t->size * sizeof(*sorted));
+    qsort(sorted, t->size, sizeof(*sorted), by_count);
+    for (i = 0; i < t->size && n < count; i++) {
+        if (sorted[i]->key)
+            entries[n++] = sorted[i];
+    }
+    free(sorted);
+    return n;
+}
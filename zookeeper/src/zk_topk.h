@@ -0,0 +1,78 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZK_TOPK_H_
+#define ZK_TOPK_H_
+
+#include <zookeeper.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The most frequent keys of a stream, counted with the Space-Saving
+ * algorithm of Metwally et al. At most capacity keys are counted; a key
+ * that is not takes over the counter of the least frequent one and
+ * inherits its count as the error. A counted key's count overestimates
+ * its true count by at most its error, and any key seen more than
+ * total / capacity times is always among the counted ones. Adding a key is
+ * O(log capacity) and the memory use is fixed once the sketch is full.
+ *
+ * The sketch does no locking; the caller serializes access to it.
+ */
+typedef struct _zk_topk_entry {
+    char *key;
+    int64_t count;
+    int64_t error; /* the count the key inherited when it took the counter */
+    int heap_index;
+} zk_topk_entry_t;
+
+typedef struct _zk_topk {
+    int capacity;
+    int size; /* the counters in use */
+    int64_t total; /* the number of keys added */
+    zk_topk_entry_t *entries;
+    zk_topk_entry_t **heap; /* the counters in use, least frequent first */
+    struct hashtable *index; /* key to counter */
+} zk_topk_t;
+
+/**
+ * Returns a sketch of capacity counters, 0 if out of memory.
+ */
+zk_topk_t *zk_topk_create(int capacity);
+
+void zk_topk_destroy(zk_topk_t *t);
+
+/**
+ * Counts a key, which is copied. Returns 0 on success, -1 if out of memory.
+ */
+int zk_topk_add(zk_topk_t *t, const char *key);
+
+/**
+ * Fills in up to count of the counters in use, most frequent first, and
+ * returns how many it filled in. The keys belong to the sketch and are only
+ * valid until the next call to zk_topk_add.
+ */
+int zk_topk_list(const zk_topk_t *t, const zk_topk_entry_t **entries, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*ZK_TOPK_H_*/
@@ -30,6 +30,8 @@
 #include "zk_adaptor.h"
 #include "zookeeper_log.h"
 #include "zk_hashtable.h"
+#include "zk_histogram.h"
+#include "zk_topk.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -39,6 +41,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <limits.h>
 
 #ifndef WIN32
@@ -69,11 +72,14 @@ const int ZOOKEEPER_READ = 1 << 1;
 const int ZOO_EPHEMERAL = 1 << 0;
 const int ZOO_SEQUENCE = 1 << 1;
 
+const int ZOO_READONLY = 1 << 0;
+
 const int ZOO_EXPIRED_SESSION_STATE = EXPIRED_SESSION_STATE_DEF;
 const int ZOO_AUTH_FAILED_STATE = AUTH_FAILED_STATE_DEF;
 const int ZOO_CONNECTING_STATE = CONNECTING_STATE_DEF;
 const int ZOO_ASSOCIATING_STATE = ASSOCIATING_STATE_DEF;
 const int ZOO_CONNECTED_STATE = CONNECTED_STATE_DEF;
+const int ZOO_READONLY_STATE = READONLY_STATE_DEF;
 static __attribute__ ((unused)) const char* state2String(int state){
     switch(state){
     case 0:
@@ -84,6 +90,8 @@ static __attribute__ ((unused)) const char* state2String(int state){
         return "ZOO_ASSOCIATING_STATE";
     case CONNECTED_STATE_DEF:
         return "ZOO_CONNECTED_STATE";
+    case READONLY_STATE_DEF:
+        return "ZOO_READONLY_STATE";
     case EXPIRED_SESSION_STATE_DEF:
         return "ZOO_EXPIRED_SESSION_STATE";
     case AUTH_FAILED_STATE_DEF:
@@ -171,21 +179,34 @@ typedef struct _completion_list {
     buffer_list_t *buffer;
     struct _completion_list *next;
     watcher_registration_t* watcher;
+    buffer_list_t *request; /* the serialized request until it's queued to send */
+    zk_timer_t timer; /* the deadline of the request */
+    int timed_out; /* the caller has been completed, discard the reply */
+    int type; /* the op code of the request, while it's traced */
+    int64_t queued; /* when it was submitted in us, 0 if it isn't traced */
+    int64_t sent;
+    int64_t received;
+    zoo_slow_op_t *slow; /* what the slow log keeps of the request, while it's on */
 } completion_list_t;
 
+#define completion_of_timer(t) \
+    ((completion_list_t*)((char*)(t) - offsetof(completion_list_t, timer)))
+
 const char*err2string(int err);
 static int queue_session_event(zhandle_t *zh, int state);
 static const char* format_endpoint_info(const struct sockaddr_storage* ep);
+static void format_endpoint(const struct sockaddr_storage* ep, char *buf,
+        size_t len);
 static const char* format_current_endpoint_info(zhandle_t* zh);
 
 /* deserialize forward declarations */
 static void deserialize_response(int type, int xid, int failed, int rc, completion_list_t *cptr, struct iarchive *ia);
-static int deserialize_multi(int xid, completion_list_t *cptr, struct iarchive *ia);
+static int deserialize_multi(int xid, completion_list_t *cptr, struct iarchive *ia, int err);
 
 /* completion routine forward declarations */
 static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front, 
-        watcher_registration_t* wo, completion_head_t *clist);
+        const void *dc, const void *data, watcher_registration_t* wo,
+        completion_head_t *clist, struct oarchive *oa);
 static completion_list_t* create_completion_entry(int xid, int completion_type,
         const void *dc, const void *data, watcher_registration_t* wo, 
         completion_head_t *clist);
@@ -194,17 +215,85 @@ static void queue_completion_nolock(completion_head_t *list, completion_list_t *
         int add_to_front);
 static void queue_completion(completion_head_t *list, completion_list_t *c,
         int add_to_front);
+static void drain_submissions(zhandle_t *zh);
+static void drain_submissions_nolock(zhandle_t *zh);
+static void process_expired_requests(zhandle_t *zh);
+static void start_trace(zhandle_t *zh, completion_list_t *c);
+static void note_reply(zhandle_t *zh, completion_list_t *c, buffer_list_t *reply,
+        int rc);
+static void finish_trace(zhandle_t *zh, completion_list_t *c, int rc,
+        int64_t completed);
+static void free_latency(zhandle_t *zh);
+static void limit_to_deadlines(zhandle_t *zh, struct timeval *tv);
 static int handle_socket_error_msg(zhandle_t *zh, int line, int rc,
     const char* format,...);
 static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc);
+static void close_connect_attempts(zhandle_t *zh);
+static void record_server_failure(zhandle_t *zh, int index);
+static struct timeval time_after(const struct timeval *tv, int ms);
+static inline int calculate_interval(const struct timeval *start,
+        const struct timeval *end);
 
 static int disable_conn_permute=0; // permute enabled by default
 
+/* how long a connect is given before the next server is tried in parallel */
+#define DEFAULT_CONNECT_STAGGER 250
+/* how often the racing connects are checked when more than one is pending,
+ * the IO thread only waits on the newest one */
+#define CONNECT_POLL_INTERVAL 10
+/* the penalty a failure adds to the score of a server, in ms */
+#define FAILURE_PENALTY 1000
+#define MAX_FAILURE_PENALTY 60000
+/* the failure penalty halves every FAILURE_HALF_LIFE ms */
+#define FAILURE_HALF_LIFE 30000
+/* how long resolved host names are used before they are looked up again */
+#define DNS_CACHE_TTL 60000
+/* how long to wait before retrying a failed lookup */
+#define DNS_RETRY_INTERVAL 1000
+/* the backoff between connect rounds, see zoo_set_reconnect_backoff */
+#define DEFAULT_BACKOFF_BASE 100
+#define DEFAULT_BACKOFF_CAP 10000
+
+/* a token bucket pacing the connects of all the zhandles of the process */
+static struct {
+    int per_second; /* 0 means no limit */
+    int burst;
+    int tokens; /* in thousandths of a token */
+    struct timeval refilled;
+} connect_limiter = { 100, 100, 100 * 1000, { 0, 0 } };
+
 static __attribute__((unused)) void print_completion_queue(zhandle_t *zh);
 
 static void *SYNCHRONOUS_MARKER = (void*)&SYNCHRONOUS_MARKER;
 static int isValidPath(const char* path, const int flags);
 
+/* the time in ms, as used for the deadlines of the requests */
+static int64_t current_ms()
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* a monotonic time in us, as used for the request traces */
+static int64_t current_us()
+{
+#ifdef WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (int64_t)(count.QuadPart / frequency.QuadPart * 1000000
+            + count.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+#define is_tracing(zh) ((zh)->trace_hook != 0 || (zh)->trace_histograms \
+        || (zh)->slow_threshold > 0 || (zh)->hot_paths != 0)
+
 #ifdef _WINDOWS
 static int zookeeper_send(SOCKET s, const char* buf, int len)
 #else
@@ -360,6 +449,21 @@ int is_unrecoverable(zhandle_t *zh)
     return (zh->state<0)? ZINVALIDSTATE: ZOK;
 }
 
+/* true if the session is established, read-write or read-only */
+static int is_connected(zhandle_t *zh)
+{
+    return zh->state == ZOO_CONNECTED_STATE || zh->state == ZOO_READONLY_STATE;
+}
+
+/* the session to ask for in the handshake; a session that only ever ran on
+ * read-only servers is local to them and can't be resumed elsewhere */
+static int64_t handshake_session_id(zhandle_t *zh)
+{
+    if (zh->allow_read_only && !zh->seen_rw_server_before)
+        return 0;
+    return zh->client_id.client_id;
+}
+
 zk_hashtable *exists_result_checker(zhandle_t *zh, int rc)
 {
     if (rc == ZOK) {
@@ -389,7 +493,9 @@ static void destroy(zhandle_t *zh)
     if (zh == NULL) {
         return;
     }
-    /* call any outstanding completions with a special error code */
+    /* call any outstanding completions with a special error code;
+     * cleanup_bufs drains zh->submitted first, so requests that were
+     * pushed but never picked up by the IO thread are failed too */
     cleanup_bufs(zh,1,ZCLOSING);
     if (zh->hostname != 0) {
         free(zh->hostname);
@@ -400,10 +506,19 @@ static void destroy(zhandle_t *zh)
         zh->fd = -1;
         zh->state = 0;
     }
+    close_connect_attempts(zh);
     if (zh->addrs != 0) {
         free(zh->addrs);
         zh->addrs = NULL;
     }
+    if (zh->addr_stats != 0) {
+        free(zh->addr_stats);
+        zh->addr_stats = NULL;
+    }
+    if (zh->resolve_job != 0) {
+        release_resolve_job(zh->resolve_job);
+        zh->resolve_job = NULL;
+    }
 
     if (zh->chroot != 0) {
         free(zh->chroot);
@@ -414,6 +529,11 @@ static void destroy(zhandle_t *zh)
     destroy_zk_hashtable(zh->active_node_watchers);
     destroy_zk_hashtable(zh->active_exist_watchers);
     destroy_zk_hashtable(zh->active_child_watchers);
+    free_latency(zh);
+    free(zh->slow_ops);
+    zh->slow_ops = 0;
+    zk_topk_destroy(zh->hot_paths);
+    zh->hot_paths = 0;
 }
 
 static void setup_random()
@@ -469,31 +589,52 @@ static int getaddrinfo_errno(int rc) {
 }
 #endif
 
+static int same_address(const struct sockaddr_storage *a,
+        const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+        return 0;
+#if defined(AF_INET6)
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6*)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6*)b;
+        return a6->sin6_port == b6->sin6_port &&
+            memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+#endif
+    return ((const struct sockaddr_in*)a)->sin_port ==
+            ((const struct sockaddr_in*)b)->sin_port &&
+        memcmp(&((const struct sockaddr_in*)a)->sin_addr,
+            &((const struct sockaddr_in*)b)->sin_addr,
+            sizeof(struct in_addr)) == 0;
+}
+
 /**
- * fill in the addrs array of the zookeeper servers in the zhandle. after filling
- * them in, we will permute them for load balancing.
+ * resolve the comma separated host:port list into an array of addresses.
+ * With numeric_only set, hosts that are not numeric addresses are skipped
+ * and counted in *unresolved instead of being looked up, so the call never
+ * blocks on a name server.
  */
-int getaddrs(zhandle_t *zh)
+int resolve_hosts(const char *hostname, int numeric_only,
+        struct sockaddr_storage **addrs_out, int *count_out, int *unresolved)
 {
-    char *hosts = strdup(zh->hostname);
+    char *hosts = strdup(hostname);
     char *host;
     char *strtok_last;
+    struct sockaddr_storage *addrs = 0;
     struct sockaddr_storage *addr;
-    int i;
+    int addrs_count = 0;
     int rc;
     int alen = 0; /* the allocated length of the addrs array */
 
-    zh->addrs_count = 0;
-    if (zh->addrs) {
-        free(zh->addrs);
-        zh->addrs = 0;
-    }
+    *addrs_out = 0;
+    *count_out = 0;
+    *unresolved = 0;
     if (!hosts) {
          LOG_ERROR(("out of memory"));
         errno=ENOMEM;
         return ZSYSTEMERROR;
     }
-    zh->addrs = 0;
     host=strtok_r(hosts, ",", &strtok_last);
     while(host) {
         char *port_spec = strrchr(host, ':');
@@ -532,24 +673,24 @@ int getaddrs(zhandle_t *zh)
 
         /* Setup the address array */
         for(ptr = he->h_addr_list;*ptr != 0; ptr++) {
-            if (zh->addrs_count == alen) {
+            if (addrs_count == alen) {
                 alen += 16;
-                zh->addrs = realloc(zh->addrs, sizeof(*zh->addrs)*alen);
-                if (zh->addrs == 0) {
+                addrs = realloc(addrs, sizeof(*addrs)*alen);
+                if (addrs == 0) {
                     LOG_ERROR(("out of memory"));
                     errno=ENOMEM;
                     rc=ZSYSTEMERROR;
                     goto fail;
                 }
             }
-            addr = &zh->addrs[zh->addrs_count];
+            addr = &addrs[addrs_count];
             addr4 = (struct sockaddr_in*)addr;
             addr->ss_family = he->h_addrtype;
             if (addr->ss_family == AF_INET) {
                 addr4->sin_port = htons(port);
                 memset(&addr4->sin_zero, 0, sizeof(addr4->sin_zero));
                 memcpy(&addr4->sin_addr, *ptr, he->h_length);
-                zh->addrs_count++;
+                addrs_count++;
             }
 #if defined(AF_INET6)
             else if (addr->ss_family == AF_INET6) {
@@ -560,12 +701,12 @@ int getaddrs(zhandle_t *zh)
                 addr6->sin6_scope_id = 0;
                 addr6->sin6_flowinfo = 0;
                 memcpy(&addr6->sin6_addr, *ptr, he->h_length);
-                zh->addrs_count++;
+                addrs_count++;
             }
 #endif
             else {
                 LOG_WARN(("skipping unknown address family %x for %s",
-                         addr->ss_family, zh->hostname));
+                         addr->ss_family, hostname));
             }
         }
         host = strtok_r(0, ",", &strtok_last);
@@ -580,6 +721,8 @@ int getaddrs(zhandle_t *zh)
 #else
         hints.ai_flags = 0;
 #endif
+        if (numeric_only)
+            hints.ai_flags |= AI_NUMERICHOST;
         hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_protocol = IPPROTO_TCP;
@@ -592,7 +735,7 @@ int getaddrs(zhandle_t *zh)
             //EAI_BADFLAGS or EAI_ADDRFAMILY with AF_UNSPEC and 
             // ai_flags as AI_ADDRCONFIG
 #ifdef AI_ADDRCONFIG
-            if ((hints.ai_flags == AI_ADDRCONFIG) && 
+            if ((hints.ai_flags & AI_ADDRCONFIG) && 
 // ZOOKEEPER-1323 EAI_NODATA and EAI_ADDRFAMILY are deprecated in FreeBSD.
 #ifdef EAI_ADDRFAMILY
                 ((rc ==EAI_BADFLAGS) || (rc == EAI_ADDRFAMILY))) {
@@ -600,51 +743,63 @@ int getaddrs(zhandle_t *zh)
                 (rc == EAI_BADFLAGS)) {
 #endif
                 //reset ai_flags to null
-                hints.ai_flags = 0;
+                hints.ai_flags &= ~AI_ADDRCONFIG;
                 //retry getaddrinfo
                 rc = getaddrinfo(host, port_spec, &hints, &res0);
             }
 #endif
+            if (rc == EAI_NONAME && numeric_only) {
+                /* a name, leave it to the resolver */
+                (*unresolved)++;
+                host = strtok_r(0, ",", &strtok_last);
+                continue;
+            }
             if (rc != 0) {
                 errno = getaddrinfo_errno(rc);
 #ifdef WIN32
                 LOG_ERROR(("Win32 message: %s\n", gai_strerror(rc)));
 #else
-                LOG_ERROR(("getaddrinfo: %s\n", strerror(errno)));
+                LOG_ERROR(("getaddrinfo %s: %s\n", host, strerror(errno)));
 #endif
-                rc=ZSYSTEMERROR;
-                goto fail;
+                if (errno == ENOMEM) {
+                    rc=ZSYSTEMERROR;
+                    goto fail;
+                }
+                /* the other servers may still be reachable */
+                (*unresolved)++;
+                host = strtok_r(0, ",", &strtok_last);
+                continue;
             }
         }
 
         for (res = res0; res; res = res->ai_next) {
             // Expand address list if needed
-            if (zh->addrs_count == alen) {
+            if (addrs_count == alen) {
                 void *tmpaddr;
                 alen += 16;
-                tmpaddr = realloc(zh->addrs, sizeof(*zh->addrs)*alen);
+                tmpaddr = realloc(addrs, sizeof(*addrs)*alen);
                 if (tmpaddr == 0) {
                     LOG_ERROR(("out of memory"));
                     errno=ENOMEM;
                     rc=ZSYSTEMERROR;
                     goto fail;
                 }
-                zh->addrs=tmpaddr;
+                addrs=tmpaddr;
             }
 
             // Copy addrinfo into address list
-            addr = &zh->addrs[zh->addrs_count];
+            addr = &addrs[addrs_count];
             switch (res->ai_family) {
             case AF_INET:
 #if defined(AF_INET6)
             case AF_INET6:
 #endif
                 memcpy(addr, res->ai_addr, res->ai_addrlen);
-                ++zh->addrs_count;
+                ++addrs_count;
                 break;
             default:
                 LOG_WARN(("skipping unknown address family %x for %s",
-                res->ai_family, zh->hostname));
+                res->ai_family, hostname));
                 break;
             }
         }
@@ -656,27 +811,237 @@ int getaddrs(zhandle_t *zh)
 #endif
     }
     free(hosts);
+    if (addrs_count == 0 && *unresolved > 0 && !numeric_only) {
+        errno=ENOENT;
+        return ZSYSTEMERROR;
+    }
+    *addrs_out = addrs;
+    *count_out = addrs_count;
+    return ZOK;
+fail:
+    if (addrs) {
+        free(addrs);
+    }
+    if (hosts) {
+        free(hosts);
+    }
+    return rc;
+}
+
+/**
+ * Addresses resolved by name, shared by all the handles of the process.
+ * Looking the names up again is left to the resolver once an entry is
+ * older than DNS_CACHE_TTL.
+ */
+typedef struct _dns_cache_entry {
+    char *hosts;
+    struct sockaddr_storage *addrs;
+    int addrs_count;
+    struct timeval resolved;
+    struct _dns_cache_entry *next;
+} dns_cache_entry_t;
+
+static dns_cache_entry_t *dns_cache = 0;
+
+/* returns ZOK and a copy of the cached addresses if they are fresh */
+static int dns_cache_lookup(const char *hosts, struct sockaddr_storage **addrs,
+        int *count, struct timeval *resolved)
+{
+    dns_cache_entry_t *e;
+    struct timeval now;
+    int rc = ZNOTHING;
+
+    gettimeofday(&now, 0);
+    lock_dns_cache();
+    for (e = dns_cache; e; e = e->next) {
+        if (strcmp(e->hosts, hosts) == 0) {
+            if (calculate_interval(&e->resolved, &now) < DNS_CACHE_TTL) {
+                *addrs = malloc((e->addrs_count ? e->addrs_count : 1) *
+                        sizeof(**addrs));
+                if (*addrs) {
+                    memcpy(*addrs, e->addrs, e->addrs_count * sizeof(**addrs));
+                    *count = e->addrs_count;
+                    *resolved = e->resolved;
+                    rc = ZOK;
+                }
+            }
+            break;
+        }
+    }
+    unlock_dns_cache();
+    return rc;
+}
 
+void dns_cache_store(const char *hosts, const struct sockaddr_storage *addrs,
+        int count)
+{
+    dns_cache_entry_t *e;
+    struct sockaddr_storage *copy = malloc((count ? count : 1) * sizeof(*copy));
+
+    if (copy == 0)
+        return;
+    memcpy(copy, addrs, count * sizeof(*copy));
+    lock_dns_cache();
+    for (e = dns_cache; e; e = e->next) {
+        if (strcmp(e->hosts, hosts) == 0)
+            break;
+    }
+    if (e == 0) {
+        e = calloc(1, sizeof(*e));
+        if (e)
+            e->hosts = strdup(hosts);
+        if (e == 0 || e->hosts == 0) {
+            unlock_dns_cache();
+            if (e)
+                free(e);
+            free(copy);
+            return;
+        }
+        e->next = dns_cache;
+        dns_cache = e;
+    } else {
+        free(e->addrs);
+    }
+    e->addrs = copy;
+    e->addrs_count = count;
+    gettimeofday(&e->resolved, 0);
+    unlock_dns_cache();
+}
+
+/**
+ * make addrs the addresses of the zhandle. after filling them in, we will
+ * permute them for load balancing. The statistics of the addresses that
+ * were in the previous list are carried over. Takes ownership of addrs.
+ */
+static int install_addrs(zhandle_t *zh, struct sockaddr_storage *addrs,
+        int count)
+{
+    server_stats_t *stats;
+    int i;
+
+    stats = calloc(count ? count : 1, sizeof(*stats));
+    if (stats == 0) {
+        LOG_ERROR(("out of memory"));
+        free(addrs);
+        errno=ENOMEM;
+        return ZSYSTEMERROR;
+    }
     if(!disable_conn_permute){
         setup_random();
         /* Permute */
-        for (i = zh->addrs_count - 1; i > 0; --i) {
+        for (i = count - 1; i > 0; --i) {
             long int j = random()%(i+1);
             if (i != j) {
-                struct sockaddr_storage t = zh->addrs[i];
-                zh->addrs[i] = zh->addrs[j];
-                zh->addrs[j] = t;
+                struct sockaddr_storage t = addrs[i];
+                addrs[i] = addrs[j];
+                addrs[j] = t;
             }
         }
     }
-    return ZOK;
-fail:
-    if (zh->addrs) {
+    /* keep what we know about the addresses that are still there */
+    for (i = 0; i < count; i++) {
+        int j;
+        stats[i].rtt = -1;
+        for (j = 0; j < zh->addrs_count; j++) {
+            if (same_address(&addrs[i], &zh->addrs[j])) {
+                stats[i] = zh->addr_stats[j];
+                break;
+            }
+        }
+    }
+    if (zh->addrs)
         free(zh->addrs);
-        zh->addrs=0;
+    if (zh->addr_stats)
+        free(zh->addr_stats);
+    zh->addrs = addrs;
+    zh->addr_stats = stats;
+    zh->addrs_count = count;
+    return ZOK;
+}
+
+/**
+ * Installs the result of a finished resolution. Returns ZNOTHING if none
+ * has finished.
+ */
+static int take_resolved_addrs(zhandle_t *zh)
+{
+    resolve_job_t *job = zh->resolve_job;
+    int rc;
+
+    if (job == 0 || !resolve_job_done(job))
+        return ZNOTHING;
+    zh->resolve_job = 0;
+    rc = job->rc;
+    if (rc == ZOK) {
+        LOG_DEBUG(("resolved %s to %d addresses", job->hosts,
+                job->addrs_count));
+        gettimeofday(&zh->addrs_resolved, 0);
+        rc = install_addrs(zh, job->addrs, job->addrs_count);
+        job->addrs = 0;
+    } else {
+        LOG_ERROR(("failed to resolve %s, keeping %d known addresses",
+                job->hosts, zh->addrs_count));
     }
-    if (hosts) {
-        free(hosts);
+    release_resolve_job(job);
+    return rc;
+}
+
+/**
+ * Starts resolving the host names of the zhandle off the calling thread,
+ * unless the process wide cache already has fresh addresses for them.
+ */
+static int refresh_addrs(zhandle_t *zh)
+{
+    struct sockaddr_storage *addrs;
+    int count;
+
+    if (zh->resolve_job)
+        return ZOK;
+    if (dns_cache_lookup(zh->hostname, &addrs, &count,
+            &zh->addrs_resolved) == ZOK)
+        return install_addrs(zh, addrs, count);
+    gettimeofday(&zh->resolve_started, 0);
+    zh->resolve_job = start_resolve_job(zh->hostname);
+    if (zh->resolve_job == 0) {
+        LOG_ERROR(("out of memory"));
+        errno=ENOMEM;
+        return ZSYSTEMERROR;
+    }
+    return ZOK;
+}
+
+/**
+ * fill in the addrs array of the zookeeper servers in the zhandle. Numeric
+ * addresses are used right away; host names are looked up by the adaptor
+ * and their addresses installed once the lookup completes.
+ */
+int getaddrs(zhandle_t *zh)
+{
+    struct sockaddr_storage *addrs, *cached;
+    int count, cached_count;
+    int unresolved;
+    int rc;
+
+    rc = resolve_hosts(zh->hostname, 1, &addrs, &count, &unresolved);
+    if (rc != ZOK)
+        return rc;
+    if (unresolved == 0)
+        return install_addrs(zh, addrs, count);
+    zh->needs_dns = 1;
+    if (dns_cache_lookup(zh->hostname, &cached, &cached_count,
+            &zh->addrs_resolved) == ZOK) {
+        free(addrs);
+        return install_addrs(zh, cached, cached_count);
+    }
+    rc = install_addrs(zh, addrs, count);
+    if (rc == ZOK)
+        rc = refresh_addrs(zh);
+    if (rc == ZOK && zh->resolve_job && resolve_job_done(zh->resolve_job)) {
+        /* the adaptor resolved synchronously */
+        rc = take_resolved_addrs(zh);
+        if (rc != ZOK && zh->addrs_count == 0)
+            return rc;
+        rc = ZOK;
     }
     return rc;
 }
@@ -702,7 +1067,7 @@ watcher_fn zoo_set_watcher(zhandle_t *zh,watcher_fn newFn)
 struct sockaddr* zookeeper_get_connected_host(zhandle_t *zh,
                  struct sockaddr *addr, socklen_t *addr_len)
 {
-    if (zh->state!=ZOO_CONNECTED_STATE) {
+    if (!is_connected(zh)) {
         return NULL;
     }
     if (getpeername(zh->fd, addr, addr_len)==-1) {
@@ -851,11 +1216,20 @@ zhandle_t *zookeeper_init(const char *host, watcher_fn watcher,
         goto abort;
     }
     zh->connect_index = 0;
+    zh->attempts_count = 0;
+    zh->max_attempts = MAX_CONNECT_ATTEMPTS;
+    zh->connect_stagger = DEFAULT_CONNECT_STAGGER;
+    zh->backoff_base = DEFAULT_BACKOFF_BASE;
+    zh->backoff_cap = DEFAULT_BACKOFF_CAP;
+    gettimeofday(&zh->disconnected_at, 0);
     if (clientid) {
         memcpy(&zh->client_id, clientid, sizeof(zh->client_id));
     } else {
         memset(&zh->client_id, 0, sizeof(zh->client_id));
     }
+    zh->allow_read_only = (flags & ZOO_READONLY) != 0;
+    /* a session handed in by the application is resumed as it is */
+    zh->seen_rw_server_before = zh->client_id.client_id != 0;
     zh->primer_buffer.buffer = zh->primer_storage_buffer;
     zh->primer_buffer.curr_offset = 0;
     zh->primer_buffer.len = sizeof(zh->primer_storage_buffer);
@@ -866,6 +1240,7 @@ zhandle_t *zookeeper_init(const char *host, watcher_fn watcher,
     zh->active_node_watchers=create_zk_hashtable();
     zh->active_exist_watchers=create_zk_hashtable();
     zh->active_child_watchers=create_zk_hashtable();
+    zk_timerwheel_init(&zh->request_timers, current_ms());
 
     if (adaptor_init(zh) == -1) {
         goto abort;
@@ -964,6 +1339,8 @@ static buffer_list_t *dequeue_buffer(buffer_head_t *list)
             assert(b == list->last);
             list->last = 0;
         }
+        list->count--;
+        list->bytes -= b->len;
     }
     unlock_buffer_list(list);
     return b;
@@ -979,10 +1356,12 @@ static int remove_buffer(buffer_head_t *list)
     return 1;
 }
 
-static void queue_buffer(buffer_head_t *list, buffer_list_t *b, int add_to_front)
+static void queue_buffer_nolock(buffer_head_t *list, buffer_list_t *b,
+        int add_to_front)
 {
     b->next = 0;
-    lock_buffer_list(list);
+    list->count++;
+    list->bytes += b->len;
     if (list->head) {
         assert(list->last);
         // The list is not empty
@@ -999,6 +1378,12 @@ static void queue_buffer(buffer_head_t *list, buffer_list_t *b, int add_to_front
         list->head = b;
         list->last = b;
     }
+}
+
+static void queue_buffer(buffer_head_t *list, buffer_list_t *b, int add_to_front)
+{
+    lock_buffer_list(list);
+    queue_buffer_nolock(list, b, add_to_front);
     unlock_buffer_list(list);
 }
 
@@ -1020,17 +1405,6 @@ static int queue_front_buffer_bytes(buffer_head_t *list, char *buff, int len)
     return ZOK;
 }
 
-static __attribute__ ((unused)) int get_queue_len(buffer_head_t *list)
-{
-    int i;
-    buffer_list_t *ptr;
-    lock_buffer_list(list);
-    ptr = list->head;
-    for (i=0; ptr!=0; ptr=ptr->next, i++)
-        ;
-    unlock_buffer_list(list);
-    return i;
-}
 /* returns:
  * -1 if send failed,
  * 0 if send would block while sending the buffer (or a send was incomplete),
@@ -1156,11 +1530,29 @@ void free_buffers(buffer_head_t *list)
         ;
 }
 
-void free_completions(zhandle_t *zh,int callCompletion,int reason)
+/* a reply header without a body, to complete a request locally */
+static buffer_list_t *fake_reply(int xid, int err)
 {
-    completion_head_t tmp_list;
     struct oarchive *oa;
     struct ReplyHeader h;
+    buffer_list_t *bptr;
+
+    h.xid = xid;
+    h.zxid = -1;
+    h.err = err;
+    oa = create_buffer_oarchive();
+    serialize_ReplyHeader(oa, "header", &h);
+    bptr = calloc(sizeof(*bptr), 1);
+    assert(bptr);
+    bptr->len = get_buffer_len(oa);
+    bptr->buffer = get_buffer(oa);
+    close_buffer_oarchive(&oa, 0);
+    return bptr;
+}
+
+void free_completions(zhandle_t *zh,int callCompletion,int reason)
+{
+    completion_head_t tmp_list;
     void_completion_t auth_completion = NULL;
     auth_completion_list_t a_list, *a_tmp;
 	a_list.completion = NULL;
@@ -1170,13 +1562,18 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
         tmp_list = zh->sent_requests;
         zh->sent_requests.head = 0;
         zh->sent_requests.last = 0;
+        zh->sent_requests.count = 0;
+        zk_timerwheel_init(&zh->request_timers, current_ms());
         unlock_completion_list(&zh->sent_requests);
     
         while (tmp_list.head) {
             completion_list_t *cptr = tmp_list.head;
 
             tmp_list.head = cptr->next;
-            if (cptr->c.data_result == SYNCHRONOUS_MARKER) {
+            if (cptr->timed_out) {
+                /* the caller was already told */
+                destroy_completion_entry(cptr);
+            } else if (cptr->c.data_result == SYNCHRONOUS_MARKER) {
                 struct sync_completion
                             *sc = (struct sync_completion*)cptr->data;
                 sc->rc = reason;
@@ -1185,18 +1582,7 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
                 destroy_completion_entry(cptr);
             } else if (callCompletion) {
                 // Fake the response
-                buffer_list_t *bptr;
-                h.xid = cptr->xid;
-                h.zxid = -1;
-                h.err = reason;
-                oa = create_buffer_oarchive();
-                serialize_ReplyHeader(oa, "header", &h);
-                bptr = calloc(sizeof(*bptr), 1);
-                assert(bptr);
-                bptr->len = get_buffer_len(oa);
-                bptr->buffer = get_buffer(oa);
-                close_buffer_oarchive(&oa, 0);
-                cptr->buffer = bptr;
+                cptr->buffer = fake_reply(cptr->xid, reason);
                 queue_completion(&zh->completions_to_process, cptr, 0);
             }
         }
@@ -1223,6 +1609,7 @@ void free_completions(zhandle_t *zh,int callCompletion,int reason)
 static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc)
 {
     enter_critical(zh);
+    drain_submissions_nolock(zh);
     free_buffers(&zh->to_send);
     free_buffers(&zh->to_process);
     free_completions(zh,callCompletion,rc);
@@ -1235,18 +1622,36 @@ static void cleanup_bufs(zhandle_t *zh,int callCompletion,int rc)
 
 static void handle_error(zhandle_t *zh,int rc)
 {
+    int was_connected = is_connected(zh);
     close(zh->fd);
+    zh->socket_readable.tv_sec = zh->socket_readable.tv_usec = 0;
+    if (zh->connect_index < zh->addrs_count)
+        record_server_failure(zh, zh->connect_index);
+    if (zh->disconnected_at.tv_sec == 0) {
+        /* the session was lost, spread the reconnects of the clients
+         * that were dropped at the same time */
+        gettimeofday(&zh->disconnected_at, 0);
+        zh->next_connect = time_after(&zh->disconnected_at,
+                random() % (zh->backoff_base + 1));
+    }
     if (is_unrecoverable(zh)) {
         LOG_DEBUG(("Calling a watcher for a ZOO_SESSION_EVENT and the state=%s",
                 state2String(zh->state)));
         PROCESS_SESSION_EVENT(zh, zh->state);
-    } else if (zh->state == ZOO_CONNECTED_STATE) {
+    } else if (is_connected(zh)) {
         LOG_DEBUG(("Calling a watcher for a ZOO_SESSION_EVENT and the state=CONNECTING_STATE"));
         PROCESS_SESSION_EVENT(zh, ZOO_CONNECTING_STATE);
     }
     cleanup_bufs(zh,1,rc);
     zh->fd = -1;
-    zh->connect_index++;
+    /* an established connection was lost: start a new round so the servers
+     * are ordered again, the one that dropped us is penalized above and a
+     * faster server that has recovered is tried first. A failed handshake
+     * moves on to the next server of the current round */
+    if (was_connected && !disable_conn_permute)
+        zh->connect_index = 0;
+    else
+        zh->connect_index++;
     if (!is_unrecoverable(zh)) {
         zh->state = 0;
     }
@@ -1369,51 +1774,120 @@ static int send_last_auth_info(zhandle_t *zh)
     return (rc < 0)?ZMARSHALLINGERROR:ZOK;
 }
 
-static void free_key_list(char **list, int count)
-{
-    int i;
+/* the serialized size of the paths carried by a single SetWatches request;
+ * keeps every chunk well below the server's jute.maxbuffer */
+#define SET_WATCHES_MAX_LENGTH (128 * 1024)
+/* the number of SetWatches chunks allowed on the wire at the same time */
+#define SET_WATCHES_WINDOW 4
 
-    for(i = 0; i < count; i++) {
-        free(list[i]);
+static zk_hashtable *set_watches_table(zhandle_t *zh, int table)
+{
+    switch (table) {
+    case 0:
+        return zh->active_node_watchers;
+    case 1:
+        return zh->active_exist_watchers;
+    case 2:
+        return zh->active_child_watchers;
     }
-    free(list);
+    return 0;
 }
 
-static int send_set_watches(zhandle_t *zh)
+/**
+ * Builds the next SetWatches request straight from the watcher tables and
+ * queues it. Returns ZNOTHING if all the watches have already been sent.
+ */
+static int send_set_watches_chunk(zhandle_t *zh, int add_to_front)
 {
     struct oarchive *oa;
     struct RequestHeader h = { STRUCT_INITIALIZER(xid , SET_WATCHES_XID), STRUCT_INITIALIZER(type , ZOO_SETWATCHES_OP)};
     struct SetWatches req;
+    struct String_vector *keys[3];
+    set_watches_state_t *sw = &zh->set_watches;
+    int budget = SET_WATCHES_MAX_LENGTH;
     int rc;
 
-    req.relativeZxid = zh->last_zxid;
-    req.dataWatches.data = collect_keys(zh->active_node_watchers, (int*)&req.dataWatches.count);
-    req.existWatches.data = collect_keys(zh->active_exist_watchers, (int*)&req.existWatches.count);
-    req.childWatches.data = collect_keys(zh->active_child_watchers, (int*)&req.childWatches.count);
+    memset(&req, 0, sizeof(req));
+    req.relativeZxid = sw->zxid;
+    keys[0] = &req.dataWatches;
+    keys[1] = &req.existWatches;
+    keys[2] = &req.childWatches;
+    while (sw->table < 3 && budget > 0) {
+        if (collect_keys_chunk(set_watches_table(zh, sw->table), &sw->cursor,
+                keys[sw->table], &budget)) {
+            sw->table++;
+            memset(&sw->cursor, 0, sizeof(sw->cursor));
+        }
+    }
 
     // return if there are no pending watches
     if (!req.dataWatches.count && !req.existWatches.count &&
         !req.childWatches.count) {
-        free_key_list(req.dataWatches.data, req.dataWatches.count);
-        free_key_list(req.existWatches.data, req.existWatches.count);
-        free_key_list(req.childWatches.data, req.childWatches.count);
-        return ZOK;
+        return ZNOTHING;
     }
 
-
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetWatches(oa, "req", &req);
-    /* add this buffer to the head of the send queue */
-    rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    /* We queued the buffer, so don't free it */   
-    close_buffer_oarchive(&oa, 0);
-    free_key_list(req.dataWatches.data, req.dataWatches.count);
-    free_key_list(req.existWatches.data, req.existWatches.count);
-    free_key_list(req.childWatches.data, req.childWatches.count);
-    LOG_DEBUG(("Sending set watches request to %s",format_current_endpoint_info(zh)));
-    return (rc < 0)?ZMARSHALLINGERROR:ZOK;
+    if (add_to_front) {
+        rc = rc < 0 ? rc : queue_front_buffer_bytes(&zh->to_send, get_buffer(oa),
+                get_buffer_len(oa));
+    } else {
+        rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
+                get_buffer_len(oa));
+    }
+    /* We queued the buffer, so don't free it */
+    close_buffer_oarchive(&oa, rc < 0);
+    /* the paths belong to the watcher tables, only the arrays are ours */
+    free(req.dataWatches.data);
+    free(req.existWatches.data);
+    free(req.childWatches.data);
+    if (rc < 0) {
+        return ZMARSHALLINGERROR;
+    }
+    sw->outstanding++;
+    LOG_DEBUG(("Sending set watches request (%d data, %d exist, %d child) to %s",
+            req.dataWatches.count, req.existWatches.count, req.childWatches.count,
+            format_current_endpoint_info(zh)));
+    return ZOK;
+}
+
+/**
+ * Keeps up to SET_WATCHES_WINDOW SetWatches chunks in flight until all the
+ * watches have been restored. Called once the connection is established and
+ * then each time the server acknowledges a chunk, so that the restore is
+ * interleaved with the regular traffic instead of blocking it.
+ */
+static int send_set_watches(zhandle_t *zh)
+{
+    int rc = ZOK;
+
+    while (zh->set_watches.table < 3 &&
+            zh->set_watches.outstanding < SET_WATCHES_WINDOW) {
+        rc = send_set_watches_chunk(zh, 0);
+        if (rc != ZOK) {
+            break;
+        }
+    }
+    return rc == ZNOTHING ? ZOK : rc;
+}
+
+/**
+ * Starts restoring the watches on a newly established connection. The first
+ * chunk goes to the head of the send queue, the rest follow the requests
+ * that were queued while we were disconnected.
+ */
+static int start_set_watches(zhandle_t *zh)
+{
+    int rc;
+
+    memset(&zh->set_watches, 0, sizeof(zh->set_watches));
+    zh->set_watches.zxid = zh->last_zxid;
+    rc = send_set_watches_chunk(zh, 1);
+    if (rc != ZOK) {
+        return rc == ZNOTHING ? ZOK : rc;
+    }
+    return send_set_watches(zh);
 }
 
 static int serialize_prime_connect(struct connect_req *req, char* buffer){
@@ -1440,6 +1914,9 @@ static int serialize_prime_connect(struct connect_req *req, char* buffer){
     offset = offset +  sizeof(req->passwd_len);
 
     memcpy(buffer + offset, req->passwd, sizeof(req->passwd));
+    offset = offset +  sizeof(req->passwd);
+
+    memcpy(buffer + offset, &req->readOnly, sizeof(req->readOnly));
 
     return 0;
 }
@@ -1468,6 +1945,9 @@ static int serialize_prime_connect(struct connect_req *req, char* buffer){
 
      req->passwd_len = ntohl(req->passwd_len);
      memcpy(req->passwd, buffer + offset, sizeof(req->passwd));
+     offset = offset +  sizeof(req->passwd);
+
+     memcpy(&req->readOnly, buffer + offset, sizeof(req->readOnly));
      return 0;
  }
 
@@ -1480,11 +1960,12 @@ static int prime_connection(zhandle_t *zh)
     int hlen = 0;
     struct connect_req req;
     req.protocolVersion = 0;
-    req.sessionId = zh->client_id.client_id;
+    req.sessionId = handshake_session_id(zh);
     req.passwd_len = sizeof(req.passwd);
     memcpy(req.passwd, zh->client_id.passwd, sizeof(zh->client_id.passwd));
     req.timeOut = zh->recv_timeout;
     req.lastZxidSeen = zh->last_zxid;
+    req.readOnly = zh->allow_read_only ? 1 : 0;
     hlen = htonl(len);
     /* We are running fast and loose here, but this string should fit in the initial buffer! */
     rc=zookeeper_send(zh->fd, &hlen, sizeof(len));
@@ -1494,6 +1975,8 @@ static int prime_connection(zhandle_t *zh)
         return handle_socket_error_msg(zh, __LINE__, ZCONNECTIONLOSS,
                 "failed to send a handshake packet: %s", strerror(errno));
     }
+    zh->stats.bytes_out += sizeof(len) + len;
+    zh->stats.frames_out++;
     zh->state = ZOO_ASSOCIATING_STATE;
 
     zh->input_buffer = &zh->primer_buffer;
@@ -1527,10 +2010,6 @@ static struct timeval get_timeval(int interval)
     return tv;
 }
 
- static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-     const void *data);
- static int add_string_completion(zhandle_t *zh, int xid,
-     string_completion_t dc, const void *data);
 
  int send_ping(zhandle_t* zh)
  {
@@ -1548,105 +2027,506 @@ static struct timeval get_timeval(int interval)
     return rc<0 ? rc : adaptor_send_queue(zh, 0);
 }
 
-#ifdef WIN32
-int zookeeper_interest(zhandle_t *zh, SOCKET *fd, int *interest,
-     struct timeval *tv)
+static struct timeval time_after(const struct timeval *tv, int ms)
 {
+    struct timeval t = *tv;
+    t.tv_sec += ms / 1000;
+    t.tv_usec += (ms % 1000) * 1000;
+    if (t.tv_usec >= 1000000) {
+        t.tv_sec += t.tv_usec / 1000000;
+        t.tv_usec = t.tv_usec % 1000000;
+    }
+    return t;
+}
 
-    ULONG nonblocking_flag = 1;
-#else
-int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
-     struct timeval *tv)
+/**
+ * Takes a token from the process wide connect limiter. Returns 0 if one was
+ * available, otherwise the ms until there will be one.
+ */
+static int take_connect_token(const struct timeval *now)
 {
-#endif
-    struct timeval now;
-    if(zh==0 || fd==0 ||interest==0 || tv==0)
-        return ZBADARGUMENTS;
-    if (is_unrecoverable(zh))
-        return ZINVALIDSTATE;
-    gettimeofday(&now, 0);
-    if(zh->next_deadline.tv_sec!=0 || zh->next_deadline.tv_usec!=0){
-        int time_left = calculate_interval(&zh->next_deadline, &now);
-        if (time_left > 10)
-            LOG_WARN(("Exceeded deadline by %dms", time_left));
+    int wait = 0;
+    lock_connect_limiter();
+    if (connect_limiter.per_second > 0) {
+        int burst = connect_limiter.burst * 1000;
+        if (connect_limiter.refilled.tv_sec == 0) {
+            connect_limiter.tokens = burst;
+        } else if (now->tv_sec - connect_limiter.refilled.tv_sec >= 60) {
+            connect_limiter.tokens = burst;
+        } else {
+            int elapsed = calculate_interval(&connect_limiter.refilled, now);
+            long long tokens = connect_limiter.tokens;
+            if (elapsed > 0)
+                tokens += (long long)elapsed * connect_limiter.per_second;
+            connect_limiter.tokens = tokens > burst ? burst : (int)tokens;
+        }
+        connect_limiter.refilled = *now;
+        if (connect_limiter.tokens >= 1000) {
+            connect_limiter.tokens -= 1000;
+        } else {
+            wait = (1000 - connect_limiter.tokens + connect_limiter.per_second - 1)
+                / connect_limiter.per_second;
+        }
     }
-    api_prolog(zh);
-    *fd = zh->fd;
-    *interest = 0;
-    tv->tv_sec = 0;
-    tv->tv_usec = 0;
-    if (*fd == -1) {
-        if (zh->connect_index == zh->addrs_count) {
-            /* Wait a bit before trying again so that we don't spin */
-            zh->connect_index = 0;
-        }else {
-            int rc;
-#ifdef WIN32
-            char enable_tcp_nodelay = 1;
-#else
-            int enable_tcp_nodelay = 1;
-#endif
-            int ssoresult;
+    unlock_connect_limiter();
+    return wait;
+}
 
-            zh->fd = socket(zh->addrs[zh->connect_index].ss_family, SOCK_STREAM, IPPROTO_TCP);
-            if (zh->fd < 0) {
-                return api_epilog(zh,handle_socket_error_msg(zh,__LINE__,
-                                                             ZSYSTEMERROR, "socket() call failed"));
-            }
-            ssoresult = setsockopt(zh->fd, IPPROTO_TCP, TCP_NODELAY, &enable_tcp_nodelay, sizeof(enable_tcp_nodelay));
-            if (ssoresult != 0) {
-                LOG_WARN(("Unable to set TCP_NODELAY, operation latency may be effected"));
-            }
-#ifdef WIN32
-            //ioctlsocket(zh->fd, FIONBIO, &nonblocking_flag);                    
-#else
-            fcntl(zh->fd, F_SETFL, O_NONBLOCK|fcntl(zh->fd, F_GETFL, 0));
-#endif
-#if defined(AF_INET6)
-            if (zh->addrs[zh->connect_index].ss_family == AF_INET6) {
-                rc = connect(zh->fd, (struct sockaddr*) &zh->addrs[zh->connect_index], sizeof(struct sockaddr_in6));
-            } else {
-#else
-               LOG_DEBUG(("[zk] connect()\n"));
-            {
-#endif
-                rc = connect(zh->fd, (struct sockaddr*) &zh->addrs[zh->connect_index], sizeof(struct sockaddr_in));
-#ifdef WIN32
-                get_errno();
-#if _MSC_VER >= 1600
-                switch (errno) {
-                case WSAEWOULDBLOCK:
-                    errno = EWOULDBLOCK;
-                    break;
-                case WSAEINPROGRESS:
-                    errno = EINPROGRESS;
-                    break;
-                }
-#endif
-#endif
-            }
-            if (rc == -1) {
-                /* we are handling the non-blocking connect according to
-                 * the description in section 16.3 "Non-blocking connect"
-                 * in UNIX Network Programming vol 1, 3rd edition */
-                if (errno == EWOULDBLOCK || errno == EINPROGRESS)
-                    zh->state = ZOO_CONNECTING_STATE;
-                else
-                    return api_epilog(zh,handle_socket_error_msg(zh,__LINE__,
-                            ZCONNECTIONLOSS,"connect() call failed"));
-            } else {
-                if((rc=prime_connection(zh))!=0)
-                    return api_epilog(zh,rc);
+/* a session was established, account for the time it took */
+static void record_reconnect(zhandle_t *zh)
+{
+    struct timeval now;
+    int elapsed;
 
-                LOG_INFO(("Initiated connection to server [%s]",
-                        format_endpoint_info(&zh->addrs[zh->connect_index])));
-            }
-        }
+    gettimeofday(&now, 0);
+    elapsed = calculate_interval(&zh->disconnected_at, &now);
+    zh->connect_stats.reconnects++;
+    zh->connect_stats.total_reconnect_ms += elapsed;
+    zh->connect_stats.last_reconnect_ms = elapsed;
+    if (elapsed > zh->connect_stats.max_reconnect_ms)
+        zh->connect_stats.max_reconnect_ms = elapsed;
+    zh->disconnected_at.tv_sec = zh->disconnected_at.tv_usec = 0;
+    zh->failed_rounds = 0;
+}
+
+/* the full jitter backoff after a failed connect round */
+static int backoff_delay(zhandle_t *zh)
+{
+    int shift = zh->failed_rounds < 16 ? zh->failed_rounds : 16;
+    long long delay = (long long)zh->backoff_base << shift;
+    if (delay > zh->backoff_cap)
+        delay = zh->backoff_cap;
+    return (int)(random() % (delay + 1));
+}
+
+/* the failure penalty of the server after the decay up to now */
+static int current_penalty(server_stats_t *stats, const struct timeval *now)
+{
+    int elapsed;
+    int penalty = stats->penalty;
+    if (penalty == 0)
+        return 0;
+    /* after 16 half-lives any penalty has decayed to nothing; checking the
+     * seconds first also keeps calculate_interval, which returns int
+     * milliseconds, from overflowing for a failure long ago */
+    if (now->tv_sec - stats->last_failure.tv_sec >= 16 * FAILURE_HALF_LIFE / 1000)
+        return 0;
+    elapsed = calculate_interval(&stats->last_failure, now);
+    /* the wall clock may have been set back since the failure */
+    if (elapsed < 0)
+        elapsed = 0;
+    for (; elapsed >= FAILURE_HALF_LIFE && penalty > 0;
+            elapsed -= FAILURE_HALF_LIFE)
+        penalty /= 2;
+    return penalty - (int)((long long)penalty * elapsed / (2 * FAILURE_HALF_LIFE));
+}
+
+static void record_server_rtt(zhandle_t *zh, int index, int rtt)
+{
+    server_stats_t *stats = &zh->addr_stats[index];
+    if (rtt < 0)
+        rtt = 0;
+    /* the same smoothing as the TCP round trip time estimate */
+    if (stats->rtt < 0)
+        stats->rtt = rtt;
+    else
+        stats->rtt = (7 * stats->rtt + rtt) / 8;
+}
+
+static void record_server_failure(zhandle_t *zh, int index)
+{
+    server_stats_t *stats = &zh->addr_stats[index];
+    struct timeval now;
+    gettimeofday(&now, 0);
+    stats->penalty = current_penalty(stats, &now) + FAILURE_PENALTY;
+    if (stats->penalty > MAX_FAILURE_PENALTY)
+        stats->penalty = MAX_FAILURE_PENALTY;
+    stats->last_failure = now;
+}
+
+/**
+ * Orders the servers by measured latency plus the penalty for recent
+ * failures. Servers that were never measured count as the average of the
+ * measured ones, and ties keep the permuted order.
+ */
+static void order_servers(zhandle_t *zh)
+{
+    struct timeval now;
+    int *score;
+    int i, j;
+    int measured = 0;
+    long long total = 0;
+    int unknown_rtt = 0;
+
+    if (disable_conn_permute || zh->addrs_count < 2)
+        return;
+    score = malloc(zh->addrs_count * sizeof(*score));
+    if (score == 0)
+        return;
+    gettimeofday(&now, 0);
+    for (i = 0; i < zh->addrs_count; i++) {
+        if (zh->addr_stats[i].rtt >= 0) {
+            total += zh->addr_stats[i].rtt;
+            measured++;
+        }
+    }
+    if (measured > 0)
+        unknown_rtt = (int)(total / measured);
+    for (i = 0; i < zh->addrs_count; i++) {
+        server_stats_t *stats = &zh->addr_stats[i];
+        score[i] = (stats->rtt >= 0 ? stats->rtt : unknown_rtt) +
+            current_penalty(stats, &now);
+    }
+    /* insertion sort: there are only a handful of servers and it is stable */
+    for (i = 1; i < zh->addrs_count; i++) {
+        struct sockaddr_storage addr = zh->addrs[i];
+        server_stats_t stats = zh->addr_stats[i];
+        int s = score[i];
+        for (j = i; j > 0 && score[j-1] > s; j--) {
+            zh->addrs[j] = zh->addrs[j-1];
+            zh->addr_stats[j] = zh->addr_stats[j-1];
+            score[j] = score[j-1];
+        }
+        zh->addrs[j] = addr;
+        zh->addr_stats[j] = stats;
+        score[j] = s;
+    }
+    free(score);
+}
+
+/**
+ * Starts a non-blocking connect to the server at the given index. Returns 1
+ * if the connect is in progress, 0 if it completed right away and -1 if it
+ * failed.
+ */
+static int start_connect(zhandle_t *zh, int index, connect_attempt_t *attempt)
+{
+    int rc;
+#ifdef WIN32
+    char enable_tcp_nodelay = 1;
+#else
+    int enable_tcp_nodelay = 1;
+#endif
+    int ssoresult;
+
+    attempt->index = index;
+    gettimeofday(&attempt->started, 0);
+    attempt->fd = socket(zh->addrs[index].ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (attempt->fd < 0) {
+        LOG_ERROR(("socket() call failed: %s", strerror(errno)));
+        attempt->fd = -1;
+        return -1;
+    }
+    ssoresult = setsockopt(attempt->fd, IPPROTO_TCP, TCP_NODELAY, &enable_tcp_nodelay, sizeof(enable_tcp_nodelay));
+    if (ssoresult != 0) {
+        LOG_WARN(("Unable to set TCP_NODELAY, operation latency may be effected"));
+    }
+#ifdef WIN32
+    //ioctlsocket(attempt->fd, FIONBIO, &nonblocking_flag);
+#else
+    fcntl(attempt->fd, F_SETFL, O_NONBLOCK|fcntl(attempt->fd, F_GETFL, 0));
+#endif
+#if defined(AF_INET6)
+    if (zh->addrs[index].ss_family == AF_INET6) {
+        rc = connect(attempt->fd, (struct sockaddr*) &zh->addrs[index], sizeof(struct sockaddr_in6));
+    } else {
+#else
+       LOG_DEBUG(("[zk] connect()\n"));
+    {
+#endif
+        rc = connect(attempt->fd, (struct sockaddr*) &zh->addrs[index], sizeof(struct sockaddr_in));
+#ifdef WIN32
+        get_errno();
+#if _MSC_VER >= 1600
+        switch (errno) {
+        case WSAEWOULDBLOCK:
+            errno = EWOULDBLOCK;
+            break;
+        case WSAEINPROGRESS:
+            errno = EINPROGRESS;
+            break;
+        }
+#endif
+#endif
+    }
+    if (rc == -1) {
+        /* we are handling the non-blocking connect according to
+         * the description in section 16.3 "Non-blocking connect"
+         * in UNIX Network Programming vol 1, 3rd edition */
+        if (errno == EWOULDBLOCK || errno == EINPROGRESS)
+            return 1;
+        LOG_ERROR(("connect() call to [%s] failed: %s",
+                format_endpoint_info(&zh->addrs[index]), strerror(errno)));
+        record_server_failure(zh, index);
+        close(attempt->fd);
+        attempt->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns 1 if the connect has completed, 0 if it is still in progress and
+ * -1 if it failed.
+ */
+static int poll_connect(connect_attempt_t *attempt)
+{
+    int rc, error;
+    socklen_t len = sizeof(error);
+#ifdef WIN32
+    fd_set wfds, efds;
+    struct timeval tv = {0, 0};
+
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    FD_SET(attempt->fd, &wfds);
+    FD_SET(attempt->fd, &efds);
+    rc = select(0, 0, &wfds, &efds, &tv);
+    if (rc <= 0)
+        return rc;
+#else
+    struct pollfd pfd;
+
+    pfd.fd = attempt->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    rc = poll(&pfd, 1, 0);
+    if (rc == 0 || (rc < 0 && errno == EINTR))
+        return 0;
+    if (rc < 0)
+        return -1;
+#endif
+    rc = getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    /* the description in section 16.4 "Non-blocking connect"
+     * in UNIX Network Programming vol 1, 3rd edition, points out
+     * that sometimes the error is in errno and sometimes in error */
+    if (rc < 0 || error) {
+        if (rc == 0)
+            errno = error;
+        return -1;
+    }
+    return 1;
+}
+
+/* removes the attempt from the array, keeping the others in order */
+static void remove_connect_attempt(zhandle_t *zh, int i)
+{
+    for (--zh->attempts_count; i < zh->attempts_count; i++) {
+        zh->attempts[i] = zh->attempts[i+1];
+    }
+}
+
+static void close_connect_attempts(zhandle_t *zh)
+{
+    while (zh->attempts_count > 0) {
+        close(zh->attempts[0].fd);
+        remove_connect_attempt(zh, 0);
+    }
+}
+
+/**
+ * Makes the connected attempt the connection of the handle, drops the
+ * other connects and starts the handshake.
+ */
+static int adopt_connection(zhandle_t *zh, int i)
+{
+    int rc;
+
+    zh->fd = zh->attempts[i].fd;
+    zh->connect_index = zh->attempts[i].index;
+    gettimeofday(&zh->last_recv, 0);
+    /* the TCP handshake took about one round trip */
+    record_server_rtt(zh, zh->connect_index,
+            calculate_interval(&zh->attempts[i].started, &zh->last_recv));
+    zh->last_send = zh->last_recv;
+    zh->last_ping = zh->last_recv;
+    remove_connect_attempt(zh, i);
+    close_connect_attempts(zh);
+    if((rc=prime_connection(zh))!=0)
+        return rc;
+    LOG_INFO(("initiated connection to server [%s]",
+            format_endpoint_info(&zh->addrs[zh->connect_index])));
+    return ZOK;
+}
+
+/**
+ * Checks the connects in progress and adopts the first one that completed.
+ * Failed and timed out connects are dropped. Returns ZNOTHING if none has
+ * completed yet.
+ */
+static int check_connect_attempts(zhandle_t *zh, struct timeval *now)
+{
+    int i = 0;
+    while (i < zh->attempts_count) {
+        connect_attempt_t *attempt = &zh->attempts[i];
+        int rc = poll_connect(attempt);
+        if (rc > 0)
+            return adopt_connection(zh, i);
+        if (rc < 0) {
+            LOG_ERROR(("server [%s] refused to accept the client: %s",
+                    format_endpoint_info(&zh->addrs[attempt->index]),
+                    strerror(errno)));
+        } else if (calculate_interval(&attempt->started, now) >=
+                zh->recv_timeout*2/3) {
+            LOG_ERROR(("connection to [%s] timed out",
+                    format_endpoint_info(&zh->addrs[attempt->index])));
+        } else {
+            i++;
+            continue;
+        }
+        zh->connect_stats.failed_attempts++;
+        record_server_failure(zh, attempt->index);
+        close(attempt->fd);
+        remove_connect_attempt(zh, i);
+    }
+    return ZNOTHING;
+}
+
+/**
+ * Starts a connect to the next server if nothing is in progress yet, or if
+ * the newest connect has been pending for the stagger interval and fewer
+ * than max_attempts are racing. Returns ZOK if a connection was adopted.
+ */
+static int next_connect_attempt(zhandle_t *zh, struct timeval *now)
+{
+    if (zh->attempts_count > 0) {
+        connect_attempt_t *newest = &zh->attempts[zh->attempts_count-1];
+        if (zh->attempts_count >= zh->max_attempts ||
+                calculate_interval(&newest->started, now) < zh->connect_stagger)
+            return ZNOTHING;
+    }
+    if (zh->next_connect.tv_sec != 0 &&
+            calculate_interval(now, &zh->next_connect) > 0)
+        return ZNOTHING;
+    if (zh->connect_index == 0 && zh->attempts_count == 0) {
+        /* a new round, the addresses can be replaced */
+        take_resolved_addrs(zh);
+        order_servers(zh);
+    }
+    while (zh->connect_index < zh->addrs_count) {
+        connect_attempt_t *attempt = &zh->attempts[zh->attempts_count];
+        int rc;
+        int wait = take_connect_token(now);
+        if (wait > 0) {
+            zh->next_connect = time_after(now, wait);
+            return ZNOTHING;
+        }
+        zh->connect_stats.attempts++;
+        rc = start_connect(zh, zh->connect_index++, attempt);
+        if (rc < 0) {
+            zh->connect_stats.failed_attempts++;
+            continue;
+        }
+        zh->attempts_count++;
+        zh->state = ZOO_CONNECTING_STATE;
+        if (rc == 0)
+            return adopt_connection(zh, zh->attempts_count-1);
+        return ZNOTHING;
+    }
+    if (zh->attempts_count == 0) {
+        /* every server has been tried, start over after a pause */
+        int delay = backoff_delay(zh);
+        zh->connect_index = 0;
+        zh->failed_rounds++;
+        zh->connect_stats.failed_rounds++;
+        zh->next_connect = time_after(now, delay);
+        if (zh->addrs_count > 0)
+            LOG_WARN(("no server could be reached, retrying in %dms", delay));
+        if (zh->needs_dns && zh->resolve_job == 0 &&
+                (zh->addrs_resolved.tv_sec == 0 ||
+                 calculate_interval(&zh->addrs_resolved, now) >= DNS_CACHE_TTL) &&
+                (zh->resolve_started.tv_sec == 0 ||
+                 calculate_interval(&zh->resolve_started, now) >= DNS_RETRY_INTERVAL)) {
+            /* the servers may have moved */
+            return refresh_addrs(zh);
+        }
+    }
+    return ZNOTHING;
+}
+
+/* how long the IO thread may wait before the connects need attention */
+static int connect_wait(zhandle_t *zh, struct timeval *now)
+{
+    int i;
+    int wait = zh->recv_timeout*2/3;
+    for (i = 0; i < zh->attempts_count; i++) {
+        int left = zh->recv_timeout*2/3 -
+            calculate_interval(&zh->attempts[i].started, now);
+        if (left < wait)
+            wait = left;
+    }
+    if (zh->attempts_count < zh->max_attempts &&
+            zh->connect_index < zh->addrs_count) {
+        int left = zh->connect_stagger -
+            calculate_interval(&zh->attempts[zh->attempts_count-1].started, now);
+        if (zh->next_connect.tv_sec != 0) {
+            int paced = calculate_interval(now, &zh->next_connect);
+            if (paced > left)
+                left = paced;
+        }
+        if (left < wait)
+            wait = left;
+    }
+    if (zh->attempts_count > 1 && wait > CONNECT_POLL_INTERVAL)
+        wait = CONNECT_POLL_INTERVAL;
+    return wait;
+}
+
+#ifdef WIN32
+int zookeeper_interest(zhandle_t *zh, SOCKET *fd, int *interest,
+     struct timeval *tv)
+{
+#else
+int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
+     struct timeval *tv)
+{
+#endif
+    struct timeval now;
+    if(zh==0 || fd==0 ||interest==0 || tv==0)
+        return ZBADARGUMENTS;
+    if (is_unrecoverable(zh))
+        return ZINVALIDSTATE;
+    gettimeofday(&now, 0);
+    if(zh->next_deadline.tv_sec!=0 || zh->next_deadline.tv_usec!=0){
+        int time_left = calculate_interval(&zh->next_deadline, &now);
+        if (time_left > 10)
+            LOG_WARN(("Exceeded deadline by %dms", time_left));
+    }
+    api_prolog(zh);
+    drain_submissions(zh);
+    process_expired_requests(zh);
+    *fd = zh->fd;
+    *interest = 0;
+    tv->tv_sec = 0;
+    tv->tv_usec = 0;
+    if (*fd == -1) {
+        int rc = check_connect_attempts(zh, &now);
+        if (rc == ZNOTHING)
+            rc = next_connect_attempt(zh, &now);
+        if (rc != ZOK && rc != ZNOTHING)
+            return api_epilog(zh, rc);
+        if (zh->fd == -1) {
+            zh->next_deadline.tv_sec = zh->next_deadline.tv_usec = 0;
+            if (zh->attempts_count > 0) {
+                *fd = zh->attempts[zh->attempts_count-1].fd;
+                *interest = ZOOKEEPER_WRITE;
+                *tv = get_timeval(connect_wait(zh, &now));
+            } else if (zh->addrs_count == 0 && zh->resolve_job) {
+                /* nothing to connect to until the names are resolved */
+                *tv = get_timeval(CONNECT_POLL_INTERVAL);
+            } else if (zh->addrs_count == 0) {
+                /* Wait a bit before trying again so that we don't spin */
+                *tv = get_timeval(zh->recv_timeout/3);
+            } else {
+                /* back off until the next connect may start */
+                *tv = get_timeval(zh->next_connect.tv_sec == 0 ? 0 :
+                        calculate_interval(&now, &zh->next_connect));
+            }
+            limit_to_deadlines(zh, tv);
+            return api_epilog(zh, ZOK);
+        }
         *fd = zh->fd;
         *tv = get_timeval(zh->recv_timeout/3);
-        zh->last_recv = now;
-        zh->last_send = now;
-        zh->last_ping = now;
     }
     if (zh->fd != -1) {
         int idle_recv = calculate_interval(&zh->last_recv, &now);
@@ -1672,7 +2552,7 @@ int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
         }
         // We only allow 1/3 of our timeout time to expire before sending
         // a PING
-        if (zh->state==ZOO_CONNECTED_STATE) {
+        if (is_connected(zh)) {
             send_to = zh->recv_timeout/3 - idle_send;
             if (send_to <= 0) {
                 if (zh->sent_requests.head==0) {
@@ -1698,36 +2578,23 @@ int zookeeper_interest(zhandle_t *zh, int *fd, int *interest,
         *interest = ZOOKEEPER_READ;
         /* we are interested in a write if we are connected and have something
          * to send, or we are waiting for a connect to finish. */
-        if ((zh->to_send.head && (zh->state == ZOO_CONNECTED_STATE))
+        if ((zh->to_send.head && is_connected(zh))
         || zh->state == ZOO_CONNECTING_STATE) {
             *interest |= ZOOKEEPER_WRITE;
         }
+        limit_to_deadlines(zh, tv);
     }
     return api_epilog(zh,ZOK);
 }
 
 static int check_events(zhandle_t *zh, int events)
 {
-    if (zh->fd == -1)
-        return ZINVALIDSTATE;
-    if ((events&ZOOKEEPER_WRITE)&&(zh->state == ZOO_CONNECTING_STATE)) {
-        int rc, error;
-        socklen_t len = sizeof(error);
-        rc = getsockopt(zh->fd, SOL_SOCKET, SO_ERROR, &error, &len);
-        /* the description in section 16.4 "Non-blocking connect"
-         * in UNIX Network Programming vol 1, 3rd edition, points out
-         * that sometimes the error is in errno and sometimes in error */
-        if (rc < 0 || error) {
-            if (rc == 0)
-                errno = error;
-            return handle_socket_error_msg(zh, __LINE__,ZCONNECTIONLOSS,
-                "server refused to accept the client");
-        }
-        if((rc=prime_connection(zh))!=0)
-            return rc;
-        LOG_INFO(("initiated connection to server [%s]",
-                format_endpoint_info(&zh->addrs[zh->connect_index])));
-        return ZOK;
+    if (zh->fd == -1) {
+        struct timeval now;
+        if (zh->attempts_count == 0)
+            return ZINVALIDSTATE;
+        gettimeofday(&now, 0);
+        return check_connect_attempts(zh, &now);
     }
     if (zh->to_send.head && (events&ZOOKEEPER_WRITE)) {
         /* make the flush call non-blocking by specifying a 0 timeout */
@@ -1738,18 +2605,24 @@ static int check_events(zhandle_t *zh, int events)
     }
     if (events&ZOOKEEPER_READ) {
         int rc;
+        int offset;
         if (zh->input_buffer == 0) {
             zh->input_buffer = allocate_buffer(0,0);
         }
 
+        offset = zh->input_buffer->curr_offset;
         rc = recv_buffer(zh->fd, zh->input_buffer);
         if (rc < 0) {
             return handle_socket_error_msg(zh, __LINE__,ZCONNECTIONLOSS,
                 "failed while receiving a server response");
         }
+        zh->stats.bytes_in += zh->input_buffer->curr_offset - offset;
         if (rc > 0) {
+            zh->stats.frames_in++;
             gettimeofday(&zh->last_recv, 0);
             if (zh->input_buffer != &zh->primer_buffer) {
+                if (is_tracing(zh))
+                    zh->input_buffer->received = current_us();
                 queue_buffer(&zh->to_process, zh->input_buffer, 0);
             } else  {
                 int64_t oldid,newid;
@@ -1757,7 +2630,7 @@ static int check_events(zhandle_t *zh, int events)
                 deserialize_prime_response(&zh->primer_storage, zh->primer_buffer.buffer);
                 /* We are processing the primer_buffer, so we need to finish
                  * the connection handshake */
-                oldid = zh->client_id.client_id;
+                oldid = handshake_session_id(zh);
                 newid = zh->primer_storage.sessionId;
                 if (oldid != 0 && oldid != newid) {
                     zh->state = ZOO_EXPIRED_SESSION_STATE;
@@ -1770,18 +2643,26 @@ static int check_events(zhandle_t *zh, int events)
                  
                     memcpy(zh->client_id.passwd, &zh->primer_storage.passwd,
                            sizeof(zh->client_id.passwd));
-                    zh->state = ZOO_CONNECTED_STATE;
-                    LOG_INFO(("session establishment complete on server [%s], sessionId=%#llx, negotiated timeout=%d",
+                    if (zh->primer_storage.readOnly) {
+                        zh->state = ZOO_READONLY_STATE;
+                    } else {
+                        zh->state = ZOO_CONNECTED_STATE;
+                        zh->seen_rw_server_before = 1;
+                    }
+                    record_reconnect(zh);
+                    LOG_INFO(("session establishment complete on server [%s], sessionId=%#llx, negotiated timeout=%d%s",
                               format_endpoint_info(&zh->addrs[zh->connect_index]),
-                              newid, zh->recv_timeout));
+                              newid, zh->recv_timeout,
+                              zh->primer_storage.readOnly ? " (READ-ONLY mode)" : ""));
                     /* we want the auth to be sent for, but since both call push to front
-                       we need to call send_watch_set first */
-                    send_set_watches(zh);
+                       we need to call start_set_watches first */
+                    start_set_watches(zh);
                     /* send the authentication packet now */
                     send_auth_info(zh);
-                    LOG_DEBUG(("Calling a watcher for a ZOO_SESSION_EVENT and the state=ZOO_CONNECTED_STATE"));
+                    LOG_DEBUG(("Calling a watcher for a ZOO_SESSION_EVENT and the state=%s",
+                              state2String(zh->state)));
                     zh->input_buffer = 0; // just in case the watcher calls zookeeper_process() again
-                    PROCESS_SESSION_EVENT(zh, ZOO_CONNECTED_STATE);
+                    PROCESS_SESSION_EVENT(zh, zh->state);
                 }
             }
             zh->input_buffer = 0;
@@ -1879,11 +2760,94 @@ completion_list_t *dequeue_completion(completion_head_t *list)
             assert(list->last == cptr);
             list->last = 0;
         }
+        list->count--;
     }
     unlock_completion_list(list);
     return cptr;
 }
 
+/* takes the oldest request off sent_requests, with its deadline */
+static completion_list_t *dequeue_sent_request(zhandle_t *zh)
+{
+    completion_head_t *list = &zh->sent_requests;
+    completion_list_t *cptr;
+    lock_completion_list(list);
+    cptr = list->head;
+    if (cptr) {
+        list->head = cptr->next;
+        if (!list->head) {
+            assert(list->last == cptr);
+            list->last = 0;
+        }
+        list->count--;
+        zk_timerwheel_remove(&zh->request_timers, &cptr->timer);
+    }
+    unlock_completion_list(list);
+    return cptr;
+}
+
+/**
+ * Completes the requests that are past their deadline with
+ * ZOPERATIONTIMEOUT. The request stays in sent_requests, marked as timed
+ * out, so that its reply still matches and can be discarded; the caller is
+ * completed through a copy of the completion, or by waking the waiting
+ * thread for a synchronous call.
+ */
+static void process_expired_requests(zhandle_t *zh)
+{
+    completion_head_t expired = { 0 };
+    completion_list_t *copy;
+    zk_timer_t *timer;
+
+    lock_completion_list(&zh->sent_requests);
+    timer = zk_timerwheel_advance(&zh->request_timers, current_ms());
+    while (timer) {
+        completion_list_t *cptr = completion_of_timer(timer);
+        timer = timer->next;
+        LOG_WARN(("Request xid=%#x timed out after %dms", cptr->xid,
+                zh->operation_timeout));
+        cptr->timed_out = 1;
+        if (cptr->c.void_result == SYNCHRONOUS_MARKER) {
+            struct sync_completion *sc = (struct sync_completion*)cptr->data;
+            if (cptr->c.type == COMPLETION_MULTI) {
+                /* the results belong to the caller, who is about to return */
+                completion_list_t *entry;
+                while ((entry = dequeue_completion(&cptr->c.clist)) != 0)
+                    destroy_completion_entry(entry);
+            }
+            cptr->data = 0;
+            sc->rc = ZOPERATIONTIMEOUT;
+            notify_sync_completion(sc);
+            zh->outstanding_sync--;
+            continue;
+        }
+        copy = create_completion_entry(cptr->xid, cptr->c.type,
+                cptr->c.void_result, cptr->data, 0, &cptr->c.clist);
+        if (copy == 0)
+            continue;
+        /* the operations of a multi are completed through the copy */
+        cptr->c.clist.head = cptr->c.clist.last = 0;
+        copy->buffer = fake_reply(cptr->xid, ZOPERATIONTIMEOUT);
+        queue_completion_nolock(&expired, copy, 0);
+    }
+    unlock_completion_list(&zh->sent_requests);
+    while ((copy = expired.head) != 0) {
+        expired.head = copy->next;
+        queue_completion(&zh->completions_to_process, copy, 0);
+    }
+}
+
+/* shortens the wait of the IO loop to the next request deadline */
+static void limit_to_deadlines(zhandle_t *zh, struct timeval *tv)
+{
+    int wait;
+    lock_completion_list(&zh->sent_requests);
+    wait = zk_timerwheel_next(&zh->request_timers, current_ms());
+    unlock_completion_list(&zh->sent_requests);
+    if (wait >= 0 && wait < tv->tv_sec * 1000 + tv->tv_usec / 1000)
+        *tv = get_timeval(wait);
+}
+
 static void process_sync_completion(
         completion_list_t *cptr,
         struct sync_completion *sc,
@@ -1975,7 +2939,7 @@ static void process_sync_completion(
     case COMPLETION_VOID:
         break;
     case COMPLETION_MULTI:
-        sc->rc = deserialize_multi(cptr->xid, cptr, ia);
+        sc->rc = deserialize_multi(cptr->xid, cptr, ia, sc->rc);
         break;
     default:
         LOG_DEBUG(("Unsupported completion type=%d", cptr->c.type));
@@ -1983,13 +2947,27 @@ static void process_sync_completion(
     }
 }
 
-static int deserialize_multi(int xid, completion_list_t *cptr, struct iarchive *ia)
+/* completes each operation of a multi that got no reply with the error */
+static void fail_multi(int xid, completion_list_t *cptr, int err)
+{
+    completion_list_t *entry;
+    while ((entry = dequeue_completion(&cptr->c.clist)) != 0) {
+        deserialize_response(entry->c.type, xid, 1, err, entry, 0);
+        destroy_completion_entry(entry);
+    }
+}
+
+static int deserialize_multi(int xid, completion_list_t *cptr, struct iarchive *ia, int err)
 {
     int rc = 0;
     completion_head_t *clist = &cptr->c.clist;
     struct MultiHeader mhdr = { STRUCT_INITIALIZER(type , 0), STRUCT_INITIALIZER(done , 0), STRUCT_INITIALIZER(err , 0) };
     assert(clist);
-    deserialize_MultiHeader(ia, "multiheader", &mhdr);
+    if (deserialize_MultiHeader(ia, "multiheader", &mhdr) < 0) {
+        /* the request failed as a whole, there are no results */
+        fail_multi(xid, cptr, err ? err : ZMARSHALLINGERROR);
+        return err ? err : ZMARSHALLINGERROR;
+    }
     while (!mhdr.done) {
         completion_list_t *entry = dequeue_completion(clist);
         assert(entry);
@@ -2099,7 +3077,7 @@ static void deserialize_response(int type, int xid, int failed, int rc, completi
     case COMPLETION_MULTI:
         LOG_DEBUG(("Calling COMPLETION_MULTI for xid=%#x failed=%d rc=%d",
                     cptr->xid, failed, rc));
-        rc = deserialize_multi(xid, cptr, ia);
+        rc = deserialize_multi(xid, cptr, ia, rc);
         assert(cptr->c.void_result);
         cptr->c.void_result(rc, cptr->data);
         break;
@@ -2134,7 +3112,10 @@ void process_completions(zhandle_t *zh)
             deliverWatchers(zh,type,state,evt.path, &cptr->c.watcher_result);
             deallocate_WatcherEvent(&evt);
         } else {
+            int64_t completed = cptr->queued ? current_us() : 0;
             deserialize_response(cptr->c.type, hdr.xid, hdr.err != 0, hdr.err, cptr, ia);
+            if (cptr->queued)
+                finish_trace(zh, cptr, hdr.err, completed);
         }
         destroy_completion_entry(cptr);
         close_buffer_iarchive(&ia);
@@ -2176,6 +3157,8 @@ static void checkResponseLatency(zhandle_t* zh)
 
     gettimeofday(&now,0);
     delay=calculate_interval(&zh->socket_readable, &now);
+    if (delay > zh->stats.max_recv_dwell_ms)
+        zh->stats.max_recv_dwell_ms = delay;
     if(delay>20)
         LOG_DEBUG(("The following server response has spent at least %dms sitting in the client socket recv buffer",delay));
 
@@ -2185,6 +3168,7 @@ static void checkResponseLatency(zhandle_t* zh)
 int zookeeper_process(zhandle_t *zh, int events)
 {
     buffer_list_t *bptr;
+    int64_t frames;
     int rc;
 
     if (zh==NULL)
@@ -2192,12 +3176,15 @@ int zookeeper_process(zhandle_t *zh, int events)
     if (is_unrecoverable(zh))
         return ZINVALIDSTATE;
     api_prolog(zh);
-    IF_DEBUG(checkResponseLatency(zh));
+    checkResponseLatency(zh);
+    frames = zh->stats.frames_in;
     rc = check_events(zh, events);
     if (rc!=ZOK)
         return api_epilog(zh, rc);
 
-    IF_DEBUG(isSocketReadable(zh));
+    /* only a read can leave more replies waiting in the socket */
+    if (zh->stats.frames_in != frames)
+        isSocketReadable(zh);
 
     while (rc >= 0 && (bptr=dequeue_buffer(&zh->to_process))) {
         struct ReplyHeader hdr;
@@ -2217,6 +3204,7 @@ int zookeeper_process(zhandle_t *zh, int events)
             gettimeofday(&now, 0);
             elapsed = calculate_interval(&zh->last_ping, &now);
             LOG_DEBUG(("Got ping response in %d ms", elapsed));
+            record_server_rtt(zh, zh->connect_index, elapsed);
             free_buffer(bptr);
         } else if (hdr.xid == WATCHER_EVENT_XID) {
             struct WatcherEvent evt;
@@ -2240,6 +3228,10 @@ int zookeeper_process(zhandle_t *zh, int events)
         } else if (hdr.xid == SET_WATCHES_XID) {
             LOG_DEBUG(("Processing SET_WATCHES"));
             free_buffer(bptr);
+            if (zh->set_watches.outstanding > 0) {
+                zh->set_watches.outstanding--;
+            }
+            send_set_watches(zh);
         } else if (hdr.xid == AUTH_XID){
             LOG_DEBUG(("Processing AUTH_XID"));
 
@@ -2257,7 +3249,7 @@ int zookeeper_process(zhandle_t *zh, int events)
         } else {
             int rc = hdr.err;
             /* Find the request corresponding to the response */
-            completion_list_t *cptr = dequeue_completion(&zh->sent_requests);
+            completion_list_t *cptr = dequeue_sent_request(zh);
 
             /* [ZOOKEEPER-804] Don't assert if zookeeper_close has been called. */
             if (zh->close_requested == 1 && cptr == NULL) {
@@ -2283,7 +3275,19 @@ int zookeeper_process(zhandle_t *zh, int events)
                                   hdr.xid,cptr->xid));
             }
 
+            if (cptr->timed_out) {
+                LOG_DEBUG(("Discarding the reply to xid=%#x, it timed out",
+                        cptr->xid));
+                free_buffer(bptr);
+                destroy_completion_entry(cptr);
+                close_buffer_iarchive(&ia);
+                continue;
+            }
+
             activateWatcher(zh, cptr->watcher, rc);
+            cptr->received = bptr->received;
+            if (cptr->slow)
+                note_reply(zh, cptr, bptr, rc);
 
             if (cptr->c.void_result != SYNCHRONOUS_MARKER) {
                 LOG_DEBUG(("Queueing asynchronous response"));
@@ -2292,11 +3296,14 @@ int zookeeper_process(zhandle_t *zh, int events)
             } else {
                 struct sync_completion
                         *sc = (struct sync_completion*)cptr->data;
+                int64_t completed = cptr->queued ? current_us() : 0;
                 sc->rc = rc;
                 
                 process_sync_completion(cptr, sc, ia, zh); 
                 
                 notify_sync_completion(sc);
+                if (cptr->queued)
+                    finish_trace(zh, cptr, rc, completed);
                 free_buffer(bptr);
                 zh->outstanding_sync--;
                 destroy_completion_entry(cptr);
@@ -2387,6 +3394,9 @@ static void destroy_completion_entry(completion_list_t* c){
         destroy_watcher_registration(c->watcher);
         if(c->buffer!=0)
             free_buffer(c->buffer);
+        if(c->request!=0)
+            free_buffer(c->request);
+        free(c->slow);
         free(c);
     }
 }
@@ -2396,6 +3406,7 @@ static void queue_completion_nolock(completion_head_t *list,
                                     int add_to_front) 
 {
     c->next = 0;
+    list->count++;
     /* appending a new entry to the back of the list */
     if (list->last) {
         assert(list->head);
@@ -2424,76 +3435,153 @@ static void queue_completion(completion_head_t *list, completion_list_t *c,
     unlock_completion_list(list);
 }
 
-static int add_completion(zhandle_t *zh, int xid, int completion_type,
-        const void *dc, const void *data, int add_to_front,
-        watcher_registration_t* wo, completion_head_t *clist)
+/* Hands completions first..last (chained newest first) over to the IO
+ * thread. Callers never block each other here, the requests are moved to
+ * sent_requests and to_send by drain_submissions. */
+static void submit_requests(zhandle_t *zh, completion_list_t *first,
+        completion_list_t *last)
 {
-    completion_list_t *c =create_completion_entry(xid, completion_type, dc,
-            data, wo, clist);
-    int rc = 0;
-    if (!c)
-        return ZSYSTEMERROR;
+    completion_list_t *head;
+    do {
+        head = zh->submitted;
+        last->next = head;
+    } while (!atomic_cas_ptr((void *volatile *)&zh->submitted, head, first));
+}
+
+/* Moves the submitted requests to sent_requests and to_send, in the same
+ * order on both queues so that every reply matches the head of
+ * sent_requests. The caller must be in the critical section. */
+static void drain_submissions_nolock(zhandle_t *zh)
+{
+    completion_list_t *c = atomic_exchange_ptr(
+            (void *volatile *)&zh->submitted, 0);
+    completion_list_t *oldest = 0;
+
+    if (c == 0)
+        return;
+    while (c) {
+        completion_list_t *next = c->next;
+        c->next = oldest;
+        oldest = c;
+        c = next;
+    }
     lock_completion_list(&zh->sent_requests);
-    if (zh->close_requested != 1) {
-        queue_completion_nolock(&zh->sent_requests, c, add_to_front);
-        if (dc == SYNCHRONOUS_MARKER) {
+    lock_buffer_list(&zh->to_send);
+    while (oldest) {
+        c = oldest;
+        oldest = c->next;
+        if (c->queued != 0) {
+            c->request->completion = c;
+        }
+        queue_buffer_nolock(&zh->to_send, c->request, 0);
+        c->request = 0;
+        if (c->c.void_result == SYNCHRONOUS_MARKER) {
             zh->outstanding_sync++;
         }
-        rc = ZOK;
-    } else {
-        free(c);
-        rc = ZINVALIDSTATE;
+        if (c->timer.expires != 0) {
+            zk_timerwheel_add(&zh->request_timers, &c->timer, c->timer.expires);
+        }
+        queue_completion_nolock(&zh->sent_requests, c, 0);
     }
+    unlock_buffer_list(&zh->to_send);
     unlock_completion_list(&zh->sent_requests);
-    return rc;
+}
+
+static void drain_submissions(zhandle_t *zh)
+{
+    if (zh->submitted == 0)
+        return;
+    enter_critical(zh);
+    drain_submissions_nolock(zh);
+    leave_critical(zh);
+}
+
+static int add_completion(zhandle_t *zh, int xid, int completion_type,
+        const void *dc, const void *data, watcher_registration_t* wo,
+        completion_head_t *clist, struct oarchive *oa)
+{
+    completion_list_t *c;
+    /* the watcher registration is ours from here on, even on failure */
+    if (zh->close_requested == 1) {
+        destroy_watcher_registration(wo);
+        return ZINVALIDSTATE;
+    }
+    c = create_completion_entry(xid, completion_type, dc, data, wo, clist);
+    if (!c) {
+        destroy_watcher_registration(wo);
+        return ZSYSTEMERROR;
+    }
+    c->request = allocate_buffer(get_buffer(oa), get_buffer_len(oa));
+    if (!c->request) {
+        destroy_completion_entry(c);
+        return ZSYSTEMERROR;
+    }
+    if (zh->operation_timeout > 0) {
+        c->timer.expires = current_ms() + zh->operation_timeout;
+    }
+    start_trace(zh, c);
+    submit_requests(zh, c, c);
+    /* zookeeper_close may have set close_requested and drained the
+     * submissions between the check above and the push, in which case
+     * nobody would ever send or fail this request. The close fails every
+     * outstanding request with ZCLOSING anyway, so do the same here. */
+    if (zh->close_requested == 1) {
+        enter_critical(zh);
+        drain_submissions_nolock(zh);
+        free_completions(zh,1,ZCLOSING);
+        leave_critical(zh);
+    }
+    return ZOK;
 }
 
 static int add_data_completion(zhandle_t *zh, int xid, data_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+        const void *data,watcher_registration_t* wo, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_DATA, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, COMPLETION_DATA, dc, data, wo, 0, oa);
 }
 
 static int add_stat_completion(zhandle_t *zh, int xid, stat_completion_t dc,
-        const void *data,watcher_registration_t* wo)
+        const void *data,watcher_registration_t* wo, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, COMPLETION_STAT, dc, data, wo, 0, oa);
 }
 
 static int add_strings_completion(zhandle_t *zh, int xid,
-        strings_completion_t dc, const void *data,watcher_registration_t* wo)
+        strings_completion_t dc, const void *data,watcher_registration_t* wo,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, COMPLETION_STRINGLIST, dc, data, wo, 0, oa);
 }
 
 static int add_strings_stat_completion(zhandle_t *zh, int xid,
-        strings_stat_completion_t dc, const void *data,watcher_registration_t* wo)
+        strings_stat_completion_t dc, const void *data,watcher_registration_t* wo,
+        struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRINGLIST_STAT, dc, data, 0, wo, 0);
+    return add_completion(zh, xid, COMPLETION_STRINGLIST_STAT, dc, data, wo, 0, oa);
 }
 
 static int add_acl_completion(zhandle_t *zh, int xid, acl_completion_t dc,
-        const void *data)
+        const void *data, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_ACLLIST, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, COMPLETION_ACLLIST, dc, data, 0, 0, oa);
 }
 
 static int add_void_completion(zhandle_t *zh, int xid, void_completion_t dc,
-        const void *data)
+        const void *data, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_VOID, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, COMPLETION_VOID, dc, data, 0, 0, oa);
 }
 
 static int add_string_completion(zhandle_t *zh, int xid,
-        string_completion_t dc, const void *data)
+        string_completion_t dc, const void *data, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_STRING, dc, data, 0, 0, 0);
+    return add_completion(zh, xid, COMPLETION_STRING, dc, data, 0, 0, oa);
 }
 
 static int add_multi_completion(zhandle_t *zh, int xid, void_completion_t dc,
-        const void *data, completion_head_t *clist)
+        const void *data, completion_head_t *clist, struct oarchive *oa)
 {
-    return add_completion(zh, xid, COMPLETION_MULTI, dc, data, 0,0, clist);
+    return add_completion(zh, xid, COMPLETION_MULTI, dc, data, 0, clist, oa);
 }
 
 int zookeeper_close(zhandle_t *zh)
@@ -2510,6 +3598,7 @@ int zookeeper_close(zhandle_t *zh)
 
 	/* Signal any syncronous completions before joining the threads */
         enter_critical(zh);
+        drain_submissions_nolock(zh);
         free_completions(zh,1,ZCLOSING);
         leave_critical(zh);
 
@@ -2521,7 +3610,7 @@ int zookeeper_close(zhandle_t *zh)
     }
     /* No need to decrement the counter since we're just going to
      * destroy the handle later. */
-    if(zh->state==ZOO_CONNECTED_STATE){
+    if(is_connected(zh) && !zh->detach_requested){
         struct oarchive *oa;
         struct RequestHeader h = { STRUCT_INITIALIZER (xid , get_xid()), STRUCT_INITIALIZER (type , ZOO_CLOSE_OP)};
         LOG_INFO(("Closing zookeeper sessionId=%#llx to [%s]\n",
@@ -2556,6 +3645,17 @@ finish:
     return rc;
 }
 
+int zookeeper_detach(zhandle_t *zh)
+{
+    if (zh==0)
+        return ZBADARGUMENTS;
+
+    LOG_INFO(("Detaching from zookeeper sessionId=%#llx\n",
+            zh->client_id.client_id));
+    zh->detach_requested=1;
+    return zookeeper_close(zh);
+}
+
 static int isValidPath(const char* path, const int flags) {
     int len = 0;
     char lastc = '/';
@@ -2664,12 +3764,8 @@ int zoo_awget(zhandle_t *zh, const char *path,
     oa=create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
-    enter_critical(zh);
     rc = rc < 0 ? rc : add_data_completion(zh, h.xid, dc, data,
-        create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+        create_watcher_registration(server_path,data_result_checker,watcher,watcherCtx), oa);
     free_duplicate_path(server_path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2710,11 +3806,7 @@ int zoo_aset(zhandle_t *zh, const char *path, const char *buffer, int buflen,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, dc, data,0);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, dc, data,0, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2766,11 +3858,7 @@ int zoo_acreate(zhandle_t *zh, const char *path, const char *value,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2806,11 +3894,7 @@ int zoo_adelete(zhandle_t *zh, const char *path, int version,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2843,13 +3927,9 @@ int zoo_awexists(zhandle_t *zh, const char *path,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_ExistsRequest(oa, "req", &req);
-    enter_critical(zh);
     rc = rc < 0 ? rc : add_stat_completion(zh, h.xid, completion, data,
         create_watcher_registration(req.path,exists_result_checker,
-                watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+                watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2877,12 +3957,8 @@ static int zoo_awget_children_(zhandle_t *zh, const char *path,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildrenRequest(oa, "req", &req);
-    enter_critical(zh);
     rc = rc < 0 ? rc : add_strings_completion(zh, h.xid, sc, data,
-            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2925,12 +4001,8 @@ static int zoo_awget_children2_(zhandle_t *zh, const char *path,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetChildren2Request(oa, "req", &req);
-    enter_critical(zh);
     rc = rc < 0 ? rc : add_strings_stat_completion(zh, h.xid, ssc, data,
-            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx));
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+            create_watcher_registration(req.path,child_result_checker,watcher,watcherCtx), oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2969,11 +4041,7 @@ int zoo_async(zhandle_t *zh, const char *path,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SyncRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_string_completion(zh, h.xid, completion, data, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -2999,11 +4067,7 @@ int zoo_aget_acl(zhandle_t *zh, const char *path, acl_completion_t completion,
     oa = create_buffer_oarchive();
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_GetACLRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_acl_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_acl_completion(zh, h.xid, completion, data, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -3030,11 +4094,7 @@ int zoo_aset_acl(zhandle_t *zh, const char *path, int version,
     req.version = version;
     rc = serialize_RequestHeader(oa, "header", &h);
     rc = rc < 0 ? rc : serialize_SetACLRequest(oa, "req", &req);
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_void_completion(zh, h.xid, completion, data, oa);
     free_duplicate_path(req.path, path);
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -3132,9 +4192,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
                 result->value = op->create_op.buf;
 				result->valuelen = op->create_op.buflen;
 
-                enter_critical(zh);
                 entry = create_completion_entry(h.xid, COMPLETION_STRING, op_result_string_completion, result, 0, 0); 
-                leave_critical(zh);
                 free_duplicate_path(req.path, op->create_op.path);
                 break;
             }
@@ -3144,9 +4202,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
                 rc = rc < 0 ? rc : DeleteRequest_init(zh, &req, op->delete_op.path, op->delete_op.version);
                 rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
 
-                enter_critical(zh);
                 entry = create_completion_entry(h.xid, COMPLETION_VOID, op_result_void_completion, result, 0, 0); 
-                leave_critical(zh);
                 free_duplicate_path(req.path, op->delete_op.path);
                 break;
             }
@@ -3159,9 +4215,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
                 rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
                 result->stat = op->set_op.stat;
 
-                enter_critical(zh);
                 entry = create_completion_entry(h.xid, COMPLETION_STAT, op_result_stat_completion, result, 0, 0); 
-                leave_critical(zh);
                 free_duplicate_path(req.path, op->set_op.path);
                 break;
             }
@@ -3172,9 +4226,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
                                         op->check_op.path, op->check_op.version);
                 rc = rc < 0 ? rc : serialize_CheckVersionRequest(oa, "req", &req);
 
-                enter_critical(zh);
                 entry = create_completion_entry(h.xid, COMPLETION_VOID, op_result_void_completion, result, 0, 0); 
-                leave_critical(zh);
                 free_duplicate_path(req.path, op->check_op.path);
                 break;
             } 
@@ -3188,13 +4240,7 @@ int zoo_amulti(zhandle_t *zh, int count, const zoo_op_t *ops,
     }
 
     rc = rc < 0 ? rc : serialize_MultiHeader(oa, "multiheader", &mh);
-  
-    /* BEGIN: CRTICIAL SECTION */
-    enter_critical(zh);
-    rc = rc < 0 ? rc : add_multi_completion(zh, h.xid, completion, data, &clist);
-    rc = rc < 0 ? rc : queue_buffer_bytes(&zh->to_send, get_buffer(oa),
-            get_buffer_len(oa));
-    leave_critical(zh);
+    rc = rc < 0 ? rc : add_multi_completion(zh, h.xid, completion, data, &clist, oa);
     
     /* We queued the buffer, so don't free it */
     close_buffer_oarchive(&oa, 0);
@@ -3250,6 +4296,234 @@ void zoo_check_op_init(zoo_op_t *op, const char *path, int version)
     op->check_op.version = version;
 }
 
+/* Serializes one batch op into its own request buffer and builds the
+ * completion entry that carries it to the IO thread. */
+static int prepare_batch_op(zhandle_t *zh, const zoo_batch_op_t *op,
+        completion_list_t **entry)
+{
+    struct RequestHeader h = { STRUCT_INITIALIZER (xid , get_xid()), STRUCT_INITIALIZER (type , op->type)};
+    struct oarchive *oa = create_buffer_oarchive();
+    int rc = serialize_RequestHeader(oa, "header", &h);
+    int ok = ZOK;
+
+    switch(op->type) {
+    case ZOO_GETDATA_OP: {
+        struct GetDataRequest req;
+        ok = Request_path_watch_init(zh, 0, &req.path, op->get_op.path,
+                &req.watch, op->get_op.watch != 0);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_GetDataRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_DATA,
+                op->get_op.completion, op->data, req.watch ?
+                create_watcher_registration(req.path, data_result_checker,
+                        zh->watcher, zh->context) : 0, 0);
+        free_duplicate_path(req.path, op->get_op.path);
+        break;
+    }
+    case ZOO_EXISTS_OP: {
+        struct ExistsRequest req;
+        ok = Request_path_watch_init(zh, 0, &req.path, op->exists_op.path,
+                &req.watch, op->exists_op.watch != 0);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_ExistsRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_STAT,
+                op->exists_op.completion, op->data, req.watch ?
+                create_watcher_registration(req.path, exists_result_checker,
+                        zh->watcher, zh->context) : 0, 0);
+        free_duplicate_path(req.path, op->exists_op.path);
+        break;
+    }
+    case ZOO_GETCHILDREN_OP: {
+        struct GetChildrenRequest req;
+        ok = Request_path_watch_init(zh, 0, &req.path, op->children_op.path,
+                &req.watch, op->children_op.watch != 0);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_GetChildrenRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_STRINGLIST,
+                op->children_op.completion, op->data, req.watch ?
+                create_watcher_registration(req.path, child_result_checker,
+                        zh->watcher, zh->context) : 0, 0);
+        free_duplicate_path(req.path, op->children_op.path);
+        break;
+    }
+    case ZOO_CREATE_OP: {
+        struct CreateRequest req;
+        ok = CreateRequest_init(zh, &req, op->create_op.path,
+                op->create_op.data, op->create_op.datalen, op->create_op.acl,
+                op->create_op.flags);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_CreateRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_STRING,
+                op->create_op.completion, op->data, 0, 0);
+        free_duplicate_path(req.path, op->create_op.path);
+        break;
+    }
+    case ZOO_DELETE_OP: {
+        struct DeleteRequest req;
+        ok = DeleteRequest_init(zh, &req, op->delete_op.path,
+                op->delete_op.version);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_DeleteRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_VOID,
+                op->delete_op.completion, op->data, 0, 0);
+        free_duplicate_path(req.path, op->delete_op.path);
+        break;
+    }
+    case ZOO_SETDATA_OP: {
+        struct SetDataRequest req;
+        ok = SetDataRequest_init(zh, &req, op->set_op.path, op->set_op.data,
+                op->set_op.datalen, op->set_op.version);
+        if (ok != ZOK)
+            break;
+        rc = rc < 0 ? rc : serialize_SetDataRequest(oa, "req", &req);
+        *entry = create_completion_entry(h.xid, COMPLETION_STAT,
+                op->set_op.completion, op->data, 0, 0);
+        free_duplicate_path(req.path, op->set_op.path);
+        break;
+    }
+    default:
+        LOG_ERROR(("Unimplemented op type=%d in batch", op->type));
+        ok = ZUNIMPLEMENTED;
+    }
+
+    if (ok == ZOK && rc >= 0 && *entry) {
+        (*entry)->request = allocate_buffer(get_buffer(oa), get_buffer_len(oa));
+        if ((*entry)->request) {
+            /* the buffer list entry owns the serialized request now */
+            close_buffer_oarchive(&oa, 0);
+            return ZOK;
+        }
+    }
+    close_buffer_oarchive(&oa, 1);
+    if (ok != ZOK)
+        return ok;
+    return rc < 0 ? ZMARSHALLINGERROR : ZSYSTEMERROR;
+}
+
+int zoo_abatch(zhandle_t *zh, int count, const zoo_batch_op_t *ops)
+{
+    completion_list_t **entries;
+    int64_t deadline = 0;
+    int rc = ZOK;
+    int i;
+
+    if (zh == 0 || count < 0 || (count > 0 && ops == 0))
+        return ZBADARGUMENTS;
+    if (is_unrecoverable(zh) || zh->close_requested == 1)
+        return ZINVALIDSTATE;
+    if (count == 0)
+        return ZOK;
+    entries = calloc(count, sizeof(*entries));
+    if (entries == 0)
+        return ZSYSTEMERROR;
+    for (i = 0; i < count && rc == ZOK; i++) {
+        rc = prepare_batch_op(zh, ops + i, &entries[i]);
+    }
+    if (rc != ZOK) {
+        for (i = 0; i < count; i++) {
+            destroy_completion_entry(entries[i]);
+        }
+        free(entries);
+        return rc;
+    }
+
+    if (zh->operation_timeout > 0) {
+        deadline = current_ms() + zh->operation_timeout;
+    }
+    /* chain the batch newest first and hand it over in one go */
+    for (i = 0; i < count; i++) {
+        entries[i]->timer.expires = deadline;
+        entries[i]->next = i > 0 ? entries[i - 1] : 0;
+        start_trace(zh, entries[i]);
+    }
+    submit_requests(zh, entries[count - 1], entries[0]);
+    free(entries);
+
+    LOG_DEBUG(("Sending batch of %d requests to %s", count,
+            format_current_endpoint_info(zh)));
+    /* make a best (non-blocking) effort to send the requests asap */
+    adaptor_send_queue(zh, 0);
+    return ZOK;
+}
+
+void zoo_batch_get_init(zoo_batch_op_t *op, const char *path, int watch,
+        data_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_GETDATA_OP;
+    op->data = data;
+    op->get_op.path = path;
+    op->get_op.watch = watch;
+    op->get_op.completion = completion;
+}
+
+void zoo_batch_exists_init(zoo_batch_op_t *op, const char *path, int watch,
+        stat_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_EXISTS_OP;
+    op->data = data;
+    op->exists_op.path = path;
+    op->exists_op.watch = watch;
+    op->exists_op.completion = completion;
+}
+
+void zoo_batch_get_children_init(zoo_batch_op_t *op, const char *path,
+        int watch, strings_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_GETCHILDREN_OP;
+    op->data = data;
+    op->children_op.path = path;
+    op->children_op.watch = watch;
+    op->children_op.completion = completion;
+}
+
+void zoo_batch_create_init(zoo_batch_op_t *op, const char *path,
+        const char *value, int valuelen, const struct ACL_vector *acl,
+        int flags, string_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_CREATE_OP;
+    op->data = data;
+    op->create_op.path = path;
+    op->create_op.data = value;
+    op->create_op.datalen = valuelen;
+    op->create_op.acl = acl;
+    op->create_op.flags = flags;
+    op->create_op.completion = completion;
+}
+
+void zoo_batch_delete_init(zoo_batch_op_t *op, const char *path, int version,
+        void_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_DELETE_OP;
+    op->data = data;
+    op->delete_op.path = path;
+    op->delete_op.version = version;
+    op->delete_op.completion = completion;
+}
+
+void zoo_batch_set_init(zoo_batch_op_t *op, const char *path,
+        const char *buffer, int buflen, int version,
+        stat_completion_t completion, const void *data)
+{
+    assert(op);
+    op->type = ZOO_SETDATA_OP;
+    op->data = data;
+    op->set_op.path = path;
+    op->set_op.data = buffer;
+    op->set_op.datalen = buflen;
+    op->set_op.version = version;
+    op->set_op.completion = completion;
+}
+
 int zoo_multi(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results)
 {
     int rc;
@@ -3274,18 +4548,20 @@ int zoo_multi(zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *re
 int flush_send_queue(zhandle_t*zh, int timeout)
 {
     int rc= ZOK;
+    int offset;
     struct timeval started;
 #ifdef WIN32
     fd_set pollSet; 
     struct timeval wait;
 #endif
     gettimeofday(&started,0);
+    drain_submissions(zh);
     // we can't use dequeue_buffer() here because if (non-blocking) send_buffer()
     // returns EWOULDBLOCK we'd have to put the buffer back on the queue.
     // we use a recursive lock instead and only dequeue the buffer if a send was
     // successful
     lock_buffer_list(&zh->to_send);
-    while (zh->to_send.head != 0&& zh->state == ZOO_CONNECTED_STATE) {
+    while (zh->to_send.head != 0&& is_connected(zh)) {
         if(timeout!=0){
             int elapsed;
             struct timeval now;
@@ -3316,7 +4592,10 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             }
         }
 
+        offset = zh->to_send.head->curr_offset;
         rc = send_buffer(zh->fd, zh->to_send.head);
+        if (rc >= 0)
+            zh->stats.bytes_out += zh->to_send.head->curr_offset - offset;
         if(rc==0 && timeout==0){
             /* send_buffer would block while sending this buffer */
             rc = ZOK;
@@ -3327,8 +4606,12 @@ int flush_send_queue(zhandle_t*zh, int timeout)
             break;
         }
         // if the buffer has been sent successfully, remove it from the queue
-        if (rc > 0)
+        if (rc > 0) {
+            zh->stats.frames_out++;
+            if (zh->to_send.head->completion)
+                zh->to_send.head->completion->sent = current_us();
             remove_buffer(&zh->to_send);
+        }
         gettimeofday(&zh->last_send, 0);
         rc = ZOK;
     }
@@ -3387,6 +4670,8 @@ const char* zerror(int c)
       return "(not error) no server responses to process";
     case ZSESSIONMOVED:
       return "session moved to another server, so operation is ignored";
+    case ZNOTREADONLY:
+      return "state-changing request is passed to read-only server";
     }
     if (c > 0) {
       return strerror(c);
@@ -3433,7 +4718,7 @@ int zoo_add_auth(zhandle_t *zh,const char* scheme,const char* cert,
     add_last_auth(&zh->auth_h, authinfo);
     zoo_unlock_auth(zh);
 
-    if(zh->state == ZOO_CONNECTED_STATE || zh->state == ZOO_ASSOCIATING_STATE)
+    if(is_connected(zh) || zh->state == ZOO_ASSOCIATING_STATE)
         return send_last_auth_info(zh);
 
     return ZOK;
@@ -3442,14 +4727,22 @@ int zoo_add_auth(zhandle_t *zh,const char* scheme,const char* cert,
 static const char* format_endpoint_info(const struct sockaddr_storage* ep)
 {
     static char buf[128];
+    if(ep==0)
+        return "null";
+    format_endpoint(ep, buf, sizeof(buf));
+    return buf;
+}
+
+/* formats ep as address:port into a buffer owned by the caller */
+static void format_endpoint(const struct sockaddr_storage* ep, char *buf,
+        size_t len)
+{
     char addrstr[128];
     void *inaddr;
 #ifdef WIN32
     char * addrstring;
 #endif
     int port;
-    if(ep==0)
-        return "null";
 
 #if defined(AF_INET6)
     if(ep->ss_family==AF_INET6){
@@ -3464,12 +4757,11 @@ static const char* format_endpoint_info(const struct sockaddr_storage* ep)
 #endif
 #ifdef WIN32
     addrstring = inet_ntoa (*(struct in_addr*)inaddr); 
-    sprintf(buf,"%s:%d",addrstring,ntohs(port));
+    snprintf(buf,len,"%s:%d",addrstring,ntohs(port));
 #else
     inet_ntop(ep->ss_family,inaddr,addrstr,sizeof(addrstr)-1);
-    sprintf(buf,"%s:%d",addrstr,ntohs(port));
+    snprintf(buf,len,"%s:%d",addrstr,ntohs(port));
 #endif    
-    return buf;
 }
 
 static const char* format_current_endpoint_info(zhandle_t* zh)
@@ -3482,6 +4774,379 @@ void zoo_deterministic_conn_order(int yesOrNo)
     disable_conn_permute=yesOrNo;
 }
 
+void zoo_set_operation_timeout(zhandle_t *zh, int timeout_ms)
+{
+    zh->operation_timeout = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+static int32_t read_int(const char *buffer)
+{
+    int32_t i;
+    memcpy(&i, buffer, sizeof(i));
+    return ntohl(i);
+}
+
+/* copies the path of a request, truncated to fit, and returns the offset of
+ * what follows it, or returns 0 if the op has no path */
+static int request_path(completion_list_t *c, char *path, int size)
+{
+    int32_t len;
+
+    switch (c->type) {
+    case ZOO_CREATE_OP:
+    case ZOO_DELETE_OP:
+    case ZOO_EXISTS_OP:
+    case ZOO_GETDATA_OP:
+    case ZOO_SETDATA_OP:
+    case ZOO_GETACL_OP:
+    case ZOO_SETACL_OP:
+    case ZOO_GETCHILDREN_OP:
+    case ZOO_SYNC_OP:
+    case ZOO_GETCHILDREN2_OP:
+    case ZOO_CHECK_OP:
+        break;
+    default:
+        return 0;
+    }
+    /* the record follows the RequestHeader and starts with the path */
+    if (c->request->len < 12)
+        return 0;
+    len = read_int(c->request->buffer + 8);
+    if (len < 0 || len > c->request->len - 12)
+        return 0;
+    if (len > size - 1)
+        len = size - 1;
+    memcpy(path, c->request->buffer + 12, len);
+    path[len] = 0;
+    return 12 + read_int(c->request->buffer + 8);
+}
+
+/* stamps a request being submitted, if tracing is on */
+static void start_trace(zhandle_t *zh, completion_list_t *c)
+{
+    char path[ZOO_SLOW_OP_PATH_LEN];
+    int end;
+
+    if (!is_tracing(zh) || c->request == 0 || c->request->len < 8)
+        return;
+    /* the request starts with its RequestHeader, the xid and then the type */
+    c->type = read_int(c->request->buffer + 4);
+    c->queued = current_us();
+    if (zh->slow_threshold <= 0 && zh->hot_paths == 0)
+        return;
+
+    end = request_path(c, path, sizeof(path));
+    if (zh->slow_threshold > 0) {
+        c->slow = calloc(1, sizeof(*c->slow));
+        if (c->slow) {
+            if (end)
+                strcpy(c->slow->path, path);
+            c->slow->value_len = -1;
+            /* the data of a create or a set follows its path */
+            if ((c->type == ZOO_CREATE_OP || c->type == ZOO_SETDATA_OP)
+                    && end > 0 && end + 4 <= c->request->len)
+                c->slow->value_len = read_int(c->request->buffer + end);
+        }
+    }
+    if (end && zh->hot_paths) {
+        zoo_lock_trace(zh);
+        if (zh->hot_paths)
+            zk_topk_add(zh->hot_paths, path);
+        zoo_unlock_trace(zh);
+    }
+}
+
+/* keeps what the slow log wants to know of a reply, on the IO thread */
+static void note_reply(zhandle_t *zh, completion_list_t *c, buffer_list_t *reply,
+        int rc)
+{
+    format_endpoint(&zh->addrs[zh->connect_index], c->slow->server,
+            sizeof(c->slow->server));
+    /* the data of a get follows the ReplyHeader: xid, zxid and err */
+    if (c->type == ZOO_GETDATA_OP && rc == ZOK && reply->len >= 20)
+        c->slow->value_len = read_int(reply->buffer + 16);
+}
+
+/* keeps a slow request in the ring, under the trace lock */
+static void record_slow_op(zhandle_t *zh, const zoo_slow_op_t *op)
+{
+    if (zh->slow_ops == 0)
+        return;
+    zh->slow_ops[zh->slow_next] = *op;
+    zh->slow_next = (zh->slow_next + 1) % zh->slow_capacity;
+    if (zh->slow_count < zh->slow_capacity)
+        zh->slow_count++;
+}
+
+static void record_latency(zhandle_t *zh, int type, int stage, int64_t from,
+        int64_t to)
+{
+    zk_histogram_t **h = &zh->latency[type][stage];
+    if (from == 0 || to == 0)
+        return;
+    if (*h == 0) {
+        *h = malloc(sizeof(**h));
+        if (*h == 0)
+            return;
+        zk_histogram_init(*h);
+    }
+    zk_histogram_record(*h, to - from);
+}
+
+/* records a traced request that completed and passes it to the hook */
+static void finish_trace(zhandle_t *zh, completion_list_t *c, int rc,
+        int64_t completed)
+{
+    zoo_request_trace_t trace;
+    zoo_trace_fn hook;
+    void *context;
+    int slow = 0;
+
+    trace.xid = c->xid;
+    trace.type = c->type;
+    trace.rc = rc;
+    trace.queued = c->queued;
+    trace.sent = c->sent;
+    trace.received = c->received;
+    trace.completed = completed;
+
+    zoo_lock_trace(zh);
+    hook = zh->trace_hook;
+    context = zh->trace_context;
+    if (zh->trace_histograms && trace.type >= 0 && trace.type < TRACE_OPS) {
+        record_latency(zh, trace.type, ZOO_TRACE_SEND_QUEUE, trace.queued, trace.sent);
+        record_latency(zh, trace.type, ZOO_TRACE_SERVER, trace.sent, trace.received);
+        record_latency(zh, trace.type, ZOO_TRACE_DISPATCH, trace.received, trace.completed);
+        record_latency(zh, trace.type, ZOO_TRACE_TOTAL, trace.queued, trace.completed);
+    }
+    if (c->slow && zh->slow_threshold > 0
+            && trace.completed - trace.queued >= zh->slow_threshold) {
+        c->slow->trace = trace;
+        record_slow_op(zh, c->slow);
+        slow = 1;
+    }
+    zoo_unlock_trace(zh);
+    if (slow) {
+        LOG_WARN(("Slow request xid=%#x type=%d path=%s took %lld us "
+                "(sent after %lld, reply after %lld) from %s", trace.xid,
+                trace.type, c->slow->path, (long long)(trace.completed - trace.queued),
+                (long long)(trace.sent ? trace.sent - trace.queued : -1),
+                (long long)(trace.received ? trace.received - trace.queued : -1),
+                c->slow->server));
+    }
+    if (hook)
+        hook(zh, &trace, context);
+}
+
+static void free_latency(zhandle_t *zh)
+{
+    int type;
+    int stage;
+    for (type = 0; type < TRACE_OPS; type++) {
+        for (stage = 0; stage < ZOO_TRACE_STAGES; stage++) {
+            free(zh->latency[type][stage]);
+            zh->latency[type][stage] = 0;
+        }
+    }
+}
+
+void zoo_set_trace_hook(zhandle_t *zh, zoo_trace_fn hook, void *context)
+{
+    zoo_lock_trace(zh);
+    zh->trace_hook = hook;
+    zh->trace_context = context;
+    zoo_unlock_trace(zh);
+}
+
+void zoo_set_latency_histograms(zhandle_t *zh, int enable)
+{
+    zoo_lock_trace(zh);
+    zh->trace_histograms = enable != 0;
+    zoo_unlock_trace(zh);
+}
+
+int zoo_get_latency(zhandle_t *zh, int type, int stage, zoo_latency_t *latency)
+{
+    zk_histogram_t *merged;
+    int t;
+
+    if (zh == 0 || latency == 0 || type < -1 || type >= TRACE_OPS
+            || stage < 0 || stage >= ZOO_TRACE_STAGES)
+        return ZBADARGUMENTS;
+    merged = malloc(sizeof(*merged));
+    if (merged == 0)
+        return ZSYSTEMERROR;
+    zk_histogram_init(merged);
+    zoo_lock_trace(zh);
+    for (t = 0; t < TRACE_OPS; t++) {
+        if ((type == -1 || type == t) && zh->latency[t][stage])
+            zk_histogram_merge(merged, zh->latency[t][stage]);
+    }
+    zoo_unlock_trace(zh);
+
+    latency->count = merged->total;
+    latency->min = merged->min;
+    latency->max = merged->max;
+    latency->mean = zk_histogram_mean(merged);
+    latency->p50 = zk_histogram_percentile(merged, 50);
+    latency->p90 = zk_histogram_percentile(merged, 90);
+    latency->p99 = zk_histogram_percentile(merged, 99);
+    latency->p999 = zk_histogram_percentile(merged, 99.9);
+    free(merged);
+    return ZOK;
+}
+
+void zoo_reset_latency(zhandle_t *zh)
+{
+    zoo_lock_trace(zh);
+    free_latency(zh);
+    zoo_unlock_trace(zh);
+}
+
+int zoo_set_slow_log(zhandle_t *zh, int threshold_ms, int capacity)
+{
+    zoo_slow_op_t *ops = 0;
+    zoo_slow_op_t *old;
+
+    if (zh == 0 || threshold_ms < 0 || (threshold_ms > 0 && capacity <= 0))
+        return ZBADARGUMENTS;
+    if (threshold_ms > 0) {
+        ops = calloc(capacity, sizeof(*ops));
+        if (ops == 0)
+            return ZSYSTEMERROR;
+    }
+    zoo_lock_trace(zh);
+    old = zh->slow_ops;
+    zh->slow_ops = ops;
+    zh->slow_capacity = ops ? capacity : 0;
+    zh->slow_count = 0;
+    zh->slow_next = 0;
+    zh->slow_threshold = (int64_t)threshold_ms * 1000;
+    zoo_unlock_trace(zh);
+    free(old);
+    return ZOK;
+}
+
+int zoo_get_slow_ops(zhandle_t *zh, zoo_slow_op_t *ops, int count)
+{
+    int n;
+
+    if (zh == 0 || ops == 0 || count < 0)
+        return ZBADARGUMENTS;
+    zoo_lock_trace(zh);
+    for (n = 0; n < count && n < zh->slow_count; n++) {
+        int slot = (zh->slow_next - 1 - n + zh->slow_capacity) % zh->slow_capacity;
+        ops[n] = zh->slow_ops[slot];
+    }
+    zoo_unlock_trace(zh);
+    return n;
+}
+
+int zoo_set_hot_paths(zhandle_t *zh, int k)
+{
+    zk_topk_t *paths = 0;
+    zk_topk_t *old;
+
+    if (zh == 0 || k < 0)
+        return ZBADARGUMENTS;
+    if (k > 0) {
+        paths = zk_topk_create(k);
+        if (paths == 0)
+            return ZSYSTEMERROR;
+    }
+    zoo_lock_trace(zh);
+    old = zh->hot_paths;
+    zh->hot_paths = paths;
+    zoo_unlock_trace(zh);
+    zk_topk_destroy(old);
+    return ZOK;
+}
+
+int zoo_get_hot_paths(zhandle_t *zh, zoo_hot_path_t *paths, int count)
+{
+    const zk_topk_entry_t **entries;
+    int n = 0;
+    int i;
+
+    if (zh == 0 || paths == 0 || count < 0)
+        return ZBADARGUMENTS;
+    if (count == 0)
+        return 0;
+    entries = malloc(count * sizeof(*entries));
+    if (entries == 0)
+        return ZSYSTEMERROR;
+    zoo_lock_trace(zh);
+    if (zh->hot_paths)
+        n = zk_topk_list(zh->hot_paths, entries, count);
+    for (i = 0; i < n; i++) {
+        strncpy(paths[i].path, entries[i]->key, sizeof(paths[i].path) - 1);
+        paths[i].path[sizeof(paths[i].path) - 1] = 0;
+        paths[i].count = entries[i]->count;
+        paths[i].error = entries[i]->error;
+    }
+    zoo_unlock_trace(zh);
+    free(entries);
+    return n;
+}
+
+void zoo_set_reconnect_backoff(zhandle_t *zh, int base_ms, int cap_ms)
+{
+    if (base_ms < 0)
+        base_ms = 0;
+    if (cap_ms < base_ms)
+        cap_ms = base_ms;
+    zh->backoff_base = base_ms;
+    zh->backoff_cap = cap_ms;
+}
+
+void zoo_set_connect_rate_limit(int per_second, int burst)
+{
+    if (per_second < 0)
+        per_second = 0;
+    if (burst < 1)
+        burst = 1;
+    lock_connect_limiter();
+    connect_limiter.per_second = per_second;
+    connect_limiter.burst = burst;
+    if (connect_limiter.tokens > burst * 1000)
+        connect_limiter.tokens = burst * 1000;
+    unlock_connect_limiter();
+}
+
+int zoo_get_connect_stats(zhandle_t *zh, zoo_connect_stats_t *stats)
+{
+    if (zh == 0 || stats == 0)
+        return ZBADARGUMENTS;
+    *stats = zh->connect_stats;
+    return ZOK;
+}
+
+int zoo_get_stats(zhandle_t *zh, zoo_stats_t *stats)
+{
+    if (zh == 0 || stats == 0)
+        return ZBADARGUMENTS;
+    *stats = zh->stats;
+    stats->send_queue = zh->to_send.count;
+    stats->send_queue_bytes = zh->to_send.bytes;
+    stats->sent_requests = zh->sent_requests.count;
+    stats->completion_backlog = zh->completions_to_process.count;
+    stats->outstanding_sync = zh->outstanding_sync;
+    stats->reconnects = zh->connect_stats.reconnects;
+    return ZOK;
+}
+
+void zoo_set_parallel_connect(zhandle_t *zh, int max_attempts, int stagger_ms)
+{
+    if (max_attempts < 1)
+        max_attempts = 1;
+    if (max_attempts > MAX_CONNECT_ATTEMPTS)
+        max_attempts = MAX_CONNECT_ATTEMPTS;
+    if (stagger_ms < 0)
+        stagger_ms = 0;
+    zh->max_attempts = max_attempts;
+    zh->connect_stagger = stagger_ms;
+}
+
 /*---------------------------------------------------------------------------*
  * SYNC API
  *---------------------------------------------------------------------------*/
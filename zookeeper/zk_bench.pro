@@ -0,0 +1,33 @@
+CONFIG -= QT
+CONFIG += console
+
+TEMPLATE = app
+
+TARGET = zk_bench
+
+DESTDIR = $$PWD/bin
+
+win32 {
+    error(The benchmarks need POSIX clocks and threads)
+}
+
+DEFINES += THREADED
+
+INCLUDEPATH += include generated src src/hashtable
+
+# bench/zk_bench.c includes src/zookeeper.c to reach the queues, so the
+# library is compiled in instead of linked
+SOURCES += \
+    bench/zk_bench.c \
+    generated/zookeeper.jute.c \
+    src/hashtable/hashtable.c \
+    src/hashtable/hashtable_itr.c \
+    src/mt_adaptor.c \
+    src/recordio.c \
+    src/zk_hashtable.c \
+    src/zk_histogram.c \
+    src/zk_log.c \
+    src/zk_timerwheel.c \
+    src/zk_topk.c
+
+LIBS += -lpthread
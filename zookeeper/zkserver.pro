@@ -0,0 +1,16 @@
+CONFIG -= QT
+CONFIG += console
+
+TEMPLATE = app
+
+TARGET = zkserver
+
+DESTDIR = $$PWD/bin
+
+INCLUDEPATH += server
+
+SOURCES += \
+    server/zk_server_main.c
+
+LIBS += -L$$PWD/lib -lzkserver -lpthread
+PRE_TARGETDEPS += $$PWD/lib/libzkserver.a